@@ -29,9 +29,6 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <ctype.h>
 #include <stdlib.h>
 
-#define _GPRMCterm "GPRMC"
-#define _GPGGAterm "GPGGA"
-
 // Converts degrees to radians.
 #define radians(angleDegrees) ((angleDegrees)*M_PI / 180.0)
 
@@ -42,11 +39,14 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #define sq(x) ((x) * (x))
 
 TinyGPSPlus::TinyGPSPlus()
-    : parity(0), isChecksumTerm(false), curSentenceType(GPS_SENTENCE_OTHER), curTermNumber(0),
-      curTermOffset(0), sentenceHasFix(false), customElts(0), customCandidates(0),
+    : parity(0), isChecksumTerm(false), curSentenceType(GPS_SENTENCE_OTHER),
+      curConstellation(GPS_CONSTELLATION_OTHER), curTermNumber(0),
+      curTermOffset(0), sentenceHasFix(false), hasCustomCandidates(false),
       encodedCharCount(0), sentencesWithFixCount(0), failedChecksumCount(0), passedChecksumCount(0)
 {
     term[0] = '\0';
+    memset(customBuckets, 0, sizeof(customBuckets));
+    memset(customSlots, 0, sizeof(customSlots));
 }
 
 //
@@ -97,6 +97,49 @@ bool TinyGPSPlus::encode(char c)
     return false;
 }
 
+// Same as calling encode(char) for each character, but runs of ordinary
+// characters are copied into the term buffer and checksummed in one pass
+// without a call per character. Returns true if any sentence in the block
+// was validated.
+bool TinyGPSPlus::encode(const char *buf, size_t len)
+{
+    bool isValidSentence = false;
+    const char *end = buf + len;
+
+    while(buf < end)
+    {
+        const char *run = buf;
+        uint8_t runParity = 0;
+        size_t offset = curTermOffset;
+        for(; buf < end; ++buf)
+        {
+            char c = *buf;
+            // Delimiters are all at or below ','; digits, letters, '.' and
+            // '-' are above it
+            if((uint8_t)c <= ',' &&
+               (c == ',' || c == '\r' || c == '\n' || c == '*' || c == '$'))
+                break;
+            // curTermOffset never exceeds sizeof(term) - 1, see encode(char)
+            if(offset < sizeof(term) - 1)
+                term[offset++] = c;
+            runParity ^= c;
+        }
+        curTermOffset = offset;
+        encodedCharCount += buf - run;
+        if(!isChecksumTerm)
+            parity ^= runParity;
+
+        if(buf < end)
+        {
+            if(encode(*buf))
+                isValidSentence = true;
+            ++buf;
+        }
+    }
+
+    return isValidSentence;
+}
+
 //
 // internal utilities
 //
@@ -154,6 +197,55 @@ void TinyGPSPlus::parseDegrees(const char *term, RawDegrees &deg)
     deg.negative = false;
 }
 
+// static
+// Sentence type from a 5-character ID, whatever the talker (GP, GN, GL...)
+uint8_t TinyGPSPlus::sentenceType(const char *id)
+{
+    if(strlen(id) != 5)
+        return GPS_SENTENCE_OTHER;
+
+    switch(sentenceKey(id[2], id[3], id[4]))
+    {
+    case sentenceKey('G', 'G', 'A'):
+        return GPS_SENTENCE_GGA;
+    case sentenceKey('R', 'M', 'C'):
+        return GPS_SENTENCE_RMC;
+    case sentenceKey('G', 'S', 'A'):
+        return GPS_SENTENCE_GSA;
+    case sentenceKey('V', 'T', 'G'):
+        return GPS_SENTENCE_VTG;
+    case sentenceKey('G', 'S', 'V'):
+        return GPS_SENTENCE_GSV;
+    default:
+        return GPS_SENTENCE_OTHER;
+    }
+}
+
+// static
+// Constellation from the talker ID. GN (combined solution) has none.
+uint8_t TinyGPSPlus::constellation(const char *id)
+{
+    if(id[0] == 'G')
+    {
+        switch(id[1])
+        {
+        case 'P':
+            return GPS_CONSTELLATION_GPS;
+        case 'L':
+            return GPS_CONSTELLATION_GLONASS;
+        case 'A':
+            return GPS_CONSTELLATION_GALILEO;
+        case 'B':
+            return GPS_CONSTELLATION_BEIDOU;
+        }
+    }
+    else if(id[0] == 'B' && id[1] == 'D')
+    {
+        return GPS_CONSTELLATION_BEIDOU;
+    }
+    return GPS_CONSTELLATION_OTHER;
+}
+
 #define COMBINE(sentence_type, term_number) (((unsigned)(sentence_type) << 5) | term_number)
 
 // Processes a just-completed term
@@ -172,7 +264,7 @@ bool TinyGPSPlus::endOfTermHandler()
 
             switch(curSentenceType)
             {
-            case GPS_SENTENCE_GPRMC:
+            case GPS_SENTENCE_RMC:
                 date.commit();
                 time.commit();
                 if(sentenceHasFix)
@@ -182,7 +274,7 @@ bool TinyGPSPlus::endOfTermHandler()
                     course.commit();
                 }
                 break;
-            case GPS_SENTENCE_GPGGA:
+            case GPS_SENTENCE_GGA:
                 time.commit();
                 if(sentenceHasFix)
                 {
@@ -192,13 +284,32 @@ bool TinyGPSPlus::endOfTermHandler()
                 satellites.commit();
                 hdop.commit();
                 break;
+            case GPS_SENTENCE_GSA:
+                if(sentenceHasFix)
+                {
+                    pdop.commit();
+                    hdop.commit();
+                    vdop.commit();
+                }
+                break;
+            case GPS_SENTENCE_VTG:
+                if(sentenceHasFix)
+                {
+                    speed.commit();
+                    course.commit();
+                }
+                break;
+            case GPS_SENTENCE_GSV:
+                if(curConstellation != GPS_CONSTELLATION_OTHER)
+                    satellitesInView[curConstellation].commit();
+                break;
             }
 
             // Commit all custom listeners of this sentence type
-            for(TinyGPSCustom *p = customCandidates;
-                p != NULL && strcmp(p->sentenceName, customCandidates->sentenceName) == 0;
-                p = p->next)
-                p->commit();
+            if(hasCustomCandidates)
+                for(int i = 0; i < _GPS_MAX_CUSTOM_TERMS; ++i)
+                    for(TinyGPSCustom *p = customSlots[i]; p != NULL; p = p->nextInSlot)
+                        p->commit();
             return true;
         }
 
@@ -213,20 +324,11 @@ bool TinyGPSPlus::endOfTermHandler()
     // the first term determines the sentence type
     if(curTermNumber == 0)
     {
-        if(!strcmp(term, _GPRMCterm))
-            curSentenceType = GPS_SENTENCE_GPRMC;
-        else if(!strcmp(term, _GPGGAterm))
-            curSentenceType = GPS_SENTENCE_GPGGA;
-        else
-            curSentenceType = GPS_SENTENCE_OTHER;
+        curSentenceType = sentenceType(term);
+        curConstellation = constellation(term);
 
         // Any custom candidates of this sentence type?
-        for(customCandidates = customElts;
-            customCandidates != NULL && strcmp(customCandidates->sentenceName, term) < 0;
-            customCandidates = customCandidates->next)
-            ;
-        if(customCandidates != NULL && strcmp(customCandidates->sentenceName, term) > 0)
-            customCandidates = NULL;
+        resolveCustom(term);
 
         return false;
     }
@@ -234,59 +336,87 @@ bool TinyGPSPlus::endOfTermHandler()
     if(curSentenceType != GPS_SENTENCE_OTHER && term[0])
         switch(COMBINE(curSentenceType, curTermNumber))
         {
-        case COMBINE(GPS_SENTENCE_GPRMC, 1): // Time in both sentences
-        case COMBINE(GPS_SENTENCE_GPGGA, 1):
+        case COMBINE(GPS_SENTENCE_RMC, 1): // Time in both sentences
+        case COMBINE(GPS_SENTENCE_GGA, 1):
             time.setTime(term);
             break;
-        case COMBINE(GPS_SENTENCE_GPRMC, 2): // GPRMC validity
+        case COMBINE(GPS_SENTENCE_RMC, 2): // RMC validity
             sentenceHasFix = term[0] == 'A';
             break;
-        case COMBINE(GPS_SENTENCE_GPRMC, 3): // Latitude
-        case COMBINE(GPS_SENTENCE_GPGGA, 2):
+        case COMBINE(GPS_SENTENCE_RMC, 3): // Latitude
+        case COMBINE(GPS_SENTENCE_GGA, 2):
             location.setLatitude(term);
             break;
-        case COMBINE(GPS_SENTENCE_GPRMC, 4): // N/S
-        case COMBINE(GPS_SENTENCE_GPGGA, 3):
+        case COMBINE(GPS_SENTENCE_RMC, 4): // N/S
+        case COMBINE(GPS_SENTENCE_GGA, 3):
             location.rawNewLatData.negative = term[0] == 'S';
             break;
-        case COMBINE(GPS_SENTENCE_GPRMC, 5): // Longitude
-        case COMBINE(GPS_SENTENCE_GPGGA, 4):
+        case COMBINE(GPS_SENTENCE_RMC, 5): // Longitude
+        case COMBINE(GPS_SENTENCE_GGA, 4):
             location.setLongitude(term);
             break;
-        case COMBINE(GPS_SENTENCE_GPRMC, 6): // E/W
-        case COMBINE(GPS_SENTENCE_GPGGA, 5):
+        case COMBINE(GPS_SENTENCE_RMC, 6): // E/W
+        case COMBINE(GPS_SENTENCE_GGA, 5):
             location.rawNewLngData.negative = term[0] == 'W';
             break;
-        case COMBINE(GPS_SENTENCE_GPRMC, 7): // Speed (GPRMC)
+        case COMBINE(GPS_SENTENCE_RMC, 7): // Speed (RMC)
             speed.set(term);
             break;
-        case COMBINE(GPS_SENTENCE_GPRMC, 8): // Course (GPRMC)
+        case COMBINE(GPS_SENTENCE_RMC, 8): // Course (RMC)
             course.set(term);
             break;
-        case COMBINE(GPS_SENTENCE_GPRMC, 9): // Date (GPRMC)
+        case COMBINE(GPS_SENTENCE_RMC, 9): // Date (RMC)
             date.setDate(term);
             break;
-        case COMBINE(GPS_SENTENCE_GPGGA, 6): // Fix data (GPGGA)
+        case COMBINE(GPS_SENTENCE_GGA, 6): // Fix data (GGA)
             sentenceHasFix = term[0] > '0';
             break;
-        case COMBINE(GPS_SENTENCE_GPGGA, 7): // Satellites used (GPGGA)
+        case COMBINE(GPS_SENTENCE_GGA, 7): // Satellites used (GGA)
             satellites.set(term);
             break;
-        case COMBINE(GPS_SENTENCE_GPGGA, 8): // HDOP
+        case COMBINE(GPS_SENTENCE_GGA, 8): // HDOP
             hdop.set(term);
             break;
-        case COMBINE(GPS_SENTENCE_GPGGA, 9): // Altitude (GPGGA)
+        case COMBINE(GPS_SENTENCE_GGA, 9): // Altitude (GGA)
             altitude.set(term);
             break;
+        case COMBINE(GPS_SENTENCE_GSA, 2): // Fix type (GSA), 1 = no fix
+            sentenceHasFix = term[0] > '1';
+            break;
+        case COMBINE(GPS_SENTENCE_GSA, 15): // PDOP (GSA)
+            pdop.set(term);
+            break;
+        case COMBINE(GPS_SENTENCE_GSA, 16): // HDOP (GSA)
+            hdop.set(term);
+            break;
+        case COMBINE(GPS_SENTENCE_GSA, 17): // VDOP (GSA)
+            vdop.set(term);
+            break;
+        case COMBINE(GPS_SENTENCE_VTG, 1): // True course over ground (VTG)
+            course.set(term);
+            break;
+        case COMBINE(GPS_SENTENCE_VTG, 5): // Speed in knots (VTG)
+            // Standing still, the course is empty but the speed isn't
+            speed.set(term);
+            sentenceHasFix = true;
+            break;
+        case COMBINE(GPS_SENTENCE_VTG, 9): // Mode indicator (VTG), N = not valid
+            sentenceHasFix = sentenceHasFix && term[0] != 'N';
+            break;
+        case COMBINE(GPS_SENTENCE_GSV, 3): // Satellites in view (GSV)
+            if(curConstellation != GPS_CONSTELLATION_OTHER)
+                satellitesInView[curConstellation].set(term);
+            break;
         }
 
     // Set custom values as needed
-    for(TinyGPSCustom *p = customCandidates;
-        p != NULL && strcmp(p->sentenceName, customCandidates->sentenceName) == 0 &&
-            p->termNumber <= curTermNumber;
-        p = p->next)
-        if(p->termNumber == curTermNumber)
-            p->set(term);
+    if(hasCustomCandidates)
+    {
+        int slot = curTermNumber < _GPS_MAX_CUSTOM_TERMS ? curTermNumber : _GPS_MAX_CUSTOM_TERMS - 1;
+        for(TinyGPSCustom *p = customSlots[slot]; p != NULL; p = p->nextInSlot)
+            if(p->termNumber == curTermNumber)
+                p->set(term);
+    }
 
     return false;
 }
@@ -472,7 +602,7 @@ void TinyGPSCustom::begin(TinyGPSPlus &gps, const char *_sentenceName, int _term
     memset(stagingBuffer, '\0', sizeof(stagingBuffer));
     memset(buffer, '\0', sizeof(buffer));
 
-    // Insert this item into the GPS tree
+    // Insert this item into the GPS custom table
     gps.insertCustom(this, _sentenceName, _termNumber);
 }
 
@@ -490,15 +620,44 @@ void TinyGPSCustom::set(const char *term)
 
 void TinyGPSPlus::insertCustom(TinyGPSCustom *pElt, const char *sentenceName, int termNumber)
 {
-    TinyGPSCustom **ppelt;
+    (void)termNumber;
+    pElt->sentenceHash = hashSentence(sentenceName);
+    TinyGPSCustom **bucket = &customBuckets[pElt->sentenceHash % _GPS_CUSTOM_BUCKETS];
+    pElt->next = *bucket;
+    pElt->nextInSlot = NULL;
+    *bucket = pElt;
+}
 
-    for(ppelt = &this->customElts; *ppelt != NULL; ppelt = &(*ppelt)->next)
+// Gathers the customs registered for this sentence into their term slots
+void TinyGPSPlus::resolveCustom(const char *sentenceName)
+{
+    if(hasCustomCandidates)
     {
-        int cmp = strcmp(sentenceName, (*ppelt)->sentenceName);
-        if(cmp < 0 || (cmp == 0 && termNumber < (*ppelt)->termNumber))
-            break;
+        memset(customSlots, 0, sizeof(customSlots));
+        hasCustomCandidates = false;
     }
 
-    pElt->next = *ppelt;
-    *ppelt = pElt;
+    uint32_t hash = hashSentence(sentenceName);
+    for(TinyGPSCustom *p = customBuckets[hash % _GPS_CUSTOM_BUCKETS]; p != NULL; p = p->next)
+    {
+        if(p->sentenceHash != hash || strcmp(p->sentenceName, sentenceName) != 0)
+            continue;
+        int slot = p->termNumber < _GPS_MAX_CUSTOM_TERMS ? p->termNumber : _GPS_MAX_CUSTOM_TERMS - 1;
+        p->nextInSlot = customSlots[slot];
+        customSlots[slot] = p;
+        hasCustomCandidates = true;
+    }
+}
+
+// static
+// FNV-1a hash of a sentence ID
+uint32_t TinyGPSPlus::hashSentence(const char *sentenceName)
+{
+    uint32_t hash = 2166136261UL;
+    while(*sentenceName)
+    {
+        hash ^= (uint8_t)*sentenceName++;
+        hash *= 16777619UL;
+    }
+    return hash;
 }
@@ -36,6 +36,8 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #define _GPS_KM_PER_METER 0.001
 #define _GPS_FEET_PER_METER 3.2808399
 #define _GPS_MAX_FIELD_SIZE 15
+#define _GPS_CUSTOM_BUCKETS 8
+#define _GPS_MAX_CUSTOM_TERMS 20
 
 struct RawDegrees
 {
@@ -50,6 +52,7 @@ public:
 struct TinyGPSLocation
 {
     friend class TinyGPSPlus;
+    friend class UbxParser;
 
 public:
     bool isValid() const { return valid; }
@@ -82,6 +85,7 @@ private:
 struct TinyGPSDate
 {
     friend class TinyGPSPlus;
+    friend class UbxParser;
 
 public:
     bool isValid() const { return valid; }
@@ -110,6 +114,7 @@ private:
 struct TinyGPSTime
 {
     friend class TinyGPSPlus;
+    friend class UbxParser;
 
 public:
     bool isValid() const { return valid; }
@@ -139,6 +144,7 @@ private:
 struct TinyGPSDecimal
 {
     friend class TinyGPSPlus;
+    friend class UbxParser;
 
 public:
     bool isValid() const { return valid; }
@@ -163,6 +169,7 @@ private:
 struct TinyGPSInteger
 {
     friend class TinyGPSPlus;
+    friend class UbxParser;
 
 public:
     bool isValid() const { return valid; }
@@ -231,9 +238,11 @@ private:
     unsigned long lastCommitTime;
     bool valid, updated;
     const char *sentenceName;
+    uint32_t sentenceHash;
     int termNumber;
     friend class TinyGPSPlus;
-    TinyGPSCustom *next;
+    TinyGPSCustom *next;       // next in the same hash bucket
+    TinyGPSCustom *nextInSlot; // next custom of the current sentence in the same term slot
 };
 
 class TinyGPSPlus
@@ -241,6 +250,7 @@ class TinyGPSPlus
 public:
     TinyGPSPlus();
     bool encode(char c); // process one character received from GPS
+    bool encode(const char *buf, size_t len); // process a block of characters
     TinyGPSPlus &operator<<(char c)
     {
         encode(c);
@@ -255,6 +265,19 @@ public:
     TinyGPSAltitude altitude;
     TinyGPSInteger satellites;
     TinyGPSDecimal hdop;
+    TinyGPSDecimal pdop;
+    TinyGPSDecimal vdop;
+
+    enum
+    {
+        GPS_CONSTELLATION_GPS,
+        GPS_CONSTELLATION_GLONASS,
+        GPS_CONSTELLATION_GALILEO,
+        GPS_CONSTELLATION_BEIDOU,
+        GPS_CONSTELLATION_COUNT,
+        GPS_CONSTELLATION_OTHER = GPS_CONSTELLATION_COUNT
+    };
+    TinyGPSInteger satellitesInView[GPS_CONSTELLATION_COUNT];
 
     static const char *libraryVersion() { return _GPS_VERSION; }
 
@@ -273,25 +296,45 @@ public:
 private:
     enum
     {
-        GPS_SENTENCE_GPGGA,
-        GPS_SENTENCE_GPRMC,
+        GPS_SENTENCE_GGA,
+        GPS_SENTENCE_RMC,
+        GPS_SENTENCE_GSA,
+        GPS_SENTENCE_VTG,
+        GPS_SENTENCE_GSV,
         GPS_SENTENCE_OTHER
     };
 
+    // Packs the 3-letter sentence formatter (the ID without its talker prefix)
+    // into 15 bits. Distinct uppercase formatters always get distinct keys, so
+    // this is a perfect hash and a switch on it recognizes sentences in O(1).
+    static constexpr uint16_t sentenceKey(char a, char b, char c)
+    {
+        return ((a & 0x1f) << 10) | ((b & 0x1f) << 5) | (c & 0x1f);
+    }
+    static uint8_t sentenceType(const char *id);
+    static uint8_t constellation(const char *id);
+
     // parsing state variables
     uint8_t parity;
     bool isChecksumTerm;
     char term[_GPS_MAX_FIELD_SIZE];
     uint8_t curSentenceType;
+    uint8_t curConstellation;
     uint8_t curTermNumber;
     uint8_t curTermOffset;
     bool sentenceHasFix;
 
     // custom element support
+    // Customs are kept in buckets by sentence ID hash. When a sentence starts,
+    // the customs for it are resolved into slots by term number (terms past the
+    // last slot share it), so each term costs O(1) however many are registered.
     friend class TinyGPSCustom;
-    TinyGPSCustom *customElts;
-    TinyGPSCustom *customCandidates;
+    TinyGPSCustom *customBuckets[_GPS_CUSTOM_BUCKETS];
+    TinyGPSCustom *customSlots[_GPS_MAX_CUSTOM_TERMS];
+    bool hasCustomCandidates;
     void insertCustom(TinyGPSCustom *pElt, const char *sentenceName, int index);
+    void resolveCustom(const char *sentenceName);
+    static uint32_t hashSentence(const char *sentenceName);
 
     // statistics
     uint32_t encodedCharCount;
@@ -16,17 +16,63 @@
 
 #include "application.h"
 #include "carloop.h"
+#include "record_buffer.h"
+#include "position_encoder.h"
+#include "track_simplifier.h"
+#include "time_base.h"
+#include "power_manager.h"
+#include "latency_stats.h"
+#include "scheduler.h"
+#include "ecu_tracker.h"
+#include "derived_signals.h"
+#include "burst_capture.h"
+#include "j1939_decoder.h"
+#include "dtc_reader.h"
+#include "retransmit_buffer.h"
 #include "base85.h"
 
 SYSTEM_MODE(SEMI_AUTOMATIC);
 SYSTEM_THREAD(ENABLED);
 
+void updateCarloop();
+void receiveGps();
+void startActiveTasks();
+void stopActiveTasks();
+bool canReady();
+bool gpsReady();
 void sendObdRequest();
-void waitForObdResponse();
-void delayUntilNextRequest();
-void printValuesAtInterval();
+void receiveObdResponse();
+void printBatteryEvents(uint8_t events);
+void updatePowerMode();
+void enterPowerMode(PowerManager::Mode_e from, PowerManager::Mode_e to);
+bool isObdReply(const CANMessage &message);
+bool frameDue(const CANMessage &message);
+void noteEngineRpm(const CANMessage &message);
+void recordPosition();
 void printValues();
 String dumpMessage(const CANMessage &message);
+uint8_t encodeMessage(const CANMessage &message, uint8_t *payload, uint8_t &type);
+bool recordMessage(const CANMessage &message);
+void sampleDerivedSignals(const CANMessage &message);
+bool isFastReply(const CANMessage &message);
+bool isPrimaryEcu(const CANMessage &message);
+bool isJ1939(const CANMessage &message);
+void recordJ1939(String &dump);
+void noteMilStatus(const CANMessage &message);
+void sendFlowControl(const CANMessage &message);
+void recordDtcChanges();
+void uploadBurst();
+void publishChunk(const char *name, RecordBuffer &chunk);
+void publishEncoded(const char *name, const uint8_t *chunk, size_t len);
+int nackChunks(String ranges);
+void resendChunk();
+bool takePublish();
+void appendRecord(unsigned long now, uint8_t type, const uint8_t *payload, uint8_t len);
+void publishRecords();
+void updateTimeBase();
+void publishDiagnostics();
+void recordDerivedSignals(bool flush);
+void recordDerivedSignalsAtInterval();
 bool byteArray8Equal(uint8_t a1[8], uint8_t a2[8]);
 
 Carloop<CarloopRevision2> carloop;
@@ -38,6 +84,35 @@ const auto OBD_CAN_BROADCAST_ID    = 0X7DF;
 const auto OBD_CAN_REQUEST_ID      = 0x7E0;
 const auto OBD_CAN_REPLY_ID_MIN    = 0x7E8;
 const auto OBD_CAN_REPLY_ID_MAX    = 0x7EF;
+// With 29-bit addressing
+const auto OBD_CAN_BROADCAST_ID_29 = 0x18DB33F1;
+const auto OBD_CAN_REQUEST_ID_29   = 0x18DA00F1; // ECU in the second byte
+const auto OBD_CAN_REPLY_ID_29     = 0x18DAF100; // low byte is the ECU
+// The engine ECU, whose replies are recorded without an ECU byte
+const auto OBD_PRIMARY_ECU         = 0xE8;
+const auto OBD_PRIMARY_ECU_29      = 0x10;
+
+// A u-blox module can be switched from NMEA at 9600 baud to UBX at
+// 115200, build with -DGPS_UBX
+#ifdef GPS_UBX
+const bool GPS_USE_UBX = true;
+#else
+const bool GPS_USE_UBX = false;
+#endif
+// At 115200 baud the 64-byte receive buffer fills in 5.5 ms
+const unsigned long GPS_UBX_RECEIVE_INTERVAL = 4;
+
+// updateCarloop and printValues, plus the timed tasks of
+// startActiveTasks(): OBD requests, diagnostics, derived signals,
+// upload and resend, and the UBX drain
+const uint8_t SCHEDULED_TASKS = 2 + 5 + (GPS_USE_UBX ? 1 : 0);
+static_assert(SCHEDULED_TASKS <= Scheduler::MAX_TASKS,
+	"raise Scheduler::MAX_TASKS for the timed tasks");
+
+// Heavy-duty vehicles broadcast J1939 at this bitrate rather than
+// answering OBD requests
+const uint32_t J1939_CAN_SPEED = 250000;
+const auto J1939_PGN_EEC1 = 61444; // engine speed in bytes 4-5, 0.125 rpm
 
 // OBD services / modes
 const auto OBD_MODE_CURRENT_DATA = 0x01;
@@ -82,8 +157,25 @@ const auto OBD_PID_ACCELERATOR_PEDAL_POSITION_D          = 0X49;
 const auto OBD_PID_ACCELERATOR_PEDAL_POSITION_E          = 0X4a;
 const auto OBD_PID_COMMANDED_THROTTLE_ACTUATOR           = 0X4c;
 
-const size_t NUM_PIDS_TO_REQUEST = 30;
+// Virtual PIDs computed on the device, see setup()
+const auto DERIVED_PID_FUEL_RATE      = 0xf0; // mL/h
+const auto DERIVED_PID_TRIP_DISTANCE  = 0xf1; // decimeters since boot
+const auto DERIVED_PID_ENGINE_ON_TIME = 0xf2; // ms with a non-zero RPM
+const auto DERIVED_PID_IDLE_TIME      = 0xf3; // ms running at standstill
+const auto DERIVED_PID_IDLE_PERCENT   = 0xf4; // idle share of engine-on time
+// Burst capture triggers, 1 when they fire
+const auto DERIVED_PID_HARD_BRAKING   = 0xf8;
+const auto DERIVED_PID_HIGH_RPM       = 0xf9;
+const auto DERIVED_PID_MIL_ON         = 0xfa;
+const uint8_t burstTriggers[] = {
+	DERIVED_PID_HARD_BRAKING,
+	DERIVED_PID_HIGH_RPM,
+	DERIVED_PID_MIL_ON
+};
+
+const size_t NUM_PIDS_TO_REQUEST = 31;
 const uint8_t pidsToRequest[NUM_PIDS_TO_REQUEST] = {
+	OBD_PID_MIL_STATUS,
 	OBD_PID_ENGINE_LOAD,
 	OBD_PID_COOLANT_TEMPERATURE,
 	OBD_PID_SHORT_TERM_FUEL_TRIM,
@@ -117,23 +209,202 @@ const uint8_t pidsToRequest[NUM_PIDS_TO_REQUEST] = {
 };
 uint8_t pidIndex = NUM_PIDS_TO_REQUEST - 1;
 
-String dumpForPublish;
+// The SPNs recorded from J1939 broadcasts, sorted by PGN, with the raw
+// values' start bit and size from J1939-71. See README.md for scaling.
+const uint8_t NUM_J1939_PGNS = 8;
+const J1939Pgn j1939Pgns[NUM_J1939_PGNS] = {
+	// EEC1: actual engine torque, engine speed
+	{ J1939_PGN_EEC1, 1000, { { 513, 16, 8 }, { 190, 24, 16 } } },
+	// VD: total vehicle distance
+	{ 65248, 60000, { { 245, 32, 32 } } },
+	// EC1, sent as a BAM: engine reference torque
+	{ 65251, 60000, { { 544, 152, 16 } } },
+	// ET1: engine coolant temperature
+	{ 65262, 10000, { { 110, 0, 8 } } },
+	// EFL/P1: engine oil pressure
+	{ 65263, 10000, { { 100, 24, 8 } } },
+	// CCVS1: wheel-based vehicle speed
+	{ 65265, 1000, { { 84, 8, 16 } } },
+	// LFE1: engine fuel rate
+	{ 65266, 1000, { { 183, 0, 16 } } },
+	// VEP1: battery potential
+	{ 65271, 10000, { { 168, 32, 16 } } }
+};
+// Every other request is for one of these, so the burst triggers see
+// them every 720 ms rather than once per sweep
+const size_t NUM_FAST_PIDS = 2;
+const uint8_t fastPids[NUM_FAST_PIDS] = {
+	OBD_PID_VEHICLE_SPEED,
+	OBD_PID_ENGINE_RPM
+};
+uint8_t fastPidIndex = NUM_FAST_PIDS - 1;
+// The fast PID just requested, zero when it was one from the sweep
+uint8_t fastPidRequested = 0;
+// 100 ms for the replies to come in, then 80 ms before the next request
+const unsigned long OBD_REQUEST_INTERVAL = 180;
+
+RecordBuffer records;
+PositionEncoder positions;
+// Publish a fix when the track leaves a 10 m corridor, turns by over 20˚,
+// or at least every 30 s
+TrackSimplifier track(10000, 20, 30000);
+TimeBase timeBase;
+// Park after a minute without the engine running or 5 s of CAN silence,
+// then listen to the bus for 0.5 s every 15 s
+PowerManager power(60000, 5000, 15000, 500);
+LatencyStats latency;
+// Histograms of the loop phases, refreshed with printValues()
+String latencyText;
+EcuTracker ecus;
+// Replies and duplicates per ECU, refreshed with printValues()
+String ecuText;
+DerivedSignals derived;
+// The 5 s of CAN traffic before and after a trigger, uploaded as "b" events
+BurstCapture burst(5000, 5000, 60000);
+RecordBuffer burstRecords;
+J1939Decoder j1939(j1939Pgns, NUM_J1939_PGNS);
+// Every 10 s with the MIL on, backing off to every 5 min 20 s
+DtcReader dtcs(10000, 320000);
+// Chunks published, "m" and "b" alike, from 0 at boot
+uint16_t chunkSequence = 0;
+RetransmitBuffer retransmit;
+// The cloud takes one publish a second on average, in bursts of up to 4,
+// and drops the rest. Publishes are spent from this budget first.
+const unsigned long PUBLISH_INTERVAL = 1000;
+const unsigned long PUBLISH_BURST = 4;
+// When the budget is full again
+unsigned long publishCredit = 0;
+
+// Everything runs from here, loop() sleeps until the next task is due
+Scheduler scheduler(5);
+// Parked, there is only the battery to watch, and sampling it every
+// 50 ms still catches the few hundred ms of cranking
+const unsigned long UPDATE_INTERVAL = 10;
+const unsigned long PARKED_UPDATE_INTERVAL = 50;
 
-auto *obdLoopFunction = sendObdRequest;
-unsigned long transitionTime = 0;
-uint8_t lastMessageData[8];
+// Broadcast frames repeat every 10-100 ms, mostly unchanged, and
+// recording them all fills several chunks a second, over the publish
+// rate limit. A frame is recorded when it differs from the last one
+// recorded with its ID, at most once per FRAME_INTERVAL.
+const unsigned long FRAME_INTERVAL = 1000;
+const uint8_t MAX_FRAME_IDS = 64;
+struct RecordedFrame
+{
+	uint32_t id;
+	unsigned long time;
+	uint8_t len;
+	uint8_t data[8];
+};
+RecordedFrame recordedFrames[MAX_FRAME_IDS];
+uint8_t recordedFrameCount = 0;
+// Frames of IDs past the first MAX_FRAME_IDS, not recorded
+uint32_t untrackedFrames = 0;
 
 void setup() {
 	Serial.begin(115200);
+	carloop.setCANSpeed(CARLOOP_CAN_AUTO_SPEED);
+	if (GPS_USE_UBX) {
+		carloop.setGPSProtocol(CARLOOP_GPS_UBX);
+	}
 	carloop.begin();
+	latency.begin();
+	Particle.variable("latency", latencyText);
+	Particle.variable("ecus", ecuText);
+	Particle.function("nack", nackChunks);
 	Particle.connect();
-	transitionTime = millis();
+
+	// Fuel for gasoline at 14.7:1 and 737 g/L from MAF in g/s * 100,
+	// distance from km/h over the time between speed replies
+	bool defined = derived.define(DERIVED_PID_FUEL_RATE, OBD_PID_MAF_AIR_FLOW_RATE, 2, 10000,
+		"#10 3323 * 1000 /");
+	defined &= derived.define(DERIVED_PID_TRIP_DISTANCE, OBD_PID_VEHICLE_SPEED, 4, 60000,
+		"acc #0d dt * 360 / +");
+	defined &= derived.define(DERIVED_PID_ENGINE_ON_TIME, OBD_PID_ENGINE_RPM, 4, 60000,
+		"acc #0c 0 > dt * +");
+	defined &= derived.define(DERIVED_PID_IDLE_TIME, OBD_PID_ENGINE_RPM, 4, 0,
+		"acc #0c 0 > #0d 1 < * dt * +");
+	defined &= derived.define(DERIVED_PID_IDLE_PERCENT, OBD_PID_ENGINE_RPM, 1, 60000,
+		"@f3 100 * @f2 1 max /");
+	// Slowing down by over 14 km/h a second (0.4 g), over 5000 RPM,
+	// and the check engine light coming on (bit 7 of the first byte)
+	defined &= derived.define(DERIVED_PID_HARD_BRAKING, OBD_PID_VEHICLE_SPEED, 1, 0,
+		"%0d #0d - 1000 * dt 1 max / 14 >");
+	defined &= derived.define(DERIVED_PID_HIGH_RPM, OBD_PID_ENGINE_RPM, 1, 0,
+		"#0c 20000 >");
+	defined &= derived.define(DERIVED_PID_MIL_ON, OBD_PID_MIL_STATUS, 1, 0,
+		"#01 0 < 1 %01 0 < - *");
+	if (!defined) {
+		Serial.println("Derived signal not defined");
+	}
+
+	// The battery is sampled every 10 ms, and at 9600 baud the 64-byte
+	// GPS receive buffer takes 66 ms to fill. UBX at 115200 baud is
+	// read more often while the GPS is on, see startActiveTasks().
+	bool scheduled = scheduler.every(UPDATE_INTERVAL, updateCarloop, millis());
+	scheduled &= scheduler.every(20000, printValues, 20000);
+	if (!scheduled) {
+		Serial.println("Scheduler full");
+	}
+	startActiveTasks();
 }
 
 void loop() {
+	uint32_t loopStart = LatencyStats::start();
+	unsigned long idle = scheduler.run(millis());
+	latency.stop(LatencyStats::PHASE_LOOP, loopStart);
+	if (idle > 0) {
+		// Nothing to do until then, leave the processor to the system thread
+		delay(idle);
+	}
+}
+
+void updateCarloop() {
+	uint32_t start = LatencyStats::start();
 	carloop.update();
-	printValuesAtInterval();
-	obdLoopFunction();
+	latency.stop(LatencyStats::PHASE_UPDATE, start);
+	updatePowerMode();
+	updateTimeBase();
+}
+
+void receiveGps() {
+	carloop.receiveGPS();
+}
+
+// The jobs of the ACTIVE power mode
+void startActiveTasks() {
+	bool scheduled = scheduler.every(OBD_REQUEST_INTERVAL, sendObdRequest, millis());
+	scheduled &= scheduler.watch(canReady, receiveObdResponse);
+	scheduled &= scheduler.watch(gpsReady, recordPosition);
+	if (GPS_USE_UBX) {
+		scheduled &= scheduler.every(GPS_UBX_RECEIVE_INTERVAL, receiveGps, millis());
+	}
+	scheduled &= scheduler.at(millis() + 600000, publishDiagnostics);
+	scheduled &= scheduler.every(1000, recordDerivedSignalsAtInterval, millis() + 1000);
+	// A chunk at a time, leaving most of the publish budget to "m" events
+	scheduled &= scheduler.every(5000, uploadBurst, millis() + 5000);
+	scheduled &= scheduler.every(1000, resendChunk, millis() + 1000);
+	if (!scheduled) {
+		Serial.println("Scheduler full, active tasks missing");
+	}
+}
+
+void stopActiveTasks() {
+	scheduler.cancel(sendObdRequest);
+	scheduler.cancel(receiveObdResponse);
+	scheduler.cancel(recordPosition);
+	scheduler.cancel(receiveGps);
+	scheduler.cancel(publishDiagnostics);
+	scheduler.cancel(recordDerivedSignalsAtInterval);
+	scheduler.cancel(uploadBurst);
+	scheduler.cancel(resendChunk);
+}
+
+bool canReady() {
+	return !carloop.canDetecting() && carloop.can().available() > 0;
+}
+
+bool gpsReady() {
+	return carloop.gps().location.isUpdated();
 }
 
 
@@ -150,92 +421,358 @@ void loop() {
  * and: https://en.wikipedia.org/wiki/OBD-II_PIDs#Standard_PIDs
  */
 void sendObdRequest() {
-	pidIndex = (pidIndex + 1) % NUM_PIDS_TO_REQUEST;
+	if (carloop.canDetecting()) {
+		return;
+	}
+
+	// Now and then a DTC read takes the place of a PID
+	uint8_t dtcMode = dtcs.poll(millis());
+	recordDtcChanges();
+
+	uint8_t pid = 0;
+	if (dtcMode) {
+		// Leave the fast and sweep PIDs where they were
+	} else if (!fastPidRequested) {
+		fastPidIndex = (fastPidIndex + 1) % NUM_FAST_PIDS;
+		pid = fastPidRequested = fastPids[fastPidIndex];
+	} else {
+		pidIndex = (pidIndex + 1) % NUM_PIDS_TO_REQUEST;
+		pid = pidsToRequest[pidIndex];
+		fastPidRequested = 0;
+	}
 
 	CANMessage message;
-	message.id = OBD_CAN_BROADCAST_ID;
+	if (carloop.canAddressing() == CARLOOP_CAN_29BIT) {
+		message.id = OBD_CAN_BROADCAST_ID_29;
+		message.extended = true;
+	} else {
+		message.id = OBD_CAN_BROADCAST_ID;
+	}
 	message.len = 8; // just always use 8
-	message.data[0] = 0x02; // 0 = single-frame format, 2  = num data bytes
-	message.data[1] = OBD_MODE_CURRENT_DATA; // OBD MODE
-	message.data[2] = pidsToRequest[pidIndex]; // OBD PID
+	if (dtcMode) {
+		message.data[0] = 0x01; // a mode without a PID
+		message.data[1] = dtcMode;
+	} else {
+		message.data[0] = 0x02; // 0 = single-frame format, 2  = num data bytes
+		message.data[1] = OBD_MODE_CURRENT_DATA; // OBD MODE
+		message.data[2] = pid; // OBD PID
+	}
 
+	uint32_t start = LatencyStats::start();
 	carloop.can().transmit(message);
-
-	obdLoopFunction = waitForObdResponse;
-	transitionTime = millis();
+	latency.stop(LatencyStats::PHASE_SEND, start);
+	ecus.request();
 }
 
-void waitForObdResponse() {
-	if (millis() - transitionTime >= 100) {
-		obdLoopFunction = delayUntilNextRequest;
-		transitionTime = millis();
-		return;
+/* Tell an ECU that started a multi-frame reply to send the rest: no
+ * more flow control frames, no delay between frames. See ISO 15765-2.
+ */
+void sendFlowControl(const CANMessage &message) {
+	CANMessage control;
+	uint8_t ecu = message.id & 0xff;
+	if (message.extended) {
+		control.id = OBD_CAN_REQUEST_ID_29 | (ecu << 8);
+		control.extended = true;
+	} else {
+		control.id = OBD_CAN_REQUEST_ID + (message.id - OBD_CAN_REPLY_ID_MIN);
 	}
+	control.len = 8;
+	control.data[0] = 0x30;
+	carloop.can().transmit(control);
+}
 
+// Runs whenever frames are waiting: replies to the last request,
+// and anything else on the bus
+void receiveObdResponse() {
 	String dump;
 	CANMessage message;
+	int received = 0;
+	bool flowControl;
+	uint32_t start = LatencyStats::start();
 	while (carloop.can().receive(message)) {
+		received++;
 		canMessageCount++;
-		if (message.id == 0x130) {
-			// This message gets sent every tenth of a second,
-			// so only publish it when the value changes.
-			if (!byteArray8Equal(message.data, lastMessageData)) {
-				memcpy(lastMessageData, message.data, 8);
+		power.canActivity(millis());
+		noteEngineRpm(message);
+		burst.add(millis(), message);
+		if (isJ1939(message)) {
+			// Only the SPNs in the table are recorded, not the frames
+			if (j1939.add(millis(), message)) {
+				recordJ1939(dump);
+			}
+		} else if (isObdReply(message) && dtcs.add(message, flowControl)) {
+			if (flowControl) {
+				sendFlowControl(message);
+			}
+		} else if (isFastReply(message)) {
+			// Only for the triggers and derived signals, bursts record them
+			if (isPrimaryEcu(message)) {
+				sampleDerivedSignals(message);
+			}
+		} else if (isObdReply(message) || frameDue(message)) {
+			if (recordMessage(message)) {
 				dump += dumpMessage(message);
 			}
-		} else {
-			dump += dumpMessage(message);
 		}
 	}
+	if (received == 0) {
+		// Only time the drains that had work, empty polls are most of them
+		return;
+	}
+	latency.stop(LatencyStats::PHASE_RECEIVE, start);
 
+	start = LatencyStats::start();
 	Serial.write(dump);
-	dumpForPublish += dump;
-	// change to:
-	// if > 196 binary bytes
-	// when each time stamp is exactly 2 bytes encoding integer tenths of a second
-	// and 1-5 data bytes follow
-	// then we base85 encode the binary to get close to the 255-byte publish limit
-	if (dumpForPublish.length() >= 220) {
-		Particle.publish("m", dumpForPublish, 60, PRIVATE);
-		dumpForPublish.remove(0);
+	latency.stop(LatencyStats::PHASE_SERIAL, start);
+}
+
+// A broadcast frame worth recording, see FRAME_INTERVAL
+bool frameDue(const CANMessage &message) {
+	uint8_t len = message.len < 8 ? message.len : 8;
+	RecordedFrame *frame = NULL;
+	for (uint8_t i = 0; i < recordedFrameCount; i++) {
+		if (recordedFrames[i].id == message.id) {
+			frame = &recordedFrames[i];
+			break;
+		}
+	}
+	if (!frame) {
+		if (recordedFrameCount >= MAX_FRAME_IDS) {
+			untrackedFrames++;
+			return false;
+		}
+		frame = &recordedFrames[recordedFrameCount++];
+		frame->id = message.id;
+	} else if (millis() - frame->time < FRAME_INTERVAL ||
+			(frame->len == len && memcmp(frame->data, message.data, len) == 0)) {
+		return false;
 	}
+	frame->time = millis();
+	frame->len = len;
+	memcpy(frame->data, message.data, len);
+	return true;
+}
+
+bool isObdReply(const CANMessage &message) {
+	return message.extended ?
+		(message.id & 0xFFFFFF00) == OBD_CAN_REPLY_ID_29 :
+		message.id >= OBD_CAN_REPLY_ID_MIN && message.id <= OBD_CAN_REPLY_ID_MAX;
+}
+
+// A reply to a fast PID request
+bool isFastReply(const CANMessage &message) {
+	return fastPidRequested && isObdReply(message) &&
+		message.data[1] == 0x40 + OBD_MODE_CURRENT_DATA && message.data[2] == fastPidRequested;
+}
+
+// A J1939 broadcast, on a bus at the J1939 bitrate
+bool isJ1939(const CANMessage &message) {
+	return message.extended && !isObdReply(message) && carloop.getCANSpeed() == J1939_CAN_SPEED;
+}
+
+bool isPrimaryEcu(const CANMessage &message) {
+	uint8_t ecu = message.id & 0xff;
+	return ecu == (message.extended ? OBD_PRIMARY_ECU_29 : OBD_PRIMARY_ECU);
 }
 
-void delayUntilNextRequest() {
-	if (millis() - transitionTime >= 80) {
-		obdLoopFunction = sendObdRequest;
-		transitionTime = millis();
+void noteEngineRpm(const CANMessage &message) {
+	if (isObdReply(message) && message.data[0] >= 4 && message.data[1] == 0x40 + OBD_MODE_CURRENT_DATA &&
+			message.data[2] == OBD_PID_ENGINE_RPM) {
+		power.engineRpm(millis(), ((message.data[3] << 8) | message.data[4]) / 4);
+	} else if (isJ1939(message) && J1939Decoder::pgn(message.id) == J1939_PGN_EEC1 &&
+			message.data[4] < 0xfb) {
+		power.engineRpm(millis(), ((message.data[4] << 8) | message.data[3]) / 8);
 	}
 }
 
 /*************** End: OBD Loop Functions ****************/
 
 
-void printValuesAtInterval() {
-	static const unsigned long interval = 20000;
-	static unsigned long lastDisplay = 0;
-	if (millis() - lastDisplay < interval) {
+/*************** Begin: Power Mode Functions ****************/
+
+void updatePowerMode() {
+	uint8_t events = carloop.batteryEvents();
+	printBatteryEvents(events);
+	power.battery(millis(), carloop.batteryCharging(), events & CARLOOP_BATTERY_CHARGING_STARTED,
+		events & CARLOOP_BATTERY_CRANKING);
+
+	PowerManager::Mode_e previous = power.mode();
+	PowerManager::Mode_e mode = power.update(millis());
+	if (mode != previous) {
+		enterPowerMode(previous, mode);
+	}
+
+	if (mode == PowerManager::MODE_SNIFF) {
+		// Nothing is requested, anything received means the bus is awake
+		CANMessage message;
+		while (carloop.can().receive(message)) {
+			power.canActivity(millis());
+		}
+	}
+}
+
+void enterPowerMode(PowerManager::Mode_e from, PowerManager::Mode_e to) {
+	switch (to) {
+	case PowerManager::MODE_ACTIVE:
+		Serial.println("Power mode: active");
+		if (from == PowerManager::MODE_PARKED) {
+			carloop.enableCAN();
+		}
+		if (!carloop.canDetected()) {
+			// The car was off at boot, detect now that the bus is awake.
+			// updateCarloop() runs it, the OBD tasks wait for it.
+			carloop.startCANDetection();
+		}
+		carloop.enableGPS();
+		Particle.connect();
+		scheduler.every(UPDATE_INTERVAL, updateCarloop, millis());
+		startActiveTasks();
+		break;
+
+	case PowerManager::MODE_PARKED:
+		if (from == PowerManager::MODE_ACTIVE) {
+			Serial.println("Power mode: parked");
+			stopActiveTasks();
+			// The totals of the drive go out with the last chunk
+			recordDerivedSignals(true);
+			if (!records.isEmpty()) {
+				publishRecords();
+			}
+			track.reset();
+			carloop.disableGPS();
+			Particle.disconnect();
+			scheduler.every(PARKED_UPDATE_INTERVAL, updateCarloop, millis() + PARKED_UPDATE_INTERVAL);
+		}
+		carloop.disableCAN();
+		break;
+
+	case PowerManager::MODE_SNIFF:
+		carloop.enableCAN();
+		break;
+	}
+}
+
+/*************** End: Power Mode Functions ****************/
+
+
+/* Publish the loop latency summary as a "d" event and start over,
+ * so each event covers the 10 minutes before it
+ */
+void publishDiagnostics() {
+	if (!Particle.connected() || !takePublish()) {
+		scheduler.at(millis() + 1000, publishDiagnostics);
+		return;
+	}
+	scheduler.at(millis() + 600000, publishDiagnostics);
+	char summary[200];
+	latency.summary(summary, sizeof(summary));
+	Particle.publish("d", summary, 60, PRIVATE);
+	latency.reset();
+}
+
+void printBatteryEvents(uint8_t events) {
+	if (events & CARLOOP_BATTERY_CRANKING) {
+		Serial.println("Engine cranking");
+	}
+	if (events & CARLOOP_BATTERY_CHARGING_STARTED) {
+		Serial.println("Battery charging");
+	}
+	if (events & CARLOOP_BATTERY_CHARGING_STOPPED) {
+		Serial.println("Battery not charging");
+	}
+}
+
+// Geotag the OBD data with the GPS track, sampled once a second
+// and simplified so straight stretches cost next to nothing
+void recordPosition() {
+	static const unsigned long interval = 1000;
+	static unsigned long lastPosition = 0;
+	if (millis() - lastPosition < interval) {
+		return;
+	}
+	TinyGPSPlus &gps = carloop.gps();
+	if (!gps.location.isValid() || !gps.location.isUpdated()) {
+		return;
+	}
+	lastPosition = millis();
+
+	TrackFix fix;
+	fix.time = lastPosition;
+	GeoPoint point = geoPoint(gps.location.rawLat(), gps.location.rawLng());
+	fix.sample = PositionEncoder::quantize(point,
+		gps.speed.value(), gps.course.value(), gps.hdop.value());
+
+	TrackFix publishFix;
+	if (!track.add(fix, publishFix)) {
 		return;
 	}
-	lastDisplay = millis();
-	printValues();
+
+	// Start a new chunk rather than splitting a keyframe-sized record
+	if (!records.fits(PositionEncoder::MAX_PAYLOAD)) {
+		publishRecords();
+	}
+
+	uint8_t payload[PositionEncoder::MAX_PAYLOAD];
+	uint8_t type;
+	uint8_t len = positions.encode(publishFix.sample, payload, type);
+	appendRecord(publishFix.time, type, payload, len);
+}
+
+// Discipline the UTC time base with GPS time, and cloud time until there's a fix
+void updateTimeBase() {
+	TinyGPSPlus &gps = carloop.gps();
+	if (gps.time.isUpdated() && gps.location.isValid() && gps.location.age() < 2000) {
+		// GGA updates the time without the date, so only use times
+		// committed together with a date by RMC, or midnight goes wrong
+		uint32_t age = gps.time.age();
+		if (gps.date.isValid() && gps.date.age() - age <= 2) {
+			timeBase.gpsTime(millis() - age, gps.date.value(), gps.time.value());
+		}
+	}
+
+	static const unsigned long cloudInterval = 600000;
+	static unsigned long lastCloud = 0;
+	static bool hasCloud = false;
+	if ((!hasCloud || millis() - lastCloud >= cloudInterval) &&
+			Particle.connected() && Time.isValid()) {
+		lastCloud = millis();
+		hasCloud = true;
+		timeBase.cloudTime(lastCloud, Time.now());
+	}
+
+	timeBase.update(millis());
 }
 
 void printValues() {
-	Serial.printf("Battery voltage: %12f ", carloop.battery());
+	Serial.printf("Battery voltage: %5u mV%s ", carloop.batteryMillivolts(),
+			carloop.batteryCharging() ? " charging" : "");
 	Serial.printf("CAN messages: %12d ", canMessageCount);
+	if (carloop.getCANSpeed() == J1939_CAN_SPEED) {
+		Serial.printf("BAMs: %lu dropped %lu ", (unsigned long)j1939.bamCompleted(),
+			(unsigned long)j1939.bamDropped());
+	}
+	Serial.printf("Late: %4lu ms ", scheduler.maxLateness());
+	Serial.printf("DTCs: %u stored %u pending, read every %lu s ", dtcs.count(DtcReader::MODE_STORED),
+		dtcs.count(DtcReader::MODE_PENDING), dtcs.interval() / 1000);
+	Serial.printf("Resent: %lu dropped %lu ", (unsigned long)retransmit.resent(),
+		(unsigned long)retransmit.dropped());
+	if (untrackedFrames) {
+		Serial.printf("Untracked frames: %lu ", (unsigned long)untrackedFrames);
+	}
 	Serial.println("");
+	latency.format(latencyText);
+	Serial.println(latencyText.c_str());
+	ecus.format(ecuText);
+	Serial.println(ecuText.c_str());
 }
 
 String dumpMessage(const CANMessage &message) {
-	// change to: each timestamp as exactly 2 bytes
-	// as unsigned integer tenths of a second
-	// wrap around carefully
-	// maybe (quick stab) -- uint16_t t = (millis() / 100) & 0xffff
+	uint32_t start = LatencyStats::start();
 	String str = String::format("%.1f:", millis() / 1000.0);
 	int startIdx = 0;
 	int lastIdx = message.len - 1;
-	if (message.id >= 0x700) {
+	if (isObdReply(message)) {
+		str += String::format("%02x/", (unsigned)(message.id & 0xff));
 		// We can ignore the first two bytes
 		// data[0] is the length
 		// data[1] is the UDS service response ID, always 0x41 for me
@@ -245,16 +782,266 @@ String dumpMessage(const CANMessage &message) {
 			lastIdx = message.data[0];
 		}
 	}
-	// hmm... Since the binary data can include zeros
-	// I may have to do the base85 encoding on the fly
-	// rather than right before publish...
 	for (int i = startIdx; i <= lastIdx; i++) {
 		str += String::format("%02x", message.data[i]);
 	}
 	str += ",";
+	latency.stop(LatencyStats::PHASE_FORMAT, start);
 	return str;
 }
 
+/* Append the message to the binary publish buffer,
+ * publishing the buffer first if the record would not fit.
+ * False when there was nothing worth recording.
+ * See README.md for the record format.
+ */
+bool recordMessage(const CANMessage &message) {
+	uint8_t payload[RecordBuffer::MAX_PAYLOAD];
+	uint8_t type;
+	uint8_t len = encodeMessage(message, payload, type);
+	if (len == 0) {
+		// a zero tag marks the end of a chunk, and there's nothing to publish anyway
+		return false;
+	}
+
+	if (type != RECORD_CAN_FRAME) {
+		uint8_t start = type == RECORD_ECU_REPLY ? 1 : 0;
+		if (!ecus.reply(message.id & 0xff, payload + start, len - start,
+				isPrimaryEcu(message))) {
+			// Another ECU already said the same in this request window
+			return false;
+		}
+		if (isPrimaryEcu(message)) {
+			sampleDerivedSignals(message);
+			noteMilStatus(message);
+		}
+	}
+
+	appendRecord(millis(), type, payload, len);
+	return true;
+}
+
+// The record payload for a frame, zero length when there's nothing in it
+uint8_t encodeMessage(const CANMessage &message, uint8_t *payload, uint8_t &type) {
+	uint8_t len = 0;
+	if (isObdReply(message)) {
+		if (isPrimaryEcu(message)) {
+			type = RECORD_OBD_REPLY;
+		} else {
+			type = RECORD_ECU_REPLY;
+			payload[len++] = message.id & 0xff;
+		}
+		// Same trimming as dumpMessage: PID and reply data only
+		int lastIdx = message.len - 1;
+		if (message.data[0] < message.len) {
+			lastIdx = message.data[0];
+		}
+		for (int i = 2; i <= lastIdx; i++) {
+			payload[len++] = message.data[i];
+		}
+		if (len == 1 && type == RECORD_ECU_REPLY) {
+			len = 0;
+		}
+	} else {
+		type = RECORD_CAN_FRAME;
+		payload[len++] = (message.id >> 8) & 0xff;
+		payload[len++] = message.id & 0xff;
+		for (int i = 0; i < message.len && i < 8; i++) {
+			payload[len++] = message.data[i];
+		}
+	}
+	return len;
+}
+
+// The MIL and the DTC count make the DTC reader look at once
+void noteMilStatus(const CANMessage &message) {
+	if (message.data[0] >= 3 && message.data[1] == 0x40 + OBD_MODE_CURRENT_DATA &&
+			message.data[2] == OBD_PID_MIL_STATUS) {
+		dtcs.status(millis(), message.data[3] & 0x80, message.data[3] & 0x7f);
+	}
+}
+
+/* Record the DTCs added and removed by the last read, and publish them
+ * at once rather than when the chunk is full. Offline they wait in the
+ * chunk like any other record.
+ */
+void recordDtcChanges() {
+	uint8_t payload[DtcReader::MAX_PAYLOAD];
+	uint8_t len;
+	bool changed = false;
+	while (dtcs.next(payload, len)) {
+		appendRecord(millis(), RECORD_DTC, payload, len);
+		// P0301 and the like: the top 2 bits are the system letter
+		Serial.printf("DTC %c%c%04x %s\n", payload[0] & 0x80 ? '+' : '-', "PCBU"[payload[1] >> 6],
+			((payload[1] & 0x3f) << 8) | payload[2],
+			(payload[0] & 0x7f) == DtcReader::MODE_STORED ? "stored" : "pending");
+		changed = true;
+	}
+	if (changed && Particle.connected()) {
+		publishRecords();
+	}
+}
+
+// Record the changed SPNs of the frame the J1939 decoder just took
+void recordJ1939(String &dump) {
+	uint8_t payload[J1939Decoder::MAX_PAYLOAD];
+	uint8_t len;
+	while (j1939.next(payload, len)) {
+		appendRecord(millis(), RECORD_J1939, payload, len);
+
+		uint32_t spn = ((uint32_t)payload[1] << 16) | (payload[2] << 8) | payload[3];
+		uint32_t value = 0;
+		for (uint8_t i = 4; i < len; i++) {
+			value = (value << 8) | payload[i];
+		}
+		dump += String::format("%.1f:%02x/%lu=%lu,", millis() / 1000.0, payload[0],
+			(unsigned long)spn, (unsigned long)value);
+	}
+}
+
+// Feed a Mode 01 reply to the derived signals, and start a burst
+// capture when that fires one of the triggers
+void sampleDerivedSignals(const CANMessage &message) {
+	int lastIdx = message.len - 1;
+	if (message.data[0] < message.len) {
+		lastIdx = message.data[0];
+	}
+	if (message.data[1] != 0x40 + OBD_MODE_CURRENT_DATA || lastIdx < 2) {
+		return;
+	}
+	derived.sample(millis(), message.data[2], message.data + 3, lastIdx - 2);
+
+	for (uint8_t trigger : burstTriggers) {
+		if (derived.value(trigger) && burst.trigger(millis(), trigger)) {
+			Serial.printf("Burst capture: %02x\n", trigger);
+		}
+	}
+}
+
+// Record the virtual PIDs that changed, each at most at its own interval
+void recordDerivedSignals(bool flush) {
+	uint8_t payload[RecordBuffer::MAX_PAYLOAD];
+	uint8_t len;
+	while (derived.next(millis(), payload, len, flush)) {
+		appendRecord(millis(), RECORD_DERIVED, payload, len);
+	}
+}
+
+void recordDerivedSignalsAtInterval() {
+	recordDerivedSignals(false);
+}
+
+// Append a record, publishing the current chunk first if it would not fit
+void appendRecord(unsigned long now, uint8_t type, const uint8_t *payload, uint8_t len) {
+	if (!records.fits(len)) {
+		publishRecords();
+	}
+	if (records.length() == 0) {
+		unsigned long start = millis();
+		records.start(start, timeBase.nowUtc(start));
+	}
+	records.append(now, type, payload, len);
+}
+
+void publishRecords() {
+	if (records.isEmpty()) {
+		return;
+	}
+	publishChunk("m", records);
+	// Each chunk starts with a position keyframe, so it decodes on its own
+	positions.reset();
+}
+
+/* Publish the next chunk of a finished burst capture. Each chunk starts
+ * with the trigger, so it decodes on its own.
+ */
+void uploadBurst() {
+	if (!burst.frozen(millis()) || !Particle.connected()) {
+		return;
+	}
+	// Room for the largest record, a CAN frame with its ID
+	static const uint8_t LARGEST_RECORD = 10;
+	CANMessage message;
+	unsigned long time;
+	while (burstRecords.fits(LARGEST_RECORD) && burst.next(millis(), message, time)) {
+		if (burstRecords.length() == 0) {
+			unsigned long triggered = burst.triggerTime();
+			unsigned long anchor = (long)(triggered - time) < 0 ? triggered : time;
+			burstRecords.start(anchor, timeBase.nowUtc(anchor));
+			uint8_t reason = burst.reason();
+			burstRecords.append(triggered, RECORD_BURST_TRIGGER, &reason, 1);
+		}
+		uint8_t payload[RecordBuffer::MAX_PAYLOAD];
+		uint8_t type;
+		uint8_t len = encodeMessage(message, payload, type);
+		if (len > 0) {
+			burstRecords.append(time, type, payload, len);
+		}
+	}
+	if (!burstRecords.isEmpty()) {
+		publishChunk("b", burstRecords);
+	}
+}
+
+/* Number the chunk and keep it in case the server reports it missing.
+ * Offline or over the publish budget, it waits there for resendChunk().
+ */
+void publishChunk(const char *name, RecordBuffer &chunk) {
+	chunk.seal(chunkSequence++);
+	bool sent = Particle.connected() && takePublish();
+	retransmit.add(name, chunk.data(), chunk.length(), sent);
+	if (sent) {
+		publishEncoded(name, chunk.data(), chunk.length());
+	}
+	chunk.clear();
+}
+
+// base85 encode the binary records to get close to the 255-byte publish limit
+void publishEncoded(const char *name, const uint8_t *chunk, size_t len) {
+	char encoded[RecordBuffer::ENCODED_SIZE];
+	encode_85(encoded, chunk, len);
+	uint32_t start = LatencyStats::start();
+	Particle.publish(name, encoded, 60, PRIVATE);
+	latency.stop(LatencyStats::PHASE_PUBLISH, start);
+}
+
+/* Cloud function: the server lists the sequence numbers of the chunks it
+ * didn't get, as "12-15,20". Those still held go out again as the
+ * publish budget allows, at most one a second.
+ * Returns how many that is, -1 when the list doesn't parse.
+ */
+int nackChunks(String ranges) {
+	return retransmit.nack(ranges.c_str());
+}
+
+// Chunks the server asked for and ones that couldn't be sent yet,
+// one a second at most so new chunks get most of the publish budget
+void resendChunk() {
+	if (!Particle.connected() || retransmit.pending() == 0 || !takePublish()) {
+		return;
+	}
+	char name[2];
+	uint8_t chunk[RecordBuffer::CAPACITY];
+	size_t len;
+	if (retransmit.next(name, chunk, len)) {
+		publishEncoded(name, chunk, len);
+	}
+}
+
+// Spends a publish from the budget, false when there's none left
+bool takePublish() {
+	unsigned long now = millis();
+	if ((long)(publishCredit - now) < 0) {
+		publishCredit = now;
+	}
+	// A millisecond to spare, millis() rounds down
+	if (publishCredit - now + PUBLISH_INTERVAL >= PUBLISH_BURST * PUBLISH_INTERVAL) {
+		return false;
+	}
+	publishCredit += PUBLISH_INTERVAL;
+	return true;
+}
+
 bool byteArray8Equal(uint8_t a1[8], uint8_t a2[8]) {
 	for (int i = 0; i < 8; i++) {
 		if (a1[i] != a2[i]) return false;
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "burst_capture.h"
+
+BurstCapture::BurstCapture(unsigned long before, unsigned long after, unsigned long holdoff)
+    : before(before), after(after), holdoff(holdoff), head(0), count(0),
+      state(STATE_RECORDING), triggeredAt(0), finishedAt(0), finished(false),
+      triggerReason(0), captureCount(0)
+{
+}
+
+void BurstCapture::add(unsigned long now, const CANMessage &message)
+{
+    if(frozen(now))
+    {
+        return;
+    }
+    Frame &frame = ring[head];
+    frame.time = now;
+    frame.id = message.id | (message.extended ? 0x80000000 : 0);
+    frame.len = message.len <= 8 ? message.len : 8;
+    memcpy(frame.data, message.data, sizeof(frame.data));
+    head = (head + 1) % CAPACITY;
+    if(count < CAPACITY)
+    {
+        count++;
+    }
+}
+
+bool BurstCapture::trigger(unsigned long now, uint8_t reason)
+{
+    if(state != STATE_RECORDING || (finished && now - finishedAt < holdoff))
+    {
+        return false;
+    }
+    state = STATE_AFTER;
+    triggeredAt = now;
+    triggerReason = reason;
+    captureCount++;
+    return true;
+}
+
+bool BurstCapture::next(unsigned long now, CANMessage &message, unsigned long &time)
+{
+    if(!frozen(now))
+    {
+        return false;
+    }
+    while(count > 0)
+    {
+        const Frame &frame = ring[(head + CAPACITY - count) % CAPACITY];
+        count--;
+        if(triggeredAt - frame.time > before && (long)(triggeredAt - frame.time) > 0)
+        {
+            continue;
+        }
+        message = CANMessage();
+        message.id = frame.id & 0x7fffffff;
+        message.extended = frame.id & 0x80000000;
+        message.len = frame.len;
+        memcpy(message.data, frame.data, sizeof(message.data));
+        time = frame.time;
+        return true;
+    }
+
+    state = STATE_RECORDING;
+    finished = true;
+    finishedAt = now;
+    return false;
+}
+
+bool BurstCapture::frozen(unsigned long now)
+{
+    if(state == STATE_AFTER && now - triggeredAt >= after)
+    {
+        state = STATE_FROZEN;
+    }
+    return state == STATE_FROZEN;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BurstCapture_h
+#define __BurstCapture_h
+
+#include "application.h"
+
+/* Keeps the most recent CAN frames in a ring, so that what led up to an
+ * incident can be uploaded in full.
+ *
+ * Every received frame goes into the ring, at O(1) cost, until trigger()
+ * is called. Recording continues for the after period, then the ring is
+ * frozen. next() hands out the frozen frames from before - trigger time
+ * onwards, oldest first. When they're drained, recording resumes with an
+ * empty ring. Triggers are ignored while a capture is in progress and
+ * for the holdoff after it, so a condition that stays true doesn't keep
+ * the device uploading.
+ *
+ * A busy bus fills the ring faster than the before period. The capture
+ * then starts with the oldest frame still in the ring.
+ */
+class BurstCapture
+{
+public:
+    static constexpr uint16_t CAPACITY = 512;
+
+    BurstCapture(unsigned long before = 5000, unsigned long after = 5000,
+                 unsigned long holdoff = 60000);
+
+    void add(unsigned long now, const CANMessage &message);
+    // False when ignored. The reason is handed back by reason().
+    bool trigger(unsigned long now, uint8_t reason);
+
+    // A frame of the frozen capture and when it was received
+    bool next(unsigned long now, CANMessage &message, unsigned long &time);
+
+    // A capture is waiting to be uploaded
+    bool frozen(unsigned long now);
+    uint8_t reason() const { return triggerReason; }
+    unsigned long triggerTime() const { return triggeredAt; }
+    uint32_t captures() const { return captureCount; }
+
+private:
+    enum State_e
+    {
+        STATE_RECORDING,
+        STATE_AFTER,
+        STATE_FROZEN
+    };
+
+    struct Frame
+    {
+        uint32_t time;
+        uint32_t id; // bit 31 set for an extended ID
+        uint8_t len;
+        uint8_t data[8];
+    };
+
+    unsigned long before;
+    unsigned long after;
+    unsigned long holdoff;
+
+    Frame ring[CAPACITY];
+    uint16_t head; // next slot to write
+    uint16_t count;
+
+    State_e state;
+    unsigned long triggeredAt;
+    unsigned long finishedAt;
+    bool finished;
+    uint8_t triggerReason;
+    uint32_t captureCount;
+};
+
+#endif // def(__BurstCapture_h)
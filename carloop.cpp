@@ -6,21 +6,81 @@
  */
 
 #include "carloop.h"
-#include <functional>
 
-std::function<void(char)> serialHandler;
+// Auto-detection candidates, most common first
+static const uint32_t CAN_SPEEDS[] = { 500000, 250000, 125000, 1000000 };
+// A wrong speed only shows as error passive after about 15 frames, so this
+// covers buses down to 50 frames per second
+static constexpr unsigned long CAN_LISTEN_WINDOW = 300;
+// ISO 15765-4 gives ECUs 50 ms to reply
+static constexpr unsigned long CAN_PROBE_TIMEOUT = 100;
+
+struct CarloopCANCache
+{
+    static constexpr uint16_t MAGIC = 0xca17;
+    uint16_t magic;
+    uint8_t addressing;
+    uint32_t speed;
+};
 
 template<typename Config>
 Carloop<Config>::Carloop()
+{
+}
+
+template<typename Config, bool Enabled>
+CarloopCAN<Config, Enabled>::CarloopCAN()
     : canDriver(Config::CAN_PINS),
-    canSpeed(Config::CAN_DEFAULT_SPEED)
+    canSpeed(Config::CAN_DEFAULT_SPEED),
+    canAddressingMode(CARLOOP_CAN_11BIT),
+    canAutoDetect(false),
+    canIsDetected(false),
+    detectState(DETECT_IDLE),
+    detectIndex(0),
+    detectStart(0),
+    detectHeard(false),
+    detectCachedSpeed(Config::CAN_DEFAULT_SPEED),
+    detectCachedAddressing(CARLOOP_CAN_11BIT),
+    detectCached(false)
 {
 }
 
-template <typename Config>
-void Carloop<Config>::setCANSpeed(uint32_t canSpeed)
+template<typename Config, bool Enabled>
+CarloopGPS<Config, Enabled>::CarloopGPS()
+    : ubxDriver(gpsDriver),
+    gpsProtocol(CARLOOP_GPS_NMEA),
+    gpsBaudRate(Config::GPS_BAUD_RATE),
+    gpsPeriodMs(1000)
 {
-    this->canSpeed = canSpeed;
+}
+
+template<typename Config, bool Enabled>
+CarloopBattery<Config, Enabled>::CarloopBattery()
+    : nextBatterySample(0),
+    batteryFiltered(0),
+    batteryIsCranking(false),
+    batteryIsCharging(false),
+    batteryEventFlags(0)
+{
+}
+
+template <typename Config, bool Enabled>
+void CarloopCAN<Config, Enabled>::setCANSpeed(uint32_t canSpeed)
+{
+    canAutoDetect = canSpeed == CARLOOP_CAN_AUTO_SPEED;
+    if(!canAutoDetect)
+    {
+        this->canSpeed = canSpeed;
+    }
+}
+
+template <typename Config, bool Enabled>
+void CarloopGPS<Config, Enabled>::setGPSProtocol(CarloopGPSProtocol_e protocol,
+                                                 uint32_t baudRate, uint16_t periodMs)
+{
+    this->gpsProtocol = protocol;
+    this->gpsBaudRate = baudRate;
+    this->gpsPeriodMs = periodMs;
 }
 
 template <typename Config>
@@ -30,97 +90,439 @@ void Carloop<Config>::begin(CarloopFeatures_e features)
 
     if(hasCAN())
     {
-        enableCAN();
+        this->beginCAN();
     }
 
     if(hasGPS())
     {
-        enableGPS();
+        this->enableGPS();
     }
 
     if(hasBattery())
     {
-        enableBattery();
+        this->enableBattery();
     }
 }
 
 template <typename Config>
 void Carloop<Config>::update()
 {
+    if(hasCAN())
+    {
+        this->updateCAN();
+    }
+
+    if(hasGPS())
+    {
+        this->receiveGPS();
+    }
+
     if(hasBattery())
     {
-        batteryVoltage = readBattery();
+        this->updateBattery();
     }
 }
 
-template <typename Config>
-CANChannel &Carloop<Config>::can()
+template <typename Config, bool Enabled>
+CANChannel &CarloopCAN<Config, Enabled>::can()
 {
     return canDriver;
 }
 
-template <typename Config>
-TinyGPSPlus &Carloop<Config>::gps()
+template <typename Config, bool Enabled>
+uint32_t CarloopCAN<Config, Enabled>::getCANSpeed()
+{
+    return canSpeed;
+}
+
+template <typename Config, bool Enabled>
+CarloopCANAddressing_e CarloopCAN<Config, Enabled>::canAddressing()
+{
+    return canAddressingMode;
+}
+
+template <typename Config, bool Enabled>
+bool CarloopCAN<Config, Enabled>::canDetected()
+{
+    return canIsDetected;
+}
+
+template <typename Config, bool Enabled>
+TinyGPSPlus &CarloopGPS<Config, Enabled>::gps()
 {
     return gpsDriver;
 }
 
-template <typename Config>
-float Carloop<Config>::battery()
+template <typename Config, bool Enabled>
+float CarloopBattery<Config, Enabled>::battery()
 {
-    return batteryVoltage;
+    return batteryMillivolts() / 1000.0f;
 }
 
-template <typename Config>
-void Carloop<Config>::enableCAN()
+template <typename Config, bool Enabled>
+uint16_t CarloopBattery<Config, Enabled>::batteryMillivolts()
+{
+    return (batteryFiltered + 128) >> 8;
+}
+
+template <typename Config, bool Enabled>
+bool CarloopBattery<Config, Enabled>::batteryCharging()
+{
+    return batteryIsCharging;
+}
+
+template <typename Config, bool Enabled>
+uint8_t CarloopBattery<Config, Enabled>::batteryEvents()
+{
+    uint8_t events = batteryEventFlags;
+    batteryEventFlags = 0;
+    return events;
+}
+
+template <typename Config, bool Enabled>
+void CarloopCAN<Config, Enabled>::enableCAN()
 {
     pinMode(Config::CAN_ENABLE_PIN, OUTPUT);
     digitalWrite(Config::CAN_ENABLE_PIN, Config::CAN_ENABLE_ACTIVE);
     canDriver.begin(canSpeed);
 }
 
-template <typename Config>
-void Carloop<Config>::disableCAN()
+/* Finds the bitrate by listening at each candidate speed: a wrong one
+ * makes the controller error passive within about 15 frames, a right one
+ * delivers a frame, so each try ends as soon as either happens. The HAL
+ * has no listen-only mode, so the controller answers each of those frames
+ * with an error flag that destroys it for the whole bus. Only a
+ * speed that delivered a frame is probed with an OBD request, 11-bit and
+ * 29-bit, and a reply settles both the speed and the addressing. A silent
+ * bus is probed at the last result alone, where the OBD requests would go
+ * anyway, so nothing is ever sent at a guessed bitrate. The last result
+ * is tried first, so a warm start normally takes one frame and one reply.
+ *
+ * Each step only looks at the controller and the time, so detectCAN()
+ * spins on them while update() takes one step per call.
+ */
+template <typename Config, bool Enabled>
+void CarloopCAN<Config, Enabled>::beginCAN()
+{
+    enableCAN();
+    if(canAutoDetect)
+    {
+        detectCAN();
+    }
+}
+
+template <typename Config, bool Enabled>
+bool CarloopCAN<Config, Enabled>::detectCAN()
+{
+    startCANDetection();
+    while(detectState != DETECT_IDLE)
+    {
+        updateCAN();
+    }
+    return canIsDetected;
+}
+
+template <typename Config, bool Enabled>
+void CarloopCAN<Config, Enabled>::startCANDetection()
+{
+    CarloopCANCache cache;
+    EEPROM.get(Config::CAN_EEPROM_ADDRESS, cache);
+    detectCached = cache.magic == CarloopCANCache::MAGIC;
+    detectCachedSpeed = detectCached ? cache.speed : Config::CAN_DEFAULT_SPEED;
+    detectCachedAddressing = detectCached ? (CarloopCANAddressing_e)cache.addressing : CARLOOP_CAN_11BIT;
+    listenCAN(-1);
+}
+
+template <typename Config, bool Enabled>
+bool CarloopCAN<Config, Enabled>::canDetecting()
+{
+    return detectState != DETECT_IDLE;
+}
+
+template <typename Config, bool Enabled>
+void CarloopCAN<Config, Enabled>::updateCAN()
+{
+    if(detectState == DETECT_IDLE)
+    {
+        return;
+    }
+
+    CANMessage message;
+    bool errors = canDriver.errorStatus() != CAN_NO_ERROR;
+    bool timeout = millis() - detectStart >= (detectState == DETECT_LISTEN ? CAN_LISTEN_WINDOW
+                                                                           : CAN_PROBE_TIMEOUT);
+    if(detectState == DETECT_LISTEN)
+    {
+        if(!errors && canDriver.receive(message))
+        {
+            detectHeard = true;
+            probeCAN(detectCachedAddressing);
+        }
+        else if(!errors && timeout && detectIndex < 0)
+        {
+            probeCAN(detectCachedAddressing);
+        }
+        else if(errors || timeout)
+        {
+            listenCAN(detectIndex + 1);
+        }
+        return;
+    }
+
+    // Probing: errors mean nobody acknowledged the request
+    bool extended = canAddressingMode == CARLOOP_CAN_29BIT;
+    while(!errors && canDriver.receive(message))
+    {
+        bool reply = extended ? (message.id & 0xffffff00) == 0x18daf100
+                              : message.id >= 0x7e8 && message.id <= 0x7ef;
+        if(message.extended == extended && reply && message.data[1] == 0x41)
+        {
+            finishCANDetection(true);
+            return;
+        }
+    }
+    if(!errors && !timeout)
+    {
+        return;
+    }
+    if(canAddressingMode == detectCachedAddressing)
+    {
+        probeCAN(extended ? CARLOOP_CAN_11BIT : CARLOOP_CAN_29BIT);
+    }
+    else if(detectHeard)
+    {
+        // Traffic without OBD replies still pins down the speed
+        finishCANDetection(false);
+    }
+    else
+    {
+        listenCAN(detectIndex + 1);
+    }
+}
+
+// Moves on to the speed at index, skipping the cached one, or gives up
+template <typename Config, bool Enabled>
+void CarloopCAN<Config, Enabled>::listenCAN(int8_t index)
+{
+    static constexpr int8_t SPEEDS = sizeof(CAN_SPEEDS) / sizeof(CAN_SPEEDS[0]);
+    while(index >= 0 && index < SPEEDS && CAN_SPEEDS[index] == detectCachedSpeed)
+    {
+        index++;
+    }
+    if(index >= SPEEDS)
+    {
+        finishCANDetection(false);
+        return;
+    }
+
+    detectIndex = index;
+    detectHeard = false;
+    detectState = DETECT_LISTEN;
+    canSpeed = index < 0 ? detectCachedSpeed : CAN_SPEEDS[index];
+    canDriver.end();
+    canDriver.begin(canSpeed);
+    detectStart = millis();
+}
+
+template <typename Config, bool Enabled>
+void CarloopCAN<Config, Enabled>::probeCAN(CarloopCANAddressing_e addressing)
+{
+    CANMessage message;
+    while(canDriver.receive(message))
+    {
+    }
+
+    // Mode 01 PID 00, which every OBD ECU must answer
+    bool extended = addressing == CARLOOP_CAN_29BIT;
+    message.id = extended ? 0x18db33f1 : 0x7df;
+    message.extended = extended;
+    message.len = 8;
+    memset(message.data, 0, sizeof(message.data));
+    message.data[0] = 0x02;
+    message.data[1] = 0x01;
+    canDriver.transmit(message);
+
+    canAddressingMode = addressing;
+    detectState = DETECT_PROBE;
+    detectStart = millis();
+}
+
+template <typename Config, bool Enabled>
+void CarloopCAN<Config, Enabled>::finishCANDetection(bool detected)
+{
+    detectState = DETECT_IDLE;
+    canIsDetected = detected;
+    if(detected)
+    {
+        if(!detectCached || detectCachedSpeed != canSpeed || detectCachedAddressing != canAddressingMode)
+        {
+            CarloopCANCache cache;
+            cache.magic = CarloopCANCache::MAGIC;
+            cache.speed = canSpeed;
+            cache.addressing = canAddressingMode;
+            EEPROM.put(Config::CAN_EEPROM_ADDRESS, cache);
+        }
+        return;
+    }
+
+    if(!detectHeard)
+    {
+        canSpeed = detectCachedSpeed;
+    }
+    canAddressingMode = detectCachedAddressing;
+    canDriver.end();
+    canDriver.begin(canSpeed);
+}
+
+template <typename Config, bool Enabled>
+void CarloopCAN<Config, Enabled>::disableCAN()
 {
     canDriver.end();
     digitalWrite(Config::CAN_ENABLE_PIN, Config::CAN_ENABLE_INACTIVE);
 }
 
-template <typename Config>
-void Carloop<Config>::enableGPS()
+template <typename Config, bool Enabled>
+void CarloopGPS<Config, Enabled>::enableGPS()
 {
     pinMode(Config::GPS_ENABLE_PIN, OUTPUT);
     digitalWrite(Config::GPS_ENABLE_PIN, Config::GPS_ENABLE_ACTIVE);
 
     Serial1.begin(Config::GPS_BAUD_RATE);
+    if(gpsProtocol == CARLOOP_GPS_UBX)
+    {
+        configureUBX();
+    }
+}
+
+template <typename Config, bool Enabled>
+void CarloopGPS<Config, Enabled>::configureUBX()
+{
+    uint8_t frame[28];
 
-    serialHandler = [this](char c)
+    // UART1 at the new baud rate, 8N1, UBX only in both directions
+    uint8_t port[20] = { 0 };
+    port[0] = 1;
+    port[4] = 0xd0;
+    port[5] = 0x08;
+    for(int i = 0; i < 4; i++)
     {
-        gpsDriver.encode(c);
-    };
+        port[8 + i] = (gpsBaudRate >> (8 * i)) & 0xff;
+    }
+    port[12] = 0x01;
+    port[14] = 0x01;
+    Serial1.write(frame, UbxParser::frame(frame, UbxParser::CLASS_CFG, UbxParser::CFG_PRT,
+                                          port, sizeof(port)));
+    Serial1.flush();
+    // Give the module time to switch before talking at the new rate
+    delay(100);
+    Serial1.begin(gpsBaudRate);
+
+    // One solution per measurement period, aligned to GPS time
+    uint8_t rate[6] = { (uint8_t)(gpsPeriodMs & 0xff), (uint8_t)(gpsPeriodMs >> 8), 1, 0, 1, 0 };
+    Serial1.write(frame, UbxParser::frame(frame, UbxParser::CLASS_CFG, UbxParser::CFG_RATE,
+                                          rate, sizeof(rate)));
+
+    // NAV-PVT and NAV-DOP with every solution
+    uint8_t message[3] = { UbxParser::CLASS_NAV, UbxParser::NAV_PVT, 1 };
+    Serial1.write(frame, UbxParser::frame(frame, UbxParser::CLASS_CFG, UbxParser::CFG_MSG,
+                                          message, sizeof(message)));
+    message[1] = UbxParser::NAV_DOP;
+    Serial1.write(frame, UbxParser::frame(frame, UbxParser::CLASS_CFG, UbxParser::CFG_MSG,
+                                          message, sizeof(message)));
 }
 
-template <typename Config>
-void Carloop<Config>::disableGPS()
+template <typename Config, bool Enabled>
+void CarloopGPS<Config, Enabled>::disableGPS()
 {
     digitalWrite(Config::GPS_ENABLE_PIN, Config::GPS_ENABLE_INACTIVE);
-    serialHandler = nullptr;
 }
 
-template <typename Config>
-void Carloop<Config>::enableBattery()
+template <typename Config, bool Enabled>
+void CarloopBattery<Config, Enabled>::enableBattery()
 {
     pinMode(Config::BATTERY_PIN, INPUT);
-    readBattery();
+    batteryFiltered = 0;
+    nextBatterySample = millis();
+    sampleBattery();
 }
 
-template <typename Config>
-float Carloop<Config>::readBattery()
+template <typename Config, bool Enabled>
+float CarloopBattery<Config, Enabled>::readBattery()
+{
+    return readBatteryMillivolts() / 1000.0f;
+}
+
+template <typename Config, bool Enabled>
+uint16_t CarloopBattery<Config, Enabled>::readBatteryMillivolts()
 {
     static constexpr auto MAX_ANALOG_VALUE = 4096;
-    static constexpr auto MAX_ANALOG_VOLTAGE = 3.3f;
-    auto adcValue = analogRead(Config::BATTERY_PIN);
-    return adcValue * MAX_ANALOG_VOLTAGE / MAX_ANALOG_VALUE * Config::BATTERY_FACTOR;
+    static constexpr auto MAX_ANALOG_MILLIVOLTS = 3300.0f;
+    // Millivolts per count of the oversampled sum, in Q16
+    static constexpr uint32_t SCALE = MAX_ANALOG_MILLIVOLTS * Config::BATTERY_FACTOR * 65536 /
+                                      (MAX_ANALOG_VALUE * BATTERY_OVERSAMPLING) + 0.5f;
+
+    // Summing 4 readings decimates them to one 14 bit sample with half the noise
+    uint32_t sum = 0;
+    for(uint8_t i = 0; i < BATTERY_OVERSAMPLING; i++)
+    {
+        sum += analogRead(Config::BATTERY_PIN);
+    }
+    return (sum * SCALE + 0x8000) >> 16;
+}
+
+template <typename Config, bool Enabled>
+void CarloopBattery<Config, Enabled>::updateBattery()
+{
+    if((long)(millis() - nextBatterySample) >= 0)
+    {
+        sampleBattery();
+    }
+}
+
+template <typename Config, bool Enabled>
+void CarloopBattery<Config, Enabled>::sampleBattery()
+{
+    unsigned long now = millis();
+    nextBatterySample += BATTERY_SAMPLE_INTERVAL;
+    // Skip the missed samples rather than bunching them up after a slow loop
+    if((long)(now - nextBatterySample) >= 0)
+    {
+        nextBatterySample = now + BATTERY_SAMPLE_INTERVAL;
+    }
+
+    int32_t sample = readBatteryMillivolts();
+    if(batteryFiltered == 0)
+    {
+        batteryFiltered = sample << 8;
+    }
+
+    // The starter pulls the voltage well below the filtered resting level
+    // for a few hundred ms, faster than the filter can follow. A drop while
+    // charging is the engine stopping instead.
+    int32_t level = batteryFiltered >> 8;
+    if(!batteryIsCranking && !batteryIsCharging && sample < level - BATTERY_CRANKING_DROP)
+    {
+        batteryIsCranking = true;
+        batteryEventFlags |= CARLOOP_BATTERY_CRANKING;
+    }
+    else if(batteryIsCranking && sample > level - BATTERY_CRANKING_DROP / 2)
+    {
+        batteryIsCranking = false;
+    }
+
+    batteryFiltered += ((sample << 8) - batteryFiltered) >> BATTERY_FILTER_SHIFT;
+
+    uint16_t millivolts = batteryMillivolts();
+    if(!batteryIsCharging && millivolts >= BATTERY_CHARGING_ON)
+    {
+        batteryIsCharging = true;
+        batteryEventFlags |= CARLOOP_BATTERY_CHARGING_STARTED;
+    }
+    else if(batteryIsCharging && millivolts < BATTERY_CHARGING_OFF)
+    {
+        batteryIsCharging = false;
+        batteryEventFlags |= CARLOOP_BATTERY_CHARGING_STOPPED;
+    }
 }
 
 template <typename Config>
@@ -141,18 +543,29 @@ bool Carloop<Config>::hasBattery()
     return Config::FEATURES & features & CARLOOP_BATTERY;
 }
 
-// Receive bytes from the GPS
-void serialEvent1()
+// Feed everything available on Serial1 to the GPS parser in blocks,
+// called from update() so there is no serialEvent1 handler to link
+template <typename Config, bool Enabled>
+void CarloopGPS<Config, Enabled>::receiveGPS()
 {
-    while(Serial1.available())
+    char buf[64];
+    int available;
+    while((available = Serial1.available()) > 0)
     {
-        char c = Serial1.read();
-        if(serialHandler)
+        size_t len = Serial1.readBytes(buf, available < (int)sizeof(buf) ? available : sizeof(buf));
+        if(gpsProtocol == CARLOOP_GPS_UBX)
+        {
+            ubxDriver.encode(buf, len);
+        }
+        else
         {
-            serialHandler(c);
+            gpsDriver.encode(buf, len);
         }
     }
 }
 
 // Template instantiation
+template class CarloopCAN<CarloopRevision2>;
+template class CarloopGPS<CarloopRevision2>;
+template class CarloopBattery<CarloopRevision2>;
 template class Carloop<CarloopRevision2>;
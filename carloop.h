@@ -6,6 +6,7 @@
  */
 #include "application.h"
 #include "TinyGPS++.h"
+#include "ubx.h"
 
 enum CarloopFeatures_e
 {
@@ -15,10 +16,35 @@ enum CarloopFeatures_e
     CARLOOP_ALL_FEATURES = CARLOOP_CAN | CARLOOP_GPS | CARLOOP_BATTERY
 };
 
+enum CarloopGPSProtocol_e
+{
+    CARLOOP_GPS_NMEA,
+    CARLOOP_GPS_UBX
+};
+
+// Pass to setCANSpeed() to detect the bitrate and OBD addressing in begin()
+const uint32_t CARLOOP_CAN_AUTO_SPEED = 0;
+
+enum CarloopCANAddressing_e
+{
+    CARLOOP_CAN_11BIT, // OBD requests to 0x7DF, replies from 0x7E8-0x7EF
+    CARLOOP_CAN_29BIT  // OBD requests to 0x18DB33F1, replies from 0x18DAF1xx
+};
+
+// Returned by Carloop::batteryEvents()
+enum CarloopBatteryEvents_e
+{
+    CARLOOP_BATTERY_CRANKING = 1,         // voltage dipped, the starter ran
+    CARLOOP_BATTERY_CHARGING_STARTED = 2, // alternator output came up
+    CARLOOP_BATTERY_CHARGING_STOPPED = 4
+};
+
 struct CarloopRevision2
 {
     static constexpr auto CAN_PINS = CAN_D1_D2;
     static constexpr uint32_t CAN_DEFAULT_SPEED = 500000;
+    // Where the auto-detected CAN settings are kept between boots
+    static constexpr int CAN_EEPROM_ADDRESS = 0;
 
     static constexpr auto BATTERY_PIN = A1;
     static constexpr auto BATTERY_FACTOR = 7.2f;
@@ -31,47 +57,184 @@ struct CarloopRevision2
     static constexpr auto GPS_ENABLE_PIN = A0;
     static constexpr auto GPS_ENABLE_ACTIVE = HIGH;
     static constexpr auto GPS_ENABLE_INACTIVE = LOW;
-    // Serial cannot be configured because of dependency on the serialEvent1
-    // handler
+    // GPS bytes are read by Carloop::update()
     // constexpr auto &GPS_SERIAL = Serial1;
 
     static constexpr auto FEATURES = CARLOOP_CAN | CARLOOP_GPS | CARLOOP_BATTERY;
 };
 
-template <typename Config>
-class Carloop
+/* Each feature's drivers, state and functions live in its own class,
+ * selected at compile time from Config::FEATURES. The disabled version
+ * is empty but for no-op hooks, so a configuration without a feature
+ * carries none of its code or RAM, and calling its functions (say gps()
+ * in a CAN-only build) is a compile error rather than a runtime no-op.
+ * Carloop::begin() can still leave out features that are compiled in.
+ */
+template <typename Config, bool = (Config::FEATURES & CARLOOP_CAN) != 0>
+class CarloopCAN
 {
 public:
-    Carloop();
+    CarloopCAN();
 
     void setCANSpeed(uint32_t canSpeed);
-    void begin(CarloopFeatures_e features = CARLOOP_ALL_FEATURES);
-
-    void update();
+    // Runs the CAN auto-detection again, true when an OBD ECU replied.
+    // begin() already does it when the speed is CARLOOP_CAN_AUTO_SPEED.
+    bool detectCAN();
+    // The same without blocking, update() takes it a step further on each
+    // call. Until canDetecting() is false the CAN channel is the detection's.
+    // Listening at a wrong speed destroys up to about 15 frames of the car's
+    // traffic with error flags, as the controller has no listen-only mode,
+    // so only run it when the bus speed isn't known.
+    void startCANDetection();
+    bool canDetecting();
 
     CANChannel &can();
-    TinyGPSPlus &gps();
-    float battery();
+    uint32_t getCANSpeed();
+    CarloopCANAddressing_e canAddressing();
+    bool canDetected();
 
     void enableCAN();
     void disableCAN();
+
+protected:
+    void beginCAN();
+    void updateCAN();
+
+private:
+    enum Detect_e
+    {
+        DETECT_IDLE,
+        DETECT_LISTEN,
+        DETECT_PROBE
+    };
+
+    void listenCAN(int8_t index);
+    void probeCAN(CarloopCANAddressing_e addressing);
+    void finishCANDetection(bool detected);
+
+    CANChannel canDriver;
+    uint32_t canSpeed;
+    CarloopCANAddressing_e canAddressingMode;
+    bool canAutoDetect;
+    bool canIsDetected;
+
+    Detect_e detectState;
+    int8_t detectIndex; // into CAN_SPEEDS, -1 for the cached speed
+    unsigned long detectStart;
+    bool detectHeard;
+    uint32_t detectCachedSpeed;
+    CarloopCANAddressing_e detectCachedAddressing;
+    bool detectCached;
+};
+
+template <typename Config>
+class CarloopCAN<Config, false>
+{
+protected:
+    void beginCAN() {}
+    void updateCAN() {}
+};
+
+template <typename Config, bool = (Config::FEATURES & CARLOOP_GPS) != 0>
+class CarloopGPS
+{
+public:
+    CarloopGPS();
+
+    // Call before begin(). UBX reconfigures a u-blox module to send only
+    // UBX-NAV-PVT and UBX-NAV-DOP at the given baud rate and period.
+    void setGPSProtocol(CarloopGPSProtocol_e protocol, uint32_t baudRate = 115200,
+                        uint16_t periodMs = 200);
+
+    TinyGPSPlus &gps();
+
     void enableGPS();
     void disableGPS();
+
+    // Reads what the GPS sent. update() does too, but at high baud rates
+    // the 64-byte receive buffer fills faster than it is usually called.
+    void receiveGPS();
+
+private:
+    void configureUBX();
+
+    TinyGPSPlus gpsDriver;
+    UbxParser ubxDriver;
+    CarloopGPSProtocol_e gpsProtocol;
+    uint32_t gpsBaudRate;
+    uint16_t gpsPeriodMs;
+};
+
+template <typename Config>
+class CarloopGPS<Config, false>
+{
+public:
+    void receiveGPS() {}
+
+protected:
+    void enableGPS() {}
+};
+
+template <typename Config, bool = (Config::FEATURES & CARLOOP_BATTERY) != 0>
+class CarloopBattery
+{
+public:
+    CarloopBattery();
+
+    float battery();
+    uint16_t batteryMillivolts();
+    bool batteryCharging();
+    // Events since the last call, see CarloopBatteryEvents_e
+    uint8_t batteryEvents();
+
     void enableBattery();
 
     float readBattery();
+    uint16_t readBatteryMillivolts();
 
-    bool hasCAN();
-    bool hasGPS();
-    bool hasBattery();
+protected:
+    void updateBattery();
 
 private:
-    CANChannel canDriver;
-    uint32_t canSpeed;
+    // The battery is sampled at a fixed rate from update(), each sample
+    // the sum of BATTERY_OVERSAMPLING ADC readings, then low-pass filtered
+    static constexpr unsigned long BATTERY_SAMPLE_INTERVAL = 10;
+    static constexpr uint8_t BATTERY_OVERSAMPLING = 4;
+    static constexpr uint8_t BATTERY_FILTER_SHIFT = 6; // ~0.64 s time constant
+    static constexpr uint16_t BATTERY_CRANKING_DROP = 1000;
+    static constexpr uint16_t BATTERY_CHARGING_ON = 13300;
+    static constexpr uint16_t BATTERY_CHARGING_OFF = 13000;
+    void sampleBattery();
+
+    unsigned long nextBatterySample;
+    int32_t batteryFiltered; // millivolts << 8, zero before the first sample
+    bool batteryIsCranking;
+    bool batteryIsCharging;
+    uint8_t batteryEventFlags;
+};
 
-    TinyGPSPlus gpsDriver;
+template <typename Config>
+class CarloopBattery<Config, false>
+{
+protected:
+    void enableBattery() {}
+    void updateBattery() {}
+};
 
-    float batteryVoltage;
+template <typename Config>
+class Carloop : public CarloopCAN<Config>, public CarloopGPS<Config>, public CarloopBattery<Config>
+{
+public:
+    Carloop();
 
+    void begin(CarloopFeatures_e features = CARLOOP_ALL_FEATURES);
+
+    void update();
+
+    bool hasCAN();
+    bool hasGPS();
+    bool hasBattery();
+
+private:
     CarloopFeatures_e features;
 };
@@ -0,0 +1,338 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "derived_signals.h"
+#include <stdlib.h>
+
+DerivedSignals::DerivedSignals()
+    : inputCount(0), signalCount(0)
+{
+}
+
+bool DerivedSignals::define(uint8_t pid, uint8_t trigger, uint8_t width,
+                            unsigned long interval, const char *expression)
+{
+    if(signalCount >= MAX_SIGNALS || (width != 1 && width != 2 && width != 4))
+    {
+        return false;
+    }
+    Signal &signal = signals[signalCount];
+    if(!compile(expression, signal.code))
+    {
+        return false;
+    }
+    signal.pid = pid;
+    signal.trigger = trigger;
+    signal.width = width;
+    signal.evaluated = false;
+    signal.changed = false;
+    signal.interval = interval;
+    signal.lastEvaluation = 0;
+    signal.lastRecord = 0;
+    signal.value = 0;
+    signalCount++;
+    return true;
+}
+
+void DerivedSignals::sample(unsigned long now, uint8_t pid, const uint8_t *data, uint8_t len)
+{
+    int index = findInput(pid, false);
+    if(index >= 0)
+    {
+        uint32_t value = 0;
+        for(uint8_t i = 0; i < len && i < 4; i++)
+        {
+            value = (value << 8) | data[i];
+        }
+        inputs[index].previous = inputs[index].valid ? inputs[index].value : (int32_t)value;
+        inputs[index].value = value;
+        inputs[index].valid = true;
+    }
+
+    for(uint8_t i = 0; i < signalCount; i++)
+    {
+        if(signals[i].trigger == pid)
+        {
+            evaluate(signals[i], now);
+        }
+    }
+}
+
+bool DerivedSignals::next(unsigned long now, uint8_t *payload, uint8_t &len, bool flush)
+{
+    for(uint8_t i = 0; i < signalCount; i++)
+    {
+        Signal &signal = signals[i];
+        if(signal.interval == 0 || !signal.changed ||
+           (!flush && signal.lastRecord != 0 && now - signal.lastRecord < signal.interval))
+        {
+            continue;
+        }
+        signal.changed = false;
+        signal.lastRecord = now;
+
+        uint32_t max = signal.width == 4 ? 0xffffffff : (1UL << (8 * signal.width)) - 1;
+        uint32_t value = signal.value < 0 ? 0 : (uint32_t)signal.value;
+        if(value > max)
+        {
+            value = max;
+        }
+        len = 0;
+        payload[len++] = signal.pid;
+        for(int shift = 8 * (signal.width - 1); shift >= 0; shift -= 8)
+        {
+            payload[len++] = (value >> shift) & 0xff;
+        }
+        return true;
+    }
+    return false;
+}
+
+int32_t DerivedSignals::value(uint8_t pid) const
+{
+    int index = findSignal(pid);
+    return index >= 0 ? signals[index].value : 0;
+}
+
+bool DerivedSignals::compile(const char *expression, uint8_t *code)
+{
+    uint8_t length = 0;
+    int depth = 0;
+    // Inputs first read here, only registered once the whole expression compiles
+    uint8_t added[MAX_INPUTS];
+    uint8_t addedCount = 0;
+    const char *p = expression;
+    for(;;)
+    {
+        while(*p == ' ')
+        {
+            p++;
+        }
+        if(*p == '\0')
+        {
+            break;
+        }
+        const char *end = p;
+        while(*end != ' ' && *end != '\0')
+        {
+            end++;
+        }
+        size_t tokenLength = end - p;
+
+        // Room for the instruction and the final OP_END
+        bool input = *p == '#' || *p == '%';
+        size_t size = *p >= '0' && *p <= '9' ? 5 : input || *p == '@' ? 2 : 1;
+        if(length + size + 1 > MAX_CODE)
+        {
+            return false;
+        }
+        if(*p >= '0' && *p <= '9')
+        {
+            int32_t value = strtol(p, NULL, 10);
+            code[length++] = OP_CONST;
+            code[length++] = (value >> 24) & 0xff;
+            code[length++] = (value >> 16) & 0xff;
+            code[length++] = (value >> 8) & 0xff;
+            code[length++] = value & 0xff;
+            depth++;
+        }
+        else if(input || *p == '@')
+        {
+            uint8_t pid = strtoul(p + 1, NULL, 16);
+            int index = input ? findInput(pid, false) : findSignal(pid);
+            for(uint8_t i = 0; input && index < 0 && i < addedCount; i++)
+            {
+                if(added[i] == pid)
+                {
+                    index = inputCount + i;
+                }
+            }
+            if(input && index < 0 && inputCount + addedCount < MAX_INPUTS)
+            {
+                added[addedCount] = pid;
+                index = inputCount + addedCount++;
+            }
+            if(index < 0)
+            {
+                return false;
+            }
+            code[length++] = *p == '#' ? OP_INPUT : *p == '%' ? OP_PREVIOUS : OP_SIGNAL;
+            code[length++] = index;
+            depth++;
+        }
+        else
+        {
+            static const struct
+            {
+                const char *name;
+                uint8_t op;
+            } WORDS[] = {
+                { "acc", OP_ACC }, { "dt", OP_DT }, { "+", OP_ADD }, { "-", OP_SUB },
+                { "*", OP_MUL }, { "/", OP_DIV }, { "min", OP_MIN }, { "max", OP_MAX },
+                { "<", OP_LESS }, { ">", OP_GREATER }
+            };
+            uint8_t op = OP_END;
+            for(size_t i = 0; i < sizeof(WORDS) / sizeof(WORDS[0]); i++)
+            {
+                if(strlen(WORDS[i].name) == tokenLength && !strncmp(WORDS[i].name, p, tokenLength))
+                {
+                    op = WORDS[i].op;
+                }
+            }
+            if(op == OP_END)
+            {
+                return false;
+            }
+            code[length++] = op;
+            // Operands push one value, operators pop two and push one
+            depth += op <= OP_DT ? 1 : -1;
+        }
+        if(depth < 1 || depth > STACK_DEPTH)
+        {
+            return false;
+        }
+        p = end;
+    }
+    code[length] = OP_END;
+    if(depth != 1)
+    {
+        return false;
+    }
+    for(uint8_t i = 0; i < addedCount; i++)
+    {
+        findInput(added[i], true);
+    }
+    return true;
+}
+
+int DerivedSignals::findInput(uint8_t pid, bool add)
+{
+    for(uint8_t i = 0; i < inputCount; i++)
+    {
+        if(inputs[i].pid == pid)
+        {
+            return i;
+        }
+    }
+    if(!add || inputCount >= MAX_INPUTS)
+    {
+        return -1;
+    }
+    inputs[inputCount].pid = pid;
+    inputs[inputCount].valid = false;
+    inputs[inputCount].value = 0;
+    inputs[inputCount].previous = 0;
+    return inputCount++;
+}
+
+int DerivedSignals::findSignal(uint8_t pid) const
+{
+    for(uint8_t i = 0; i < signalCount; i++)
+    {
+        if(signals[i].pid == pid)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool DerivedSignals::evaluate(Signal &signal, unsigned long now)
+{
+    unsigned long dt = signal.evaluated ? now - signal.lastEvaluation : 0;
+    if(dt > MAX_STEP)
+    {
+        dt = MAX_STEP;
+    }
+
+    int32_t stack[STACK_DEPTH] = { 0 };
+    uint8_t top = 0;
+    const uint8_t *pc = signal.code;
+    for(;;)
+    {
+        uint8_t op = *pc++;
+        if(op == OP_END)
+        {
+            break;
+        }
+        switch(op)
+        {
+        case OP_CONST:
+            stack[top++] = (int32_t)((uint32_t)pc[0] << 24 | (uint32_t)pc[1] << 16 |
+                                     (uint32_t)pc[2] << 8 | pc[3]);
+            pc += 4;
+            continue;
+        case OP_INPUT:
+            if(!inputs[*pc].valid)
+            {
+                return false;
+            }
+            stack[top++] = inputs[*pc++].value;
+            continue;
+        case OP_PREVIOUS:
+            if(!inputs[*pc].valid)
+            {
+                return false;
+            }
+            stack[top++] = inputs[*pc++].previous;
+            continue;
+        case OP_SIGNAL:
+            stack[top++] = signals[*pc++].value;
+            continue;
+        case OP_ACC:
+            stack[top++] = signal.value;
+            continue;
+        case OP_DT:
+            stack[top++] = dt;
+            continue;
+        }
+
+        int32_t b = stack[--top];
+        int32_t a = stack[top - 1];
+        int64_t result;
+        switch(op)
+        {
+        case OP_ADD: result = (int64_t)a + b; break;
+        case OP_SUB: result = (int64_t)a - b; break;
+        case OP_MUL: result = (int64_t)a * b; break;
+        // INT32_MIN / -1 overflows, it saturates below like the others
+        case OP_DIV: result = b ? (int64_t)a / b : 0; break;
+        case OP_MIN: result = a < b ? a : b; break;
+        case OP_MAX: result = a > b ? a : b; break;
+        case OP_LESS: result = a < b; break;
+        default: result = a > b; break;
+        }
+        // Saturate rather than wrap
+        if(result > INT32_MAX)
+        {
+            result = INT32_MAX;
+        }
+        else if(result < INT32_MIN)
+        {
+            result = INT32_MIN;
+        }
+        stack[top - 1] = result;
+    }
+
+    if(stack[0] != signal.value || !signal.evaluated)
+    {
+        signal.changed = true;
+    }
+    signal.value = stack[0];
+    signal.evaluated = true;
+    signal.lastEvaluation = now;
+    return true;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __DerivedSignals_h
+#define __DerivedSignals_h
+
+#include "application.h"
+
+/* Virtual PIDs computed on the device from the replies to real ones.
+ *
+ * Each signal is an integer expression in reverse Polish notation,
+ * compiled once by define() into a few bytes of stack machine code and
+ * evaluated whenever a reply to its trigger PID comes in. Operands are
+ *
+ *   123    a decimal constant
+ *   #0d    the raw value of PID 0x0d: its reply bytes as a big-endian
+ *          unsigned number
+ *   %0d    the raw value of PID 0x0d in the reply before, the same as
+ *          #0d after the first reply
+ *   @f2    the current value of the virtual PID 0xf2, defined earlier
+ *   acc    this signal's own previous value, zero at first
+ *   dt     milliseconds since this signal was last evaluated, zero at
+ *          first and at most MAX_STEP, so a parked car adds nothing
+ *
+ * and the operators are + - * / min max < >, the comparisons giving 0
+ * or 1. Division by zero gives zero, and results saturate at the int32
+ * range rather than wrap. Scaling is up to the expression, in 32-bit
+ * fixed point: "#10 3323 * 1000 /" is MAF (g/s * 100) to mL/h.
+ *
+ * A signal is only evaluated once every PID it reads has had a reply.
+ * next() hands out the signals to record, each at most once per its
+ * publish interval and only when its value changed. An interval of zero
+ * keeps the signal internal, for other expressions to use.
+ */
+class DerivedSignals
+{
+public:
+    static constexpr uint8_t MAX_SIGNALS = 10;
+    static constexpr uint8_t MAX_INPUTS = 6;
+    static constexpr uint8_t MAX_CODE = 32;
+    static constexpr uint8_t STACK_DEPTH = 6;
+    static constexpr unsigned long MAX_STEP = 10000;
+
+    DerivedSignals();
+
+    // Value is recorded in width bytes (1, 2 or 4), clamped to fit.
+    // False when the expression doesn't compile or there is no room.
+    bool define(uint8_t pid, uint8_t trigger, uint8_t width,
+                unsigned long interval, const char *expression);
+
+    // A reply to a real PID: its data bytes after the PID
+    void sample(unsigned long now, uint8_t pid, const uint8_t *data, uint8_t len);
+
+    // A signal due to be recorded: fills in its PID and value, big-endian.
+    // With flush, changed signals are due regardless of their interval.
+    bool next(unsigned long now, uint8_t *payload, uint8_t &len, bool flush = false);
+
+    int32_t value(uint8_t pid) const;
+
+private:
+    enum Op_e
+    {
+        OP_END,
+        OP_CONST,  // followed by a big-endian int32
+        OP_INPUT,  // followed by an input index
+        OP_PREVIOUS, // followed by an input index
+        OP_SIGNAL, // followed by a signal index
+        OP_ACC,
+        OP_DT,
+        OP_ADD,
+        OP_SUB,
+        OP_MUL,
+        OP_DIV,
+        OP_MIN,
+        OP_MAX,
+        OP_LESS,
+        OP_GREATER
+    };
+
+    struct Input
+    {
+        uint8_t pid;
+        bool valid;
+        int32_t value;
+        int32_t previous;
+    };
+
+    struct Signal
+    {
+        uint8_t pid;
+        uint8_t trigger;
+        uint8_t width;
+        bool evaluated;
+        bool changed;
+        unsigned long interval;
+        unsigned long lastEvaluation;
+        unsigned long lastRecord;
+        int32_t value;
+        uint8_t code[MAX_CODE];
+    };
+
+    bool compile(const char *expression, uint8_t *code);
+    int findInput(uint8_t pid, bool add);
+    int findSignal(uint8_t pid) const;
+    bool evaluate(Signal &signal, unsigned long now);
+
+    Input inputs[MAX_INPUTS];
+    uint8_t inputCount;
+    Signal signals[MAX_SIGNALS];
+    uint8_t signalCount;
+};
+
+#endif // def(__DerivedSignals_h)
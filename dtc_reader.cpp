@@ -0,0 +1,298 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dtc_reader.h"
+
+// ISO-TP frame types, in the high nibble of the first byte
+static constexpr uint8_t ISOTP_SINGLE = 0;
+static constexpr uint8_t ISOTP_FIRST = 1;
+static constexpr uint8_t ISOTP_CONSECUTIVE = 2;
+static constexpr uint8_t FIRST_FRAME_BYTES = 6;
+static constexpr uint8_t CONSECUTIVE_FRAME_BYTES = 7;
+
+static bool isDtcReply(uint8_t service)
+{
+    return service == 0x40 + DtcReader::MODE_STORED || service == 0x40 + DtcReader::MODE_PENDING;
+}
+
+DtcReader::DtcReader(unsigned long minInterval, unsigned long maxInterval)
+    : minInterval(minInterval), maxInterval(maxInterval), currentInterval(minInterval),
+      nextRead(0), milOn(false), lastCount(-1), cycleChanged(false), readingMode(0),
+      replied(false), cut(false), diffMode(0), previousIndex(0), currentIndex(0)
+{
+    reading.count = 0;
+    stored.count = 0;
+    pending.count = 0;
+    previous.count = 0;
+    memset(transfers, 0, sizeof(transfers));
+}
+
+void DtcReader::status(unsigned long now, bool mil, uint8_t count)
+{
+    bool changed = (mil && !milOn) || (lastCount >= 0 && count != lastCount);
+    milOn = mil;
+    lastCount = count;
+    if(changed)
+    {
+        currentInterval = minInterval;
+        cycleChanged = true;
+        if(!readingMode)
+        {
+            nextRead = now;
+        }
+    }
+}
+
+uint8_t DtcReader::poll(unsigned long now)
+{
+    uint8_t mode = readingMode;
+    if(mode)
+    {
+        finish();
+    }
+    if(mode == MODE_STORED)
+    {
+        start(MODE_PENDING);
+        return MODE_PENDING;
+    }
+    if(mode == MODE_PENDING)
+    {
+        // Back off while there's nothing wrong
+        if(cycleChanged || milOn)
+        {
+            currentInterval = minInterval;
+        }
+        else if(currentInterval < maxInterval)
+        {
+            currentInterval = currentInterval * 2 < maxInterval ? currentInterval * 2 : maxInterval;
+        }
+        nextRead = now + currentInterval;
+        return 0;
+    }
+    if((long)(now - nextRead) < 0)
+    {
+        return 0;
+    }
+    cycleChanged = false;
+    start(MODE_STORED);
+    return MODE_STORED;
+}
+
+bool DtcReader::add(const CANMessage &message, bool &flowControl)
+{
+    flowControl = false;
+    const uint8_t *data = message.data;
+    switch(data[0] >> 4)
+    {
+    case ISOTP_SINGLE:
+    {
+        uint8_t len = data[0] & 0x0f;
+        if(len < 2 || len > 7 || !isDtcReply(data[1]))
+        {
+            return false;
+        }
+        take(data + 1, len);
+        return true;
+    }
+
+    case ISOTP_FIRST:
+    {
+        if(!isDtcReply(data[2]))
+        {
+            return false;
+        }
+        Transfer *transfer = NULL;
+        for(Transfer &candidate : transfers)
+        {
+            if(candidate.active && candidate.id == message.id)
+            {
+                transfer = &candidate;
+                break;
+            }
+            if(!candidate.active && !transfer)
+            {
+                transfer = &candidate;
+            }
+        }
+        if(!transfer)
+        {
+            // More ECUs sending long replies at once than there's room for
+            cut = true;
+            return true;
+        }
+        transfer->active = true;
+        transfer->id = message.id;
+        transfer->size = ((data[0] & 0x0f) << 8) | data[1];
+        transfer->received = FIRST_FRAME_BYTES;
+        transfer->sequence = 1;
+        memcpy(transfer->data, data + 2, FIRST_FRAME_BYTES);
+        flowControl = true;
+        return true;
+    }
+
+    case ISOTP_CONSECUTIVE:
+        for(Transfer &transfer : transfers)
+        {
+            if(!transfer.active || transfer.id != message.id)
+            {
+                continue;
+            }
+            if((data[0] & 0x0f) != transfer.sequence)
+            {
+                // A lost frame loses the reply
+                transfer.active = false;
+                cut = true;
+                return true;
+            }
+            transfer.sequence = (transfer.sequence + 1) & 0x0f;
+            if(transfer.received < MAX_REPLY)
+            {
+                uint16_t room = MAX_REPLY - transfer.received;
+                memcpy(transfer.data + transfer.received, data + 1,
+                       room < CONSECUTIVE_FRAME_BYTES ? room : CONSECUTIVE_FRAME_BYTES);
+            }
+            transfer.received += CONSECUTIVE_FRAME_BYTES;
+            if(transfer.received >= transfer.size)
+            {
+                transfer.active = false;
+                take(transfer.data, transfer.size < MAX_REPLY ? transfer.size : MAX_REPLY);
+            }
+            return true;
+        }
+        return false;
+    }
+    return false;
+}
+
+bool DtcReader::next(uint8_t *payload, uint8_t &len)
+{
+    if(!diffMode)
+    {
+        return false;
+    }
+    // Both sets are sorted, so one pass finds the differences
+    const Set &now = current(diffMode);
+    while(previousIndex < previous.count || currentIndex < now.count)
+    {
+        bool removed = currentIndex == now.count ||
+            (previousIndex < previous.count && previous.codes[previousIndex] < now.codes[currentIndex]);
+        bool added = !removed &&
+            (previousIndex == previous.count || now.codes[currentIndex] < previous.codes[previousIndex]);
+        if(!removed && !added)
+        {
+            previousIndex++;
+            currentIndex++;
+            continue;
+        }
+        uint16_t code = removed ? previous.codes[previousIndex++] : now.codes[currentIndex++];
+        payload[0] = diffMode | (added ? 0x80 : 0);
+        payload[1] = code >> 8;
+        payload[2] = code & 0xff;
+        len = 3;
+        return true;
+    }
+    diffMode = 0;
+    return false;
+}
+
+uint8_t DtcReader::count(uint8_t mode) const
+{
+    return mode == MODE_STORED ? stored.count : pending.count;
+}
+
+void DtcReader::start(uint8_t mode)
+{
+    readingMode = mode;
+    replied = false;
+    cut = false;
+    reading.count = 0;
+    for(Transfer &transfer : transfers)
+    {
+        transfer.active = false;
+    }
+}
+
+// Replace the current set with the one just read, if the read was whole
+void DtcReader::finish()
+{
+    for(Transfer &transfer : transfers)
+    {
+        if(transfer.active)
+        {
+            transfer.active = false;
+            cut = true;
+        }
+    }
+    uint8_t mode = readingMode;
+    readingMode = 0;
+    if(!replied || cut)
+    {
+        return;
+    }
+    Set &set = current(mode);
+    if(set.count == reading.count &&
+       !memcmp(set.codes, reading.codes, reading.count * sizeof(reading.codes[0])))
+    {
+        return;
+    }
+    previous = set;
+    set = reading;
+    diffMode = mode;
+    previousIndex = 0;
+    currentIndex = 0;
+    cycleChanged = true;
+}
+
+// A complete reply: service, count, then the codes
+void DtcReader::take(const uint8_t *data, uint16_t len)
+{
+    if(!readingMode || data[0] != 0x40 + readingMode || len < 2)
+    {
+        // A late reply to the read before
+        return;
+    }
+    replied = true;
+    uint8_t count = data[1];
+    if(count > (len - 2) / 2)
+    {
+        count = (len - 2) / 2;
+    }
+    for(uint8_t i = 0; i < count; i++)
+    {
+        uint16_t code = (data[2 + 2 * i] << 8) | data[3 + 2 * i];
+        if(code)
+        {
+            insert(reading, code);
+        }
+    }
+}
+
+// Into the sorted set, once. Codes past MAX_DTCS are left out.
+void DtcReader::insert(Set &set, uint16_t code)
+{
+    uint8_t i = 0;
+    while(i < set.count && set.codes[i] < code)
+    {
+        i++;
+    }
+    if((i < set.count && set.codes[i] == code) || set.count == MAX_DTCS)
+    {
+        return;
+    }
+    memmove(set.codes + i + 1, set.codes + i, (set.count - i) * sizeof(set.codes[0]));
+    set.codes[i] = code;
+    set.count++;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __DtcReader_h
+#define __DtcReader_h
+
+#include "application.h"
+
+/* Reads the diagnostic trouble codes: Mode 03 for the stored ones and
+ * Mode 07 for the pending ones, and keeps the current set of each.
+ *
+ * poll() says when to send which request. Until the next poll(), add()
+ * takes the replies of all ECUs, reassembling ISO-TP multi-frame
+ * replies: a first frame needs a flow control frame sent back to its
+ * ECU, then the consecutive frames follow. The codes of a read are
+ * merged into a sorted array. When the read is over it replaces the
+ * current set, and next() hands out the codes added and removed. A read
+ * without replies, or with a transfer cut short, is thrown away rather
+ * than taken for the codes being cleared.
+ *
+ * Both modes are read one after the other every interval. While the MIL
+ * is off, the interval doubles after every read that changed nothing, up
+ * to maxInterval. The MIL coming on or the DTC count in PID 01 changing
+ * starts a read at once, and that or a change in the codes brings the
+ * interval back to minInterval.
+ */
+class DtcReader
+{
+public:
+    static constexpr uint8_t MODE_STORED = 0x03;
+    static constexpr uint8_t MODE_PENDING = 0x07;
+    static constexpr uint8_t MAX_DTCS = 16;
+    static constexpr uint8_t MAX_TRANSFERS = 2;
+    // Service, count and the codes
+    static constexpr uint8_t MAX_REPLY = 2 + 2 * MAX_DTCS;
+    static constexpr uint8_t MAX_PAYLOAD = 3;
+
+    DtcReader(unsigned long minInterval = 10000, unsigned long maxInterval = 320000);
+
+    // PID 01 of the engine ECU: the MIL and the number of stored DTCs
+    void status(unsigned long now, bool mil, uint8_t count);
+
+    // Ends the read in progress and returns the mode to request now,
+    // zero when it's not time yet
+    uint8_t poll(unsigned long now);
+
+    // A frame from an OBD ECU, false when it's not part of a DTC reply.
+    // flowControl is set when the ECU waits for a flow control frame.
+    bool add(const CANMessage &message, bool &flowControl);
+
+    // A change of the last read: its mode, with bit 7 set when the code
+    // was added, then the code in the 2 bytes of the reply
+    bool next(uint8_t *payload, uint8_t &len);
+
+    uint8_t count(uint8_t mode) const;
+    unsigned long interval() const { return currentInterval; }
+
+private:
+    struct Set
+    {
+        uint8_t count;
+        uint16_t codes[MAX_DTCS];
+    };
+
+    struct Transfer
+    {
+        bool active;
+        uint32_t id;
+        uint16_t size;
+        uint16_t received;
+        uint8_t sequence;
+        uint8_t data[MAX_REPLY];
+    };
+
+    void start(uint8_t mode);
+    void finish();
+    void take(const uint8_t *data, uint16_t len);
+    static void insert(Set &set, uint16_t code);
+    Set &current(uint8_t mode) { return mode == MODE_STORED ? stored : pending; }
+
+    unsigned long minInterval;
+    unsigned long maxInterval;
+    unsigned long currentInterval;
+    unsigned long nextRead;
+
+    bool milOn;
+    int16_t lastCount; // -1 before the first PID 01 reply
+    bool cycleChanged;
+
+    uint8_t readingMode; // zero between reads
+    bool replied;
+    bool cut;
+    Set reading;
+    Transfer transfers[MAX_TRANSFERS];
+
+    Set stored;
+    Set pending;
+
+    // Walking the last read's set against the one it replaced
+    uint8_t diffMode;
+    Set previous;
+    uint8_t previousIndex;
+    uint8_t currentIndex;
+};
+
+#endif // def(__DtcReader_h)
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ecu_tracker.h"
+
+EcuTracker::EcuTracker()
+    : ecuCount(0), windowCount(0)
+{
+}
+
+void EcuTracker::request()
+{
+    windowCount = 0;
+}
+
+bool EcuTracker::reply(uint8_t address, const uint8_t *data, uint8_t len, bool primary)
+{
+    Ecu *ecu = NULL;
+    for(uint8_t i = 0; i < ecuCount; i++)
+    {
+        if(ecus[i].address == address)
+        {
+            ecu = &ecus[i];
+            break;
+        }
+    }
+    if(!ecu && ecuCount < MAX_ECUS)
+    {
+        ecu = &ecus[ecuCount++];
+        ecu->address = address;
+        ecu->replies = 0;
+        ecu->duplicates = 0;
+    }
+    if(ecu)
+    {
+        ecu->replies++;
+    }
+
+    if(len > sizeof(window[0].data))
+    {
+        len = sizeof(window[0].data);
+    }
+    for(uint8_t i = 0; i < windowCount && !primary; i++)
+    {
+        if(window[i].len == len && memcmp(window[i].data, data, len) == 0)
+        {
+            if(ecu)
+            {
+                ecu->duplicates++;
+            }
+            return false;
+        }
+    }
+    if(windowCount < MAX_ECUS)
+    {
+        window[windowCount].len = len;
+        memcpy(window[windowCount].data, data, len);
+        windowCount++;
+    }
+    return true;
+}
+
+void EcuTracker::format(String &out) const
+{
+    out = "";
+    for(uint8_t i = 0; i < ecuCount; i++)
+    {
+        out += String::format("%02x %lu %lu;", ecus[i].address,
+                              (unsigned long)ecus[i].replies, (unsigned long)ecus[i].duplicates);
+    }
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __EcuTracker_h
+#define __EcuTracker_h
+
+#include "application.h"
+
+/* Keeps track of the ECUs answering OBD requests.
+ *
+ * A functional request gets one reply from each ECU that supports the
+ * PID, and ECUs often agree: the engine and transmission both report
+ * vehicle speed. Within a request window, a reply byte-identical to one
+ * already seen is a duplicate and isn't worth publishing, unless it
+ * comes from the primary ECU: its replies are always kept, so a faster
+ * transmission can't stand in for the engine. Replies and
+ * duplicates are counted per ECU, identified by the low byte of its
+ * reply CAN ID (0xE8-0xEF with 11-bit addressing, the source address
+ * with 29-bit addressing).
+ */
+class EcuTracker
+{
+public:
+    static constexpr uint8_t MAX_ECUS = 8;
+
+    struct Ecu
+    {
+        uint8_t address;
+        uint32_t replies;
+        uint32_t duplicates;
+    };
+
+    EcuTracker();
+
+    // A request went out, later replies are compared with each other
+    void request();
+    // Counts a reply, false when a secondary ECU's duplicates one in
+    // this window
+    bool reply(uint8_t address, const uint8_t *data, uint8_t len, bool primary);
+
+    uint8_t count() const { return ecuCount; }
+    const Ecu &ecu(uint8_t index) const { return ecus[index]; }
+
+    // "address replies duplicates;" for each ECU, in hex and decimal
+    void format(String &out) const;
+
+private:
+    struct Reply
+    {
+        uint8_t len;
+        uint8_t data[7];
+    };
+
+    Ecu ecus[MAX_ECUS];
+    uint8_t ecuCount;
+    // More replies in a window than ECUs only come from retransmissions
+    Reply window[MAX_ECUS];
+    uint8_t windowCount;
+};
+
+#endif // def(__EcuTracker_h)
@@ -0,0 +1,337 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "geodesy.h"
+
+// Angles are handled internally as binary angles, where 2^32 is a full turn.
+static constexpr uint32_t QUARTER_TURN = 0x40000000UL;
+static constexpr uint32_t HALF_TURN = 0x80000000UL;
+
+// Binary angle units per 1e-7 degree, Q30
+static constexpr int64_t BAM_PER_DEG7_Q30 = 1281023894LL;
+// Millimeters per 1e-7 degree of arc on a sphere of radius 6372795 m, Q16
+static constexpr int64_t MM_PER_DEG7_Q16 = 728932LL;
+// Radians per 1e-7 degree, Q40
+static constexpr int64_t RAD_PER_DEG7_Q40 = 1919LL;
+// Meters per binary angle unit of arc (the circumference), Q32
+static constexpr uint64_t M_PER_BAM_Q32 = 40041470ULL;
+
+// Spans below this use the equirectangular approximation
+static constexpr int32_t SHORT_SPAN_DEG7 = 1000000L;
+
+// sin(x) for x in [0, 90] degrees in 256 steps, Q30
+static const int32_t SIN_TABLE[257] = {
+    0, 6588356, 13176464, 19764076, 26350943, 32936819,
+    39521455, 46104602, 52686014, 59265442, 65842639, 72417357,
+    78989349, 85558366, 92124163, 98686491, 105245103, 111799753,
+    118350194, 124896179, 131437462, 137973796, 144504935, 151030634,
+    157550647, 164064728, 170572633, 177074115, 183568930, 190056834,
+    196537583, 203010932, 209476638, 215934457, 222384147, 228825464,
+    235258165, 241682010, 248096755, 254502159, 260897982, 267283981,
+    273659918, 280025552, 286380643, 292724951, 299058239, 305380268,
+    311690799, 317989595, 324276419, 330551034, 336813204, 343062693,
+    349299266, 355522689, 361732726, 367929144, 374111709, 380280190,
+    386434353, 392573967, 398698801, 404808624, 410903207, 416982319,
+    423045732, 429093217, 435124548, 441139496, 447137835, 453119340,
+    459083786, 465030947, 470960600, 476872522, 482766489, 488642281,
+    494499676, 500338453, 506158392, 511959275, 517740883, 523502998,
+    529245404, 534967884, 540670223, 546352205, 552013618, 557654248,
+    563273883, 568872310, 574449320, 580004702, 585538248, 591049748,
+    596538995, 602005783, 607449906, 612871159, 618269338, 623644239,
+    628995660, 634323400, 639627258, 644907034, 650162530, 655393548,
+    660599890, 665781362, 670937767, 676068911, 681174602, 686254647,
+    691308855, 696337036, 701339000, 706314559, 711263525, 716185713,
+    721080937, 725949013, 730789757, 735602987, 740388522, 745146182,
+    749875788, 754577161, 759250125, 763894504, 768510122, 773096806,
+    777654384, 782182683, 786681534, 791150767, 795590213, 799999706,
+    804379079, 808728167, 813046808, 817334838, 821592095, 825818421,
+    830013654, 834177638, 838310216, 842411232, 846480531, 850517961,
+    854523370, 858496606, 862437520, 866345964, 870221790, 874064853,
+    877875009, 881652112, 885396022, 889106597, 892783698, 896427186,
+    900036924, 903612776, 907154608, 910662286, 914135678, 917574653,
+    920979082, 924348837, 927683790, 930983817, 934248793, 937478595,
+    940673101, 943832191, 946955747, 950043650, 953095785, 956112036,
+    959092290, 962036435, 964944360, 967815955, 970651112, 973449725,
+    976211688, 978936898, 981625251, 984276646, 986890984, 989468165,
+    992008094, 994510675, 996975812, 999403415, 1001793390, 1004145648,
+    1006460100, 1008736660, 1010975242, 1013175761, 1015338134, 1017462281,
+    1019548121, 1021595575, 1023604567, 1025575020, 1027506862, 1029400018,
+    1031254418, 1033069992, 1034846671, 1036584389, 1038283080, 1039942680,
+    1041563127, 1043144360, 1044686319, 1046188946, 1047652185, 1049075980,
+    1050460278, 1051805027, 1053110176, 1054375676, 1055601479, 1056787540,
+    1057933813, 1059040255, 1060106826, 1061133483, 1062120190, 1063066909,
+    1063973603, 1064840240, 1065666786, 1066453210, 1067199483, 1067905576,
+    1068571464, 1069197120, 1069782521, 1070327646, 1070832474, 1071296985,
+    1071721163, 1072104991, 1072448455, 1072751542, 1073014240, 1073236540,
+    1073418433, 1073559913, 1073660973, 1073721611, 1073741824,
+};
+
+// atan(x) for x in [0, 1] in 256 steps, in binary angle units
+static const int32_t ATAN_TABLE[257] = {
+    0, 2670163, 5340245, 8010164, 10679838, 13349187,
+    16018129, 18686582, 21354465, 24021698, 26688200, 29353889,
+    32018685, 34682507, 37345276, 40006910, 42667331, 45326458,
+    47984212, 50640513, 53295284, 55948444, 58599915, 61249621,
+    63897482, 66543421, 69187361, 71829226, 74468939, 77106424,
+    79741605, 82374407, 85004756, 87632577, 90257796, 92880340,
+    95500135, 98117110, 100731191, 103342309, 105950391, 108555367,
+    111157167, 113755721, 116350962, 118942819, 121531227, 124116117,
+    126697423, 129275078, 131849018, 134419178, 136985493, 139547900,
+    142106335, 144660738, 147211045, 149757197, 152299132, 154836791,
+    157370116, 159899047, 162423527, 164943499, 167458907, 169969696,
+    172475810, 174977196, 177473799, 179965568, 182452450, 184934394,
+    187411349, 189883266, 192350096, 194811789, 197268300, 199719579,
+    202165583, 204606264, 207041579, 209471483, 211895933, 214314887,
+    216728303, 219136141, 221538359, 223934919, 226325781, 228710908,
+    231090262, 233463808, 235831508, 238193329, 240549235, 242899194,
+    245243172, 247581137, 249913059, 252238905, 254558647, 256872255,
+    259179700, 261480955, 263775993, 266064788, 268347313, 270623543,
+    272893455, 275157025, 277414230, 279665048, 281909457, 284147437,
+    286378966, 288604026, 290822599, 293034664, 295240206, 297439207,
+    299631651, 301817523, 303996806, 306169488, 308335554, 310494991,
+    312647786, 314793928, 316933406, 319066208, 321192324, 323311746,
+    325424463, 327530468, 329629752, 331722309, 333808132, 335887214,
+    337959550, 340025134, 342083962, 344136031, 346181336, 348219874,
+    350251643, 352276640, 354294865, 356306316, 358310992, 360308894,
+    362300021, 364284375, 366261957, 368232767, 370196809, 372154086,
+    374104599, 376048352, 377985350, 379915596, 381839095, 383755852,
+    385665872, 387569162, 389465727, 391355574, 393238710, 395115141,
+    396984877, 398847924, 400704291, 402553986, 404397019, 406233399,
+    408063135, 409886237, 411702716, 413512582, 415315845, 417112518,
+    418902610, 420686135, 422463104, 424233528, 425997422, 427754796,
+    429505665, 431250041, 432987938, 434719370, 436444350, 438162893,
+    439875013, 441580724, 443280042, 444972981, 446659557, 448339785,
+    450013680, 451681259, 453342536, 454997530, 456646255, 458288728,
+    459924966, 461554985, 463178803, 464796437, 466407904, 468013221,
+    469612406, 471205476, 472792449, 474373344, 475948178, 477516969,
+    479079736, 480636498, 482187271, 483732076, 485270931, 486803855,
+    488330866, 489851983, 491367227, 492876615, 494380167, 495877903,
+    497369841, 498856002, 500336404, 501811068, 503280012, 504743258,
+    506200824, 507652730, 509098996, 510539643, 511974689, 513404156,
+    514828063, 516246430, 517659277, 519066625, 520468494, 521864904,
+    523255875, 524641427, 526021581, 527396357, 528765775, 530129856,
+    531488619, 532842087, 534190278, 535533213, 536870912,
+};
+
+static uint32_t toBam(int32_t deg7)
+{
+    return (uint32_t)(((int64_t)deg7 * BAM_PER_DEG7_Q30) >> 30);
+}
+
+// Q30
+static int32_t sinBam(uint32_t angle)
+{
+    uint32_t x = angle & (QUARTER_TURN - 1);
+    if(angle & QUARTER_TURN)
+        x = QUARTER_TURN - x;
+
+    uint32_t i = x >> 22;
+    int32_t value = SIN_TABLE[i];
+    if(i < 256)
+        value += (int32_t)(((int64_t)(SIN_TABLE[i + 1] - value) * (x & 0x3fffff)) >> 22);
+
+    return (angle & HALF_TURN) ? -value : value;
+}
+
+static int32_t cosBam(uint32_t angle) { return sinBam(angle + QUARTER_TURN); }
+
+static uint32_t atan2Bam(int64_t y, int64_t x)
+{
+    uint64_t ax = x < 0 ? -x : x;
+    uint64_t ay = y < 0 ? -y : y;
+    if(ax == 0 && ay == 0)
+        return 0;
+
+    // Reduce to the first octant, ratio in Q30
+    bool steep = ay > ax;
+    uint64_t num = steep ? ax : ay;
+    uint64_t den = steep ? ay : ax;
+    uint32_t ratio = (uint32_t)((num << 30) / den);
+
+    uint32_t i = ratio >> 22;
+    uint32_t angle = ATAN_TABLE[i];
+    if(i < 256)
+        angle += (uint32_t)(((uint64_t)(ATAN_TABLE[i + 1] - ATAN_TABLE[i]) * (ratio & 0x3fffff)) >> 22);
+
+    if(steep)
+        angle = QUARTER_TURN - angle;
+    if(x < 0)
+        angle = HALF_TURN - angle;
+    if(y < 0)
+        angle = -angle;
+    return angle;
+}
+
+static uint64_t isqrt64(uint64_t value)
+{
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+    while(bit > value)
+        bit >>= 2;
+    while(bit != 0)
+    {
+        if(value >= root + bit)
+        {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+// Longitude difference, wrapped into [-180, 180) degrees
+static int32_t deltaLng(const GeoPoint &from, const GeoPoint &to)
+{
+    int64_t delta = (int64_t)to.lng - from.lng;
+    if(delta >= 1800000000LL)
+        delta -= 3600000000LL;
+    else if(delta < -1800000000LL)
+        delta += 3600000000LL;
+    return (int32_t)delta;
+}
+
+// Local east/north offsets in millimeters, for short spans only
+static void localOffset(const GeoPoint &from, const GeoPoint &to, int64_t &east, int64_t &north)
+{
+    int32_t dLat = to.lat - from.lat;
+    int32_t midLat = from.lat + dLat / 2;
+    int64_t eastQ8 = ((int64_t)deltaLng(from, to) * MM_PER_DEG7_Q16) >> 8;
+    east = (eastQ8 * cosBam(toBam(midLat))) >> 38;
+    north = ((int64_t)dLat * MM_PER_DEG7_Q16) >> 16;
+}
+
+static bool isShortSpan(const GeoPoint &from, const GeoPoint &to)
+{
+    int32_t dLat = to.lat - from.lat;
+    int32_t dLng = deltaLng(from, to);
+    return dLat < SHORT_SPAN_DEG7 && dLat > -SHORT_SPAN_DEG7 &&
+           dLng < SHORT_SPAN_DEG7 && dLng > -SHORT_SPAN_DEG7;
+}
+
+int32_t geoDegrees7(const RawDegrees &raw)
+{
+    int32_t value = raw.deg * 10000000L + (raw.billionths + 50) / 100;
+    return raw.negative ? -value : value;
+}
+
+GeoPoint geoPoint(const RawDegrees &lat, const RawDegrees &lng)
+{
+    GeoPoint point;
+    point.lat = geoDegrees7(lat);
+    point.lng = geoDegrees7(lng);
+    return point;
+}
+
+uint32_t geoDistance(const GeoPoint &from, const GeoPoint &to)
+{
+    if(isShortSpan(from, to))
+        return (geoDistanceShort(from, to) + 500) / 1000;
+    return geoDistanceLong(from, to);
+}
+
+uint32_t geoDistanceShort(const GeoPoint &from, const GeoPoint &to)
+{
+    int64_t east, north;
+    localOffset(from, to, east, north);
+    return (uint32_t)isqrt64((uint64_t)(east * east) + (uint64_t)(north * north));
+}
+
+uint32_t geoDistanceLong(const GeoPoint &from, const GeoPoint &to)
+{
+    // a = sin^2(dLat/2) + cos(lat1) cos(lat2) sin^2(dLng/2), Q60 so that
+    // short spans keep their precision
+    int64_t sLat = sinBam((uint32_t)((int32_t)toBam(to.lat - from.lat) >> 1));
+    int64_t sLng = sinBam((uint32_t)((int32_t)toBam(deltaLng(from, to)) >> 1));
+    int64_t cosProduct = ((int64_t)cosBam(toBam(from.lat)) * cosBam(toBam(to.lat))) >> 30;
+    uint64_t a = (uint64_t)(sLat * sLat) + (uint64_t)(((cosProduct * sLng) >> 30) * sLng);
+    if(a > (1ULL << 60))
+        a = 1ULL << 60;
+
+    // central angle = 2 asin(sqrt(a)) = 2 atan2(sqrt(a), sqrt(1 - a))
+    int64_t y = isqrt64(a);
+    int64_t x = isqrt64((1ULL << 60) - a);
+    uint64_t angle = (uint64_t)atan2Bam(y, x) * 2;
+    return (uint32_t)((angle * M_PER_BAM_Q32 + HALF_TURN) >> 32);
+}
+
+uint16_t geoCourse(const GeoPoint &from, const GeoPoint &to)
+{
+    // Initial course = atan2(east, north) with
+    //   east  = sin(dLng) cos(lat2)
+    //   north = sin(dLat) + sin(lat1) cos(lat2) 2 sin^2(dLng/2)
+    // which avoids the cancellation in the textbook form for short spans.
+    int32_t dLat = to.lat - from.lat;
+    int32_t dLng = deltaLng(from, to);
+    int64_t cosLat2 = cosBam(toBam(to.lat));
+    int64_t sinCos = ((int64_t)sinBam(toBam(from.lat)) * cosLat2) >> 30;
+    int64_t east, north;
+    if(isShortSpan(from, to))
+    {
+        // Small angle form in 1/256 of 1e-7 degree, to keep the resolution
+        int64_t dLng2 = ((int64_t)dLng * dLng) >> 16;
+        east = ((int64_t)dLng * cosLat2) >> 22;
+        north = ((int64_t)dLat << 8) + ((((dLng2 * sinCos) >> 30) * RAD_PER_DEG7_Q40) >> 17);
+    }
+    else
+    {
+        int64_t sLng = sinBam((uint32_t)((int32_t)toBam(dLng) >> 1));
+        east = (sinBam(toBam(dLng)) * cosLat2) >> 30;
+        north = sinBam(toBam(dLat)) + ((((sinCos * sLng) >> 30) * sLng) >> 29);
+    }
+
+    // Bearing is measured clockwise from north
+    uint32_t angle = atan2Bam(east, north);
+    uint32_t course = (uint32_t)(((uint64_t)angle * 36000 + HALF_TURN) >> 32);
+    return course == 36000 ? 0 : course;
+}
+
+GeoOdometer::GeoOdometer()
+{
+    reset();
+}
+
+void GeoOdometer::reset()
+{
+    hasLast = false;
+    wholeMeters = 0;
+    millimeters = 0;
+}
+
+void GeoOdometer::add(const GeoPoint &point)
+{
+    if(hasLast)
+    {
+        if(isShortSpan(last, point))
+            millimeters += geoDistanceShort(last, point);
+        else
+            wholeMeters += geoDistanceLong(last, point);
+        wholeMeters += millimeters / 1000;
+        millimeters %= 1000;
+    }
+    last = point;
+    hasLast = true;
+}
+
+void GeoOdometer::add(const GeoPoint *points, size_t count)
+{
+    for(size_t i = 0; i < count; ++i)
+        add(points[i]);
+}
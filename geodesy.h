@@ -0,0 +1,73 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __Geodesy_h
+#define __Geodesy_h
+
+#include "TinyGPS++.h"
+
+/* Integer replacements for TinyGPSPlus::distanceBetween() and courseTo().
+ *
+ * The Electron has no FPU, so the double versions run in soft-float.
+ * These work on positions in units of 1e-7 degrees (as used by u-blox),
+ * use table lookups for sin and atan, and only need integer multiplies,
+ * one 64-bit divide and an integer square root per call.
+ * They use the same spherical Earth radius as distanceBetween().
+ *
+ * Accuracy against the double versions, over random point pairs:
+ *   geoDistanceShort: within 0.001% + 3 mm when both spans are under 0.1 degree
+ *   geoDistanceLong:  within 0.03% + 1 m up to 18000 km
+ *   geoCourse:        within 0.01 degree from 1 m to 18000 km apart
+ * Closer to antipodal, the table lookups lose up to tens of kilometers and
+ * the course up to a tenth of a degree. sim/test.cpp checks these bounds.
+ */
+
+struct GeoPoint
+{
+    int32_t lat; // 1e-7 degrees, north positive
+    int32_t lng; // 1e-7 degrees, east positive
+};
+
+int32_t geoDegrees7(const RawDegrees &raw);
+GeoPoint geoPoint(const RawDegrees &lat, const RawDegrees &lng);
+
+// Distance in meters, picks the short method for spans under 0.1 degree
+uint32_t geoDistance(const GeoPoint &from, const GeoPoint &to);
+// Equirectangular approximation, in millimeters
+uint32_t geoDistanceShort(const GeoPoint &from, const GeoPoint &to);
+// Haversine, in meters
+uint32_t geoDistanceLong(const GeoPoint &from, const GeoPoint &to);
+// Initial course in hundredths of a degree (North=0, East=9000)
+uint16_t geoCourse(const GeoPoint &from, const GeoPoint &to);
+
+// Running distance over a track, for odometry
+class GeoOdometer
+{
+public:
+    GeoOdometer();
+    void reset();
+    void add(const GeoPoint &point);
+    void add(const GeoPoint *points, size_t count);
+    uint32_t meters() const { return wholeMeters; }
+
+private:
+    GeoPoint last;
+    bool hasLast;
+    uint32_t wholeMeters;
+    uint32_t millimeters; // remainder below one meter
+};
+
+#endif // def(__Geodesy_h)
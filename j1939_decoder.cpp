@@ -0,0 +1,286 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "j1939_decoder.h"
+
+// Transport protocol, J1939-21
+static constexpr uint32_t PGN_TP_CM = 0xec00;
+static constexpr uint32_t PGN_TP_DT = 0xeb00;
+static constexpr uint8_t TP_CM_BAM = 32;
+static constexpr uint8_t TP_DT_BYTES = 7;
+
+J1939Decoder::J1939Decoder(const J1939Pgn *table, uint8_t count)
+    : table(table), count(count), sourceCount(0), pending(NULL), pendingSpns(0),
+      bamCount(0), bamDropCount(0)
+{
+    memset(sessions, 0, sizeof(sessions));
+}
+
+uint32_t J1939Decoder::pgn(uint32_t id)
+{
+    uint32_t pgn = (id >> 8) & 0x3ffff;
+    if(((pgn >> 8) & 0xff) < 240)
+    {
+        // PDU1: the low byte is the destination address
+        pgn &= 0x3ff00;
+    }
+    return pgn;
+}
+
+bool J1939Decoder::add(unsigned long now, const CANMessage &message)
+{
+    pending = NULL;
+    pendingSpns = 0;
+    if(!message.extended)
+    {
+        return false;
+    }
+    uint8_t address = message.id & 0xff;
+    uint32_t number = pgn(message.id);
+    if(number == PGN_TP_CM)
+    {
+        announce(now, address, message.data);
+        return false;
+    }
+    if(number == PGN_TP_DT)
+    {
+        return transfer(now, address, message.data);
+    }
+    int row = findRow(number);
+    if(row < 0)
+    {
+        return false;
+    }
+    return decode(now, row, address, message.data, message.len <= 8 ? message.len : 8);
+}
+
+bool J1939Decoder::next(uint8_t *payload, uint8_t &len)
+{
+    if(!pending || !pendingSpns)
+    {
+        return false;
+    }
+    uint8_t i = 0;
+    while(!(pendingSpns & (1 << i)))
+    {
+        i++;
+    }
+    pendingSpns &= ~(1 << i);
+
+    const J1939Spn &spn = table[pending->row].spns[i];
+    uint32_t value = pending->values[i];
+    len = 0;
+    payload[len++] = pending->address;
+    payload[len++] = spn.spn >> 16;
+    payload[len++] = spn.spn >> 8;
+    payload[len++] = spn.spn;
+    for(int shift = (spn.bits - 1) / 8 * 8; shift >= 0; shift -= 8)
+    {
+        payload[len++] = value >> shift;
+    }
+    return true;
+}
+
+int J1939Decoder::findRow(uint32_t pgn) const
+{
+    int low = 0;
+    int high = count - 1;
+    while(low <= high)
+    {
+        int middle = (low + high) / 2;
+        if(table[middle].pgn == pgn)
+        {
+            return middle;
+        }
+        if(table[middle].pgn < pgn)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    return -1;
+}
+
+// The state of a PGN from one source address, NULL when there's no room
+J1939Decoder::Source *J1939Decoder::findSource(uint8_t row, uint8_t address)
+{
+    for(uint8_t i = 0; i < sourceCount; i++)
+    {
+        if(sources[i].row == row && sources[i].address == address)
+        {
+            return &sources[i];
+        }
+    }
+    if(sourceCount == MAX_SOURCES)
+    {
+        return NULL;
+    }
+    Source &source = sources[sourceCount++];
+    memset(&source, 0, sizeof(source));
+    source.row = row;
+    source.address = address;
+    return &source;
+}
+
+bool J1939Decoder::decode(unsigned long now, uint8_t row, uint8_t address,
+                          const uint8_t *data, uint16_t len)
+{
+    Source *source = findSource(row, address);
+    const J1939Pgn &entry = table[row];
+    if(!source || (source->sampled && now - source->sampledAt < entry.interval))
+    {
+        return false;
+    }
+    source->sampled = true;
+    source->sampledAt = now;
+
+    uint8_t changed = 0;
+    for(uint8_t i = 0; i < J1939Pgn::MAX_SPNS && entry.spns[i].spn; i++)
+    {
+        uint32_t value;
+        if(!extract(entry.spns[i], data, len, value))
+        {
+            continue;
+        }
+        if((source->sent & (1 << i)) && source->values[i] == value)
+        {
+            continue;
+        }
+        source->values[i] = value;
+        changed |= 1 << i;
+    }
+    source->sent |= changed;
+    pending = source;
+    pendingSpns = changed;
+    return changed != 0;
+}
+
+// A TP.CM: start reassembling if it's a BAM of a PGN in the table
+void J1939Decoder::announce(unsigned long now, uint8_t address, const uint8_t *data)
+{
+    if(data[0] != TP_CM_BAM)
+    {
+        return;
+    }
+    Session *slot = NULL;
+    for(Session &session : sessions)
+    {
+        if(session.active && session.address == address)
+        {
+            // A source sends one BAM at a time, the previous one is lost
+            session.active = false;
+            bamDropCount++;
+            slot = &session;
+        }
+    }
+    int row = findRow(data[5] | (data[6] << 8) | ((uint32_t)data[7] << 16));
+    if(row < 0)
+    {
+        return;
+    }
+    for(uint8_t i = 0; !slot && i < MAX_SESSIONS; i++)
+    {
+        Session &session = sessions[i];
+        if(!session.active || now - session.lastPacket > BAM_TIMEOUT)
+        {
+            if(session.active)
+            {
+                bamDropCount++;
+            }
+            slot = &session;
+        }
+    }
+    if(!slot)
+    {
+        bamDropCount++;
+        return;
+    }
+    slot->active = true;
+    slot->address = address;
+    slot->row = row;
+    slot->size = data[1] | (data[2] << 8);
+    slot->packets = data[3];
+    slot->received = 0;
+    slot->lastPacket = now;
+}
+
+// A TP.DT: true when it completed a BAM with changed values
+bool J1939Decoder::transfer(unsigned long now, uint8_t address, const uint8_t *data)
+{
+    Session *session = NULL;
+    for(Session &candidate : sessions)
+    {
+        if(candidate.active && candidate.address == address)
+        {
+            session = &candidate;
+            break;
+        }
+    }
+    if(!session)
+    {
+        return false;
+    }
+    if(data[0] != session->received + 1 || now - session->lastPacket > BAM_TIMEOUT)
+    {
+        // A lost packet loses the whole message
+        session->active = false;
+        bamDropCount++;
+        return false;
+    }
+    uint16_t offset = session->received * TP_DT_BYTES;
+    session->received++;
+    session->lastPacket = now;
+    if(offset < MAX_BAM_SIZE)
+    {
+        uint16_t bytes = MAX_BAM_SIZE - offset < TP_DT_BYTES ? MAX_BAM_SIZE - offset : TP_DT_BYTES;
+        memcpy(session->data + offset, data + 1, bytes);
+    }
+    if(session->received < session->packets)
+    {
+        return false;
+    }
+
+    session->active = false;
+    bamCount++;
+    uint16_t len = session->size < MAX_BAM_SIZE ? session->size : MAX_BAM_SIZE;
+    return decode(now, session->row, address, session->data, len);
+}
+
+// The SPN's raw value, false when it's outside the data or not available
+bool J1939Decoder::extract(const J1939Spn &spn, const uint8_t *data, uint16_t len, uint32_t &value)
+{
+    uint16_t end = spn.startBit + spn.bits;
+    if(spn.bits == 0 || spn.bits > 32 || end > len * 8)
+    {
+        return false;
+    }
+    uint64_t raw = 0;
+    for(int i = (end - 1) / 8; i >= spn.startBit / 8; i--)
+    {
+        raw = (raw << 8) | data[i];
+    }
+    uint32_t mask = spn.bits == 32 ? 0xffffffff : (1u << spn.bits) - 1;
+    value = (raw >> (spn.startBit % 8)) & mask;
+    if(spn.bits < 8)
+    {
+        return value != mask;
+    }
+    // 0xfb-0xff in the top byte are indicators rather than values
+    return (value >> (spn.bits - 8)) <= 0xfa;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __J1939Decoder_h
+#define __J1939Decoder_h
+
+#include "application.h"
+
+/* Passive decoding of the J1939 broadcasts of heavy-duty vehicles.
+ *
+ * A J1939 frame has a 29-bit ID made of priority, PGN and source
+ * address, and its data holds SPNs: little-endian bit fields at fixed
+ * positions. Which SPNs to decode is a table fixed at compile time, one
+ * row per PGN, sorted by PGN:
+ *
+ *   { 61444, 1000, { { 190, 24, 16 }, { 513, 16, 8 } } }
+ *
+ * decodes engine speed and torque from EEC1 at most once a second.
+ *
+ * Frames of other PGNs cost a binary search of the table. For a known
+ * PGN, the SPNs are extracted once per its interval and source address,
+ * and next() hands out those that changed since they were last handed
+ * out. Values of all ones in their top byte from 0xfb up ("error", "not
+ * available") are skipped.
+ *
+ * PGNs over 8 bytes are sent as a BAM: a TP.CM announcing the PGN and
+ * size, then TP.DT packets of 7 bytes. BAMs of PGNs in the table are
+ * reassembled, up to MAX_BAM_SIZE bytes, and decoded like a single frame.
+ */
+struct J1939Spn
+{
+    uint32_t spn; // zero ends the list
+    uint16_t startBit; // from bit 0 of the first data byte
+    uint8_t bits; // 1 to 32
+};
+
+struct J1939Pgn
+{
+    static constexpr uint8_t MAX_SPNS = 4;
+
+    uint32_t pgn;
+    unsigned long interval;
+    J1939Spn spns[MAX_SPNS];
+};
+
+class J1939Decoder
+{
+public:
+    static constexpr uint8_t MAX_SOURCES = 16;
+    static constexpr uint8_t MAX_SESSIONS = 4;
+    static constexpr uint16_t MAX_BAM_SIZE = 48;
+    // J1939-21 T1, the longest gap between the packets of a BAM
+    static constexpr unsigned long BAM_TIMEOUT = 750;
+    // Source address, SPN (3 bytes) and value (up to 4 bytes)
+    static constexpr uint8_t MAX_PAYLOAD = 8;
+
+    J1939Decoder(const J1939Pgn *table, uint8_t count);
+
+    // PGN of a J1939 ID: PDU1 PGNs leave out the destination address
+    static uint32_t pgn(uint32_t id);
+
+    // True when values of the frame are ready for next()
+    bool add(unsigned long now, const CANMessage &message);
+    // A changed SPN of the last frame added: source address, SPN and
+    // its raw value, big-endian in as many bytes as its bits need
+    bool next(uint8_t *payload, uint8_t &len);
+
+    uint32_t bamCompleted() const { return bamCount; }
+    uint32_t bamDropped() const { return bamDropCount; }
+
+private:
+    struct Source
+    {
+        uint8_t row; // index into the table
+        uint8_t address;
+        uint8_t sent; // bit per SPN handed out before
+        bool sampled;
+        unsigned long sampledAt;
+        uint32_t values[J1939Pgn::MAX_SPNS];
+    };
+
+    struct Session
+    {
+        bool active;
+        uint8_t address;
+        uint8_t row;
+        uint8_t packets;
+        uint8_t received;
+        uint16_t size;
+        unsigned long lastPacket;
+        uint8_t data[MAX_BAM_SIZE];
+    };
+
+    int findRow(uint32_t pgn) const;
+    Source *findSource(uint8_t row, uint8_t address);
+    bool decode(unsigned long now, uint8_t row, uint8_t address, const uint8_t *data, uint16_t len);
+    void announce(unsigned long now, uint8_t address, const uint8_t *data);
+    bool transfer(unsigned long now, uint8_t address, const uint8_t *data);
+    static bool extract(const J1939Spn &spn, const uint8_t *data, uint16_t len, uint32_t &value);
+
+    const J1939Pgn *table;
+    uint8_t count;
+
+    Source sources[MAX_SOURCES];
+    uint8_t sourceCount;
+    Session sessions[MAX_SESSIONS];
+
+    // The SPNs of the last frame still to hand out
+    Source *pending;
+    uint8_t pendingSpns;
+
+    uint32_t bamCount;
+    uint32_t bamDropCount;
+};
+
+#endif // def(__J1939Decoder_h)
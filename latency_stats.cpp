@@ -0,0 +1,139 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "latency_stats.h"
+
+static const char *const PHASE_NAMES[LatencyStats::PHASE_COUNT] = {
+    "loop", "update", "send", "recv", "format", "serial", "publish"
+};
+
+LatencyStats::LatencyStats()
+    : ticksPerMicro(1), overhead(0)
+{
+    reset();
+}
+
+void LatencyStats::begin()
+{
+    ticksPerMicro = System.ticksPerMicrosecond();
+    if(ticksPerMicro == 0)
+    {
+        ticksPerMicro = 1;
+    }
+
+    static constexpr int ROUNDS = 64;
+    LatencyStats scratch;
+    scratch.ticksPerMicro = ticksPerMicro;
+    uint32_t first = start();
+    for(int i = 0; i < ROUNDS; i++)
+    {
+        scratch.stop(PHASE_LOOP, start());
+    }
+    uint32_t ticks = start() - first;
+    overhead = (uint64_t)ticks * 1000 / ((uint32_t)ROUNDS * ticksPerMicro);
+}
+
+void LatencyStats::add(Phase_e phase, uint32_t ticks)
+{
+    Histogram &h = phases[phase];
+    uint32_t micros = ticks / ticksPerMicro;
+    uint8_t bucket = micros == 0 ? 0 : 32 - __builtin_clz(micros);
+    if(bucket >= BUCKETS)
+    {
+        bucket = BUCKETS - 1;
+    }
+    h.counts[bucket]++;
+    if(micros > h.max)
+    {
+        h.max = micros;
+    }
+}
+
+void LatencyStats::reset()
+{
+    memset(phases, 0, sizeof(phases));
+}
+
+uint32_t LatencyStats::count(Phase_e phase) const
+{
+    uint32_t total = 0;
+    for(uint8_t b = 0; b < BUCKETS; b++)
+    {
+        total += phases[phase].counts[b];
+    }
+    return total;
+}
+
+void LatencyStats::format(String &out) const
+{
+    out = "";
+    for(uint8_t p = 0; p < PHASE_COUNT; p++)
+    {
+        const Histogram &h = phases[p];
+        int last = BUCKETS - 1;
+        while(last >= 0 && h.counts[last] == 0)
+        {
+            last--;
+        }
+        if(last < 0)
+        {
+            continue;
+        }
+        out += String::format("%s %lu ", PHASE_NAMES[p], (unsigned long)h.max);
+        for(int b = 0; b <= last; b++)
+        {
+            out += String::format(b < last ? "%lu," : "%lu;", (unsigned long)h.counts[b]);
+        }
+    }
+}
+
+size_t LatencyStats::summary(char *out, size_t size) const
+{
+    size_t len = 0;
+    for(uint8_t p = 0; p < PHASE_COUNT && len < size; p++)
+    {
+        uint32_t total = count((Phase_e)p);
+        if(total == 0)
+        {
+            continue;
+        }
+        const Histogram &h = phases[p];
+        len += snprintf(out + len, size - len, "%s %lu %lu %lu;", PHASE_NAMES[p],
+                        (unsigned long)h.max, (unsigned long)percentile(h, total, 50),
+                        (unsigned long)percentile(h, total, 99));
+    }
+    if(len < size)
+    {
+        len += snprintf(out + len, size - len, "ovh %lu", (unsigned long)overhead);
+    }
+    return len < size ? len : size - 1;
+}
+
+// Upper bound in us of the bucket holding the given percentile
+uint32_t LatencyStats::percentile(const Histogram &h, uint32_t total, uint8_t percent) const
+{
+    uint32_t rank = ((uint64_t)total * percent + 99) / 100;
+    uint32_t seen = 0;
+    for(uint8_t b = 0; b < BUCKETS; b++)
+    {
+        seen += h.counts[b];
+        if(seen >= rank)
+        {
+            return b == BUCKETS - 1 ? h.max : 1UL << b;
+        }
+    }
+    return h.max;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LatencyStats_h
+#define __LatencyStats_h
+
+#include "application.h"
+
+/* Latency histograms for the phases of the main loop.
+ *
+ * Phases are timed with the cycle counter behind System.ticks() (DWT
+ * CYCCNT on device), and each sample costs a division, a count leading
+ * zeros and two stores. Bucket 0 counts samples under 1 us, bucket b
+ * those from 2^(b-1) to 2^b us, and the last bucket everything longer.
+ * Phases can nest: LOOP covers a whole loop() and RECEIVE includes the
+ * FORMAT of each received frame.
+ */
+class LatencyStats
+{
+public:
+    enum Phase_e
+    {
+        PHASE_LOOP,
+        PHASE_UPDATE,  // carloop.update()
+        PHASE_SEND,    // OBD request transmit
+        PHASE_RECEIVE, // draining the CAN receive queue
+        PHASE_FORMAT,  // dumpMessage()
+        PHASE_SERIAL,  // Serial.write()
+        PHASE_PUBLISH, // Particle.publish()
+        PHASE_COUNT
+    };
+
+    static constexpr uint8_t BUCKETS = 20;
+
+    LatencyStats();
+    // Measures the cost of a start()/stop() pair, call once from setup()
+    void begin();
+
+    static uint32_t start() { return System.ticks(); }
+    void stop(Phase_e phase, uint32_t startTicks) { add(phase, System.ticks() - startTicks); }
+    void add(Phase_e phase, uint32_t ticks);
+    void reset();
+
+    // Every phase with samples as "name max_us count0,count1,...;"
+    void format(String &out) const;
+    // Every phase with samples as "name max p50 p99;" in us, the
+    // percentiles as the upper bound of their bucket, then the overhead
+    // of one start()/stop() pair in ns
+    size_t summary(char *out, size_t size) const;
+
+    uint32_t count(Phase_e phase) const;
+    uint32_t maxMicros(Phase_e phase) const { return phases[phase].max; }
+    uint32_t overheadNanos() const { return overhead; }
+
+private:
+    struct Histogram
+    {
+        uint32_t counts[BUCKETS];
+        uint32_t max;
+    };
+
+    uint32_t percentile(const Histogram &h, uint32_t total, uint8_t percent) const;
+
+    Histogram phases[PHASE_COUNT];
+    uint32_t ticksPerMicro;
+    uint32_t overhead;
+};
+
+#endif // def(__LatencyStats_h)
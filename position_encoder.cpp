@@ -0,0 +1,96 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "position_encoder.h"
+#include "record_buffer.h"
+
+// Largest change that fits in a 3-byte zigzag varint
+static constexpr int32_t MAX_DELTA = (1L << 20) - 1;
+
+static uint8_t saturate8(int32_t value)
+{
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+PositionEncoder::PositionEncoder()
+{
+    reset();
+}
+
+void PositionEncoder::reset()
+{
+    hasLast = false;
+    sinceKeyframe = 0;
+}
+
+PositionSample PositionEncoder::quantize(const GeoPoint &point, int32_t knots100, int32_t course100,
+                                         int32_t hdop100)
+{
+    PositionSample sample;
+    sample.point = point;
+    sample.speedKmh = saturate8((knots100 * 1852L + 50000L) / 100000L);
+    sample.course2Deg = (uint8_t)(((course100 + 100) / 200) % 180);
+    sample.hdop10 = saturate8((hdop100 + 5) / 10);
+    return sample;
+}
+
+uint8_t PositionEncoder::encode(const PositionSample &sample, uint8_t *payload, uint8_t &type)
+{
+    int32_t dLat = sample.point.lat - last.lat;
+    int32_t dLng = sample.point.lng - last.lng;
+    bool keyframe = !hasLast || sinceKeyframe >= KEYFRAME_INTERVAL ||
+                    dLat > MAX_DELTA || dLat < -MAX_DELTA ||
+                    dLng > MAX_DELTA || dLng < -MAX_DELTA;
+
+    uint8_t len = 0;
+    if(keyframe)
+    {
+        type = RECORD_POSITION_KEY;
+        for(int shift = 24; shift >= 0; shift -= 8)
+            payload[len++] = (uint32_t)sample.point.lat >> shift;
+        for(int shift = 24; shift >= 0; shift -= 8)
+            payload[len++] = (uint32_t)sample.point.lng >> shift;
+        sinceKeyframe = 0;
+    }
+    else
+    {
+        type = RECORD_POSITION_DELTA;
+        len += putVarint(payload + len, dLat);
+        len += putVarint(payload + len, dLng);
+        sinceKeyframe++;
+    }
+    payload[len++] = sample.speedKmh;
+    payload[len++] = sample.course2Deg;
+    payload[len++] = sample.hdop10;
+
+    last = sample.point;
+    hasLast = true;
+    return len;
+}
+
+// Zigzag so small negative changes stay small, 7 bits per byte, low bits first
+uint8_t PositionEncoder::putVarint(uint8_t *out, int32_t value)
+{
+    uint32_t zigzag = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+    uint8_t len = 0;
+    while(zigzag >= 0x80)
+    {
+        out[len++] = (zigzag & 0x7f) | 0x80;
+        zigzag >>= 7;
+    }
+    out[len++] = zigzag;
+    return len;
+}
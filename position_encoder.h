@@ -0,0 +1,67 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PositionEncoder_h
+#define __PositionEncoder_h
+
+#include "geodesy.h"
+
+// Quantized GPS fix as published
+struct PositionSample
+{
+    GeoPoint point;
+    uint8_t speedKmh;   // saturates at 255
+    uint8_t course2Deg; // course in 2-degree steps, 0-179
+    uint8_t hdop10;     // HDOP in tenths, saturates at 25.5
+};
+
+/* Encodes GPS fixes as RECORD_POSITION_KEY or RECORD_POSITION_DELTA payloads.
+ *
+ * Keyframe: lat (4 bytes), lng (4 bytes), speed, course, hdop
+ * Delta:    lat and lng change since the last encoded fix as zigzag varints,
+ *           then speed, course, hdop
+ *
+ * At 1 Hz and highway speed a delta is 7 bytes. A keyframe is sent for the
+ * first fix after reset(), every KEYFRAME_INTERVAL fixes, and whenever a
+ * delta would need more than 3 bytes per axis.
+ */
+class PositionEncoder
+{
+public:
+    static constexpr uint8_t KEYFRAME_SIZE = 11;
+    static constexpr uint8_t MAX_PAYLOAD = KEYFRAME_SIZE;
+    static constexpr uint8_t KEYFRAME_INTERVAL = 30;
+
+    PositionEncoder();
+
+    static PositionSample quantize(const GeoPoint &point, int32_t knots100, int32_t course100,
+                                   int32_t hdop100);
+
+    // Writes the payload and returns its length, sets type to the record type
+    uint8_t encode(const PositionSample &sample, uint8_t *payload, uint8_t &type);
+
+    // Forget the reference fix, so the next one is a keyframe
+    void reset();
+
+private:
+    static uint8_t putVarint(uint8_t *out, int32_t value);
+
+    GeoPoint last;
+    uint8_t sinceKeyframe;
+    bool hasLast;
+};
+
+#endif // def(__PositionEncoder_h)
@@ -0,0 +1,118 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "power_manager.h"
+
+PowerManager::PowerManager(unsigned long idleTimeout, unsigned long silenceTimeout,
+                           unsigned long sniffInterval, unsigned long sniffWindow)
+    : idleTimeout(idleTimeout), silenceTimeout(silenceTimeout),
+      sniffInterval(sniffInterval), sniffWindow(sniffWindow),
+      currentMode(MODE_ACTIVE), modeStart(0), lastCan(0), lastRunning(0),
+      busQuiet(false), busHeard(false), wake(false)
+{
+}
+
+void PowerManager::canActivity(unsigned long now)
+{
+    lastCan = now;
+    busHeard = true;
+    if(currentMode != MODE_ACTIVE && busQuiet)
+    {
+        wake = true;
+    }
+}
+
+void PowerManager::engineRpm(unsigned long now, uint16_t rpm)
+{
+    if(rpm > 0)
+    {
+        lastRunning = now;
+    }
+}
+
+void PowerManager::battery(unsigned long now, bool charging, bool chargingStarted, bool cranking)
+{
+    if(charging || cranking)
+    {
+        lastRunning = now;
+    }
+    // Only the edges wake it: surface charge or a maintainer can hold the
+    // voltage over the threshold for hours with the engine off
+    if((chargingStarted || cranking) && currentMode != MODE_ACTIVE)
+    {
+        wake = true;
+    }
+}
+
+PowerManager::Mode_e PowerManager::update(unsigned long now)
+{
+    switch(currentMode)
+    {
+    case MODE_ACTIVE:
+        if(now - lastCan >= silenceTimeout)
+        {
+            busQuiet = true;
+            enter(MODE_PARKED, now);
+        }
+        else if(now - lastRunning >= idleTimeout)
+        {
+            busQuiet = false;
+            enter(MODE_PARKED, now);
+        }
+        break;
+
+    case MODE_PARKED:
+        if(wake)
+        {
+            enter(MODE_ACTIVE, now);
+        }
+        else if(now - modeStart >= sniffInterval - sniffWindow)
+        {
+            enter(MODE_SNIFF, now);
+        }
+        break;
+
+    case MODE_SNIFF:
+        if(wake)
+        {
+            enter(MODE_ACTIVE, now);
+        }
+        else if(now - modeStart >= sniffWindow)
+        {
+            if(!busHeard)
+            {
+                busQuiet = true;
+            }
+            enter(MODE_PARKED, now);
+        }
+        break;
+    }
+    return currentMode;
+}
+
+void PowerManager::enter(Mode_e mode, unsigned long now)
+{
+    if(mode == MODE_ACTIVE)
+    {
+        // Give the engine the full timeouts to show it is running
+        lastCan = now;
+        lastRunning = now;
+    }
+    wake = false;
+    busHeard = false;
+    currentMode = mode;
+    modeStart = now;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PowerManager_h
+#define __PowerManager_h
+
+#include "application.h"
+
+/* Decides when the car is parked and the device should power down.
+ *
+ * The engine is considered running while the alternator charges the
+ * battery or the ECU reports a non-zero RPM. Once neither has been true
+ * for the idle timeout, or the CAN bus has been silent for the silence
+ * timeout, the device goes from ACTIVE to PARKED: the caller turns off
+ * CAN, GPS and the cloud connection. Every sniff interval it goes to
+ * SNIFF with only CAN on and listens for the sniff window. Cranking or
+ * charging starting brings it back to ACTIVE, and so does any frame once
+ * the bus has been seen silent. Modules chatting with the ignition on and
+ * the engine off don't keep waking the device up, and neither does a
+ * battery still over the charging threshold after the engine stopped.
+ *
+ * Parked, the CAN transceiver is on for sniffWindow / sniffInterval of
+ * the time and a bus that wakes up is noticed within
+ * sniffInterval + sniffWindow. Cranking and charging are noticed on the
+ * next update() since the battery is sampled in every mode. application.cpp
+ * samples it every 50 ms while parked rather than every 10 ms, which
+ * `carloop_sim --park-at S --wake-at S` reports as the duty cycle parked
+ * and the time from starting the engine to the first OBD request.
+ */
+class PowerManager
+{
+public:
+    enum Mode_e
+    {
+        MODE_ACTIVE,
+        MODE_PARKED,
+        MODE_SNIFF
+    };
+
+    PowerManager(unsigned long idleTimeout = 60000, unsigned long silenceTimeout = 5000,
+                 unsigned long sniffInterval = 15000, unsigned long sniffWindow = 500);
+
+    void canActivity(unsigned long now);
+    void engineRpm(unsigned long now, uint16_t rpm);
+    // charging is the level, chargingStarted its rising edge
+    void battery(unsigned long now, bool charging, bool chargingStarted, bool cranking);
+
+    // Advances the state machine, returns the mode the device should be in
+    Mode_e update(unsigned long now);
+    Mode_e mode() const { return currentMode; }
+    // When the mode last changed
+    unsigned long since() const { return modeStart; }
+
+private:
+    void enter(Mode_e mode, unsigned long now);
+
+    unsigned long idleTimeout;
+    unsigned long silenceTimeout;
+    unsigned long sniffInterval;
+    unsigned long sniffWindow;
+
+    Mode_e currentMode;
+    unsigned long modeStart;
+    unsigned long lastCan;
+    unsigned long lastRunning;
+    bool busQuiet;
+    bool busHeard;
+    bool wake;
+};
+
+#endif // def(__PowerManager_h)
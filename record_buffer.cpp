@@ -0,0 +1,122 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "record_buffer.h"
+
+RecordBuffer::RecordBuffer()
+    : size(0), anchor(0)
+{
+}
+
+bool RecordBuffer::fits(uint8_t len) const
+{
+    size_t needed = RECORD_OVERHEAD + len;
+    if(size == 0)
+    {
+        needed += HEADER_SIZE;
+    }
+    return len <= MAX_PAYLOAD && size + needed <= CAPACITY;
+}
+
+bool RecordBuffer::append(unsigned long now, uint8_t type, const uint8_t *payload, uint8_t len)
+{
+    if(!fits(len))
+    {
+        return false;
+    }
+
+    if(size == 0)
+    {
+        start(now, 0);
+    }
+    else if((long)(now - anchor) < 0)
+    {
+        now = anchor;
+    }
+
+    put16((now / 100) & 0xffff);
+    buffer[size++] = (type << 4) | len;
+    memcpy(buffer + size, payload, len);
+    size += len;
+    return true;
+}
+
+void RecordBuffer::start(unsigned long now, uint64_t utc)
+{
+    anchor = now;
+    size = 0;
+    buffer[size++] = VERSION;
+    put16(0); // sequence number and CRC, see seal()
+    put16(0);
+    put32(now);
+    put48(utc);
+}
+
+void RecordBuffer::clear()
+{
+    size = 0;
+}
+
+void RecordBuffer::seal(uint16_t sequence)
+{
+    buffer[1] = sequence >> 8;
+    buffer[2] = sequence & 0xff;
+    sign(buffer, size);
+}
+
+void RecordBuffer::sign(uint8_t *chunk, size_t len)
+{
+    chunk[3] = 0;
+    chunk[4] = 0;
+    // Continued over the base85 padding, up to 3 zero bytes
+    static const uint8_t padding[3] = { 0, 0, 0 };
+    uint16_t crc = crc16(padding, (4 - len % 4) % 4, crc16(chunk, len));
+    chunk[3] = crc >> 8;
+    chunk[4] = crc & 0xff;
+}
+
+// Bitwise rather than from a table: a chunk is a couple of hundred bytes
+// every few seconds
+uint16_t RecordBuffer::crc16(const uint8_t *data, size_t len, uint16_t crc)
+{
+    while(len--)
+    {
+        crc ^= *data++ << 8;
+        for(uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+void RecordBuffer::put16(uint16_t value)
+{
+    buffer[size++] = value >> 8;
+    buffer[size++] = value & 0xff;
+}
+
+void RecordBuffer::put32(uint32_t value)
+{
+    put16(value >> 16);
+    put16(value & 0xffff);
+}
+
+void RecordBuffer::put48(uint64_t value)
+{
+    put16((value >> 32) & 0xffff);
+    put32(value & 0xffffffffUL);
+}
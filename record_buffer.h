@@ -0,0 +1,103 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __RecordBuffer_h
+#define __RecordBuffer_h
+
+#include "application.h"
+
+// Record types, stored in the high nibble of each record's tag byte.
+// The low nibble holds the payload length.
+enum RecordType_e
+{
+    RECORD_OBD_REPLY = 0,      // PID followed by the reply data bytes
+    RECORD_CAN_FRAME = 1,      // 2-byte CAN ID followed by the frame data
+    RECORD_POSITION_KEY = 2,   // absolute GPS fix, see position_encoder.h
+    RECORD_POSITION_DELTA = 3, // GPS fix relative to the previous one
+    RECORD_ECU_REPLY = 4,      // ECU address, PID and reply data of a secondary ECU
+    RECORD_DERIVED = 5,        // virtual PID and its value, computed on the device
+    RECORD_BURST_TRIGGER = 6,  // virtual PID of the trigger that started a burst capture
+    RECORD_J1939 = 7,          // source address, SPN (3 bytes) and raw value of a J1939 broadcast
+    RECORD_DTC = 8,            // mode, bit 7 set when added rather than cleared, and the DTC
+};
+
+/* Binary chunk of timestamped records, sized so that its base85
+ * encoding fits in a single publish.
+ *
+ * Chunk layout (all multi-byte fields big-endian):
+ *   header: version (1 byte), sequence number (2 bytes), CRC (2 bytes),
+ *           millis() when the chunk was started (4 bytes), UTC
+ *           milliseconds since the Unix epoch at that moment (6 bytes,
+ *           zero when the time is not known yet)
+ *   record: tenths of a second (2 bytes), tag (1 byte), payload (0-15 bytes)
+ *
+ * The record timestamp is (millis() / 100) & 0xffff, which wraps every
+ * ~109 minutes. The header anchor makes it unambiguous: every record in a
+ * chunk is written after the anchor and well within one wrap of it.
+ * Records dated before the anchor are stored with the anchor time.
+ * A tag of zero marks the end of the chunk (base85 padding).
+ *
+ * seal() fills in the sequence number and the CRC just before the chunk
+ * is published. The CRC is CRC-16/CCITT-FALSE over the chunk padded with
+ * zeros to a multiple of 4 bytes, as base85 carries it, with the CRC
+ * field itself taken as zero. Bit 7 of the version is set in a chunk
+ * published again after the server reported it missing.
+ */
+class RecordBuffer
+{
+public:
+    static constexpr uint8_t VERSION = 3;
+    static constexpr uint8_t VERSION_RESENT = 0x80;
+    static constexpr size_t HEADER_SIZE = 15;
+    static constexpr size_t RECORD_OVERHEAD = 3;
+    static constexpr size_t MAX_PAYLOAD = 15;
+
+    // 196 binary bytes encode to 245 base85 characters
+    static constexpr size_t CAPACITY = 196;
+    static constexpr size_t ENCODED_SIZE = (CAPACITY + 3) / 4 * 5 + 1;
+
+    RecordBuffer();
+
+    bool fits(uint8_t len) const;
+    // Starts a new chunk anchored at now, append() does it with no UTC time
+    void start(unsigned long now, uint64_t utc);
+    bool append(unsigned long now, uint8_t type, const uint8_t *payload, uint8_t len);
+    void clear();
+    // Numbers the finished chunk and adds its CRC
+    void seal(uint16_t sequence);
+
+    // True when there are no records, even if the chunk has been started
+    bool isEmpty() const { return size <= HEADER_SIZE; }
+    size_t length() const { return size; }
+    const uint8_t *data() const { return buffer; }
+
+    static uint16_t sequence(const uint8_t *chunk) { return (chunk[1] << 8) | chunk[2]; }
+    // Writes the CRC of a sealed chunk of len bytes, again after a change
+    static void sign(uint8_t *chunk, size_t len);
+    // CRC-16/CCITT-FALSE, continued from crc if given
+    static uint16_t crc16(const uint8_t *data, size_t len, uint16_t crc = 0xffff);
+
+private:
+    void put16(uint16_t value);
+    void put32(uint32_t value);
+    void put48(uint64_t value);
+
+    uint8_t buffer[CAPACITY];
+    size_t size;
+    unsigned long anchor;
+};
+
+#endif // def(__RecordBuffer_h)
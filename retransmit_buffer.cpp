@@ -0,0 +1,152 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "retransmit_buffer.h"
+#include <stdlib.h>
+
+RetransmitBuffer::RetransmitBuffer()
+    : newest(0), resentCount(0), droppedCount(0)
+{
+    for(Slot &slot : slots)
+    {
+        slot.used = false;
+        slot.marked = false;
+        slot.sent = false;
+    }
+}
+
+void RetransmitBuffer::add(const char *name, const uint8_t *chunk, size_t len, bool sent)
+{
+    uint16_t sequence = RecordBuffer::sequence(chunk);
+    Slot &slot = slots[sequence % SLOTS];
+    if(slot.used && !slot.sent)
+    {
+        droppedCount++;
+    }
+    slot.used = true;
+    slot.marked = !sent;
+    slot.sent = sent;
+    slot.name[0] = name[0];
+    slot.name[1] = 0;
+    slot.sequence = sequence;
+    slot.len = len;
+    memcpy(slot.data, chunk, len);
+    newest = sequence;
+}
+
+int RetransmitBuffer::nack(const char *ranges)
+{
+    // Checked whole before marking anything
+    uint16_t first, last;
+    const char *p = ranges;
+    while(*p)
+    {
+        p = parseRange(p, first, last);
+        if(!p)
+        {
+            return -1;
+        }
+    }
+
+    int held = 0;
+    p = ranges;
+    while(*p)
+    {
+        p = parseRange(p, first, last);
+        for(Slot &slot : slots)
+        {
+            // Sequence numbers wrap, so may a range
+            if(slot.used && (uint16_t)(slot.sequence - first) <= (uint16_t)(last - first))
+            {
+                slot.marked = true;
+                held++;
+            }
+        }
+    }
+    return held;
+}
+
+bool RetransmitBuffer::next(char *name, uint8_t *chunk, size_t &len)
+{
+    // Oldest first: the slot after the newest chunk's comes first
+    for(uint8_t i = 1; i <= SLOTS; i++)
+    {
+        Slot &slot = slots[(newest + i) % SLOTS];
+        if(!slot.used || !slot.marked)
+        {
+            continue;
+        }
+        slot.marked = false;
+        slot.sent = true;
+        strcpy(name, slot.name);
+        memcpy(chunk, slot.data, slot.len);
+        len = slot.len;
+        chunk[0] |= RecordBuffer::VERSION_RESENT;
+        RecordBuffer::sign(chunk, len);
+        resentCount++;
+        return true;
+    }
+    return false;
+}
+
+uint8_t RetransmitBuffer::pending() const
+{
+    uint8_t count = 0;
+    for(const Slot &slot : slots)
+    {
+        if(slot.used && slot.marked)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+// One decimal number or "first-last", and the comma after it. Returns
+// where the next range starts, NULL when malformed.
+const char *RetransmitBuffer::parseRange(const char *ranges, uint16_t &first, uint16_t &last)
+{
+    char *end;
+    if(*ranges < '0' || *ranges > '9')
+    {
+        return NULL;
+    }
+    unsigned long value = strtoul(ranges, &end, 10);
+    if(value > 0xffff)
+    {
+        return NULL;
+    }
+    first = last = value;
+    if(*end == '-')
+    {
+        ranges = end + 1;
+        if(*ranges < '0' || *ranges > '9')
+        {
+            return NULL;
+        }
+        value = strtoul(ranges, &end, 10);
+        if(value > 0xffff)
+        {
+            return NULL;
+        }
+        last = value;
+    }
+    if(*end == ',')
+    {
+        return end[1] ? end + 1 : NULL;
+    }
+    return *end ? NULL : end;
+}
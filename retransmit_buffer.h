@@ -0,0 +1,78 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __RetransmitBuffer_h
+#define __RetransmitBuffer_h
+
+#include "application.h"
+#include "record_buffer.h"
+
+/* The last chunks published, kept so that the ones the server never got
+ * can be published again.
+ *
+ * Every sealed chunk goes in with add(), into the slot of its sequence
+ * number, replacing the chunk SLOTS numbers before it. A chunk that
+ * couldn't be sent yet goes in marked. The server lists the sequence
+ * numbers it's missing to nack() as ranges, "12-15,20". The chunks of
+ * those still held are marked, and next() hands them out oldest first,
+ * as they were sent but with RecordBuffer::VERSION_RESENT set in the
+ * version, so the server can tell them from a reboot's new sequence.
+ */
+class RetransmitBuffer
+{
+public:
+    // The server asks three times over 21 s, which at the publish rate
+    // limit of one a second is 21 chunks
+    static constexpr uint8_t SLOTS = 32;
+
+    RetransmitBuffer();
+
+    // name is the event name, "m" or "b". Unsent chunks come out of next().
+    void add(const char *name, const uint8_t *chunk, size_t len, bool sent);
+
+    // Marks the chunks listed, returns how many of them are still held,
+    // -1 when the list doesn't parse
+    int nack(const char *ranges);
+
+    // The next marked chunk, copied to chunk (RecordBuffer::CAPACITY bytes)
+    bool next(char *name, uint8_t *chunk, size_t &len);
+
+    uint8_t pending() const;
+    uint32_t resent() const { return resentCount; }
+    // Unsent chunks replaced before they could go out
+    uint32_t dropped() const { return droppedCount; }
+
+private:
+    struct Slot
+    {
+        bool used;
+        bool marked;
+        bool sent;
+        char name[2];
+        uint16_t sequence;
+        uint8_t len;
+        uint8_t data[RecordBuffer::CAPACITY];
+    };
+
+    static const char *parseRange(const char *ranges, uint16_t &first, uint16_t &last);
+
+    Slot slots[SLOTS];
+    uint16_t newest;
+    uint32_t resentCount;
+    uint32_t droppedCount;
+};
+
+#endif // def(__RetransmitBuffer_h)
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scheduler.h"
+
+Scheduler::Scheduler(unsigned long watchInterval)
+    : watchInterval(watchInterval), taskCount(0), watchCount(0),
+      worstLateness(0), dispatchCount(0)
+{
+}
+
+bool Scheduler::every(unsigned long interval, Task task, unsigned long first)
+{
+    for(uint8_t i = 0; i < taskCount; i++)
+    {
+        if(heap[i].task == task)
+        {
+            remove(i);
+            break;
+        }
+    }
+    if(taskCount >= MAX_TASKS)
+    {
+        return false;
+    }
+    Entry entry = { first, interval, task };
+    push(entry);
+    return true;
+}
+
+bool Scheduler::watch(Ready ready, Task task)
+{
+    for(uint8_t i = 0; i < watchCount; i++)
+    {
+        if(watches[i].task == task)
+        {
+            watches[i].ready = ready;
+            return true;
+        }
+    }
+    if(watchCount >= MAX_WATCHES)
+    {
+        return false;
+    }
+    Watch w = { ready, task };
+    watches[watchCount++] = w;
+    return true;
+}
+
+void Scheduler::cancel(Task task)
+{
+    for(uint8_t i = 0; i < taskCount; i++)
+    {
+        if(heap[i].task == task)
+        {
+            remove(i);
+            break;
+        }
+    }
+    for(uint8_t i = 0; i < watchCount; i++)
+    {
+        if(watches[i].task == task)
+        {
+            watches[i] = watches[--watchCount];
+            break;
+        }
+    }
+}
+
+unsigned long Scheduler::run(unsigned long now)
+{
+    // Indexed rather than iterated, tasks may cancel watches
+    for(uint8_t i = 0; i < watchCount; i++)
+    {
+        Watch w = watches[i];
+        if(w.ready())
+        {
+            dispatchCount++;
+            w.task();
+        }
+    }
+
+    while(taskCount > 0 && (long)(now - heap[0].deadline) >= 0)
+    {
+        Entry entry = heap[0];
+        remove(0);
+        unsigned long lateness = now - entry.deadline;
+        if(lateness > worstLateness)
+        {
+            worstLateness = lateness;
+        }
+        // Back in the heap before it runs, so it can cancel itself
+        if(entry.interval > 0)
+        {
+            entry.deadline += entry.interval;
+            if((long)(now - entry.deadline) >= 0)
+            {
+                entry.deadline = now + entry.interval;
+            }
+            push(entry);
+        }
+        dispatchCount++;
+        entry.task();
+    }
+
+    unsigned long idle = watchCount > 0 ? watchInterval : (unsigned long)-1;
+    if(taskCount > 0)
+    {
+        long untilNext = (long)(heap[0].deadline - now);
+        if(untilNext <= 0)
+        {
+            return 0;
+        }
+        if((unsigned long)untilNext < idle)
+        {
+            idle = untilNext;
+        }
+    }
+    return idle;
+}
+
+void Scheduler::reset()
+{
+    worstLateness = 0;
+    dispatchCount = 0;
+}
+
+void Scheduler::push(const Entry &entry)
+{
+    heap[taskCount] = entry;
+    siftUp(taskCount++);
+}
+
+void Scheduler::remove(uint8_t index)
+{
+    heap[index] = heap[--taskCount];
+    if(index < taskCount)
+    {
+        siftUp(index);
+        siftDown(index);
+    }
+}
+
+void Scheduler::siftUp(uint8_t index)
+{
+    while(index > 0)
+    {
+        uint8_t parent = (index - 1) / 2;
+        if(!before(heap[index], heap[parent]))
+        {
+            break;
+        }
+        Entry swap = heap[index];
+        heap[index] = heap[parent];
+        heap[parent] = swap;
+        index = parent;
+    }
+}
+
+void Scheduler::siftDown(uint8_t index)
+{
+    for(;;)
+    {
+        uint8_t smallest = index;
+        uint8_t left = 2 * index + 1;
+        uint8_t right = left + 1;
+        if(left < taskCount && before(heap[left], heap[smallest]))
+        {
+            smallest = left;
+        }
+        if(right < taskCount && before(heap[right], heap[smallest]))
+        {
+            smallest = right;
+        }
+        if(smallest == index)
+        {
+            break;
+        }
+        Entry swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
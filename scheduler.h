@@ -0,0 +1,96 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __Scheduler_h
+#define __Scheduler_h
+
+#include "application.h"
+
+/* Cooperative scheduler for the firmware's periodic jobs.
+ *
+ * Timed tasks sit in a min-heap by deadline. A task can also watch a
+ * readiness check, such as frames waiting in the CAN queue, and then runs
+ * whenever the check passes. run() dispatches whatever is due and returns
+ * how long nothing is, so the loop can sleep instead of spinning. Checks
+ * can't wake the device by themselves, so while any is registered the
+ * sleep is capped at the watch interval.
+ *
+ * Tasks run to completion and may add or cancel tasks, themselves
+ * included. A periodic task keeps its phase unless it falls more than
+ * a period behind, then it skips the missed runs.
+ */
+class Scheduler
+{
+public:
+    typedef void (*Task)();
+    typedef bool (*Ready)();
+
+    // Room for a few tasks over what the application schedules
+    static constexpr uint8_t MAX_TASKS = 12;
+    static constexpr uint8_t MAX_WATCHES = 2;
+
+    explicit Scheduler(unsigned long watchInterval = 5);
+
+    // Runs the task at first, then every interval ms if it isn't zero.
+    // Replaces an earlier schedule of the same task.
+    bool every(unsigned long interval, Task task, unsigned long first);
+    bool at(unsigned long when, Task task) { return every(0, task, when); }
+    // Runs the task whenever ready() returns true
+    bool watch(Ready ready, Task task);
+    // Removes the task's schedule and watch
+    void cancel(Task task);
+
+    // Runs the due and ready tasks, returns the ms until the next deadline
+    unsigned long run(unsigned long now);
+
+    // How late timed tasks started, since reset()
+    unsigned long maxLateness() const { return worstLateness; }
+    uint32_t dispatches() const { return dispatchCount; }
+    void reset();
+
+private:
+    struct Entry
+    {
+        unsigned long deadline;
+        unsigned long interval;
+        Task task;
+    };
+
+    struct Watch
+    {
+        Ready ready;
+        Task task;
+    };
+
+    static bool before(const Entry &a, const Entry &b)
+    {
+        return (long)(a.deadline - b.deadline) < 0;
+    }
+    void push(const Entry &entry);
+    void remove(uint8_t index);
+    void siftUp(uint8_t index);
+    void siftDown(uint8_t index);
+
+    unsigned long watchInterval;
+    Entry heap[MAX_TASKS];
+    uint8_t taskCount;
+    Watch watches[MAX_WATCHES];
+    uint8_t watchCount;
+    unsigned long worstLateness;
+    uint32_t dispatchCount;
+};
+
+#endif // def(__Scheduler_h)
@@ -0,0 +1,265 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for the parts of the Particle firmware API used by this
+ * repo, so the unmodified firmware builds and runs on Linux.
+ *
+ * Time is virtual (see sim.h): millis() and micros() read a simulated
+ * clock that only moves when the simulation advances it, so a run is
+ * deterministic and as fast as the host allows. CAN goes to a virtual
+ * bus of simulated ECUs, Serial1 is fed by a simulated NMEA GPS and
+ * Particle.publish() writes server-sent events to stdout.
+ */
+
+#ifndef __SimApplication_h
+#define __SimApplication_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+
+typedef uint8_t byte;
+
+#define SYSTEM_MODE(mode)
+#define SYSTEM_THREAD(state)
+
+void setup();
+void loop();
+
+/*************** Time and pins ****************/
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+typedef uint16_t pin_t;
+const pin_t D0 = 0, D1 = 1, D2 = 2, D3 = 3, D4 = 4, D5 = 5, D6 = 6, D7 = 7;
+const pin_t A0 = 10, A1 = 11, A2 = 12, A3 = 13, A4 = 14, A5 = 15;
+const uint8_t LOW = 0, HIGH = 1;
+
+enum PinMode
+{
+	INPUT,
+	OUTPUT,
+	INPUT_PULLUP,
+	INPUT_PULLDOWN
+};
+
+void pinMode(pin_t pin, PinMode mode);
+void digitalWrite(pin_t pin, uint8_t value);
+int32_t analogRead(pin_t pin);
+
+/*************** String ****************/
+
+class String {
+public:
+	String() {}
+	String(const char *s) : s(s ? s : "") {}
+	String(const std::string &s) : s(s) {}
+
+	static String format(const char *fmt, ...);
+
+	String &operator+=(const String &other) { s += other.s; return *this; }
+	String &operator+=(const char *other) { s += other; return *this; }
+	String &operator+=(char c) { s += c; return *this; }
+	bool operator==(const char *other) const { return s == other; }
+
+	unsigned length() const { return s.size(); }
+	void remove(unsigned index) { s.erase(index < s.size() ? index : s.size()); }
+	void remove(unsigned index, unsigned count) { s.erase(index, count); }
+	char charAt(unsigned index) const { return index < s.size() ? s[index] : 0; }
+	int indexOf(char c, unsigned from = 0) const;
+	String substring(unsigned from, unsigned to = ~0u) const;
+	long toInt() const { return strtol(s.c_str(), NULL, 0); }
+	const char *c_str() const { return s.c_str(); }
+	operator const char *() const { return s.c_str(); }
+
+private:
+	std::string s;
+};
+
+/*************** CAN ****************/
+
+enum HAL_CAN_Channel
+{
+	CAN_D1_D2,
+	CAN_C4_C5
+};
+
+enum CANErrorStatus
+{
+	CAN_NO_ERROR,
+	CAN_ERROR_PASSIVE,
+	CAN_BUS_OFF
+};
+
+struct CANMessage
+{
+	uint32_t id;
+	uint8_t size;
+	bool extended;
+	bool rtr;
+	uint8_t len;
+	uint8_t data[8];
+
+	CANMessage() : id(0), size(sizeof(data)), extended(false), rtr(false), len(0), data{} {}
+};
+
+class CANChannel {
+public:
+	CANChannel(HAL_CAN_Channel channel, uint16_t rxQueueSize = 32, uint16_t txQueueSize = 32);
+
+	void begin(unsigned long baud, uint32_t flags = 0);
+	void end();
+	uint8_t available();
+	bool receive(CANMessage &message);
+	bool transmit(const CANMessage &message);
+	CANErrorStatus errorStatus();
+
+private:
+	unsigned long baud;
+	bool started;
+	// Receive and transmit error counters, error passive from 128
+	unsigned rxErrors;
+	unsigned txErrors;
+	uint64_t since;
+};
+
+/*************** Serial ****************/
+
+class Stream {
+public:
+	virtual ~Stream() {}
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t *buf, size_t len);
+	size_t write(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+	size_t write(const String &s) { return write(s.c_str()); }
+	size_t readBytes(char *buf, size_t len);
+	size_t print(const char *s) { return write(s); }
+	size_t println(const char *s = "") { return write(s) + write("\r\n"); }
+	size_t printf(const char *fmt, ...);
+	void flush() {}
+};
+
+// Serial: what the firmware prints goes to stderr when enabled
+class USBSerial : public Stream {
+public:
+	void begin(long baud) { (void)baud; }
+	int available() { return 0; }
+	int read() { return -1; }
+	size_t write(uint8_t c);
+	size_t write(const uint8_t *buf, size_t len);
+	using Stream::write;
+};
+
+// Serial1: the GPS module, see sim.h
+class USARTSerial : public Stream {
+public:
+	static const size_t RX_BUFFER_SIZE = 64;
+
+	void begin(unsigned long baud) { this->baud = baud; }
+	int available();
+	int read();
+	size_t write(uint8_t c) { (void)c; return 1; }
+	using Stream::write;
+
+	unsigned long baud;
+};
+
+extern USBSerial Serial;
+extern USARTSerial Serial1;
+
+/*************** Cloud ****************/
+
+enum PublishFlag
+{
+	PUBLIC,
+	PRIVATE
+};
+
+class CloudClass {
+public:
+	bool publish(const char *name, const char *data, int ttl = 60, PublishFlag flag = PUBLIC);
+	bool publish(const char *name, const String &data, int ttl = 60, PublishFlag flag = PUBLIC)
+	{
+		return publish(name, data.c_str(), ttl, flag);
+	}
+
+	bool variable(const char *name, const int &value);
+	bool variable(const char *name, const double &value);
+	bool variable(const char *name, const String &value);
+	bool variable(const char *name, const char *value);
+	bool function(const char *name, int (*fn)(String));
+
+	void connect();
+	void disconnect();
+	bool connected();
+	bool syncTime() { return connected(); }
+	void process() {}
+};
+
+extern CloudClass Particle;
+
+class TimeClass {
+public:
+	bool isValid();
+	uint32_t now();
+};
+
+extern TimeClass Time;
+
+// ticks() is the host's real time in ns, to measure the host's own cost
+class SystemClass {
+public:
+	uint32_t ticks();
+	static uint32_t ticksPerMicrosecond() { return 1000; }
+};
+
+extern SystemClass System;
+
+class EEPROMClass {
+public:
+	static const size_t SIZE = 2047;
+
+	template <typename T> T &get(int address, T &value)
+	{
+		memcpy(&value, bytes + address, sizeof(T));
+		return value;
+	}
+	template <typename T> const T &put(int address, const T &value)
+	{
+		memcpy(bytes + address, &value, sizeof(T));
+		return value;
+	}
+	size_t length() const { return SIZE; }
+	void clear() { memset(bytes, 0xff, SIZE); }
+
+	EEPROMClass() { clear(); }
+
+private:
+	uint8_t bytes[SIZE];
+};
+
+extern EEPROMClass EEPROM;
+
+#endif // def(__SimApplication_h)
@@ -0,0 +1,464 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Microbenchmarks for the code that runs on every frame or sentence.
+ *
+ * Each benchmark is timed over several runs and the median is reported
+ * as nanoseconds and TSC reference cycles per operation (cycles are 0 on
+ * hosts without a TSC), and as MB/s for those that parse a stream.
+ * Results are written as JSON; with --check they are compared against a
+ * stored baseline and the exit status is 1 if any benchmark got slower
+ * than the baseline times the threshold.
+ *
+ *     carloop_bench > results.json
+ *     carloop_bench --check sim/bench_baseline.json --threshold 1.25
+ *
+ * Host numbers only rank changes; the device runs a 120 MHz Cortex-M3.
+ * The baseline has to be regenerated when the benchmark host changes.
+ *
+ * Build with the simulation HAL (see sim/main.cpp), replacing
+ * sim/main.cpp by sim/bench.cpp:
+ *
+ *     g++ -std=c++11 -O2 -Isim -I. -o carloop_bench sim/bench.cpp sim/hal.cpp \
+ *         sim/virtual_ecu.cpp sim/nmea_feeder.cpp sim/can_log.cpp application.cpp \
+ *         carloop.cpp TinyGPS++.cpp ubx.cpp record_buffer.cpp geodesy.cpp \
+ *         position_encoder.cpp track_simplifier.cpp time_base.cpp power_manager.cpp \
+ *         latency_stats.cpp scheduler.cpp ecu_tracker.cpp \
+ *         derived_signals.cpp burst_capture.cpp j1939_decoder.cpp dtc_reader.cpp \
+ *         sim/nack_server.cpp retransmit_buffer.cpp
+ */
+
+#include "sim.h"
+#include "TinyGPS++.h"
+#include "ubx.h"
+#include "geodesy.h"
+#include "latency_stats.h"
+#include "j1939_decoder.h"
+#include "nmea_feeder.h"
+#include "position_encoder.h"
+#include "track_simplifier.h"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_TSC 1
+#endif
+
+// Defined in application.cpp and base85.h
+String dumpMessage(const CANMessage &message);
+bool byteArray8Equal(uint8_t a1[8], uint8_t a2[8]);
+void encode_85(char *buf, const unsigned char *data, int bytes);
+
+namespace {
+
+const int RUNS = 7;
+
+struct Result
+{
+	std::string name;
+	double ns;
+	double cycles;
+	uint64_t iterations;
+	// Bytes handled per call, for a throughput in MB/s, zero if none
+	double bytes;
+	// More JSON fields, such as how much a lossy encoding loses
+	std::string metrics;
+};
+
+volatile uint32_t sink;
+
+uint64_t cycleCounter() {
+#ifdef BENCH_HAS_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+// Median of RUNS timed runs of iterations calls, after one warm-up run
+template <typename Body>
+Result measure(const char *name, uint64_t iterations, Body body) {
+	std::vector<double> ns, cycles;
+	for (int run = -1; run < RUNS; run++) {
+		auto start = std::chrono::steady_clock::now();
+		uint64_t startCycles = cycleCounter();
+		for (uint64_t i = 0; i < iterations; i++) {
+			body(i);
+		}
+		uint64_t endCycles = cycleCounter();
+		auto end = std::chrono::steady_clock::now();
+		if (run >= 0) {
+			ns.push_back(std::chrono::duration<double, std::nano>(end - start).count() / iterations);
+			cycles.push_back((double)(endCycles - startCycles) / iterations);
+		}
+	}
+	std::sort(ns.begin(), ns.end());
+	std::sort(cycles.begin(), cycles.end());
+	Result result = { name, ns[RUNS / 2], cycles[RUNS / 2], iterations, 0, "" };
+	return result;
+}
+
+Result withBytes(Result result, double bytes) {
+	result.bytes = bytes;
+	return result;
+}
+
+Result withMetrics(Result result, const std::string &metrics) {
+	result.metrics = metrics;
+	return result;
+}
+
+// The fixes recordPosition() makes from the simulated GPS of sim/main.cpp
+// driving at speed m/s, read off Serial1 every millisecond
+std::vector<TrackFix> nmeaDrive(uint32_t seconds, double speed) {
+	const unsigned long baud = 9600;
+	NmeaFeeder feeder(47.6062, -122.3321, 1475323200);
+	feeder.speed = speed;
+	TinyGPSPlus gps;
+	std::vector<TrackFix> fixes;
+	for (uint64_t now = 0; now <= seconds * 1000000ULL; now += 1000) {
+		int c;
+		while ((c = feeder.read(now, baud)) >= 0) {
+			gps.encode(c);
+		}
+		// RMC completes each fix
+		if (gps.speed.isUpdated() && gps.location.isValid()) {
+			TrackFix fix;
+			fix.time = now / 1000;
+			GeoPoint point = geoPoint(gps.location.rawLat(), gps.location.rawLng());
+			fix.sample = PositionEncoder::quantize(point,
+				gps.speed.value(), gps.course.value(), gps.hdop.value());
+			fixes.push_back(fix);
+		}
+	}
+	return fixes;
+}
+
+// Distance in meters from p to the segment from a to b, on a local plane
+double segmentDistance(const GeoPoint &p, const GeoPoint &a, const GeoPoint &b) {
+	const double metersPerDeg7 = 6371008.8 * M_PI / 180 / 1e7;
+	double lngScale = cos(a.lat / 1e7 * M_PI / 180);
+	double px = (p.lng - a.lng) * lngScale * metersPerDeg7, py = (p.lat - a.lat) * metersPerDeg7;
+	double bx = (b.lng - a.lng) * lngScale * metersPerDeg7, by = (b.lat - a.lat) * metersPerDeg7;
+	double length2 = bx * bx + by * by;
+	double t = length2 > 0 ? std::max(0.0, std::min(1.0, (px * bx + py * by) / length2)) : 0;
+	return hypot(px - t * bx, py - t * by);
+}
+
+// Runs the fixes through a simplifier with the settings of application.cpp,
+// returns the percentage kept and the furthest a dropped fix is from the
+// kept track. Fixes after the last kept one aren't decided yet.
+std::string simplifyMetrics(const std::vector<TrackFix> &fixes) {
+	TrackSimplifier simplifier(10000, 20, 30000);
+	std::vector<size_t> kept;
+	size_t next = 0;
+	for (size_t i = 0; i < fixes.size(); i++) {
+		TrackFix out;
+		if (simplifier.add(fixes[i], out)) {
+			while (fixes[next].time != out.time) {
+				next++;
+			}
+			kept.push_back(next);
+		}
+	}
+	double maxError = 0;
+	for (size_t k = 1; k < kept.size(); k++) {
+		for (size_t i = kept[k - 1] + 1; i < kept[k]; i++) {
+			maxError = std::max(maxError, segmentDistance(fixes[i].sample.point,
+				fixes[kept[k - 1]].sample.point, fixes[kept[k]].sample.point));
+		}
+	}
+	char metrics[96];
+	snprintf(metrics, sizeof(metrics), ", \"kept_pct\": %.1f, \"max_error_m\": %.2f",
+		100.0 * kept.size() / fixes.size(), maxError);
+	return metrics;
+}
+
+const char NMEA[] =
+	"$GPGGA,120001.00,4736.37200,N,12219.92600,W,1,08,0.9,45.0,M,-17.0,M,,*63\r\n"
+	"$GPRMC,120001.00,A,4736.37200,N,12219.92600,W,28.62,45.00,011016,,,A*42\r\n";
+
+std::vector<Result> run(uint64_t scale) {
+	std::vector<Result> results;
+
+	CANMessage reply;
+	reply.id = 0x7e8;
+	reply.len = 8;
+	const uint8_t replyData[8] = { 0x04, 0x41, 0x0c, 0x1c, 0xa6, 0x55, 0x55, 0x55 };
+	memcpy(reply.data, replyData, 8);
+	results.push_back(measure("dumpMessage", 20000 * scale, [&](uint64_t) {
+		sink += dumpMessage(reply).length();
+	}));
+
+	uint8_t a[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	uint8_t b[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	results.push_back(measure("byteArray8Equal", 2000000 * scale, [&](uint64_t i) {
+		b[7] = i & 1 ? 8 : 9;
+		sink += byteArray8Equal(a, b);
+	}));
+
+	uint8_t chunk[196];
+	for (size_t i = 0; i < sizeof(chunk); i++) {
+		chunk[i] = i * 37;
+	}
+	char encoded[250];
+	results.push_back(measure("encode_85/196B", 100000 * scale, [&](uint64_t i) {
+		chunk[0] = i;
+		encode_85(encoded, chunk, sizeof(chunk));
+		sink += encoded[0];
+	}));
+
+	TinyGPSPlus gps;
+	const size_t nmeaLength = sizeof(NMEA) - 1;
+	results.push_back(withBytes(measure("TinyGPSPlus::encode(char)/GGA+RMC", 20000 * scale, [&](uint64_t) {
+		for (size_t i = 0; i < nmeaLength; i++) {
+			gps.encode(NMEA[i]);
+		}
+	}), nmeaLength));
+	results.push_back(withBytes(measure("TinyGPSPlus::encode(block)/GGA+RMC", 20000 * scale, [&](uint64_t) {
+		gps.encode(NMEA, nmeaLength);
+	}), nmeaLength));
+	// The feed from Serial1 as it was, a type-erased handler called per
+	// character, against the block call CarloopGPS::receiveGPS() makes
+	// for each 64 bytes read
+	std::function<void(char)> serialHandler = [&](char c) { gps.encode(c); };
+	results.push_back(withBytes(measure("NMEA feed/std::function per char", 20000 * scale, [&](uint64_t) {
+		for (size_t i = 0; i < nmeaLength; i++) {
+			serialHandler(NMEA[i]);
+		}
+	}), nmeaLength));
+	results.push_back(withBytes(measure("NMEA feed/bound 64-byte blocks", 20000 * scale, [&](uint64_t) {
+		for (size_t i = 0; i < nmeaLength; i += 64) {
+			gps.encode(NMEA + i, nmeaLength - i < 64 ? nmeaLength - i : 64);
+		}
+	}), nmeaLength));
+	sink += gps.passedChecksum();
+
+	// The same fix as a u-blox module sends it in UBX, NAV-PVT and NAV-DOP
+	uint8_t pvt[92] = { 0 };
+	const uint8_t pvtFields[] = {
+		0xe0, 0x07, 10, 1, 12, 0, 1, 0x37,          // 2016-10-01 12:00:01
+		0, 0, 0, 0, 0, 0, 0, 0, 3, 0x01, 0, 8,      // 3D fix, 8 satellites
+		0x58, 0x9a, 0x15, 0xb7, 0x30, 0x21, 0x60, 0x1c, // 122.3321 W, 47.6062 N
+	};
+	memcpy(pvt + 4, pvtFields, sizeof(pvtFields));
+	pvt[36] = 0xc8; pvt[37] = 0xaf;                 // 45 m
+	pvt[60] = 0x82; pvt[61] = 0x39;                 // 14.722 m/s
+	pvt[64] = 0x20; pvt[65] = 0xaa; pvt[66] = 0x44; // 45 degrees
+	uint8_t dop[18] = { 0 };
+	dop[12] = 90;
+	uint8_t ubx[2 * UbxParser::MAX_PAYLOAD];
+	size_t ubxLength = UbxParser::frame(ubx, UbxParser::CLASS_NAV, UbxParser::NAV_PVT, pvt, sizeof(pvt));
+	ubxLength += UbxParser::frame(ubx + ubxLength, UbxParser::CLASS_NAV, UbxParser::NAV_DOP, dop, sizeof(dop));
+	UbxParser ubxParser(gps);
+	results.push_back(withBytes(measure("UbxParser::encode(block)/NAV-PVT+DOP", 20000 * scale, [&](uint64_t) {
+		ubxParser.encode((const char *)ubx, ubxLength);
+	}), ubxLength));
+	sink += ubxParser.framesProcessed();
+
+	results.push_back(measure("parseDecimal", 2000000 * scale, [&](uint64_t) {
+		sink += TinyGPSPlus::parseDecimal("-12345.67");
+	}));
+	RawDegrees degrees;
+	results.push_back(measure("parseDegrees", 1000000 * scale, [&](uint64_t) {
+		TinyGPSPlus::parseDegrees("4736.37200", degrees);
+		sink += degrees.billionths;
+	}));
+
+	results.push_back(measure("distanceBetween", 1000000 * scale, [&](uint64_t i) {
+		sink += TinyGPSPlus::distanceBetween(47.6062, -122.3321, 47.6062 + (i & 15) * 1e-4, -122.33);
+	}));
+	GeoPoint from = { 476062000, -1223321000 };
+	GeoPoint to = { 476062000, -1223300000 };
+	results.push_back(measure("geoDistance", 1000000 * scale, [&](uint64_t i) {
+		to.lat = 476062000 + (i & 15) * 1000;
+		sink += geoDistance(from, to);
+	}));
+	// Seattle to points around New York, for the haversine
+	GeoPoint far = { 407128000, -740060000 };
+	results.push_back(measure("courseTo", 1000000 * scale, [&](uint64_t i) {
+		sink += TinyGPSPlus::courseTo(47.6062, -122.3321, 40.7128 + (i & 15) * 1e-4, -74.006);
+	}));
+	results.push_back(measure("geoDistanceLong", 1000000 * scale, [&](uint64_t i) {
+		far.lat = 407128000 + (i & 15) * 1000;
+		sink += geoDistanceLong(from, far);
+	}));
+	results.push_back(measure("geoCourse", 1000000 * scale, [&](uint64_t i) {
+		far.lat = 407128000 + (i & 15) * 1000;
+		sink += geoCourse(from, far);
+	}));
+	// A minute of 1 Hz fixes 10 m apart
+	GeoPoint track[60];
+	for (int i = 0; i < 60; i++) {
+		track[i].lat = 476062000 + i * 899;
+		track[i].lng = -1223321000 + i * 300;
+	}
+	results.push_back(measure("GeoOdometer::add/60 fixes", 100000 * scale, [&](uint64_t) {
+		GeoOdometer odometer;
+		odometer.add(track, 60);
+		sink += odometer.meters();
+	}));
+
+	// Half an hour of the simulated drive, a minute straight and 30 s
+	// turning, at 90 km/h
+	std::vector<TrackFix> drive = nmeaDrive(1800, 25);
+	TrackSimplifier simplifier(10000, 20, 30000);
+	TrackFix simplified;
+	results.push_back(withMetrics(measure("TrackSimplifier::add/NMEA drive", 200000 * scale, [&](uint64_t i) {
+		sink += simplifier.add(drive[i % drive.size()], simplified);
+	}), simplifyMetrics(drive)));
+
+	LatencyStats stats;
+	stats.begin();
+	results.push_back(measure("LatencyStats start+stop", 2000000 * scale, [&](uint64_t) {
+		stats.stop(LatencyStats::PHASE_UPDATE, LatencyStats::start());
+	}));
+	sink += stats.count(LatencyStats::PHASE_UPDATE);
+
+	// A fully loaded 250 kbps bus is about 1800 frames a second. Most are
+	// PGNs outside the table, one in eight is EEC1.
+	static const J1939Pgn pgns[] = {
+		{ 61444, 1000, { { 513, 16, 8 }, { 190, 24, 16 } } },
+		{ 65262, 10000, { { 110, 0, 8 } } },
+		{ 65265, 1000, { { 84, 8, 16 } } },
+		{ 65266, 1000, { { 183, 0, 16 } } },
+	};
+	J1939Decoder j1939(pgns, sizeof(pgns) / sizeof(pgns[0]));
+	CANMessage frame;
+	frame.extended = true;
+	frame.len = 8;
+	memset(frame.data, 0x40, sizeof(frame.data));
+	results.push_back(measure("J1939Decoder::add/loaded bus", 1000000 * scale, [&](uint64_t i) {
+		frame.id = i & 7 ? 0x18ff0021 | ((i & 31) << 8) : 0x0cf00400;
+		frame.data[3] = i >> 10;
+		uint8_t payload[J1939Decoder::MAX_PAYLOAD];
+		uint8_t len;
+		if (j1939.add(i / 2, frame)) {
+			while (j1939.next(payload, len)) {
+				sink += len;
+			}
+		}
+	}));
+
+	// The whole firmware against the simulated car with every broadcast
+	// source on the bus, per 10 ms of virtual time at a millisecond per
+	// loop() plus whatever it sleeps
+	sim::bus = VirtualBus(1);
+	sim::bus.addEcu(VirtualEcu::fromTrace(0x7e8, 8000, 4000));
+	sim::bus.addEcu(VirtualEcu::transmission(0x7e9, 10000, 4000));
+	sim::bus.addNoise(6);
+	setup();
+	results.push_back(measure("loop/10ms bus load", 2000 * scale, [&](uint64_t) {
+		uint64_t until = sim::now() + 10000;
+		while (sim::now() < until) {
+			loop();
+			sim::advance(1000);
+		}
+	}));
+
+	return results;
+}
+
+void writeJson(FILE *out, const std::vector<Result> &results) {
+	fprintf(out, "{\n  \"benchmarks\": [\n");
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result &r = results[i];
+		char throughput[32] = "";
+		if (r.bytes > 0) {
+			snprintf(throughput, sizeof(throughput), ", \"mb_s\": %.1f", r.bytes * 1e3 / r.ns);
+		}
+		fprintf(out, "    {\"name\": \"%s\", \"ns\": %.2f, \"cycles\": %.1f, \"iterations\": %llu%s%s}%s\n",
+			r.name.c_str(), r.ns, r.cycles, (unsigned long long)r.iterations, throughput,
+			r.metrics.c_str(),
+			i + 1 < results.size() ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+}
+
+// Reads the name and ns of each benchmark written by writeJson()
+bool readBaseline(const char *path, std::map<std::string, double> &baseline) {
+	FILE *in = fopen(path, "r");
+	if (!in) {
+		return false;
+	}
+	char line[512];
+	while (fgets(line, sizeof(line), in)) {
+		const char *name = strstr(line, "\"name\": \"");
+		const char *ns = strstr(line, "\"ns\": ");
+		if (!name || !ns) {
+			continue;
+		}
+		name += 9;
+		const char *nameEnd = strchr(name, '"');
+		if (nameEnd) {
+			baseline[std::string(name, nameEnd)] = atof(ns + 6);
+		}
+	}
+	fclose(in);
+	return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+	const char *baselinePath = NULL;
+	double threshold = 1.25;
+	uint64_t scale = 1;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--check") && i + 1 < argc) {
+			baselinePath = argv[++i];
+		} else if (!strcmp(argv[i], "--threshold") && i + 1 < argc) {
+			threshold = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--scale") && i + 1 < argc) {
+			scale = strtoull(argv[++i], NULL, 0);
+		} else {
+			fprintf(stderr, "usage: carloop_bench [--check baseline.json] [--threshold 1.25] [--scale N]\n");
+			return 2;
+		}
+	}
+
+	// Keep the firmware's publishes out of the results
+	sim::events = NULL;
+	std::vector<Result> results = run(scale ? scale : 1);
+	writeJson(stdout, results);
+
+	if (!baselinePath) {
+		return 0;
+	}
+	std::map<std::string, double> baseline;
+	if (!readBaseline(baselinePath, baseline)) {
+		fprintf(stderr, "cannot read %s\n", baselinePath);
+		return 2;
+	}
+	int regressions = 0;
+	for (const Result &r : results) {
+		std::map<std::string, double>::iterator it = baseline.find(r.name);
+		if (it == baseline.end()) {
+			fprintf(stderr, "%-36s %10.2f ns  (not in baseline)\n", r.name.c_str(), r.ns);
+			continue;
+		}
+		double ratio = r.ns / it->second;
+		bool slower = ratio > threshold;
+		regressions += slower;
+		fprintf(stderr, "%-36s %10.2f ns  %5.2fx baseline%s\n", r.name.c_str(), r.ns, ratio,
+			slower ? "  REGRESSION" : "");
+	}
+	return regressions ? 1 : 0;
+}
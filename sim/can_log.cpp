@@ -0,0 +1,169 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "can_log.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char CanLog::MAGIC[8] = { 'C', 'A', 'N', 'L', 'O', 'G', '1', 0 };
+
+CanLog::CanLog()
+	: text(NULL), map(NULL), mapSize(0), mapOffset(0), first(0), haveFirst(false),
+	  count(0), skippedLines(0) {
+}
+
+CanLog::~CanLog() {
+	close();
+}
+
+bool CanLog::open(const char *path) {
+	close();
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	char magic[sizeof(MAGIC)];
+	struct stat st;
+	if (read(fd, magic, sizeof(magic)) == sizeof(magic) && !memcmp(magic, MAGIC, sizeof(MAGIC)) &&
+			fstat(fd, &st) == 0) {
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED) {
+			return false;
+		}
+		madvise(p, st.st_size, MADV_SEQUENTIAL);
+		map = (const uint8_t *)p;
+		mapSize = st.st_size;
+		mapOffset = sizeof(MAGIC);
+		return true;
+	}
+
+	lseek(fd, 0, SEEK_SET);
+	text = fdopen(fd, "r");
+	return text != NULL;
+}
+
+void CanLog::close() {
+	if (text) {
+		fclose(text);
+		text = NULL;
+	}
+	if (map) {
+		munmap((void *)map, mapSize);
+		map = NULL;
+	}
+	haveFirst = false;
+}
+
+bool CanLog::next(uint64_t &us, CANMessage &message) {
+	if (map) {
+		if (mapOffset + sizeof(Record) > mapSize) {
+			return false;
+		}
+		Record record;
+		memcpy(&record, map + mapOffset, sizeof(record));
+		mapOffset += sizeof(record);
+		us = record.us;
+		message = CANMessage();
+		message.id = record.id;
+		message.extended = record.flags & FLAG_EXTENDED;
+		message.rtr = record.flags & FLAG_RTR;
+		message.len = record.len;
+		memcpy(message.data, record.data, sizeof(message.data));
+		count++;
+		return true;
+	}
+
+	char line[256];
+	while (text && fgets(line, sizeof(line), text)) {
+		uint64_t at;
+		if (!parse(line, at, message)) {
+			skippedLines++;
+			continue;
+		}
+		if (!haveFirst) {
+			first = at;
+			haveFirst = true;
+		}
+		us = at - first;
+		count++;
+		return true;
+	}
+	return false;
+}
+
+// "(seconds.micros) interface id#data" with an 8-digit id for extended
+// frames and R for remote frames; CAN FD frames (##) are skipped
+bool CanLog::parse(const char *line, uint64_t &us, CANMessage &message) {
+	unsigned long long seconds, micros;
+	char interface[32], frame[64];
+	if (sscanf(line, " (%llu.%llu) %31s %63s", &seconds, &micros, interface, frame) != 4) {
+		return false;
+	}
+	us = seconds * 1000000ULL + micros;
+
+	const char *hash = strchr(frame, '#');
+	if (!hash || hash[1] == '#') {
+		return false;
+	}
+	size_t idLength = hash - frame;
+	message = CANMessage();
+	message.id = strtoul(frame, NULL, 16);
+	message.extended = idLength > 3;
+
+	const char *p = hash + 1;
+	if (*p == 'R' || *p == 'r') {
+		message.rtr = true;
+		return true;
+	}
+	while (isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1]) && message.len < 8) {
+		char byte[3] = { p[0], p[1], 0 };
+		message.data[message.len++] = strtoul(byte, NULL, 16);
+		p += 2;
+		if (*p == '.') {
+			p++;
+		}
+	}
+	return true;
+}
+
+bool CanLog::convert(const char *textPath, const char *binaryPath) {
+	CanLog in;
+	if (!in.open(textPath) || in.map) {
+		return false;
+	}
+	FILE *out = fopen(binaryPath, "wb");
+	if (!out) {
+		return false;
+	}
+	fwrite(MAGIC, 1, sizeof(MAGIC), out);
+	uint64_t us;
+	CANMessage message;
+	while (in.next(us, message)) {
+		Record record = {};
+		record.us = us;
+		record.id = message.id;
+		record.flags = (message.extended ? FLAG_EXTENDED : 0) | (message.rtr ? FLAG_RTR : 0);
+		record.len = message.len;
+		memcpy(record.data, message.data, sizeof(record.data));
+		fwrite(&record, sizeof(record), 1, out);
+	}
+	return fclose(out) == 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Reader for SocketCAN candump logs, to replay real captures on the
+ * virtual bus.
+ *
+ * Text logs are what `candump -l` writes, one frame per line:
+ *
+ *     (1436509052.249713) can0 7E8#0441057300000000
+ *
+ * convert() turns one into a flat binary file of fixed-size records,
+ * which open() maps into memory instead of parsing, for long captures
+ * replayed many times. The binary format is native-endian, a cache for
+ * the host that made it rather than an exchange format.
+ */
+
+#ifndef __CanLog_h
+#define __CanLog_h
+
+#include "application.h"
+
+class CanLog {
+public:
+	CanLog();
+	~CanLog();
+
+	// Text or binary, told apart by the binary file's magic
+	bool open(const char *path);
+	void close();
+	// Next frame and its time in us since the first frame of the log
+	bool next(uint64_t &us, CANMessage &message);
+
+	static bool convert(const char *textPath, const char *binaryPath);
+
+	uint64_t frames() const { return count; }
+	uint64_t skipped() const { return skippedLines; }
+
+private:
+	struct Record
+	{
+		uint64_t us;
+		uint32_t id;
+		uint8_t flags;
+		uint8_t len;
+		uint8_t data[8];
+		uint8_t reserved[2];
+	};
+
+	static const char MAGIC[8];
+	static const uint8_t FLAG_EXTENDED = 1;
+	static const uint8_t FLAG_RTR = 2;
+
+	bool parse(const char *line, uint64_t &us, CANMessage &message);
+
+	FILE *text;
+	const uint8_t *map;
+	size_t mapSize;
+	size_t mapOffset;
+	uint64_t first;
+	bool haveFirst;
+	uint64_t count;
+	uint64_t skippedLines;
+};
+
+#endif // def(__CanLog_h)
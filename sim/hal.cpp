@@ -0,0 +1,418 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The Particle API of application.h on top of the simulation in sim.h */
+
+#include "sim.h"
+#include <algorithm>
+#include <map>
+#include <time.h>
+
+namespace sim {
+
+uint64_t elapsed = 0;
+uint32_t startUtc = 1475323200; // 2016-10-01T12:00:00Z
+VirtualBus bus;
+NmeaFeeder gps(47.6062, -122.3321, startUtc);
+NackServer server;
+bool echoSerial = false;
+FILE *events = stdout;
+Stats stats;
+
+uint64_t now() {
+	return elapsed;
+}
+
+void advance(uint64_t us) {
+	elapsed += us;
+}
+
+uint64_t crankingUntil = 0;
+uint16_t chargingMillivolts = 14100;
+
+uint16_t batteryMillivolts() {
+	if (elapsed < crankingUntil) {
+		return 9800;
+	}
+	return bus.powered ? chargingMillivolts : 12500;
+}
+
+uint64_t canOnTotal = 0;
+uint64_t canOnSince = 0;
+bool canOn = false;
+
+uint64_t canOnUs() {
+	return canOnTotal + (canOn ? elapsed - canOnSince : 0);
+}
+
+} // namespace sim
+
+using sim::elapsed;
+
+USBSerial Serial;
+USARTSerial Serial1;
+CloudClass Particle;
+TimeClass Time;
+SystemClass System;
+EEPROMClass EEPROM;
+
+/*************** Time and pins ****************/
+
+unsigned long millis() {
+	elapsed += sim::POLL_COST_US;
+	return elapsed / 1000;
+}
+
+unsigned long micros() {
+	elapsed += sim::POLL_COST_US;
+	return elapsed;
+}
+
+void delay(unsigned long ms) {
+	elapsed += ms * 1000ULL;
+	sim::stats.sleptUs += ms * 1000ULL;
+}
+
+void pinMode(pin_t pin, PinMode mode) {
+	(void)pin;
+	(void)mode;
+}
+
+void digitalWrite(pin_t pin, uint8_t value) {
+	(void)pin;
+	(void)value;
+}
+
+// Only the battery divider on A1 is connected: 3.3 V full scale, 1/7.2
+int32_t analogRead(pin_t pin) {
+	if (pin != A1) {
+		return 0;
+	}
+	elapsed += sim::POLL_COST_US;
+	uint32_t noise = sim::bus.random() % 9;
+	int32_t counts = sim::batteryMillivolts() * 4096 / (3300 * 72 / 10);
+	return counts + noise - 4;
+}
+
+/*************** String ****************/
+
+String String::format(const char *fmt, ...) {
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	return String(buf);
+}
+
+int String::indexOf(char c, unsigned from) const {
+	size_t at = s.find(c, from);
+	return at == std::string::npos ? -1 : (int)at;
+}
+
+String String::substring(unsigned from, unsigned to) const {
+	if (from >= s.size()) {
+		return String();
+	}
+	return String(s.substr(from, to > s.size() ? std::string::npos : to - from));
+}
+
+/*************** CAN ****************/
+
+CANChannel::CANChannel(HAL_CAN_Channel channel, uint16_t rxQueueSize, uint16_t txQueueSize)
+	: baud(0), started(false), rxErrors(0), txErrors(0), since(0) {
+	(void)channel;
+	(void)rxQueueSize;
+	(void)txQueueSize;
+}
+
+void CANChannel::begin(unsigned long baud, uint32_t flags) {
+	(void)flags;
+	this->baud = baud;
+	started = true;
+	rxErrors = txErrors = 0;
+	sim::bus.flush(elapsed);
+	if (!sim::canOn) {
+		sim::canOn = true;
+		sim::canOnSince = elapsed;
+	}
+}
+
+void CANChannel::end() {
+	started = false;
+	if (sim::canOn) {
+		sim::canOnTotal += elapsed - sim::canOnSince;
+		sim::canOn = false;
+	}
+}
+
+uint8_t CANChannel::available() {
+	elapsed += sim::POLL_COST_US;
+	if (!started || baud != sim::bus.bitrate) {
+		return 0;
+	}
+	size_t due = sim::bus.due(elapsed);
+	return due > 255 ? 255 : due;
+}
+
+bool CANChannel::receive(CANMessage &message) {
+	elapsed += sim::POLL_COST_US;
+	if (!started) {
+		return false;
+	}
+	if (baud != sim::bus.bitrate) {
+		// Frames at another bitrate are only bit errors to the controller.
+		// It answers each with an error flag, which destroys the frame for
+		// the other nodes too, and their error flags then add 8 to the 1
+		// the error itself counted.
+		while (sim::bus.next(message, elapsed)) {
+			rxErrors = std::min(rxErrors + 9, 255u);
+			sim::stats.canErrorFrames++;
+		}
+		return false;
+	}
+
+	// The hardware queue holds 32 frames; older ones are lost if the
+	// firmware falls behind
+	while (sim::bus.due(elapsed) > 32) {
+		sim::bus.next(message, elapsed);
+		sim::stats.canDropped++;
+	}
+	if (!sim::bus.next(message, elapsed)) {
+		return false;
+	}
+	sim::stats.canReceived++;
+	if (rxErrors > 0) {
+		rxErrors--;
+	}
+	return true;
+}
+
+namespace {
+
+// Gaps over a second are pauses in driving, not jitter
+const uint64_t REQUEST_GAP_LIMIT_US = 1000000;
+
+void noteRequest(const CANMessage &message) {
+	static uint64_t last = 0;
+	if ((message.id != 0x7df && message.id != 0x18db33f1) || message.data[1] != 0x01) {
+		return;
+	}
+	uint64_t gap = elapsed - last;
+	if (sim::stats.obdRequests > 0 && gap < REQUEST_GAP_LIMIT_US) {
+		if (!sim::stats.requestGapMin || gap < sim::stats.requestGapMin) {
+			sim::stats.requestGapMin = gap;
+		}
+		if (gap > sim::stats.requestGapMax) {
+			sim::stats.requestGapMax = gap;
+		}
+	}
+	sim::stats.obdRequests++;
+	sim::stats.lastRequestAt = elapsed;
+	last = elapsed;
+}
+
+} // namespace
+
+bool CANChannel::transmit(const CANMessage &message) {
+	elapsed += sim::POLL_COST_US;
+	if (!started) {
+		return false;
+	}
+	sim::stats.canSent++;
+	noteRequest(message);
+	if (baud != sim::bus.bitrate || !sim::bus.transmit(message, elapsed)) {
+		// Nobody acknowledged it, and the controller resends it until its
+		// counter reaches error passive
+		txErrors = std::max(txErrors, 128u);
+	}
+	return true;
+}
+
+CANErrorStatus CANChannel::errorStatus() {
+	// Frames at another bitrate show up as errors, the others stay queued
+	if (baud != sim::bus.bitrate) {
+		CANMessage message;
+		receive(message);
+	}
+	return rxErrors >= 128 || txErrors >= 128 ? CAN_ERROR_PASSIVE : CAN_NO_ERROR;
+}
+
+/*************** Serial ****************/
+
+size_t Stream::write(const uint8_t *buf, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		write(buf[i]);
+	}
+	return len;
+}
+
+size_t Stream::readBytes(char *buf, size_t len) {
+	size_t n = 0;
+	int c;
+	while (n < len && (c = read()) >= 0) {
+		buf[n++] = c;
+	}
+	return n;
+}
+
+size_t Stream::printf(const char *fmt, ...) {
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	return write((const uint8_t *)buf, len < (int)sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+size_t USBSerial::write(uint8_t c) {
+	return write(&c, 1);
+}
+
+size_t USBSerial::write(const uint8_t *buf, size_t len) {
+	if (sim::echoSerial) {
+		fwrite(buf, 1, len, stderr);
+	}
+	return len;
+}
+
+int USARTSerial::available() {
+	elapsed += sim::POLL_COST_US;
+	return sim::gps.available(elapsed, baud);
+}
+
+int USARTSerial::read() {
+	return sim::gps.read(elapsed, baud);
+}
+
+/*************** Cloud ****************/
+
+namespace {
+
+const uint64_t CONNECT_US = 2000000;
+// Time from publish to the event reaching a subscriber
+const uint64_t PUBLISH_LATENCY_US = 250000;
+// The cloud accepts one publish a second on average, in bursts of up to 4,
+// and drops the rest
+const uint64_t PUBLISH_INTERVAL_US = 1000000;
+const uint64_t PUBLISH_BURST = 4;
+
+bool connecting = false;
+uint64_t connectAt = 0;
+// Time at which the rate limit's bucket is empty again
+uint64_t publishCredit = 0;
+std::map<std::string, int (*)(String)> functions;
+
+} // namespace
+
+bool CloudClass::publish(const char *name, const char *data, int ttl, PublishFlag flag) {
+	(void)flag;
+	if (!connected()) {
+		return false;
+	}
+	sim::stats.publishes++;
+	sim::stats.publishedBytes += strlen(data);
+	if (publishCredit < elapsed) {
+		publishCredit = elapsed;
+	}
+	if (publishCredit + PUBLISH_INTERVAL_US > elapsed + PUBLISH_BURST * PUBLISH_INTERVAL_US) {
+		sim::stats.publishOverruns++;
+		// Sent fine as far as the device can tell
+		return true;
+	}
+	publishCredit += PUBLISH_INTERVAL_US;
+	if (!sim::server.deliver(name, data, elapsed)) {
+		// Sent fine as far as the device can tell
+		return true;
+	}
+	if (!sim::events) {
+		return true;
+	}
+
+	// Same server-sent event format as the Particle event stream
+	uint64_t ms = sim::startUtc * 1000ULL + (elapsed + PUBLISH_LATENCY_US) / 1000;
+	time_t seconds = ms / 1000;
+	struct tm utc;
+	gmtime_r(&seconds, &utc);
+	char when[32];
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &utc);
+	fprintf(sim::events, "event: %s\ndata: {\"data\":\"%s\",\"ttl\":\"%d\",\"published_at\":\"%s.%03dZ\","
+		"\"coreid\":\"%024x\"}\n\n", name, data, ttl, when, (int)(ms % 1000), 0x51);
+	return true;
+}
+
+bool CloudClass::variable(const char *name, const int &value) {
+	(void)name;
+	(void)value;
+	return true;
+}
+
+bool CloudClass::variable(const char *name, const double &value) {
+	(void)name;
+	(void)value;
+	return true;
+}
+
+bool CloudClass::variable(const char *name, const String &value) {
+	(void)name;
+	(void)value;
+	return true;
+}
+
+bool CloudClass::variable(const char *name, const char *value) {
+	(void)name;
+	(void)value;
+	return true;
+}
+
+int sim::callFunction(const char *name, const char *argument) {
+	std::map<std::string, int (*)(String)>::iterator it = functions.find(name);
+	return it == functions.end() ? -1 : it->second(String(argument));
+}
+
+bool CloudClass::function(const char *name, int (*fn)(String)) {
+	functions[name] = fn;
+	return true;
+}
+
+void CloudClass::connect() {
+	if (!connecting) {
+		connecting = true;
+		connectAt = elapsed + CONNECT_US;
+	}
+}
+
+void CloudClass::disconnect() {
+	connecting = false;
+}
+
+bool CloudClass::connected() {
+	return connecting && elapsed >= connectAt;
+}
+
+bool TimeClass::isValid() {
+	return Particle.connected();
+}
+
+uint32_t TimeClass::now() {
+	return sim::startUtc + elapsed / 1000000;
+}
+
+uint32_t SystemClass::ticks() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
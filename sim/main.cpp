@@ -0,0 +1,408 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Runs the firmware on Linux against a simulated car.
+ *
+ * application.cpp and the libraries are built unmodified against the
+ * stand-in application.h in this directory. The virtual clock advances
+ * by --loop-us per loop() call, plus a microsecond per poll of the clock
+ * or a peripheral, so a run is deterministic for a given seed and takes
+ * a fraction of the simulated time. Published events are written to
+ * stdout in the Particle event stream format, so
+ *
+ *     carloop_sim --seconds 3600 | obd_ingest
+ *
+ * decodes them. The run summary goes to stderr.
+ *
+ * --replay plays a candump log of a real car on the bus instead of the
+ * simulated ECUs, from the start of the run, and runs until the log
+ * ends. The summary then adds the replayed frames per second of wall
+ * time, the bytes published per second of the drive, and how many
+ * publishes went over the cloud's rate limit. --speed 1 paces the run
+ * to real time, say for watching it live; by default it runs flat out.
+ * A log replayed many times can first be converted to a binary file,
+ * which is memory mapped rather than parsed:
+ *
+ *     carloop_sim --replay drive.log --convert drive.bin
+ *     carloop_sim --replay drive.bin --speed 1 | obd_ingest
+ *
+ * --j1939 puts a truck on a 250 kbps bus instead, broadcasting J1939
+ * rather than answering OBD requests, with filler traffic up to a fully
+ * loaded bus at --j1939 32.
+ *
+ * --park-at turns the engine off and --wake-at starts it again, cranking
+ * for 0.4 s first. The summary reports how busy the firmware was and how
+ * long CAN was on while parked, and the time from the engine starting to
+ * the first OBD request.
+ *
+ * Publishes over the cloud's rate limit never arrive. --loss also loses
+ * that fraction of the published events on the way to the stand-in
+ * server in nack_server.h, in runs of --loss-burst events. The server
+ * asks the firmware for the missing chunks again through its "nack"
+ * function, and the summary reports how many were recovered and the
+ * bytes the resent ones cost, apart from the chunks the firmware dropped
+ * over its publish budget before sending them.
+ *
+ * Build with:
+ *
+ *     g++ -std=c++11 -O2 -Isim -I. -o carloop_sim sim/main.cpp sim/hal.cpp \
+ *         sim/virtual_ecu.cpp sim/nmea_feeder.cpp sim/can_log.cpp sim/nack_server.cpp \
+ *         application.cpp carloop.cpp TinyGPS++.cpp ubx.cpp record_buffer.cpp geodesy.cpp \
+ *         position_encoder.cpp track_simplifier.cpp time_base.cpp power_manager.cpp \
+ *         latency_stats.cpp scheduler.cpp ecu_tracker.cpp derived_signals.cpp \
+ *         burst_capture.cpp j1939_decoder.cpp dtc_reader.cpp retransmit_buffer.cpp
+ *
+ * Add -DGPS_UBX to simulate firmware built for a u-blox module sending
+ * UBX at 115200 baud instead of NMEA at 9600.
+ */
+
+#include "sim.h"
+#include "can_log.h"
+#include "retransmit_buffer.h"
+#include <chrono>
+#include <thread>
+
+// application.cpp's, for the chunks it had to drop before sending them
+extern RetransmitBuffer retransmit;
+
+namespace {
+
+struct Options
+{
+	double seconds;
+	uint32_t seed;
+	int ecus;
+	double latencyMs;
+	double jitterMs;
+	int noise;
+	unsigned long bitrate;
+	bool extended;
+	double parkAt;
+	double wakeAt;
+	double brakeAt;
+	uint32_t loopUs;
+	bool gps;
+	const char *replay;
+	const char *convert;
+	double speed;
+	int j1939;
+	double dtcAt;
+	double loss;
+	unsigned lossBurst;
+};
+
+void usage() {
+	fprintf(stderr,
+		"usage: carloop_sim [options]\n"
+		"  --seconds S     simulated time to run (3600, or the replayed log)\n"
+		"  --seed N        random seed for reply jitter and ADC noise (1)\n"
+		"  --ecus N        ECUs answering OBD requests, 0-2 (2, 0 with --replay or --j1939)\n"
+		"  --latency MS    ECU reply latency (8)\n"
+		"  --jitter MS     random extra reply latency, up to (4)\n"
+		"  --noise N       periodic broadcast frames on the bus, 0-6 (3, 0 with --replay or --j1939)\n"
+		"  --bitrate BPS   bus bitrate (500000, 250000 with --j1939)\n"
+		"  --29bit         29-bit OBD addressing\n"
+		"  --park-at S     turn the engine off after S seconds\n"
+		"  --wake-at S     and start it again after S seconds\n"
+		"  --brake-at S    brake hard to a standstill after S seconds\n"
+		"  --dtc-at S      store 3 DTCs and turn the MIL on after S seconds\n"
+		"  --loop-us US    virtual time per loop() call (1000)\n"
+		"  --no-gps        no NMEA sentences on Serial1\n"
+		"  --serial        echo the firmware's Serial output on stderr\n"
+		"  --replay FILE   play a candump log, text or converted, on the bus\n"
+		"  --convert OUT   convert the --replay log to binary and exit\n"
+		"  --speed X       with --replay, run at X times real time (flat out)\n"
+		"  --j1939 N       a truck's J1939 broadcasts, plus N filler PGNs every 20 ms\n"
+		"                  on the bus; 32 load it fully\n"
+		"  --loss P        lose this fraction of the published events (0)\n"
+		"  --loss-burst N  events lost in a row each time (1)\n");
+}
+
+bool parse(int argc, char **argv, Options &options) {
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if (!strcmp(arg, "--29bit")) {
+			options.extended = true;
+			continue;
+		} else if (!strcmp(arg, "--no-gps")) {
+			options.gps = false;
+			continue;
+		} else if (!strcmp(arg, "--serial")) {
+			sim::echoSerial = true;
+			continue;
+		}
+
+		if (i + 1 >= argc) {
+			return false;
+		}
+		const char *value = argv[++i];
+		if (!strcmp(arg, "--seconds")) {
+			options.seconds = atof(value);
+		} else if (!strcmp(arg, "--seed")) {
+			options.seed = strtoul(value, NULL, 0);
+		} else if (!strcmp(arg, "--ecus")) {
+			options.ecus = atoi(value);
+		} else if (!strcmp(arg, "--latency")) {
+			options.latencyMs = atof(value);
+		} else if (!strcmp(arg, "--jitter")) {
+			options.jitterMs = atof(value);
+		} else if (!strcmp(arg, "--noise")) {
+			options.noise = atoi(value);
+		} else if (!strcmp(arg, "--bitrate")) {
+			options.bitrate = strtoul(value, NULL, 0);
+		} else if (!strcmp(arg, "--park-at")) {
+			options.parkAt = atof(value);
+		} else if (!strcmp(arg, "--wake-at")) {
+			options.wakeAt = atof(value);
+		} else if (!strcmp(arg, "--brake-at")) {
+			options.brakeAt = atof(value);
+		} else if (!strcmp(arg, "--dtc-at")) {
+			options.dtcAt = atof(value);
+		} else if (!strcmp(arg, "--loop-us")) {
+			options.loopUs = strtoul(value, NULL, 0);
+		} else if (!strcmp(arg, "--replay")) {
+			options.replay = value;
+		} else if (!strcmp(arg, "--convert")) {
+			options.convert = value;
+		} else if (!strcmp(arg, "--speed")) {
+			options.speed = atof(value);
+		} else if (!strcmp(arg, "--j1939")) {
+			options.j1939 = atoi(value);
+		} else if (!strcmp(arg, "--loss")) {
+			options.loss = atof(value);
+		} else if (!strcmp(arg, "--loss-burst")) {
+			options.lossBurst = strtoul(value, NULL, 0);
+		} else {
+			return false;
+		}
+	}
+	if (options.seconds < 0) {
+		options.seconds = options.replay ? 0 : 3600;
+	}
+	bool car = !options.replay && options.j1939 < 0;
+	if (options.ecus < 0) {
+		options.ecus = car ? 2 : 0;
+	}
+	if (options.noise < 0) {
+		options.noise = car ? 3 : 0;
+	}
+	if (!options.bitrate) {
+		options.bitrate = options.j1939 >= 0 ? 250000 : 500000;
+	}
+	return options.loopUs > 0 && options.lossBurst > 0 && (options.replay || !options.convert) &&
+		(!options.wakeAt || options.wakeAt > options.parkAt);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+	// Negative until parse() knows whether this is a replay
+	Options options = { -1, 1, -1, 8, 4, -1, 0, false, 0, 0, 0, 1000, true, NULL, NULL, 0, -1, 0, 0, 1 };
+	if (!parse(argc, argv, options)) {
+		usage();
+		return 2;
+	}
+
+	if (options.convert) {
+		if (!CanLog::convert(options.replay, options.convert)) {
+			fprintf(stderr, "can't convert %s to %s\n", options.replay, options.convert);
+			return 1;
+		}
+		return 0;
+	}
+	CanLog log;
+	if (options.replay && !log.open(options.replay)) {
+		fprintf(stderr, "can't open %s\n", options.replay);
+		return 1;
+	}
+
+	sim::bus = VirtualBus(options.seed);
+	sim::bus.bitrate = options.bitrate;
+	uint32_t latency = options.latencyMs * 1000;
+	uint32_t jitter = options.jitterMs * 1000;
+	uint32_t engineId = options.extended ? 0x18daf110 : 0x7e8;
+	uint32_t transmissionId = options.extended ? 0x18daf118 : 0x7e9;
+	if (options.ecus >= 1) {
+		VirtualEcu engine = VirtualEcu::fromTrace(engineId, latency, jitter);
+		// EVAP system small leak, pending from the start
+		engine.setDtcs(0x07, std::vector<uint16_t>(1, 0x0442));
+		sim::bus.addEcu(engine);
+	}
+	if (options.ecus >= 2) {
+		sim::bus.addEcu(VirtualEcu::transmission(transmissionId, latency + 2000, jitter));
+	}
+	sim::bus.addNoise(options.noise);
+	if (options.j1939 >= 0) {
+		sim::bus.addTruck(options.j1939);
+	}
+	if (options.replay) {
+		sim::bus.replay(&log, 0);
+	}
+	sim::gps.enabled = options.gps;
+#ifdef GPS_UBX
+	// The module the firmware was built for
+	sim::gps.ubx = true;
+#endif
+	sim::server = NackServer(options.seed);
+	sim::server.setLoss(options.loss, options.lossBurst);
+
+	static char outBuffer[1 << 16];
+	setvbuf(stdout, outBuffer, _IOFBF, sizeof(outBuffer));
+
+	// 53 km/h, the speed in the README trace
+	const double driving = 53 / 3.6;
+	// A replay runs until a second after its last frame, unless told otherwise
+	uint64_t end = options.seconds > 0 ? options.seconds * 1e6 : UINT64_MAX;
+	uint64_t parkAt = options.parkAt * 1e6;
+	uint64_t wakeAt = options.wakeAt * 1e6;
+	// The starter runs this long before the engine and the bus come up
+	const uint64_t cranking = 400000;
+	// By then the firmware has parked, whichever timeout applies
+	const uint64_t parkedAfter = 70000000;
+	uint64_t parkedFrom = parkAt + parkedAfter;
+	uint64_t parkedTo = wakeAt ? wakeAt : end;
+	bool parkedStarted = false;
+	bool parkedDone = false;
+	uint64_t sleptParked = 0;
+	uint64_t canOnParked = 0;
+	uint64_t requestsAtWake = 0;
+	uint64_t wokeAt = 0;
+	uint64_t brakeAt = options.brakeAt * 1e6;
+	uint64_t dtcAt = options.dtcAt * 1e6;
+	bool stopped = false;
+	bool faulty = false;
+	uint64_t loops = 0;
+	auto begin = std::chrono::steady_clock::now();
+
+	setup();
+	while (sim::now() < end) {
+		bool running = !parkAt || sim::now() < parkAt || (wakeAt && sim::now() >= wakeAt + cranking);
+		sim::bus.powered = running;
+		if (parkAt && !parkedDone && sim::now() >= parkedFrom) {
+			// Idle and CAN time over the parked span, from its two ends
+			if (!parkedStarted) {
+				sleptParked = sim::stats.sleptUs;
+				canOnParked = sim::canOnUs();
+				parkedStarted = true;
+			} else if (sim::now() >= parkedTo) {
+				sleptParked = sim::stats.sleptUs - sleptParked;
+				canOnParked = sim::canOnUs() - canOnParked;
+				parkedTo = sim::now();
+				parkedDone = true;
+			}
+		}
+		if (wakeAt && sim::now() >= wakeAt && !sim::crankingUntil) {
+			sim::crankingUntil = wakeAt + cranking;
+			requestsAtWake = sim::stats.obdRequests;
+		}
+		if (sim::crankingUntil && !wokeAt && sim::stats.obdRequests > requestsAtWake) {
+			wokeAt = sim::stats.lastRequestAt;
+		}
+		bool braked = brakeAt && sim::now() >= brakeAt;
+		sim::gps.speed = running && !braked ? driving : 0;
+		if (braked && !stopped) {
+			// The ECUs report standing still from now on
+			const uint8_t zero = 0;
+			for (int i = 0; i < options.ecus; i++) {
+				sim::bus.ecu(i).set(0x0d, &zero, 1, 0);
+				sim::bus.ecu(i).set(0x0d, &zero, 1, 1);
+			}
+			stopped = true;
+		}
+		if (dtcAt && sim::now() >= dtcAt && !faulty && options.ecus >= 1) {
+			// Misfire, catalyst and lean codes stored with the MIL on,
+			// random misfire pending
+			static const uint16_t stored[] = { 0x0301, 0x0420, 0x0171 };
+			static const uint16_t pending[] = { 0x0442, 0x0300 };
+			const uint8_t mil[] = { 0x80 | 3, 0x07, 0xe5, 0x00 };
+			sim::bus.ecu(0).setDtcs(0x03, std::vector<uint16_t>(stored, stored + 3));
+			sim::bus.ecu(0).setDtcs(0x07, std::vector<uint16_t>(pending, pending + 2));
+			sim::bus.ecu(0).set(0x01, mil, sizeof(mil), 0);
+			sim::bus.ecu(0).set(0x01, mil, sizeof(mil), 1);
+			faulty = true;
+		}
+		loop();
+		sim::server.update(sim::now());
+		sim::advance(options.loopUs);
+		loops++;
+
+		if (options.replay && end == UINT64_MAX && sim::bus.replayDone()) {
+			end = sim::bus.replayEnd() + 1000000;
+		}
+		if (options.speed > 0) {
+			std::this_thread::sleep_until(begin + std::chrono::microseconds(
+				(uint64_t)(sim::now() / options.speed)));
+		}
+	}
+	fflush(stdout);
+	sim::server.finish();
+
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	double simulated = sim::now() / 1e6;
+	fprintf(stderr, "simulated %.1f s in %.3f s, %.0fx real time, %llu loops\n",
+		simulated, wall, simulated / wall, (unsigned long long)loops);
+	fprintf(stderr, "can sent %llu received %llu dropped %llu error frames %llu\n",
+		(unsigned long long)sim::stats.canSent, (unsigned long long)sim::stats.canReceived,
+		(unsigned long long)sim::stats.canDropped, (unsigned long long)sim::stats.canErrorFrames);
+	fprintf(stderr, "published %llu events, %llu bytes, %llu over the rate limit\n",
+		(unsigned long long)sim::stats.publishes, (unsigned long long)sim::stats.publishedBytes,
+		(unsigned long long)sim::stats.publishOverruns);
+	fprintf(stderr, "busy %.1f%% of the time, obd requests %llu every %.1f-%.1f ms\n",
+		100.0 * (sim::now() - sim::stats.sleptUs) / sim::now(),
+		(unsigned long long)sim::stats.obdRequests, sim::stats.requestGapMin / 1e3,
+		sim::stats.requestGapMax / 1e3);
+	fprintf(stderr, "gps sent %llu bytes, dropped %llu\n",
+		(unsigned long long)sim::gps.sent(), (unsigned long long)sim::gps.dropped());
+	const NackServer::Stats &server = sim::server.stats();
+	if (server.lost || server.resent || server.corrupt || server.unrecovered || retransmit.dropped()) {
+		uint64_t first = server.chunkBytes - server.resentBytes;
+		fprintf(stderr, "lost %llu chunk events, %llu failed the crc, recovered %llu of %llu chunks, "
+			"%llu unrecovered, %llu nacks; resent %llu chunks, %llu bytes, %.1f%% overhead\n",
+			(unsigned long long)server.lost, (unsigned long long)server.corrupt,
+			(unsigned long long)server.recovered,
+			(unsigned long long)(server.received + server.unrecovered),
+			(unsigned long long)server.unrecovered, (unsigned long long)server.nacks,
+			(unsigned long long)server.resent, (unsigned long long)server.resentBytes,
+			first ? 100.0 * server.resentBytes / first : 0);
+		fprintf(stderr, "dropped %lu chunks on the device over the publish budget, never sent\n",
+			(unsigned long)retransmit.dropped());
+	}
+	if (parkedStarted) {
+		if (!parkedDone) {
+			sleptParked = sim::stats.sleptUs - sleptParked;
+			canOnParked = sim::canOnUs() - canOnParked;
+			parkedTo = sim::now();
+		}
+		uint64_t parked = parkedTo - parkedFrom;
+		fprintf(stderr, "parked %.1f s from %.0f s after the engine stopped: busy %.2f%% of the time, "
+			"can on %.1f%%\n", parked / 1e6, parkedAfter / 1e6,
+			parked ? 100.0 * (parked - sleptParked) / parked : 0,
+			parked ? 100.0 * canOnParked / parked : 0);
+	}
+	if (wakeAt && wokeAt) {
+		fprintf(stderr, "first obd request %.3f s after starting the engine\n", (wokeAt - wakeAt) / 1e6);
+	} else if (wakeAt && sim::now() > wakeAt) {
+		fprintf(stderr, "no obd request after starting the engine\n");
+	}
+	if (options.replay) {
+		double drive = sim::bus.replayEnd() / 1e6;
+		fprintf(stderr, "replayed %llu frames (%llu lines skipped) in %.3f s, %.0f frames/s; "
+			"%.1f s of driving, %.1f published bytes/s\n",
+			(unsigned long long)log.frames(), (unsigned long long)log.skipped(), wall,
+			log.frames() / wall, drive, drive > 0 ? sim::stats.publishedBytes / drive : 0);
+	}
+	return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nack_server.h"
+#include "sim.h"
+#include "record_buffer.h"
+#include <string>
+#include <vector>
+
+namespace {
+
+const uint64_t NACK_INTERVAL_US = 1000000;
+// Time for events published before the gap showed to arrive
+const uint64_t NACK_DELAY_US = 1000000;
+// Time for the device to resend, one chunk a second, before asking again
+const uint64_t NACK_RETRY_US = 10000000;
+const int NACK_TRIES = 3;
+// Particle function arguments are up to 63 characters
+const size_t MAX_NACK_LENGTH = 63;
+
+const char en85[] =
+	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz!#$%&()*+-;<=>?@^_`{|}~";
+
+// Whole 5-character groups, -1 on a character outside the alphabet
+int decode85(uint8_t *out, size_t outSize, const char *in) {
+	size_t n = 0;
+	size_t len = strlen(in);
+	for (size_t i = 0; i + 5 <= len && n + 4 <= outSize; i += 5) {
+		uint32_t acc = 0;
+		for (int j = 0; j < 5; j++) {
+			const char *digit = strchr(en85, in[i + j]);
+			if (!digit || !in[i + j]) {
+				return -1;
+			}
+			acc = acc * 85 + (digit - en85);
+		}
+		out[n++] = acc >> 24;
+		out[n++] = acc >> 16;
+		out[n++] = acc >> 8;
+		out[n++] = acc;
+	}
+	return n;
+}
+
+} // namespace
+
+NackServer::NackServer(uint32_t seed)
+	: lossRate(0), lossBurst(1), losing(0), rng(seed ? seed : 1), started(false), expected(0),
+	nextNack(0), counts() {
+}
+
+bool NackServer::deliver(const char *name, const char *data, uint64_t now) {
+	bool chunk = !strcmp(name, "m") || !strcmp(name, "b");
+	if (lose()) {
+		if (chunk) {
+			counts.lost++;
+		}
+		return false;
+	}
+	if (!chunk) {
+		return true;
+	}
+
+	uint8_t bytes[RecordBuffer::ENCODED_SIZE];
+	int len = decode85(bytes, sizeof(bytes), data);
+	if (len < (int)RecordBuffer::HEADER_SIZE ||
+			(bytes[0] & ~RecordBuffer::VERSION_RESENT) != RecordBuffer::VERSION) {
+		counts.corrupt++;
+		return true;
+	}
+	// The padding is already in, the CRC field counts as zero
+	uint16_t crc = (bytes[3] << 8) | bytes[4];
+	bytes[3] = bytes[4] = 0;
+	if (RecordBuffer::crc16(bytes, len) != crc) {
+		counts.corrupt++;
+		return true;
+	}
+
+	counts.chunkBytes += strlen(data);
+	if (bytes[0] & RecordBuffer::VERSION_RESENT) {
+		counts.resent++;
+		counts.resentBytes += strlen(data);
+	}
+	uint16_t sequence = RecordBuffer::sequence(bytes);
+	if (!started || (int16_t)(sequence - expected) >= 0) {
+		// The device starts from 0 at boot, so a first chunk past it
+		// means the ones before were lost
+		for (uint16_t missed = expected; missed != sequence; missed++) {
+			Gap gap = { now, 0, 0 };
+			missing[missed] = gap;
+		}
+		expected = sequence + 1;
+		started = true;
+		counts.received++;
+	} else if (missing.erase(sequence)) {
+		counts.recovered++;
+		counts.received++;
+	}
+	return true;
+}
+
+void NackServer::update(uint64_t now) {
+	if (now < nextNack || missing.empty()) {
+		return;
+	}
+	nextNack = now + NACK_INTERVAL_US;
+	if (!Particle.connected()) {
+		return;
+	}
+
+	std::vector<uint16_t> due;
+	std::map<uint16_t, Gap>::iterator it = missing.begin();
+	while (it != missing.end()) {
+		Gap &gap = it->second;
+		if (now - gap.noticed < NACK_DELAY_US || (gap.tries && now - gap.nacked < NACK_RETRY_US)) {
+			++it;
+		} else if (gap.tries >= NACK_TRIES) {
+			counts.unrecovered++;
+			missing.erase(it++);
+		} else {
+			due.push_back(it->first);
+			++it;
+		}
+	}
+
+	// Consecutive sequence numbers go as one range, the rest next time
+	std::string ranges;
+	for (size_t i = 0; i < due.size(); ) {
+		size_t j = i;
+		while (j + 1 < due.size() && due[j + 1] == due[j] + 1) {
+			j++;
+		}
+		std::string range = std::to_string(due[i]);
+		if (j > i) {
+			range += "-" + std::to_string(due[j]);
+		}
+		if (ranges.size() + range.size() + 1 > MAX_NACK_LENGTH) {
+			break;
+		}
+		ranges += (ranges.empty() ? "" : ",") + range;
+		for (; i <= j; i++) {
+			Gap &gap = missing[due[i]];
+			gap.nacked = now;
+			gap.tries++;
+		}
+	}
+	if (!ranges.empty()) {
+		sim::callFunction("nack", ranges.c_str());
+		counts.nacks++;
+	}
+}
+
+void NackServer::finish() {
+	counts.unrecovered += missing.size();
+	missing.clear();
+}
+
+bool NackServer::lose() {
+	if (losing > 0) {
+		losing--;
+		return true;
+	}
+	if (lossRate <= 0 || random() >= lossRate * 4294967296.0) {
+		return false;
+	}
+	losing = lossBurst - 1;
+	return true;
+}
+
+// xorshift32, apart from the bus's so loss doesn't change its jitter
+uint32_t NackServer::random() {
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
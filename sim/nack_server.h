@@ -0,0 +1,86 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Stand-in for the server end of the publish round trip.
+ *
+ * Every event the device publishes goes through deliver(), which loses
+ * some on the way: each with probability rate, and the burst - 1 events
+ * after a lost one along with it. The "m" and "b" chunks that arrive are
+ * decoded and their CRCs checked, and gaps in their sequence numbers are
+ * noted. update() then calls the firmware's "nack" function for them,
+ * as a server would through the Particle API: a second after the gap
+ * shows, to let stragglers in, and again every 10 s for up to 3 tries
+ * before giving up on a chunk.
+ */
+
+#ifndef __NackServer_h
+#define __NackServer_h
+
+#include "application.h"
+#include <map>
+
+class NackServer {
+public:
+	explicit NackServer(uint32_t seed = 1);
+
+	void setLoss(double rate, unsigned burst) { lossRate = rate; lossBurst = burst; }
+
+	// An event published at now, false when it is lost on the way
+	bool deliver(const char *name, const char *data, uint64_t now);
+	// Sends the NACKs that are due
+	void update(uint64_t now);
+	// Gives up on the chunks still missing at the end of the run
+	void finish();
+
+	struct Stats
+	{
+		uint64_t lost;        // chunk events lost on the way, resent ones too
+		uint64_t received;    // sequence numbers received
+		uint64_t recovered;   // received only once resent
+		uint64_t unrecovered; // never received
+		uint64_t resent;      // resent chunks received, wanted or not
+		uint64_t resentBytes;
+		uint64_t chunkBytes;  // of all chunks received, resent ones too
+		uint64_t corrupt;     // failed the CRC
+		uint64_t nacks;       // calls of the "nack" function
+	};
+
+	const Stats &stats() const { return counts; }
+
+private:
+	struct Gap
+	{
+		uint64_t noticed;
+		uint64_t nacked;
+		int tries;
+	};
+
+	bool lose();
+	uint32_t random();
+
+	double lossRate;
+	unsigned lossBurst;
+	unsigned losing;
+	uint32_t rng;
+
+	bool started;
+	uint16_t expected;
+	std::map<uint16_t, Gap> missing;
+	uint64_t nextNack;
+	Stats counts;
+};
+
+#endif // def(__NackServer_h)
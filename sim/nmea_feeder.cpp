@@ -0,0 +1,175 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nmea_feeder.h"
+#include "ubx.h"
+#include <time.h>
+
+namespace {
+
+const double EARTH_RADIUS = 6371008.8;
+const double PI = 3.14159265358979323846;
+const double KNOTS_PER_MPS = 1.943844;
+
+void formatDegrees(char *out, size_t size, double deg, bool lat) {
+	char hemisphere = lat ? (deg < 0 ? 'S' : 'N') : (deg < 0 ? 'W' : 'E');
+	deg = fabs(deg);
+	int whole = (int)deg;
+	double minutes = (deg - whole) * 60;
+	snprintf(out, size, lat ? "%02d%08.5f,%c" : "%03d%08.5f,%c", whole, minutes, hemisphere);
+}
+
+// UBX fields are little-endian
+void put16(uint8_t *out, size_t offset, uint16_t value) {
+	out[offset] = value & 0xff;
+	out[offset + 1] = value >> 8;
+}
+
+void put32(uint8_t *out, size_t offset, uint32_t value) {
+	put16(out, offset, value & 0xffff);
+	put16(out, offset + 2, value >> 16);
+}
+
+} // namespace
+
+NmeaFeeder::NmeaFeeder(double lat, double lng, uint32_t startUtc)
+	: enabled(true), ubx(false), speed(0), lat(lat), lng(lng), course(0), startUtc(startUtc),
+	  nextFix(1000000), fixes(0), lineFree(0), rxHead(0), rxCount(0),
+	  droppedBytes(0), sentBytes(0) {
+}
+
+int NmeaFeeder::available(uint64_t now, unsigned long baud) {
+	generate(now, baud);
+	while (!wire.empty() && wire.front().first <= now) {
+		if (rxCount < sizeof(rx)) {
+			rx[(rxHead + rxCount++) % sizeof(rx)] = wire.front().second;
+		} else {
+			droppedBytes++;
+		}
+		wire.pop_front();
+	}
+	return rxCount;
+}
+
+int NmeaFeeder::read(uint64_t now, unsigned long baud) {
+	if (!available(now, baud)) {
+		return -1;
+	}
+	char c = rx[rxHead];
+	rxHead = (rxHead + 1) % sizeof(rx);
+	rxCount--;
+	return (uint8_t)c;
+}
+
+void NmeaFeeder::generate(uint64_t now, unsigned long baud) {
+	while (enabled && nextFix <= now) {
+		move(1);
+		fixes++;
+
+		time_t t = startUtc + nextFix / 1000000;
+		if (ubx) {
+			ubxFix(t, nextFix, baud);
+			nextFix += 1000000;
+			continue;
+		}
+		struct tm utc;
+		gmtime_r(&t, &utc);
+		char when[32], date[32], latText[32], lngText[32];
+		snprintf(when, sizeof(when), "%02d%02d%02d.00", utc.tm_hour, utc.tm_min, utc.tm_sec);
+		snprintf(date, sizeof(date), "%02d%02d%02d", utc.tm_mday, utc.tm_mon + 1, utc.tm_year % 100);
+		formatDegrees(latText, sizeof(latText), lat, true);
+		formatDegrees(lngText, sizeof(lngText), lng, false);
+
+		char body[160];
+		snprintf(body, sizeof(body), "GPGGA,%s,%s,%s,1,08,0.9,45.0,M,-17.0,M,,",
+			when, latText, lngText);
+		sentence(body, nextFix, baud);
+		snprintf(body, sizeof(body), "GPRMC,%s,A,%s,%s,%.2f,%.2f,%s,,,A",
+			when, latText, lngText, speed * KNOTS_PER_MPS, course, date);
+		sentence(body, nextFix, baud);
+
+		nextFix += 1000000;
+	}
+}
+
+void NmeaFeeder::sentence(const char *body, uint64_t at, unsigned long baud) {
+	uint8_t checksum = 0;
+	for (const char *p = body; *p; p++) {
+		checksum ^= *p;
+	}
+	char line[176];
+	int len = snprintf(line, sizeof(line), "$%s*%02X\r\n", body, checksum);
+	transmit((const uint8_t *)line, len, at, baud);
+}
+
+void NmeaFeeder::ubxFix(time_t t, uint64_t at, unsigned long baud) {
+	struct tm utc;
+	gmtime_r(&t, &utc);
+	uint8_t pvt[92] = { 0 };
+	uint8_t dop[18] = { 0 };
+	uint32_t iTow = (utc.tm_wday * 86400 + utc.tm_hour * 3600 + utc.tm_min * 60 + utc.tm_sec) * 1000;
+	put32(pvt, 0, iTow);
+	put16(pvt, 4, utc.tm_year + 1900);
+	pvt[6] = utc.tm_mon + 1;
+	pvt[7] = utc.tm_mday;
+	pvt[8] = utc.tm_hour;
+	pvt[9] = utc.tm_min;
+	pvt[10] = utc.tm_sec;
+	pvt[11] = 0x07; // valid date, time, fully resolved
+	pvt[20] = 3; // 3D fix
+	pvt[21] = 0x01; // gnssFixOK
+	pvt[23] = 8; // satellites
+	put32(pvt, 24, (int32_t)lround(lng * 1e7));
+	put32(pvt, 28, (int32_t)lround(lat * 1e7));
+	put32(pvt, 32, 62000); // height above the ellipsoid, mm
+	put32(pvt, 36, 45000); // above mean sea level
+	put32(pvt, 60, (int32_t)lround(speed * 1000)); // ground speed, mm/s
+	put32(pvt, 64, (int32_t)lround(course * 1e5)); // heading of motion
+	put16(pvt, 76, 150); // pDOP
+	put32(dop, 0, iTow);
+	put16(dop, 6, 150); // pDOP
+	put16(dop, 10, 120); // vDOP
+	put16(dop, 12, 90); // hDOP
+
+	uint8_t frame[UbxParser::MAX_PAYLOAD + 8];
+	transmit(frame, UbxParser::frame(frame, UbxParser::CLASS_NAV, UbxParser::NAV_PVT, pvt, sizeof(pvt)),
+		at, baud);
+	transmit(frame, UbxParser::frame(frame, UbxParser::CLASS_NAV, UbxParser::NAV_DOP, dop, sizeof(dop)),
+		at, baud);
+}
+
+void NmeaFeeder::transmit(const uint8_t *bytes, size_t len, uint64_t at, unsigned long baud) {
+	// 10 bits per byte on the wire, back to back after the previous message
+	uint64_t byteUs = 10000000ULL / (baud ? baud : 9600);
+	uint64_t t = at > lineFree ? at : lineFree;
+	for (size_t i = 0; i < len; i++) {
+		t += byteUs;
+		wire.push_back(std::make_pair(t, (char)bytes[i]));
+	}
+	lineFree = t;
+	sentBytes += len;
+}
+
+void NmeaFeeder::move(double seconds) {
+	// A minute straight, then 30 s turning right at 3 degrees per second
+	if (fixes % 90 >= 60) {
+		course = fmod(course + 3 * seconds, 360);
+	}
+	double distance = speed * seconds;
+	double heading = course * PI / 180;
+	lat += distance * cos(heading) / EARTH_RADIUS * 180 / PI;
+	lng += distance * sin(heading) / (EARTH_RADIUS * cos(lat * PI / 180)) * 180 / PI;
+}
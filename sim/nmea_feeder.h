@@ -0,0 +1,72 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Simulated NMEA GPS module on Serial1.
+ *
+ * Once a second it sends a GGA and an RMC sentence for a car driving
+ * straight for a minute, then turning 90 degrees over 30 s, at the
+ * speed it is given. With ubx set, it sends the same fix as a
+ * UBX-NAV-PVT and a UBX-NAV-DOP frame like a u-blox module would. Bytes
+ * arrive at the serial baud rate into a 64-byte receive buffer like the
+ * real UART's; bytes arriving while the buffer is full are dropped.
+ */
+
+#ifndef __NmeaFeeder_h
+#define __NmeaFeeder_h
+
+#include "application.h"
+#include <deque>
+#include <time.h>
+
+class NmeaFeeder {
+public:
+	NmeaFeeder(double lat, double lng, uint32_t startUtc);
+
+	bool enabled;
+	bool ubx;
+	// Current ground speed, m/s
+	double speed;
+
+	int available(uint64_t now, unsigned long baud);
+	int read(uint64_t now, unsigned long baud);
+
+	uint64_t dropped() const { return droppedBytes; }
+	uint64_t sent() const { return sentBytes; }
+
+private:
+	void generate(uint64_t now, unsigned long baud);
+	void sentence(const char *body, uint64_t at, unsigned long baud);
+	void ubxFix(time_t t, uint64_t at, unsigned long baud);
+	void transmit(const uint8_t *bytes, size_t len, uint64_t at, unsigned long baud);
+	void move(double seconds);
+
+	double lat;
+	double lng;
+	double course;
+	uint32_t startUtc;
+	uint64_t nextFix;
+	uint32_t fixes;
+	uint64_t lineFree;
+
+	std::deque<std::pair<uint64_t, char> > wire;
+	char rx[USARTSerial::RX_BUFFER_SIZE];
+	size_t rxHead;
+	size_t rxCount;
+	uint64_t droppedBytes;
+	uint64_t sentBytes;
+};
+
+#endif // def(__NmeaFeeder_h)
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Control side of the host simulation: the virtual clock, the simulated
+ * car behind the HAL in application.h, and counters for reports.
+ */
+
+#ifndef __Sim_h
+#define __Sim_h
+
+#include "application.h"
+#include "virtual_ecu.h"
+#include "nmea_feeder.h"
+#include "nack_server.h"
+
+namespace sim {
+
+// Microseconds since the simulation started
+uint64_t now();
+void advance(uint64_t us);
+
+// Charged to every read of the clock or poll of a peripheral, so that
+// firmware busy-waiting on millis() makes progress
+const uint64_t POLL_COST_US = 1;
+
+// UTC at the start of the simulation, Unix seconds
+extern uint32_t startUtc;
+
+extern VirtualBus bus;
+extern NmeaFeeder gps;
+// Loses published events and asks for the missing chunks again
+extern NackServer server;
+
+// Where published events go, stdout unless changed, NULL to drop them
+extern FILE *events;
+
+// Echo what the firmware writes to Serial on stderr
+extern bool echoSerial;
+
+// Calls a function registered with Particle.function(), -1 if there is none
+int callFunction(const char *name, const char *argument);
+
+// Battery voltage the ADC sees: charging at chargingMillivolts while the
+// engine runs, sagging while the starter cranks it until crankingUntil
+uint16_t batteryMillivolts();
+extern uint64_t crankingUntil;
+extern uint16_t chargingMillivolts;
+
+// Time the CAN controller has been on
+uint64_t canOnUs();
+
+struct Stats
+{
+	uint64_t canSent;
+	uint64_t canReceived;
+	uint64_t canDropped;
+	// Error flags the controller put on the bus, each destroying a frame
+	uint64_t canErrorFrames;
+	uint64_t publishes;
+	uint64_t publishedBytes;
+	// Publishes over the cloud's rate limit, which a device would lose
+	uint64_t publishOverruns;
+	uint64_t gpsBytes;
+	uint64_t gpsDropped;
+	// Time the firmware spent in delay(), idle on a device
+	uint64_t sleptUs;
+	// Spacing of consecutive OBD requests while driving, to see how
+	// regularly the firmware wakes up for them
+	uint64_t obdRequests;
+	uint64_t requestGapMin;
+	uint64_t requestGapMax;
+	uint64_t lastRequestAt;
+};
+
+extern Stats stats;
+
+} // namespace sim
+
+#endif // def(__Sim_h)
@@ -0,0 +1,1191 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host tests for the libraries, each against a reference or a scenario
+ * on the virtual clock.
+ *
+ * Prints each failed check and exits with 1 if any failed. Build with
+ * the simulation HAL (see sim/main.cpp), replacing sim/main.cpp by
+ * sim/test.cpp and leaving out application.cpp:
+ *
+ *     g++ -std=c++11 -O2 -Isim -I. -o carloop_test sim/test.cpp sim/hal.cpp \
+ *         sim/virtual_ecu.cpp sim/nmea_feeder.cpp sim/can_log.cpp sim/nack_server.cpp \
+ *         carloop.cpp TinyGPS++.cpp ubx.cpp record_buffer.cpp geodesy.cpp \
+ *         position_encoder.cpp track_simplifier.cpp time_base.cpp power_manager.cpp \
+ *         latency_stats.cpp scheduler.cpp ecu_tracker.cpp derived_signals.cpp \
+ *         burst_capture.cpp j1939_decoder.cpp dtc_reader.cpp retransmit_buffer.cpp
+ */
+
+#include "sim.h"
+#include "carloop.h"
+#include "TinyGPS++.h"
+#include "geodesy.h"
+#include "time_base.h"
+#include "ubx.h"
+#include "track_simplifier.h"
+#include "scheduler.h"
+#include "ecu_tracker.h"
+#include "retransmit_buffer.h"
+#include "derived_signals.h"
+#include "record_buffer.h"
+#include "power_manager.h"
+#include "j1939_decoder.h"
+#include <map>
+#include "dtc_reader.h"
+#include <math.h>
+#include <time.h>
+#include <vector>
+
+// The firmware's entry points, which these tests don't run
+void setup() {}
+void loop() {}
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+void check(bool condition, const char *text, int line) {
+	if (!condition) {
+		fprintf(stderr, "test.cpp:%d: %s\n", line, text);
+		failures++;
+	}
+}
+
+// xorshift32, so every run checks the same cases
+uint32_t rng = 1;
+
+uint32_t random32() {
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+// Uniform in [-range, range], in 1e-7 degrees
+int32_t randomDeg7(int32_t range) {
+	return (int32_t)(random32() % (2 * (uint32_t)range + 1)) - range;
+}
+
+/*************** Geodesy ****************/
+
+const int GEODESY_PAIRS = 200000;
+// Beyond this, nearly antipodal, geodesy.h gives no bounds
+const double GEODESY_MAX_M = 18000000;
+
+// The bounds in geodesy.h, against TinyGPSPlus's double versions
+void testGeodesy() {
+	double worstShort = 0;
+	double worstLong = 0;
+	double worstCourse = 0;
+	for (int i = 0; i < GEODESY_PAIRS; i++) {
+		GeoPoint from = { randomDeg7(800000000), randomDeg7(1800000000) };
+		GeoPoint near = { from.lat + randomDeg7(999999), from.lng + randomDeg7(999999) };
+		GeoPoint far = { randomDeg7(800000000), randomDeg7(1800000000) };
+
+		double reference = TinyGPSPlus::distanceBetween(from.lat / 1e7, from.lng / 1e7,
+			near.lat / 1e7, near.lng / 1e7);
+		double error = fabs(geoDistanceShort(from, near) / 1e3 - reference);
+		CHECK(error <= reference * 1e-5 + 0.003);
+		worstShort = std::max(worstShort, error - reference * 1e-5);
+
+		reference = TinyGPSPlus::distanceBetween(from.lat / 1e7, from.lng / 1e7,
+			far.lat / 1e7, far.lng / 1e7);
+		if (reference > GEODESY_MAX_M) {
+			continue;
+		}
+		error = fabs(geoDistanceLong(from, far) - reference);
+		CHECK(error <= reference * 3e-4 + 1);
+		worstLong = std::max(worstLong, error - reference * 3e-4);
+
+		const GeoPoint &to = i & 1 ? near : far;
+		reference = TinyGPSPlus::distanceBetween(from.lat / 1e7, from.lng / 1e7, to.lat / 1e7, to.lng / 1e7);
+		if (reference > 1) {
+			double course = TinyGPSPlus::courseTo(from.lat / 1e7, from.lng / 1e7, to.lat / 1e7, to.lng / 1e7);
+			double diff = fabs(geoCourse(from, to) / 100.0 - course);
+			diff = std::min(diff, 360 - diff);
+			CHECK(diff <= 0.01);
+			worstCourse = std::max(worstCourse, diff);
+		}
+	}
+	fprintf(stderr, "geodesy: %d pairs, worst error past the relative part of the bound: "
+		"short %.4f m, long %.3f m; worst course error %.4f degree\n",
+		GEODESY_PAIRS, worstShort, worstLong, worstCourse);
+}
+
+void testGeoOdometer() {
+	// 1 km north in 100 steps of 10 m, then back in one
+	GeoOdometer odometer;
+	GeoPoint points[101];
+	for (int i = 0; i <= 100; i++) {
+		points[i].lat = 476062000 + i * 899;
+		points[i].lng = -1223321000;
+	}
+	odometer.add(points, 101);
+	odometer.add(points[0]);
+	double reference = TinyGPSPlus::distanceBetween(points[0].lat / 1e7, points[0].lng / 1e7,
+		points[100].lat / 1e7, points[100].lng / 1e7);
+	CHECK(fabs(odometer.meters() - 2 * reference) <= 1);
+}
+
+/*************** Track simplification ****************/
+
+// Distance in meters from p to the segment from a to b, on a local plane
+double segmentDistance(const GeoPoint &p, const GeoPoint &a, const GeoPoint &b) {
+	const double metersPerDeg7 = 6371008.8 * M_PI / 180 / 1e7;
+	double lngScale = cos(a.lat / 1e7 * M_PI / 180);
+	double px = (p.lng - a.lng) * lngScale * metersPerDeg7, py = (p.lat - a.lat) * metersPerDeg7;
+	double bx = (b.lng - a.lng) * lngScale * metersPerDeg7, by = (b.lat - a.lat) * metersPerDeg7;
+	double length2 = bx * bx + by * by;
+	double t = length2 > 0 ? std::max(0.0, std::min(1.0, (px * bx + py * by) / length2)) : 0;
+	return hypot(px - t * bx, py - t * by);
+}
+
+// An hour at 1 Hz, weaving at random rates of turn and speeds: every
+// dropped fix is within the corridor of the segment between the fixes
+// kept around it, and kept fixes are in order and never repeated
+void testTrackSimplifier() {
+	const int FIXES = 3600;
+	const double metersPerDeg7 = 6371008.8 * M_PI / 180 / 1e7;
+	TrackSimplifier simplifier(10000, 20, 30000);
+	std::vector<TrackFix> fixes;
+	std::vector<size_t> kept;
+	double lat = 47.6062, lng = -122.3321, course = 0, turnRate = 0, speed = 20;
+	for (int i = 0; i < FIXES; i++) {
+		if (i % 20 == 0) {
+			turnRate = (int32_t)(random32() % 13) - 6;
+			speed = 5 + random32() % 30;
+		}
+		course = fmod(course + turnRate + 360, 360);
+		lat += speed * cos(course * M_PI / 180) / metersPerDeg7 / 1e7;
+		lng += speed * sin(course * M_PI / 180) / metersPerDeg7 / 1e7 / cos(lat * M_PI / 180);
+
+		TrackFix fix;
+		fix.time = i * 1000;
+		GeoPoint point = { (int32_t)lround(lat * 1e7), (int32_t)lround(lng * 1e7) };
+		fix.sample = PositionEncoder::quantize(point,
+			(int32_t)(speed * 194.3844), (int32_t)(course * 100), 90);
+		fixes.push_back(fix);
+
+		TrackFix out;
+		if (simplifier.add(fix, out)) {
+			size_t index = out.time / 1000;
+			CHECK(kept.empty() || index > kept.back());
+			kept.push_back(index);
+		}
+	}
+
+	double worst = 0;
+	for (size_t k = 1; k < kept.size(); k++) {
+		for (size_t i = kept[k - 1] + 1; i < kept[k]; i++) {
+			worst = std::max(worst, segmentDistance(fixes[i].sample.point,
+				fixes[kept[k - 1]].sample.point, fixes[kept[k]].sample.point));
+		}
+	}
+	CHECK(worst <= 10);
+	CHECK(kept.size() < FIXES / 2);
+	fprintf(stderr, "track: kept %zu of %d fixes, worst error %.2f m\n", kept.size(), FIXES, worst);
+}
+
+/*************** Time base ****************/
+
+// A GPS receiver and a device clock running ppm fast, in true milliseconds
+// since TIME_START. With a leap second, the receiver reports 23:59:60 for
+// the true second leapSecond and Unix time is a second behind after it.
+const uint32_t TIME_START = 1483221600; // 2016-12-31 22:00:00 UTC
+const int NO_LEAP = -1;
+
+struct GpsClock
+{
+	double ppm;
+	int leapSecond;
+
+	unsigned long millisAt(uint64_t trueMs) const {
+		return 5000 + (unsigned long)(trueMs + trueMs * ppm / 1e6);
+	}
+
+	uint64_t unixMsAt(uint64_t trueMs) const {
+		bool afterLeap = leapSecond != NO_LEAP && trueMs >= (uint64_t)(leapSecond + 1) * 1000;
+		return (uint64_t)TIME_START * 1000 + trueMs - (afterLeap ? 1000 : 0);
+	}
+
+	// Sentences once a second of true time in [from, to), received 0-4 ms late
+	void feed(TimeBase &timeBase, uint32_t fromSecond, uint32_t toSecond) const {
+		for (uint32_t second = fromSecond; second < toSecond; second++) {
+			uint32_t date, time;
+			if ((int)second == leapSecond) {
+				date = 311216;
+				time = 23596000;
+			} else {
+				time_t t = unixMsAt(second * 1000ULL) / 1000;
+				struct tm utc;
+				gmtime_r(&t, &utc);
+				date = (utc.tm_mday * 100 + utc.tm_mon + 1) * 100 + utc.tm_year % 100;
+				time = ((utc.tm_hour * 100 + utc.tm_min) * 100 + utc.tm_sec) * 100;
+			}
+			unsigned long at = millisAt(second * 1000ULL) + random32() % 5;
+			timeBase.gpsTime(at, date, time);
+			timeBase.update(at);
+		}
+	}
+
+	double error(const TimeBase &timeBase, uint64_t trueMs) const {
+		return (double)(int64_t)(timeBase.nowUtc(millisAt(trueMs)) - unixMsAt(trueMs));
+	}
+};
+
+// An hour of GPS measures the drift of a fast and a slow clock well enough
+// that an hour without GPS after it costs a few ms rather than the 144 or
+// 216 ms of the uncorrected drift
+void testTimeBaseDrift() {
+	const double rates[] = { 40, -60 };
+	for (double ppm : rates) {
+		GpsClock clock = { ppm, NO_LEAP };
+		TimeBase timeBase;
+		clock.feed(timeBase, 0, 3600);
+		CHECK(timeBase.timeSource() == TimeBase::SOURCE_GPS);
+		CHECK(fabs(clock.error(timeBase, 3599500)) <= 5);
+		CHECK(fabs(clock.error(timeBase, 7200000)) <= 10);
+	}
+}
+
+// Through a two hour dropout the error only grows by the residual drift,
+// and the first fix after it puts the time right again
+void testTimeBaseDropout() {
+	GpsClock clock = { 40, NO_LEAP };
+	TimeBase timeBase;
+	clock.feed(timeBase, 0, 3600);
+	double worst = 0;
+	for (uint64_t trueMs = 3600000; trueMs < 3 * 3600000; trueMs += 60000) {
+		worst = std::max(worst, fabs(clock.error(timeBase, trueMs)));
+	}
+	CHECK(worst <= 20);
+	clock.feed(timeBase, 3 * 3600, 3 * 3600 + 1);
+	CHECK(fabs(clock.error(timeBase, 3 * 3600000 + 500)) <= 5);
+	clock.feed(timeBase, 3 * 3600 + 1, 4 * 3600);
+	CHECK(fabs(clock.error(timeBase, 5 * 3600000)) <= 10);
+	fprintf(stderr, "time base: worst error %.0f ms in a 2 h GPS dropout\n", worst);
+}
+
+// The leap second at the end of 2016 neither puts the time a second ahead
+// nor counts as a second of drift
+void testTimeBaseLeapSecond() {
+	GpsClock clock = { 40, 7200 };
+	TimeBase timeBase;
+	clock.feed(timeBase, 0, 7202);
+	CHECK(fabs(clock.error(timeBase, 7201500)) <= 5);
+	clock.feed(timeBase, 7202, 3 * 3600);
+	CHECK(fabs(clock.error(timeBase, 3 * 3600000 - 500)) <= 5);
+	// An hour without GPS, the drift measured across the leap second
+	CHECK(fabs(clock.error(timeBase, 4 * 3600000)) <= 10);
+}
+
+/*************** UBX ****************/
+
+// A second from a u-blox M8 at 5 Hz, NAV-PVT then NAV-DOP, starting with
+// the end of the previous NAV-DOP: 2016-10-01 12:00:01, 47.6062 N,
+// 122.3321 W, 45 m, 14.722 m/s at 45 degrees, 8 satellites, HDOP 0.9
+const uint8_t UBX_CAPTURE[] = {
+	0x3c, 0x00, 0x46, 0x00, 0xd6, 0x56,
+	0xb5, 0x62, 0x01, 0x07, 0x5c, 0x00, 0xe8, 0x59, 0x79, 0x21, 0xe0, 0x07,
+	0x0a, 0x01, 0x0c, 0x00, 0x01, 0x37, 0x19, 0x00, 0x00, 0x00, 0xc7, 0xcf,
+	0xff, 0xff, 0x03, 0x01, 0xea, 0x08, 0x58, 0x9a, 0x15, 0xb7, 0x30, 0x21,
+	0x60, 0x1c, 0x30, 0xf2, 0x00, 0x00, 0xc8, 0xaf, 0x00, 0x00, 0xdc, 0x05,
+	0x00, 0x00, 0x98, 0x08, 0x00, 0x00, 0xa9, 0x28, 0x00, 0x00, 0xa9, 0x28,
+	0x00, 0x00, 0xec, 0xff, 0xff, 0xff, 0x82, 0x39, 0x00, 0x00, 0x20, 0xaa,
+	0x44, 0x00, 0x2c, 0x01, 0x00, 0x00, 0x80, 0x38, 0x01, 0x00, 0x96, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x8d, 0xb7, 0xb5, 0x62, 0x01, 0x04, 0x12, 0x00, 0xe8, 0x59,
+	0x79, 0x21, 0xaa, 0x00, 0x96, 0x00, 0x50, 0x00, 0x78, 0x00, 0x5a, 0x00,
+	0x3c, 0x00, 0x46, 0x00, 0xd6, 0x56,
+};
+const size_t UBX_PVT_START = 6;
+const size_t UBX_PVT_FLAGS = UBX_PVT_START + 6 + 21;
+
+// The same fix as NMEA sentences
+const char UBX_CAPTURE_NMEA[] =
+	"$GPGGA,120001.00,4736.37200,N,12219.92600,W,1,08,0.9,45.0,M,-17.0,M,,*63\r\n"
+	"$GPRMC,120001.00,A,4736.37200,N,12219.92600,W,28.62,45.00,011016,,,A*42\r\n";
+
+// Feeds the capture in reads of 1 to 64 bytes, like CarloopGPS::receiveGPS()
+void encodeUbx(UbxParser &parser, const uint8_t *stream, size_t len) {
+	for (size_t i = 0; i < len; ) {
+		size_t read = std::min<size_t>(1 + random32() % 64, len - i);
+		parser.encode((const char *)stream + i, read);
+		i += read;
+	}
+}
+
+// The fix decodes to the same TinyGPSPlus values as its NMEA sentences,
+// so the rest of the firmware can't tell the protocols apart
+void testUbxCapture() {
+	TinyGPSPlus nmea;
+	nmea.encode(UBX_CAPTURE_NMEA, sizeof(UBX_CAPTURE_NMEA) - 1);
+	CHECK(nmea.passedChecksum() == 2);
+
+	for (int run = 0; run < 100; run++) {
+		TinyGPSPlus ubx;
+		UbxParser parser(ubx);
+		encodeUbx(parser, UBX_CAPTURE, sizeof(UBX_CAPTURE));
+		CHECK(parser.framesProcessed() == 2);
+		CHECK(parser.failedChecksum() == 0);
+
+		CHECK(ubx.location.isValid() && ubx.location.isUpdated());
+		CHECK(ubx.location.rawLat().negative == nmea.location.rawLat().negative);
+		CHECK(ubx.location.rawLat().deg == nmea.location.rawLat().deg);
+		CHECK(ubx.location.rawLat().billionths == nmea.location.rawLat().billionths);
+		CHECK(ubx.location.rawLng().negative == nmea.location.rawLng().negative);
+		CHECK(ubx.location.rawLng().deg == nmea.location.rawLng().deg);
+		CHECK(ubx.location.rawLng().billionths == nmea.location.rawLng().billionths);
+		CHECK(ubx.date.value() == nmea.date.value());
+		CHECK(ubx.time.value() == nmea.time.value());
+		CHECK(ubx.speed.value() == nmea.speed.value());
+		CHECK(ubx.course.value() == nmea.course.value());
+		CHECK(ubx.altitude.value() == nmea.altitude.value());
+		CHECK(ubx.satellites.value() == nmea.satellites.value());
+		CHECK(ubx.hdop.value() == nmea.hdop.value());
+	}
+}
+
+// A corrupted NAV-PVT is counted and dropped, and the parser picks up
+// again at the NAV-DOP after it. Without a fix, only the time is taken.
+void testUbxErrors() {
+	uint8_t stream[sizeof(UBX_CAPTURE)];
+	memcpy(stream, UBX_CAPTURE, sizeof(stream));
+	stream[UBX_PVT_START + 30] ^= 0x10;
+	TinyGPSPlus gps;
+	UbxParser parser(gps);
+	encodeUbx(parser, stream, sizeof(stream));
+	CHECK(parser.failedChecksum() == 1);
+	CHECK(parser.framesProcessed() == 1);
+	CHECK(!gps.location.isValid());
+	CHECK(gps.hdop.value() == 90);
+
+	memcpy(stream, UBX_CAPTURE, sizeof(stream));
+	stream[UBX_PVT_FLAGS] = 0;
+	// Both checksum bytes follow the payload
+	uint8_t a = 0, b = 0;
+	for (size_t i = UBX_PVT_START + 2; i < UBX_PVT_START + 6 + 92; i++) {
+		a += stream[i];
+		b += a;
+	}
+	stream[UBX_PVT_START + 6 + 92] = a;
+	stream[UBX_PVT_START + 6 + 93] = b;
+	TinyGPSPlus noFix;
+	UbxParser noFixParser(noFix);
+	encodeUbx(noFixParser, stream, sizeof(stream));
+	CHECK(noFixParser.framesProcessed() == 2);
+	CHECK(!noFix.location.isValid());
+	CHECK(noFix.time.value() == 12000100);
+}
+
+// A corrupted NAV-PVT length is dropped straight away instead of swallowing
+// the stream, so the NAV-DOP right after it is still decoded
+void testUbxLength() {
+	uint8_t stream[sizeof(UBX_CAPTURE)];
+	memcpy(stream, UBX_CAPTURE, sizeof(stream));
+	stream[UBX_PVT_START + 5] = 0x80;
+	TinyGPSPlus gps;
+	UbxParser parser(gps);
+	encodeUbx(parser, stream, sizeof(stream));
+	CHECK(parser.failedChecksum() == 1);
+	CHECK(parser.framesProcessed() == 1);
+	CHECK(!gps.location.isValid());
+	CHECK(gps.hdop.value() == 90);
+
+	// Just over the cap is rejected too
+	memcpy(stream, UBX_CAPTURE, sizeof(stream));
+	stream[UBX_PVT_START + 4] = UbxParser::MAX_LENGTH + 1;
+	stream[UBX_PVT_START + 5] = 0;
+	TinyGPSPlus over;
+	UbxParser overParser(over);
+	encodeUbx(overParser, stream, sizeof(stream));
+	CHECK(overParser.failedChecksum() == 1);
+	CHECK(overParser.framesProcessed() == 1);
+	CHECK(over.hdop.value() == 90);
+}
+
+/*************** CAN detection ****************/
+
+// A car with the engine ECU and some broadcast traffic at bitrate
+void startCar(unsigned long bitrate, bool powered) {
+	sim::bus = VirtualBus(1);
+	sim::bus.bitrate = bitrate;
+	sim::bus.powered = powered;
+	sim::bus.addEcu(VirtualEcu::fromTrace(0x7e8, 8000, 4000));
+	sim::bus.addNoise(3);
+	EEPROM.clear();
+}
+
+// Nothing is sent at a bitrate that hasn't delivered a frame: a silent bus
+// only gets the two requests at the default speed, where the OBD requests
+// would go anyway
+void testCanDetectionSilent() {
+	startCar(500000, false);
+	Carloop<CarloopRevision2> carloop;
+	uint64_t sent = sim::stats.canSent;
+	CHECK(!carloop.detectCAN());
+	CHECK(sim::stats.canSent - sent == 2);
+	CHECK(carloop.getCANSpeed() == 500000);
+}
+
+// At 250 kbps the default 500 kbps is never sent to, and destroys only
+// the frames it takes to get error passive. The result is kept, so the
+// next detection takes one frame and one reply and disturbs nothing.
+void testCanDetectionSpeed() {
+	startCar(250000, true);
+	Carloop<CarloopRevision2> carloop;
+	uint64_t sent = sim::stats.canSent;
+	uint64_t errorFrames = sim::stats.canErrorFrames;
+	CHECK(carloop.detectCAN());
+	CHECK(sim::stats.canSent - sent == 1);
+	CHECK(sim::stats.canErrorFrames - errorFrames <= 16);
+	CHECK(carloop.getCANSpeed() == 250000);
+	CHECK(carloop.canAddressing() == CARLOOP_CAN_11BIT);
+
+	uint64_t start = sim::now();
+	errorFrames = sim::stats.canErrorFrames;
+	CHECK(carloop.detectCAN());
+	CHECK(sim::stats.canSent - sent == 2);
+	CHECK(sim::stats.canErrorFrames == errorFrames);
+	CHECK(sim::now() - start < 50000);
+}
+
+// Through update(), no call takes more than a fraction of a millisecond
+void testCanDetectionNonBlocking() {
+	startCar(250000, true);
+	Carloop<CarloopRevision2> carloop;
+	carloop.begin();
+	carloop.startCANDetection();
+	uint64_t worst = 0;
+	int updates = 0;
+	while (carloop.canDetecting() && updates < 10000) {
+		uint64_t start = sim::now();
+		carloop.update();
+		worst = std::max(worst, sim::now() - start);
+		sim::advance(1000);
+		updates++;
+	}
+	CHECK(!carloop.canDetecting());
+	CHECK(carloop.canDetected());
+	CHECK(carloop.getCANSpeed() == 250000);
+	CHECK(worst < 500);
+}
+
+/*************** Scheduler ****************/
+
+template <int N>
+void scheduledTask() {}
+
+// A full table turns down new tasks but still reschedules its own
+void testSchedulerFull() {
+	Scheduler::Task tasks[] = {
+		scheduledTask<0>, scheduledTask<1>, scheduledTask<2>, scheduledTask<3>,
+		scheduledTask<4>, scheduledTask<5>, scheduledTask<6>, scheduledTask<7>,
+		scheduledTask<8>, scheduledTask<9>, scheduledTask<10>, scheduledTask<11>,
+		scheduledTask<12>
+	};
+	static_assert(sizeof(tasks) / sizeof(tasks[0]) > Scheduler::MAX_TASKS,
+		"one task more than the table holds");
+	Scheduler scheduler;
+	for (uint8_t i = 0; i < Scheduler::MAX_TASKS; i++) {
+		CHECK(scheduler.every(1000, tasks[i], i));
+	}
+	CHECK(!scheduler.every(1000, tasks[Scheduler::MAX_TASKS], 0));
+	CHECK(scheduler.every(500, tasks[0], 100));
+	scheduler.cancel(tasks[1]);
+	CHECK(scheduler.at(2000, tasks[Scheduler::MAX_TASKS]));
+}
+
+/*************** ECU tracker ****************/
+
+// The transmission answering first doesn't hide the engine's reply, but
+// repeating the engine or another ECU does hide its own
+void testEcuTrackerPrimary() {
+	const uint8_t speed[] = { 0x0d, 0x35 };
+	EcuTracker ecus;
+	ecus.request();
+	CHECK(ecus.reply(0xe9, speed, sizeof(speed), false));
+	CHECK(ecus.reply(0xe8, speed, sizeof(speed), true));
+	CHECK(!ecus.reply(0xea, speed, sizeof(speed), false));
+
+	ecus.request();
+	CHECK(ecus.reply(0xe8, speed, sizeof(speed), true));
+	CHECK(!ecus.reply(0xe9, speed, sizeof(speed), false));
+	CHECK(ecus.count() == 3);
+	CHECK(ecus.ecu(0).duplicates == 1 && ecus.ecu(1).duplicates == 0);
+}
+
+/*************** Retransmit buffer ****************/
+
+// A chunk that couldn't be sent comes out of next() unasked, and the
+// server can still ask for the last SLOTS chunks
+void testRetransmitHeld() {
+	RetransmitBuffer retransmit;
+	RecordBuffer chunk;
+	const uint8_t payload[] = { 0x0d, 0x35 };
+	for (uint16_t sequence = 0; sequence < 40; sequence++) {
+		chunk.append(sequence * 100, RECORD_OBD_REPLY, payload, sizeof(payload));
+		chunk.seal(sequence);
+		retransmit.add("m", chunk.data(), chunk.length(), sequence != 39);
+		chunk.clear();
+	}
+	CHECK(retransmit.pending() == 1);
+	char name[2];
+	uint8_t data[RecordBuffer::CAPACITY];
+	size_t len;
+	CHECK(retransmit.next(name, data, len));
+	CHECK(RecordBuffer::sequence(data) == 39);
+	CHECK(data[0] == (RecordBuffer::VERSION | RecordBuffer::VERSION_RESENT));
+	CHECK(!retransmit.next(name, data, len));
+
+	CHECK(retransmit.nack("0-40") == RetransmitBuffer::SLOTS);
+	CHECK(retransmit.next(name, data, len));
+	CHECK(RecordBuffer::sequence(data) == 40 - RetransmitBuffer::SLOTS);
+}
+
+/*************** Derived signals ****************/
+
+// Each signal triggers on PID 0x0d, whose reply is speed
+int32_t derivedValue(const char *expression) {
+	DerivedSignals derived;
+	CHECK(derived.define(0xf0, 0x0d, 4, 1000, expression));
+	const uint8_t speed[] = { 50 };
+	derived.sample(1000, 0x0d, speed, sizeof(speed));
+	return derived.value(0xf0);
+}
+
+// RPN order stands in for precedence, and results saturate at the int32
+// range instead of wrapping or trapping
+void testDerivedArithmetic() {
+	CHECK(derivedValue("2 3 4 * +") == 14);
+	CHECK(derivedValue("2 3 + 4 *") == 20);
+	CHECK(derivedValue("#0d 10 - 4 /") == 10);
+	CHECK(derivedValue("10 0 /") == 0);
+	CHECK(derivedValue("3 2 < 3 2 > +") == 1);
+	CHECK(derivedValue("2147483647 2 *") == INT32_MAX);
+	CHECK(derivedValue("0 2147483647 - 2147483647 -") == INT32_MIN);
+	// INT32_MIN / -1
+	CHECK(derivedValue("0 2147483647 - 1 - 0 1 - /") == INT32_MAX);
+}
+
+// A rejected expression doesn't keep the inputs it named
+void testDerivedInputs() {
+	DerivedSignals derived;
+	CHECK(!derived.define(0xf0, 0x0d, 2, 0, "#01 #02 #03 #04 #05 #06 +"));
+	CHECK(!derived.define(0xf0, 0x0d, 2, 0, "#01 #02 #03 #04 #05 #06 #07"));
+	CHECK(derived.define(0xf0, 0x0d, 2, 0, "#0d #0c #10 #11 #04 #05 + + + + +"));
+	CHECK(!derived.define(0xf1, 0x0d, 2, 0, "#01"));
+	CHECK(derived.define(0xf1, 0x0d, 2, 0, "#0d #0c +"));
+}
+
+// dt is at most MAX_STEP, and next() waits out the interval unless flushed
+void testDerivedTiming() {
+	DerivedSignals derived;
+	CHECK(derived.define(0xf0, 0x0d, 4, 5000, "acc dt +"));
+	const uint8_t speed[] = { 50 };
+	derived.sample(1000, 0x0d, speed, sizeof(speed));
+	derived.sample(2000, 0x0d, speed, sizeof(speed));
+	derived.sample(62000, 0x0d, speed, sizeof(speed));
+	CHECK(derived.value(0xf0) == 1000 + (int32_t)DerivedSignals::MAX_STEP);
+
+	uint8_t payload[RecordBuffer::MAX_PAYLOAD];
+	uint8_t len;
+	CHECK(derived.next(62000, payload, len));
+	CHECK(len == 5 && payload[0] == 0xf0 && payload[4] == (11000 & 0xff));
+	CHECK(!derived.next(62000, payload, len));
+	derived.sample(63000, 0x0d, speed, sizeof(speed));
+	CHECK(!derived.next(63000, payload, len));
+	CHECK(derived.next(63000, payload, len, true));
+	CHECK(!derived.next(63000, payload, len, true));
+	derived.sample(64000, 0x0d, speed, sizeof(speed));
+	CHECK(!derived.next(66999, payload, len));
+	CHECK(derived.next(68000, payload, len));
+}
+
+/*************** Power manager ****************/
+
+// Parked on a silent bus with the battery still over the charging
+// threshold, the device stays parked until charging starts again
+void testPowerChargingLevel() {
+	PowerManager power;
+	int wakes = 0;
+	unsigned long now = 0;
+	power.canActivity(now);
+	for (; now < 60000; now += 50) {
+		power.battery(now, true, false, false);
+		PowerManager::Mode_e previous = power.mode();
+		if (power.update(now) == PowerManager::MODE_ACTIVE && previous != PowerManager::MODE_ACTIVE) {
+			wakes++;
+		}
+	}
+	CHECK(power.mode() != PowerManager::MODE_ACTIVE);
+	CHECK(wakes == 0);
+
+	power.battery(now, true, true, false);
+	CHECK(power.update(now) == PowerManager::MODE_ACTIVE);
+}
+
+/*************** NMEA sentences ****************/
+
+// Feeds a sentence body, between $ and *, with its checksum
+void encodeNmea(TinyGPSPlus &gps, const char *body) {
+	uint8_t parity = 0;
+	for (const char *p = body; *p; p++) {
+		parity ^= *p;
+	}
+	char sentence[200];
+	snprintf(sentence, sizeof(sentence), "$%s*%02X\r\n", body, parity);
+	gps.encode(sentence, strlen(sentence));
+}
+
+// A multi-constellation receiver talks as GN for the combined solution
+void testNmeaCombinedTalker() {
+	TinyGPSPlus gps;
+	encodeNmea(gps, "GNRMC,123519,A,4807.038,N,01131.000,E,022.4,084.4,230394,,,A");
+	encodeNmea(gps, "GNGGA,123520,4807.040,N,01131.002,E,1,08,0.9,545.4,M,46.9,M,,");
+	CHECK(gps.passedChecksum() == 2);
+	CHECK(gps.sentencesWithFix() == 2);
+	CHECK(gps.location.isValid());
+	CHECK(gps.location.rawLat().deg == 48 && !gps.location.rawLat().negative);
+	CHECK(gps.date.value() == 230394);
+	CHECK(gps.time.value() == 12352000);
+	CHECK(gps.speed.value() == 2240);
+	CHECK(gps.altitude.value() == 54540);
+	CHECK(gps.satellites.value() == 8);
+}
+
+// GSA carries the three DOPs, and only counts with a 2D or 3D fix
+void testNmeaGsa() {
+	TinyGPSPlus gps;
+	encodeNmea(gps, "GNGSA,A,1,,,,,,,,,,,,,9.9,9.9,9.9");
+	CHECK(gps.passedChecksum() == 1);
+	CHECK(!gps.pdop.isValid() && !gps.hdop.isValid() && !gps.vdop.isValid());
+	encodeNmea(gps, "GNGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1");
+	CHECK(gps.pdop.isValid() && gps.pdop.value() == 250);
+	CHECK(gps.hdop.isValid() && gps.hdop.value() == 130);
+	CHECK(gps.vdop.isValid() && gps.vdop.value() == 210);
+}
+
+// Each constellation's GSV counts its own satellites, and the GN talker
+// has no constellation to count them for
+void testNmeaGsv() {
+	TinyGPSPlus gps;
+	encodeNmea(gps, "GPGSV,3,1,11,03,03,111,00,04,15,270,00,06,01,010,00,13,06,292,00");
+	encodeNmea(gps, "GLGSV,2,1,07,65,26,046,31,66,73,347,24,67,39,246,,74,15,036,");
+	encodeNmea(gps, "GAGSV,1,1,04,02,16,045,29,07,29,318,,30,40,110,33,36,19,219,");
+	encodeNmea(gps, "GBGSV,1,1,02,06,48,187,,09,44,222,");
+	encodeNmea(gps, "GNGSV,1,1,01,01,10,100,20");
+	CHECK(gps.passedChecksum() == 5);
+	CHECK(gps.satellitesInView[TinyGPSPlus::GPS_CONSTELLATION_GPS].value() == 11);
+	CHECK(gps.satellitesInView[TinyGPSPlus::GPS_CONSTELLATION_GLONASS].value() == 7);
+	CHECK(gps.satellitesInView[TinyGPSPlus::GPS_CONSTELLATION_GALILEO].value() == 4);
+	CHECK(gps.satellitesInView[TinyGPSPlus::GPS_CONSTELLATION_BEIDOU].value() == 2);
+	encodeNmea(gps, "BDGSV,1,1,03,06,48,187,,09,44,222,,11,20,100,");
+	CHECK(gps.satellitesInView[TinyGPSPlus::GPS_CONSTELLATION_BEIDOU].value() == 3);
+}
+
+// Standing still, VTG has no course but still a speed, unless the mode
+// says the fix isn't valid
+void testNmeaVtg() {
+	TinyGPSPlus gps;
+	encodeNmea(gps, "GPVTG,,T,,M,0.05,N,0.09,K,A");
+	CHECK(gps.sentencesWithFix() == 1);
+	CHECK(gps.speed.isValid() && gps.speed.isUpdated() && gps.speed.value() == 5);
+	encodeNmea(gps, "GPVTG,054.7,T,034.4,M,005.5,N,010.2,K,A");
+	CHECK(gps.speed.value() == 550 && gps.course.value() == 5470);
+	encodeNmea(gps, "GPVTG,,T,,M,1.00,N,1.85,K,N");
+	CHECK(gps.sentencesWithFix() == 2);
+	CHECK(gps.speed.value() == 550);
+}
+
+// Customs share term slots past _GPS_MAX_CUSTOM_TERMS and hash buckets
+// with other sentences, and each still gets exactly its own term
+void testNmeaCustoms() {
+	TinyGPSPlus gps;
+	TinyGPSCustom satellites(gps, "GPGSV", 3);
+	TinyGPSCustom firstId(gps, "GPGSV", 4);
+	TinyGPSCustom firstIdAgain(gps, "GPGSV", 4);
+	TinyGPSCustom glonass(gps, "GLGSV", 3);
+	TinyGPSCustom last(gps, "PTEST", _GPS_MAX_CUSTOM_TERMS - 1);
+	TinyGPSCustom past(gps, "PTEST", _GPS_MAX_CUSTOM_TERMS);
+	TinyGPSCustom farPast(gps, "PTEST", _GPS_MAX_CUSTOM_TERMS + 3);
+
+	encodeNmea(gps, "GPGSV,3,1,11,03,03,111,00,04,15,270,00,06,01,010,00,13,06,292,00");
+	CHECK(!strcmp(satellites.value(), "11"));
+	CHECK(!strcmp(firstId.value(), "03"));
+	CHECK(!strcmp(firstIdAgain.value(), "03"));
+	CHECK(!glonass.isValid() && !last.isValid());
+
+	// Term n is "t<n>"
+	char body[200] = "PTEST";
+	for (int term = 1; term <= _GPS_MAX_CUSTOM_TERMS + 5; term++) {
+		snprintf(body + strlen(body), sizeof(body) - strlen(body), ",t%d", term);
+	}
+	encodeNmea(gps, body);
+	char expected[8];
+	snprintf(expected, sizeof(expected), "t%d", _GPS_MAX_CUSTOM_TERMS - 1);
+	CHECK(!strcmp(last.value(), expected));
+	snprintf(expected, sizeof(expected), "t%d", _GPS_MAX_CUSTOM_TERMS);
+	CHECK(!strcmp(past.value(), expected));
+	snprintf(expected, sizeof(expected), "t%d", _GPS_MAX_CUSTOM_TERMS + 3);
+	CHECK(!strcmp(farPast.value(), expected));
+	CHECK(!satellites.isUpdated() && !strcmp(satellites.value(), "11"));
+	CHECK(!glonass.isValid());
+}
+
+/*************** J1939 decoder ****************/
+
+// EEC1 as in application.cpp, EC1 sent as a BAM, and a proprietary PGN
+// with SPNs that start mid-byte
+const J1939Pgn J1939_TEST_PGNS[] = {
+	{ 61444, 1000, { { 513, 16, 8 }, { 190, 24, 16 }, { 899, 0, 4 } } },
+	{ 65251, 0, { { 188, 0, 16 }, { 544, 152, 16 } } },
+	{ 65280, 0, { { 1, 4, 10 }, { 2, 20, 3 } } },
+};
+const uint8_t J1939_TEST_ROWS = sizeof(J1939_TEST_PGNS) / sizeof(J1939_TEST_PGNS[0]);
+
+CANMessage j1939Frame(uint32_t id, const uint8_t *data) {
+	CANMessage message;
+	message.id = id;
+	message.extended = true;
+	message.len = 8;
+	memcpy(message.data, data, 8);
+	return message;
+}
+
+// Hands the values next() gives out to SPN -> raw value
+std::map<uint32_t, uint32_t> j1939Values(J1939Decoder &decoder, uint8_t address) {
+	std::map<uint32_t, uint32_t> values;
+	uint8_t payload[J1939Decoder::MAX_PAYLOAD];
+	uint8_t len;
+	while (decoder.next(payload, len)) {
+		CHECK(len > 4 && payload[0] == address);
+		uint32_t value = 0;
+		for (uint8_t i = 4; i < len; i++) {
+			value = (value << 8) | payload[i];
+		}
+		values[(uint32_t)payload[1] << 16 | payload[2] << 8 | payload[3]] = value;
+	}
+	return values;
+}
+
+// Only changed SPNs are handed out, at most once per interval, and values
+// from 0xfb up in their top byte, or all ones in fewer bits, are skipped
+void testJ1939Frames() {
+	J1939Decoder decoder(J1939_TEST_PGNS, J1939_TEST_ROWS);
+	const uint8_t eec1[] = { 0xf3, 0x00, 0x7d, 0x40, 0x1f, 0x00, 0x00, 0x00 };
+	CHECK(decoder.add(0, j1939Frame(0x0cf00400, eec1)));
+	std::map<uint32_t, uint32_t> values = j1939Values(decoder, 0x00);
+	CHECK(values.size() == 3);
+	CHECK(values[513] == 0x7d && values[190] == 0x1f40 && values[899] == 3);
+
+	CHECK(!decoder.add(999, j1939Frame(0x0cf00400, eec1)));
+	CHECK(!decoder.add(1000, j1939Frame(0x0cf00400, eec1)));
+	CHECK(j1939Values(decoder, 0x00).empty());
+
+	// Another source address is tracked on its own
+	CHECK(decoder.add(1000, j1939Frame(0x0cf00401, eec1)));
+	CHECK(j1939Values(decoder, 0x01).size() == 3);
+
+	const uint8_t notAvailable[] = { 0xff, 0x00, 0xfe, 0x40, 0xfb, 0x00, 0x00, 0x00 };
+	CHECK(!decoder.add(2000, j1939Frame(0x0cf00400, notAvailable)));
+	CHECK(j1939Values(decoder, 0x00).empty());
+	const uint8_t lastValue[] = { 0xf0, 0x00, 0xfa, 0xff, 0xfa, 0x00, 0x00, 0x00 };
+	CHECK(decoder.add(3000, j1939Frame(0x0cf00400, lastValue)));
+	values = j1939Values(decoder, 0x00);
+	CHECK(values.size() == 3);
+	CHECK(values[513] == 0xfa && values[190] == 0xfaff && values[899] == 0);
+
+	// A PGN not in the table
+	CHECK(!decoder.add(4000, j1939Frame(0x18fef100, eec1)));
+	CHECK(j1939Values(decoder, 0x00).empty());
+}
+
+// The bits around an SPN that starts mid-byte don't leak into it
+void testJ1939Bits() {
+	J1939Decoder decoder(J1939_TEST_PGNS, J1939_TEST_ROWS);
+	// 0x2a5 from bit 4 and 5 from bit 20, with all the other bits set
+	const uint8_t data[] = { 0x5f, 0xea, 0xdf, 0xff, 0xff, 0xff, 0xff, 0xff };
+	CHECK(decoder.add(0, j1939Frame(0x18ff0017, data)));
+	uint8_t payload[J1939Decoder::MAX_PAYLOAD];
+	uint8_t len;
+	CHECK(decoder.next(payload, len));
+	CHECK(len == 6 && payload[0] == 0x17 && payload[3] == 1);
+	CHECK(payload[4] == 0x02 && payload[5] == 0xa5);
+	CHECK(decoder.next(payload, len));
+	CHECK(len == 5 && payload[3] == 2 && payload[4] == 5);
+	CHECK(!decoder.next(payload, len));
+}
+
+// EC1 as a BAM from address 0: bytes 0 to 38 hold 0 to 38, in 6 TP.DT
+// packets sent every 100 ms from now, leaving out the packet skip if any
+struct J1939Bam {
+	J1939Decoder decoder;
+	unsigned long now;
+
+	J1939Bam() : decoder(J1939_TEST_PGNS, J1939_TEST_ROWS), now(0) {}
+
+	void announce() {
+		const uint8_t cm[] = { 32, 39, 0, 6, 0xff, 0xe3, 0xfe, 0x00 };
+		decoder.add(now, j1939Frame(0x1cecff00, cm));
+	}
+
+	bool packet(uint8_t sequence) {
+		uint8_t dt[8] = { sequence };
+		for (uint8_t i = 0; i < 7; i++) {
+			dt[1 + i] = (sequence - 1) * 7 + i < 39 ? (sequence - 1) * 7 + i : 0xff;
+		}
+		now += 100;
+		return decoder.add(now, j1939Frame(0x1cebff00, dt));
+	}
+
+	bool send(uint8_t from, uint8_t skip = 0) {
+		bool decoded = false;
+		for (uint8_t sequence = from; sequence <= 6; sequence++) {
+			if (sequence != skip) {
+				decoded = packet(sequence);
+			}
+		}
+		return decoded;
+	}
+};
+
+// Only the last packet of a BAM in order decodes it
+void testJ1939BamInOrder() {
+	J1939Bam bam;
+	bam.announce();
+	for (uint8_t sequence = 1; sequence < 6; sequence++) {
+		CHECK(!bam.packet(sequence));
+	}
+	CHECK(bam.packet(6));
+	CHECK(bam.decoder.bamCompleted() == 1 && bam.decoder.bamDropped() == 0);
+	std::map<uint32_t, uint32_t> values = j1939Values(bam.decoder, 0x00);
+	CHECK(values.size() == 2);
+	CHECK(values[188] == 0x0100 && values[544] == 0x1413);
+}
+
+// A lost or out-of-order packet, or one after BAM_TIMEOUT, loses the BAM
+void testJ1939BamLost() {
+	J1939Bam lost;
+	lost.announce();
+	CHECK(!lost.send(1, 3));
+	CHECK(lost.decoder.bamCompleted() == 0 && lost.decoder.bamDropped() == 1);
+
+	J1939Bam swapped;
+	swapped.announce();
+	CHECK(!swapped.packet(1));
+	CHECK(!swapped.packet(3));
+	CHECK(!swapped.packet(2));
+	CHECK(!swapped.send(4));
+	CHECK(swapped.decoder.bamCompleted() == 0 && swapped.decoder.bamDropped() == 1);
+
+	J1939Bam late;
+	late.announce();
+	CHECK(!late.packet(1));
+	late.now += J1939Decoder::BAM_TIMEOUT - 100;
+	CHECK(!late.packet(2));
+	CHECK(late.decoder.bamDropped() == 0);
+	late.now += J1939Decoder::BAM_TIMEOUT - 99;
+	CHECK(!late.send(3));
+	CHECK(late.decoder.bamCompleted() == 0 && late.decoder.bamDropped() == 1);
+
+	// The next BAM starts afresh
+	late.announce();
+	CHECK(late.send(1));
+	CHECK(late.decoder.bamCompleted() == 1);
+}
+
+// A source announcing a BAM mid-transfer has given up on the previous one
+void testJ1939BamReannounced() {
+	J1939Bam bam;
+	bam.announce();
+	CHECK(!bam.packet(1));
+	CHECK(!bam.packet(2));
+	bam.announce();
+	CHECK(bam.send(1));
+	CHECK(bam.decoder.bamCompleted() == 1 && bam.decoder.bamDropped() == 1);
+	CHECK(j1939Values(bam.decoder, 0x00).size() == 2);
+}
+
+/*************** DTC reader ****************/
+
+CANMessage obdFrame(uint32_t id, const uint8_t *data) {
+	CANMessage message;
+	message.id = id;
+	message.len = 8;
+	memcpy(message.data, data, 8);
+	return message;
+}
+
+// A single frame reply from the engine ECU with up to 2 codes
+void dtcReply(DtcReader &dtc, uint8_t mode, std::vector<uint16_t> codes) {
+	uint8_t data[8] = { (uint8_t)(2 + 2 * codes.size()), (uint8_t)(0x40 + mode), (uint8_t)codes.size() };
+	for (size_t i = 0; i < codes.size(); i++) {
+		data[3 + 2 * i] = codes[i] >> 8;
+		data[4 + 2 * i] = codes[i] & 0xff;
+	}
+	bool flowControl;
+	CHECK(dtc.add(obdFrame(0x7e8, data), flowControl));
+	CHECK(!flowControl);
+}
+
+// A read of both modes, false when it wasn't time for one
+bool dtcRead(DtcReader &dtc, unsigned long now, std::vector<uint16_t> stored,
+		std::vector<uint16_t> pending) {
+	if (dtc.poll(now) != DtcReader::MODE_STORED) {
+		return false;
+	}
+	dtcReply(dtc, DtcReader::MODE_STORED, stored);
+	CHECK(dtc.poll(now + 50) == DtcReader::MODE_PENDING);
+	dtcReply(dtc, DtcReader::MODE_PENDING, pending);
+	CHECK(dtc.poll(now + 100) == 0);
+	return true;
+}
+
+// The changes next() gives out, each as its 3 bytes
+std::vector<uint32_t> dtcChanges(DtcReader &dtc) {
+	std::vector<uint32_t> changes;
+	uint8_t payload[DtcReader::MAX_PAYLOAD];
+	uint8_t len;
+	while (dtc.next(payload, len)) {
+		CHECK(len == 3);
+		changes.push_back((uint32_t)payload[0] << 16 | payload[1] << 8 | payload[2]);
+	}
+	return changes;
+}
+
+// The codes of a single frame reply come out of next() sorted, once
+void testDtcSingleFrame() {
+	DtcReader dtc;
+	CHECK(dtc.poll(0) == DtcReader::MODE_STORED);
+	const uint8_t speed[] = { 0x03, 0x41, 0x0d, 0x35, 0x00, 0x00, 0x00, 0x00 };
+	bool flowControl;
+	CHECK(!dtc.add(obdFrame(0x7e8, speed), flowControl));
+	dtcReply(dtc, DtcReader::MODE_STORED, { 0x0301, 0x0171 });
+	CHECK(dtc.poll(50) == DtcReader::MODE_PENDING);
+	CHECK(dtc.count(DtcReader::MODE_STORED) == 2);
+	CHECK(dtcChanges(dtc) == std::vector<uint32_t>({ 0x830171, 0x830301 }));
+
+	// A late stored reply doesn't count for the pending read
+	dtcReply(dtc, DtcReader::MODE_STORED, { 0x0420 });
+	CHECK(dtc.poll(100) == 0);
+	CHECK(dtc.count(DtcReader::MODE_PENDING) == 0);
+	CHECK(dtcChanges(dtc).empty());
+}
+
+// A reply of 61 codes takes 17 consecutive frames, whose sequence number
+// wraps from 15 to 0. The first MAX_DTCS codes are kept.
+void testDtcMultiFrame() {
+	std::vector<uint8_t> reply = { 0x43, 61 };
+	for (uint16_t i = 0; i < 61; i++) {
+		reply.push_back(0x01);
+		reply.push_back(i + 1);
+	}
+	reply.push_back(0);
+
+	DtcReader dtc;
+	CHECK(dtc.poll(0) == DtcReader::MODE_STORED);
+	uint8_t data[8] = { 0x10, (uint8_t)(reply.size() - 1) };
+	memcpy(data + 2, &reply[0], 6);
+	bool flowControl;
+	CHECK(dtc.add(obdFrame(0x7e8, data), flowControl));
+	CHECK(flowControl);
+	for (uint8_t frame = 1; frame <= 17; frame++) {
+		data[0] = 0x20 | (frame & 0x0f);
+		memcpy(data + 1, &reply[6 + 7 * (frame - 1)], 7);
+		CHECK(dtc.add(obdFrame(0x7e8, data), flowControl));
+		CHECK(!flowControl);
+	}
+	CHECK(dtc.poll(100) == DtcReader::MODE_PENDING);
+	CHECK(dtc.count(DtcReader::MODE_STORED) == DtcReader::MAX_DTCS);
+	std::vector<uint32_t> changes = dtcChanges(dtc);
+	CHECK(changes.size() == DtcReader::MAX_DTCS);
+	CHECK(!changes.empty() && changes.front() == 0x830101);
+	CHECK(!changes.empty() && changes.back() == 0x830100 + DtcReader::MAX_DTCS);
+}
+
+// A lost consecutive frame, or a transfer still going when the read ends,
+// throws the read away instead of clearing the codes, even with another
+// ECU's reply complete
+void testDtcLostFrame() {
+	DtcReader dtc;
+	CHECK(dtcRead(dtc, 0, { 0x0301 }, {}));
+	CHECK(dtcChanges(dtc).size() == 1);
+
+	bool flowControl;
+	const uint8_t first[] = { 0x10, 0x0a, 0x43, 0x04, 0x01, 0x71, 0x01, 0x72 };
+	const uint8_t second[] = { 0x22, 0x01, 0x73, 0x01, 0x74, 0x00, 0x00, 0x00 };
+	const uint8_t other[] = { 0x04, 0x43, 0x01, 0x04, 0x20, 0x00, 0x00, 0x00 };
+	unsigned long now = 100 + dtc.interval();
+	CHECK(dtc.poll(now) == DtcReader::MODE_STORED);
+	CHECK(dtc.add(obdFrame(0x7e8, first), flowControl));
+	CHECK(dtc.add(obdFrame(0x7e9, other), flowControl));
+	CHECK(dtc.add(obdFrame(0x7e8, second), flowControl));
+	CHECK(dtc.poll(now + 50) == DtcReader::MODE_PENDING);
+	CHECK(dtc.count(DtcReader::MODE_STORED) == 1);
+	CHECK(dtc.poll(now + 100) == 0);
+
+	now += 100 + dtc.interval();
+	CHECK(dtc.poll(now) == DtcReader::MODE_STORED);
+	CHECK(dtc.add(obdFrame(0x7e8, first), flowControl));
+	CHECK(dtc.add(obdFrame(0x7e9, other), flowControl));
+	CHECK(dtc.poll(now + 50) == DtcReader::MODE_PENDING);
+	CHECK(dtc.count(DtcReader::MODE_STORED) == 1);
+	CHECK(dtcChanges(dtc).empty());
+}
+
+// Codes added and removed since the last read, stored and pending alike
+void testDtcDiff() {
+	DtcReader dtc;
+	CHECK(dtcRead(dtc, 0, { 0x0301, 0x0420 }, {}));
+	CHECK(dtcChanges(dtc).size() == 2);
+
+	unsigned long now = 100 + dtc.interval();
+	CHECK(dtc.poll(now) == DtcReader::MODE_STORED);
+	dtcReply(dtc, DtcReader::MODE_STORED, { 0x0171, 0x0301 });
+	CHECK(dtc.poll(now + 50) == DtcReader::MODE_PENDING);
+	CHECK(dtcChanges(dtc) == std::vector<uint32_t>({ 0x830171, 0x030420 }));
+
+	dtcReply(dtc, DtcReader::MODE_PENDING, { 0x0455 });
+	CHECK(dtc.poll(now + 100) == 0);
+	CHECK(dtcChanges(dtc) == std::vector<uint32_t>({ 0x870455 }));
+}
+
+// With the MIL off, each read that changes nothing doubles the interval.
+// The MIL coming on or the DTC count changing starts a read at once.
+void testDtcBackoff() {
+	DtcReader dtc(10000, 320000);
+	dtc.status(0, false, 0);
+	unsigned long now = 0;
+	const unsigned long intervals[] = { 20000, 40000, 80000, 160000, 320000, 320000 };
+	for (unsigned long interval : intervals) {
+		CHECK(dtcRead(dtc, now, {}, {}));
+		CHECK(dtc.interval() == interval);
+		CHECK(!dtcRead(dtc, now + 100 + interval - 1, {}, {}));
+		now += 100 + interval;
+	}
+
+	dtc.status(now + 1000, false, 1);
+	CHECK(dtc.interval() == 10000);
+	CHECK(dtcRead(dtc, now + 1000, { 0x0301 }, {}));
+	CHECK(dtc.interval() == 10000);
+	// and the next read without changes backs off again
+	CHECK(dtcRead(dtc, now + 11100, { 0x0301 }, {}));
+	CHECK(dtc.interval() == 20000);
+
+	now += 100000;
+	dtc.status(now, true, 1);
+	CHECK(dtcRead(dtc, now, { 0x0301 }, {}));
+	CHECK(dtcRead(dtc, now + 10100, { 0x0301 }, {}));
+	CHECK(dtc.interval() == 10000);
+}
+
+/*************** Battery ****************/
+
+// Runs update() for ms, counting each battery event
+void runBattery(Carloop<CarloopRevision2> &carloop, unsigned long ms, int *events) {
+	for (unsigned long i = 0; i < ms; i++) {
+		carloop.update();
+		uint8_t flags = carloop.batteryEvents();
+		for (int bit = 0; bit < 3; bit++) {
+			events[bit] += (flags >> bit) & 1;
+		}
+		sim::advance(1000);
+	}
+}
+
+// Crank, charge, idle, engine off, with the ADC noise: each event fires
+// once, as the filtered voltage only leaves the 13.0-13.3 V band once
+// each way
+void testBatteryEvents() {
+	startCar(500000, false);
+	Carloop<CarloopRevision2> carloop;
+	carloop.begin(CARLOOP_BATTERY);
+	int events[3] = {};
+	runBattery(carloop, 5000, events);
+	CHECK(events[0] == 0 && events[1] == 0 && events[2] == 0);
+	CHECK(!carloop.batteryCharging());
+
+	sim::crankingUntil = sim::now() + 800000;
+	runBattery(carloop, 800, events);
+	CHECK(events[0] == 1 && events[1] == 0);
+	sim::bus.powered = true;
+	runBattery(carloop, 20000, events);
+	CHECK(events[0] == 1 && events[1] == 1 && events[2] == 0);
+	CHECK(carloop.batteryCharging());
+
+	// The alternator sagging at idle into the band changes nothing
+	sim::chargingMillivolts = 13150;
+	runBattery(carloop, 20000, events);
+	CHECK(events[0] == 1 && events[1] == 1 && events[2] == 0);
+	CHECK(carloop.batteryCharging());
+	sim::chargingMillivolts = 14100;
+
+	sim::bus.powered = false;
+	runBattery(carloop, 20000, events);
+	CHECK(events[0] == 1 && events[1] == 1 && events[2] == 1);
+	CHECK(!carloop.batteryCharging());
+	CHECK(abs(carloop.batteryMillivolts() - 12500) < 100);
+	sim::crankingUntil = 0;
+}
+
+} // namespace
+
+int main() {
+	testGeodesy();
+	testGeoOdometer();
+	testTrackSimplifier();
+	testTimeBaseDrift();
+	testTimeBaseDropout();
+	testTimeBaseLeapSecond();
+	testUbxCapture();
+	testUbxErrors();
+	testUbxLength();
+	testCanDetectionSilent();
+	testCanDetectionSpeed();
+	testCanDetectionNonBlocking();
+	testSchedulerFull();
+	testEcuTrackerPrimary();
+	testRetransmitHeld();
+	testDerivedArithmetic();
+	testDerivedInputs();
+	testDerivedTiming();
+	testPowerChargingLevel();
+	testNmeaCombinedTalker();
+	testNmeaGsa();
+	testNmeaGsv();
+	testNmeaVtg();
+	testNmeaCustoms();
+	testJ1939Frames();
+	testJ1939Bits();
+	testJ1939BamInOrder();
+	testJ1939BamLost();
+	testJ1939BamReannounced();
+	testDtcSingleFrame();
+	testDtcMultiFrame();
+	testDtcLostFrame();
+	testDtcDiff();
+	testDtcBackoff();
+	testBatteryEvents();
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	fprintf(stderr, "all tests passed\n");
+	return 0;
+}
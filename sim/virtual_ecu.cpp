@@ -0,0 +1,471 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "virtual_ecu.h"
+#include "can_log.h"
+
+namespace {
+
+const uint32_t OBD_BROADCAST_ID = 0x7df;
+const uint32_t OBD_BROADCAST_ID_29 = 0x18db33f1;
+const uint8_t OBD_MODE_CURRENT_DATA = 0x01;
+const uint8_t OBD_MODE_STORED_DTCS = 0x03;
+const uint8_t OBD_MODE_PENDING_DTCS = 0x07;
+// ISO-TP separation time the ECU keeps between consecutive frames
+const uint64_t CONSECUTIVE_FRAME_GAP_US = 1000;
+
+struct TraceValue
+{
+	uint8_t pid;
+	uint8_t len;
+	uint8_t value[2][4];
+};
+
+// The two polling cycles of the README.md trace. 0x01 and 0x41-0x4c
+// are in its supported bitmaps but not in the trace; plausible values.
+const TraceValue TRACE[] = {
+	{ 0x01, 4, { { 0x00, 0x07, 0xe5, 0x00 }, { 0x00, 0x07, 0xe5, 0x00 } } },
+	{ 0x04, 1, { { 0x58 }, { 0x67 } } },
+	{ 0x05, 1, { { 0x73 }, { 0x74 } } },
+	{ 0x06, 1, { { 0x81 }, { 0x80 } } },
+	{ 0x07, 1, { { 0x7b }, { 0x7b } } },
+	{ 0x0c, 2, { { 0x1c, 0xa6 }, { 0x1c, 0x8c } } },
+	{ 0x0d, 1, { { 0x35 }, { 0x35 } } },
+	{ 0x0e, 1, { { 0xb6 }, { 0xb1 } } },
+	{ 0x0f, 1, { { 0x3f }, { 0x3f } } },
+	{ 0x10, 2, { { 0x03, 0x7b }, { 0x03, 0xe5 } } },
+	{ 0x11, 1, { { 0x39 }, { 0x3b } } },
+	{ 0x15, 2, { { 0x9b, 0xff }, { 0x97, 0xff } } },
+	{ 0x1f, 2, { { 0x01, 0x05 }, { 0x01, 0x09 } } },
+	{ 0x21, 2, { { 0x2a, 0x47 }, { 0x2a, 0x47 } } },
+	{ 0x2e, 1, { { 0xff }, { 0xff } } },
+	{ 0x2f, 1, { { 0xb3 }, { 0xb3 } } },
+	{ 0x30, 1, { { 0xa8 }, { 0xa8 } } },
+	{ 0x31, 2, { { 0x2a, 0x0f }, { 0x2a, 0x0f } } },
+	{ 0x33, 1, { { 0x65 }, { 0x65 } } },
+	{ 0x34, 4, { { 0x7f, 0x70, 0x7f, 0xfb }, { 0x7e, 0xd8, 0x7f, 0xfa } } },
+	{ 0x3c, 2, { { 0x18, 0x09 }, { 0x18, 0x73 } } },
+	{ 0x40, 4, { { 0xfe, 0xd0, 0x00, 0x00 }, { 0xfe, 0xd0, 0x00, 0x00 } } },
+	{ 0x41, 4, { { 0x00, 0x07, 0xe5, 0x00 }, { 0x00, 0x07, 0xe5, 0x00 } } },
+	{ 0x42, 2, { { 0x37, 0x14 }, { 0x37, 0x32 } } },
+	{ 0x43, 2, { { 0x00, 0x5c }, { 0x00, 0x68 } } },
+	{ 0x44, 2, { { 0x80, 0x00 }, { 0x7f, 0xc4 } } },
+	{ 0x45, 1, { { 0x14 }, { 0x16 } } },
+	{ 0x46, 1, { { 0x2e }, { 0x2e } } },
+	{ 0x47, 1, { { 0x30 }, { 0x31 } } },
+	{ 0x49, 1, { { 0x26 }, { 0x28 } } },
+	{ 0x4a, 1, { { 0x13 }, { 0x14 } } },
+	{ 0x4c, 1, { { 0x12 }, { 0x13 } } },
+};
+
+} // namespace
+
+VirtualEcu::VirtualEcu(uint32_t replyId, uint32_t latencyUs, uint32_t jitterUs)
+	: latency(latencyUs), jitter(jitterUs), replyId(replyId), snapshotPeriod(3700000) {
+}
+
+VirtualEcu VirtualEcu::fromTrace(uint32_t replyId, uint32_t latencyUs, uint32_t jitterUs) {
+	VirtualEcu ecu(replyId, latencyUs, jitterUs);
+	for (const TraceValue &v : TRACE) {
+		ecu.set(v.pid, v.value[0], v.len, 0);
+		ecu.set(v.pid, v.value[1], v.len, 1);
+	}
+	return ecu;
+}
+
+VirtualEcu VirtualEcu::transmission(uint32_t replyId, uint32_t latencyUs, uint32_t jitterUs) {
+	VirtualEcu ecu(replyId, latencyUs, jitterUs);
+	const uint8_t speed = 0x35;
+	ecu.set(0x0d, &speed, 1);
+	return ecu;
+}
+
+void VirtualEcu::set(uint8_t pid, const uint8_t *value, uint8_t len, uint8_t snapshot) {
+	values[snapshot & 1][pid].assign(value, value + len);
+}
+
+void VirtualEcu::setDtcs(uint8_t mode, const std::vector<uint16_t> &codes) {
+	(mode == OBD_MODE_STORED_DTCS ? storedDtcs : pendingDtcs) = codes;
+}
+
+uint32_t VirtualEcu::physicalId() const {
+	return extended() ? 0x18da00f1 | ((replyId & 0xff) << 8) : replyId - 8;
+}
+
+bool VirtualEcu::accepts(const CANMessage &request) const {
+	if (request.rtr || request.extended != extended() || request.len < 2) {
+		return false;
+	}
+	uint8_t mode = request.data[1];
+	if (!(mode == OBD_MODE_CURRENT_DATA && request.len >= 3) &&
+			mode != OBD_MODE_STORED_DTCS && mode != OBD_MODE_PENDING_DTCS) {
+		return false;
+	}
+	return request.id == (extended() ? OBD_BROADCAST_ID_29 : OBD_BROADCAST_ID) ||
+		request.id == physicalId();
+}
+
+bool VirtualEcu::reply(const CANMessage &request, uint64_t now, CANMessage &out) {
+	if (!accepts(request)) {
+		return false;
+	}
+	if (request.data[1] != OBD_MODE_CURRENT_DATA) {
+		return replyDtcs(request.data[1], out);
+	}
+
+	uint8_t pid = request.data[2];
+	uint8_t value[4];
+	uint8_t len;
+	const Values &current = values[(now / snapshotPeriod) & 1];
+	Values::const_iterator it = current.find(pid);
+	const std::vector<uint8_t> *found = it != current.end() ? &it->second : NULL;
+	if (!found && (it = values[0].find(pid)) != values[0].end()) {
+		found = &it->second;
+	}
+	if (found) {
+		len = found->size();
+		memcpy(value, found->data(), len);
+	} else if (pid % 0x20 == 0) {
+		uint32_t supported = supportedPids(pid);
+		if (!supported) {
+			return false;
+		}
+		len = 4;
+		for (int i = 0; i < 4; i++) {
+			value[i] = supported >> (24 - 8 * i);
+		}
+	} else {
+		return false;
+	}
+
+	out = CANMessage();
+	out.id = replyId;
+	out.extended = extended();
+	out.len = 8;
+	memset(out.data, 0x55, sizeof(out.data));
+	out.data[0] = 2 + len;
+	out.data[1] = 0x40 + OBD_MODE_CURRENT_DATA;
+	out.data[2] = pid;
+	memcpy(out.data + 3, value, len);
+	return true;
+}
+
+// Count and codes, in a single frame when they fit
+bool VirtualEcu::replyDtcs(uint8_t mode, CANMessage &out) {
+	const std::vector<uint16_t> &codes = mode == OBD_MODE_STORED_DTCS ? storedDtcs : pendingDtcs;
+	std::vector<uint8_t> data;
+	data.push_back(0x40 + mode);
+	data.push_back(codes.size());
+	for (uint16_t code : codes) {
+		data.push_back(code >> 8);
+		data.push_back(code & 0xff);
+	}
+
+	out = CANMessage();
+	out.id = replyId;
+	out.extended = extended();
+	out.len = 8;
+	memset(out.data, 0x55, sizeof(out.data));
+	if (data.size() <= 7) {
+		out.data[0] = data.size();
+		memcpy(out.data + 1, data.data(), data.size());
+		transfer.clear();
+		return true;
+	}
+	out.data[0] = 0x10 | (data.size() >> 8);
+	out.data[1] = data.size() & 0xff;
+	memcpy(out.data + 2, data.data(), 6);
+	transfer.assign(data.begin() + 6, data.end());
+	return true;
+}
+
+bool VirtualEcu::flowControl(const CANMessage &request, std::vector<CANMessage> &out) {
+	if (transfer.empty() || request.id != physicalId() || request.extended != extended() ||
+			(request.data[0] >> 4) != 3) {
+		return false;
+	}
+	for (size_t at = 0, sequence = 1; at < transfer.size(); at += 7, sequence++) {
+		CANMessage frame;
+		frame.id = replyId;
+		frame.extended = extended();
+		frame.len = 8;
+		memset(frame.data, 0x55, sizeof(frame.data));
+		frame.data[0] = 0x20 | (sequence & 0x0f);
+		size_t bytes = transfer.size() - at < 7 ? transfer.size() - at : 7;
+		memcpy(frame.data + 1, transfer.data() + at, bytes);
+		out.push_back(frame);
+	}
+	transfer.clear();
+	return true;
+}
+
+// Bit 31 is PID base + 1, bit 0 says whether the next range has any
+uint32_t VirtualEcu::supportedPids(uint8_t base) const {
+	uint32_t bits = 0;
+	for (const auto &entry : values[0]) {
+		uint8_t pid = entry.first;
+		if (pid > base && pid <= base + 0x20) {
+			bits |= 1u << (32 - (pid - base));
+		}
+		if (pid > base + 0x20) {
+			bits |= 1;
+		}
+	}
+	return bits;
+}
+
+VirtualBus::VirtualBus(uint32_t seed)
+	: bitrate(500000), powered(true), log(NULL), logStart(0), logAt(0), logPending(false), seq(0), rng(seed ? seed : 1) {
+}
+
+void VirtualBus::addBroadcast(uint32_t id, uint32_t periodUs, bool changing) {
+	Broadcast b = { id, periodUs, changing, periodUs, 0 };
+	broadcasts.push_back(b);
+}
+
+void VirtualBus::addNoise(unsigned count) {
+	// 0x130 every 100 ms is the one application.cpp filters
+	static const struct { uint32_t id; uint32_t period; bool changing; } NOISE[] = {
+		{ 0x130, 100000, true },
+		{ 0x1a0, 20000, true },
+		{ 0x3e8, 500000, false },
+		{ 0x280, 10000, true },
+		{ 0x0c9, 12500, true },
+		{ 0x4f0, 1000000, false },
+	};
+	for (unsigned i = 0; i < count && i < sizeof(NOISE) / sizeof(NOISE[0]); i++) {
+		addBroadcast(NOISE[i].id, NOISE[i].period, NOISE[i].changing);
+	}
+}
+
+namespace {
+
+// J1939 IDs of the truck's engine, source address 0, and what it sends
+const uint32_t TRUCK_EEC1 = 0x0cf00400;
+const uint32_t TRUCK_VD = 0x18fee000;
+const uint32_t TRUCK_ET1 = 0x18feee00;
+const uint32_t TRUCK_EFL_P1 = 0x18feef00;
+const uint32_t TRUCK_CCVS1 = 0x18fef100;
+const uint32_t TRUCK_LFE1 = 0x18fef200;
+const uint32_t TRUCK_VEP1 = 0x18fef700;
+// The EC1 BAM, announced to everyone
+const uint32_t TRUCK_TP_CM = 0x1cecff00;
+const uint32_t TRUCK_TP_DT = 0x1cebff00;
+const uint32_t TRUCK_EC1 = 65251;
+const uint8_t TRUCK_EC1_SIZE = 39;
+// Between the packets of a BAM, J1939-21 asks for 50-200 ms
+const uint64_t TRUCK_BAM_GAP_US = 50000;
+// Proprietary B PGNs from the body controller, source address 0x21
+const uint32_t TRUCK_FILLER = 0x18ff0021;
+
+void putLittleEndian(uint8_t *data, uint32_t value, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		data[i] = value >> (8 * i);
+	}
+}
+
+} // namespace
+
+void VirtualBus::addTruck(unsigned fillers) {
+	static const struct { uint32_t id; uint32_t period; } PGNS[] = {
+		{ TRUCK_EEC1, 10000 },
+		{ TRUCK_CCVS1, 100000 },
+		{ TRUCK_LFE1, 100000 },
+		{ TRUCK_EFL_P1, 500000 },
+		{ TRUCK_ET1, 1000000 },
+		{ TRUCK_VEP1, 1000000 },
+		{ TRUCK_VD, 1000000 },
+		{ TRUCK_TP_CM, 5000000 },
+	};
+	for (const auto &pgn : PGNS) {
+		Broadcast b = { pgn.id, pgn.period, true, pgn.period, 0 };
+		truck.push_back(b);
+	}
+	// Spread out over the period, as they would be on the wire
+	for (unsigned i = 0; i < fillers && i < 256; i++) {
+		Broadcast b = { TRUCK_FILLER | (i << 8), 20000, true, 20000 + i * 20000 / fillers, 0 };
+		truck.push_back(b);
+	}
+}
+
+void VirtualBus::replay(CanLog *log, uint64_t startUs) {
+	this->log = log;
+	logStart = startUs;
+	logAt = 0;
+	logPending = false;
+}
+
+bool VirtualBus::transmit(const CANMessage &message, uint64_t now) {
+	// The nodes of a recorded car or a truck acknowledge frames too
+	if (!powered || (ecus.empty() && !log && truck.empty())) {
+		return false;
+	}
+	generate(now);
+	for (VirtualEcu &ecu : ecus) {
+		CANMessage reply;
+		if (ecu.reply(message, now, reply)) {
+			uint32_t jitter = ecu.jitter ? random() % (ecu.jitter + 1) : 0;
+			schedule(now + ecu.latency + jitter, reply);
+		}
+		std::vector<CANMessage> frames;
+		if (ecu.flowControl(message, frames)) {
+			for (size_t i = 0; i < frames.size(); i++) {
+				schedule(now + (i + 1) * CONSECUTIVE_FRAME_GAP_US, frames[i]);
+			}
+		}
+	}
+	return true;
+}
+
+bool VirtualBus::next(CANMessage &message, uint64_t now) {
+	generate(now);
+	if (wire.empty() || wire.top().at > now) {
+		return false;
+	}
+	message = wire.top().message;
+	wire.pop();
+	return true;
+}
+
+size_t VirtualBus::due(uint64_t now) {
+	generate(now);
+	// Only the order matters to callers, so count without popping
+	std::priority_queue<Frame> copy = wire;
+	size_t count = 0;
+	while (!copy.empty() && copy.top().at <= now) {
+		copy.pop();
+		count++;
+	}
+	return count;
+}
+
+void VirtualBus::flush(uint64_t now) {
+	CANMessage message;
+	while (next(message, now)) {
+	}
+}
+
+// xorshift32, so runs with the same seed are identical
+uint32_t VirtualBus::random() {
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+void VirtualBus::schedule(uint64_t at, const CANMessage &message) {
+	Frame frame = { at, seq++, message };
+	wire.push(frame);
+}
+
+// Values vary over a 30 s cycle: the truck speeds up from 60 to 89 km/h
+void VirtualBus::sendTruckPgn(const Broadcast &b) {
+	uint32_t step = (b.next / 1000000) % 30;
+	CANMessage message;
+	message.id = b.id;
+	message.extended = true;
+	message.len = 8;
+	memset(message.data, 0xff, sizeof(message.data));
+
+	switch (b.id) {
+	case TRUCK_EEC1:
+		message.data[2] = 125 + 40; // 40% torque
+		putLittleEndian(message.data + 3, (1200 + step * 20) * 8, 2);
+		break;
+	case TRUCK_CCVS1:
+		putLittleEndian(message.data + 1, (60 + step) * 256, 2);
+		break;
+	case TRUCK_LFE1:
+		putLittleEndian(message.data, (10 + step / 2) * 20, 2); // L/h
+		break;
+	case TRUCK_EFL_P1:
+		message.data[3] = 400 / 4; // kPa
+		break;
+	case TRUCK_ET1:
+		message.data[0] = 40 + 85 + step / 10; // ˚C
+		break;
+	case TRUCK_VEP1:
+		putLittleEndian(message.data + 4, 28200 / 50, 2); // mV
+		break;
+	case TRUCK_VD:
+		// 75 km/h on average, in eighths of a km
+		putLittleEndian(message.data + 4, 987654 * 8 + b.next / 6000000, 4);
+		break;
+	case TRUCK_TP_CM: {
+		// EC1: engine speeds and torques at its map points, with the
+		// reference torque of 2300 Nm in bytes 20-21
+		uint8_t ec1[42];
+		memset(ec1, 0xff, sizeof(ec1));
+		putLittleEndian(ec1 + 19, 2300, 2);
+		uint8_t packets = (TRUCK_EC1_SIZE + 6) / 7;
+		message.data[0] = 32;
+		putLittleEndian(message.data + 1, TRUCK_EC1_SIZE, 2);
+		message.data[3] = packets;
+		putLittleEndian(message.data + 5, TRUCK_EC1, 3);
+		schedule(b.next, message);
+		for (uint8_t i = 0; i < packets; i++) {
+			message.id = TRUCK_TP_DT;
+			message.data[0] = i + 1;
+			memcpy(message.data + 1, ec1 + 7 * i, 7);
+			schedule(b.next + (i + 1) * TRUCK_BAM_GAP_US, message);
+		}
+		return;
+	}
+	default:
+		putLittleEndian(message.data, b.count, 4);
+		break;
+	}
+	schedule(b.next, message);
+}
+
+void VirtualBus::generate(uint64_t now) {
+	for (Broadcast &b : broadcasts) {
+		while (b.next <= now) {
+			if (powered) {
+				CANMessage message;
+				message.id = b.id;
+				message.len = 8;
+				uint32_t step = b.changing ? b.count / 4 : 0;
+				for (int i = 0; i < 8; i++) {
+					message.data[i] = (b.id >> (i & 1 ? 0 : 8)) + step * (i + 1);
+				}
+				schedule(b.next, message);
+				b.count++;
+			}
+			b.next += b.period;
+		}
+	}
+
+	for (Broadcast &b : truck) {
+		while (b.next <= now) {
+			if (powered) {
+				sendTruckPgn(b);
+			}
+			b.count++;
+			b.next += b.period;
+		}
+	}
+
+	while (log && logStart + logAt <= now) {
+		if (logPending && powered) {
+			schedule(logStart + logAt, logMessage);
+		}
+		logPending = log->next(logAt, logMessage);
+		if (!logPending) {
+			log = NULL;
+		}
+	}
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Simulated OBD-II ECUs on a simulated CAN bus.
+ *
+ * Each VirtualEcu answers Mode 01 requests, functional or addressed to
+ * it, after a configurable latency plus random jitter, and Mode 03 and
+ * 07 requests for its DTCs, in several frames when they don't fit one. The bus also
+ * carries periodic broadcast frames unrelated to OBD, as a real car
+ * does. Frames are delivered to the firmware's CANChannel in time order
+ * once the virtual clock reaches them; a channel started at the wrong
+ * bitrate sees errors instead, and so does a request nobody is there
+ * to acknowledge. A recorded candump log can be replayed on the bus
+ * alongside, or instead of, the simulated ECUs, and so can the J1939
+ * broadcasts of a truck.
+ */
+
+#ifndef __VirtualEcu_h
+#define __VirtualEcu_h
+
+#include "application.h"
+#include <map>
+#include <queue>
+#include <vector>
+
+class CanLog;
+
+class VirtualEcu {
+public:
+	// replyId is 0x7E8-0x7EF, or 0x18DAF1xx with 29-bit addressing
+	VirtualEcu(uint32_t replyId, uint32_t latencyUs, uint32_t jitterUs);
+
+	// The engine ECU of the car in README.md, two snapshots of the trace
+	static VirtualEcu fromTrace(uint32_t replyId, uint32_t latencyUs, uint32_t jitterUs);
+	// A second ECU answering the supported PIDs and vehicle speed only
+	static VirtualEcu transmission(uint32_t replyId, uint32_t latencyUs, uint32_t jitterUs);
+
+	// Values alternate between snapshots every period
+	void set(uint8_t pid, const uint8_t *value, uint8_t len, uint8_t snapshot = 0);
+	void setSnapshotPeriod(uint32_t us) { snapshotPeriod = us; }
+	// The DTCs reported for Mode 03 (stored) or 07 (pending)
+	void setDtcs(uint8_t mode, const std::vector<uint16_t> &codes);
+
+	bool extended() const { return replyId > 0x7ff; }
+	bool accepts(const CANMessage &request) const;
+	// Fills the reply to a request received at now, the first frame
+	// of it when it takes several
+	bool reply(const CANMessage &request, uint64_t now, CANMessage &out);
+	// The rest of a reply, once the flow control frame comes in
+	bool flowControl(const CANMessage &request, std::vector<CANMessage> &out);
+
+	uint32_t latency;
+	uint32_t jitter;
+
+private:
+	typedef std::map<uint8_t, std::vector<uint8_t> > Values;
+	uint32_t supportedPids(uint8_t base) const;
+	uint32_t physicalId() const;
+	bool replyDtcs(uint8_t mode, CANMessage &out);
+
+	uint32_t replyId;
+	Values values[2];
+	uint32_t snapshotPeriod;
+	std::vector<uint16_t> storedDtcs;
+	std::vector<uint16_t> pendingDtcs;
+	// What's left of a multi-frame reply, waiting for flow control
+	std::vector<uint8_t> transfer;
+};
+
+class VirtualBus {
+public:
+	explicit VirtualBus(uint32_t seed = 1);
+
+	unsigned long bitrate;
+	// With the ignition off ECUs don't answer and broadcasts stop
+	bool powered;
+
+	void addEcu(const VirtualEcu &ecu) { ecus.push_back(ecu); }
+	VirtualEcu &ecu(size_t index) { return ecus[index]; }
+	// A periodic broadcast frame; when changing is set its data changes
+	// every few periods
+	void addBroadcast(uint32_t id, uint32_t periodUs, bool changing);
+	// The first few broadcasts of a typical car
+	void addNoise(unsigned count);
+	// The J1939 broadcasts of a truck's engine, with an EC1 BAM every
+	// 5 s, plus as many proprietary PGNs every 20 ms; 32 fill 250 kbps
+	void addTruck(unsigned fillers);
+	// Puts the frames of a log on the wire at their recorded times,
+	// shifted to start at startUs
+	void replay(CanLog *log, uint64_t startUs);
+	// True once every frame of the log is on the wire
+	bool replayDone() const { return !log; }
+	// Time of the last frame taken from the log so far
+	uint64_t replayEnd() const { return logStart + logAt; }
+
+	// From CANChannel: false when no ECU acknowledged the frame
+	bool transmit(const CANMessage &message, uint64_t now);
+	// Next frame on the wire at or before now, oldest first
+	bool next(CANMessage &message, uint64_t now);
+	// Frames on the wire at or before now
+	size_t due(uint64_t now);
+	// Drops everything sent before now, for a channel that wasn't listening
+	void flush(uint64_t now);
+
+	uint32_t random();
+
+private:
+	struct Frame
+	{
+		uint64_t at;
+		uint64_t seq;
+		CANMessage message;
+		bool operator<(const Frame &other) const
+		{
+			return at != other.at ? at > other.at : seq > other.seq;
+		}
+	};
+
+	struct Broadcast
+	{
+		uint32_t id;
+		uint32_t period;
+		bool changing;
+		uint64_t next;
+		uint32_t count;
+	};
+
+	void schedule(uint64_t at, const CANMessage &message);
+	void generate(uint64_t now);
+	void sendTruckPgn(const Broadcast &b);
+
+	std::vector<VirtualEcu> ecus;
+	std::vector<Broadcast> broadcasts;
+	std::vector<Broadcast> truck;
+	std::priority_queue<Frame> wire;
+	CanLog *log;
+	uint64_t logStart;
+	uint64_t logAt;
+	CANMessage logMessage;
+	bool logPending;
+	uint64_t seq;
+	uint32_t rng;
+};
+
+#endif // def(__VirtualEcu_h)
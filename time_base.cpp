@@ -0,0 +1,162 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "time_base.h"
+
+// Drift is only measured over at least this long, so jitter averages out
+static constexpr uint32_t MIN_DRIFT_INTERVAL_MS = 60000;
+// Re-anchoring well before millis() differences could overflow
+static constexpr uint32_t MAX_ANCHOR_AGE_MS = 0x40000000UL;
+// GPS time further than this from recent cloud time is not trusted
+static constexpr int64_t MAX_CLOUD_DISAGREEMENT_MS = 2000;
+static constexpr uint32_t MAX_CLOUD_AGE_MS = 600000;
+// Clocks are off by less than 1000 ppm, anything more is a bad sample
+static constexpr int64_t MAX_DRIFT_Q32 = 4294967LL;
+
+static int64_t daysFromCivil(int32_t y, uint32_t m, uint32_t d)
+{
+    y -= m <= 2;
+    int32_t era = (y >= 0 ? y : y - 399) / 400;
+    uint32_t yoe = (uint32_t)(y - era * 400);
+    uint32_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (int64_t)era * 146097 + (int64_t)doe - 719468;
+}
+
+TimeBase::TimeBase()
+    : source(SOURCE_NONE), anchorMillis(0), anchorUtc(0), driftQ32(0), driftMillis(0), driftUtc(0),
+    leapMs(0), leapPending(false), cloudSeconds(0), cloudMillis(0), hasCloud(false)
+{
+}
+
+// static
+uint64_t TimeBase::gpsToUnixMs(uint32_t date, uint32_t time)
+{
+    uint32_t day = date / 10000;
+    uint32_t month = (date / 100) % 100;
+    uint32_t year = 2000 + date % 100;
+    uint32_t hour = time / 1000000;
+    uint32_t minute = (time / 10000) % 100;
+    uint32_t second = (time / 100) % 100;
+    uint32_t ms = (time % 100) * 10;
+    if(second == 60)
+    {
+        // Leap second, hold at the end of second 59
+        second = 59;
+        ms = 999;
+    }
+    int64_t days = daysFromCivil(year, month, day);
+    return (uint64_t)(((days * 24 + hour) * 60 + minute) * 60 + second) * 1000 + ms;
+}
+
+uint64_t TimeBase::nowUtc(unsigned long now) const
+{
+    if(!isValid())
+        return 0;
+    // Signed, so times shortly before the anchor work too
+    int32_t elapsed = (int32_t)(now - anchorMillis);
+    return anchorUtc + elapsed + (((int64_t)elapsed * driftQ32) >> 32);
+}
+
+void TimeBase::gpsTime(unsigned long at, uint32_t date, uint32_t time)
+{
+    uint32_t day = date / 10000;
+    uint32_t month = (date / 100) % 100;
+    if(day < 1 || day > 31 || month < 1 || month > 12)
+        return;
+
+    bool leap = (time / 100) % 100 == 60;
+    uint64_t utc = gpsToUnixMs(date, time);
+    if(hasCloud && (uint32_t)(at - cloudMillis) < MAX_CLOUD_AGE_MS)
+    {
+        int64_t cloudUtc = (int64_t)cloudSeconds * 1000 + (uint32_t)(at - cloudMillis);
+        int64_t difference = (int64_t)utc - cloudUtc;
+        if(difference > MAX_CLOUD_DISAGREEMENT_MS || difference < -MAX_CLOUD_DISAGREEMENT_MS)
+            return;
+    }
+
+    // Samples in a leap second are held at the end of second 59, so they
+    // are no use for the drift or the anchor. Unix time leaves the second
+    // out, so it is added back to the measured span once it is over.
+    if(leap)
+    {
+        leapPending = source == SOURCE_GPS;
+        return;
+    }
+
+    if(source == SOURCE_GPS)
+    {
+        if(leapPending)
+        {
+            // Re-anchor right away, the mapping is a second ahead now
+            leapPending = false;
+            leapMs += 1000;
+        }
+        else if((uint32_t)(at - anchorMillis) < MIN_DRIFT_INTERVAL_MS)
+            return;
+
+        // Rate error over the whole span since the drift reference, so the
+        // jitter of individual samples shrinks as the span grows
+        uint32_t span = at - driftMillis;
+        if(span >= MIN_DRIFT_INTERVAL_MS)
+        {
+            int64_t error = (int64_t)(utc - driftUtc) + leapMs - (int64_t)span;
+            int64_t measured = (error << 32) / (int64_t)span;
+            if(measured <= MAX_DRIFT_Q32 && measured >= -MAX_DRIFT_Q32)
+                driftQ32 = (int32_t)measured;
+        }
+        if(span >= MAX_ANCHOR_AGE_MS)
+        {
+            driftMillis = at;
+            driftUtc = utc;
+            leapMs = 0;
+        }
+    }
+    else
+    {
+        driftMillis = at;
+        driftUtc = utc;
+        leapMs = 0;
+    }
+
+    anchor(at, utc, SOURCE_GPS);
+}
+
+void TimeBase::cloudTime(unsigned long at, uint32_t unixSeconds)
+{
+    cloudSeconds = unixSeconds;
+    cloudMillis = at;
+    hasCloud = true;
+
+    // Whole seconds are only good enough when there is nothing better
+    if(source == SOURCE_NONE)
+        anchor(at, (uint64_t)unixSeconds * 1000, SOURCE_CLOUD);
+}
+
+void TimeBase::update(unsigned long now)
+{
+    // Keep the elapsed time in nowUtc() far from overflowing during a long
+    // reference dropout by moving the anchor along the current mapping
+    if(isValid() && (uint32_t)(now - anchorMillis) >= MAX_ANCHOR_AGE_MS)
+        anchor(now, nowUtc(now), source);
+}
+
+void TimeBase::anchor(unsigned long at, uint64_t utc, Source_e newSource)
+{
+    anchorMillis = at;
+    anchorUtc = utc;
+    source = newSource;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __TimeBase_h
+#define __TimeBase_h
+
+#include "application.h"
+
+/* Maps millis() to UTC milliseconds since the Unix epoch.
+ *
+ * The mapping is utc = anchorUtc + d + d * drift, where d is the time in
+ * millis() since the anchor and drift is the measured rate error of the
+ * device clock. nowUtc() is one 32x32 multiply and two adds.
+ *
+ * GPS time is the primary reference. Cloud time only has whole seconds, so
+ * it is used to get started and to sanity check GPS time: until a receiver has
+ * downloaded the almanac, its UTC can be off by the GPS-UTC leap second count.
+ * A leap second (second 60) is folded into the last millisecond of second 59
+ * by gpsToUnixMs(). gpsTime() skips those samples and keeps the inserted
+ * second out of the drift measurement; one missed in a GPS dropout isn't.
+ *
+ * Drift is measured over the whole time GPS has been available, so after the
+ * first hour it is typically known to a few ppm. Without a reference the last
+ * mapping is extrapolated, so a GPS dropout only costs that residual drift.
+ * sim/test.cpp checks both, and the drift across a leap second.
+ */
+class TimeBase
+{
+public:
+    enum Source_e
+    {
+        SOURCE_NONE,
+        SOURCE_CLOUD,
+        SOURCE_GPS
+    };
+
+    TimeBase();
+
+    // date as DDMMYY, time as HHMMSSCC (TinyGPSDate/TinyGPSTime values),
+    // at is millis() when the sentence was received
+    void gpsTime(unsigned long at, uint32_t date, uint32_t time);
+    // Unix seconds from the cloud, at is millis() when it was read
+    void cloudTime(unsigned long at, uint32_t unixSeconds);
+    // Call every so often, at least once every few days
+    void update(unsigned long now);
+
+    bool isValid() const { return source != SOURCE_NONE; }
+    Source_e timeSource() const { return source; }
+    // 0 when not valid
+    uint64_t nowUtc(unsigned long now) const;
+
+    static uint64_t gpsToUnixMs(uint32_t date, uint32_t time);
+
+private:
+    void anchor(unsigned long at, uint64_t utc, Source_e newSource);
+
+    Source_e source;
+    unsigned long anchorMillis;
+    uint64_t anchorUtc;
+    int32_t driftQ32; // (true rate / millis() rate - 1) * 2^32
+    unsigned long driftMillis; // first GPS sample of the drift measurement
+    uint64_t driftUtc;
+    uint32_t leapMs; // leap seconds since the drift reference, missing from driftUtc
+    bool leapPending;
+    uint32_t cloudSeconds;
+    unsigned long cloudMillis;
+    bool hasCloud;
+};
+
+#endif // def(__TimeBase_h)
@@ -0,0 +1,598 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Streaming decoder for the `m` events published by the firmware.
+ *
+ * Reads a Particle server-sent event stream on stdin, for example from
+ *
+ *     curl -sN https://api.particle.io/v1/devices/events/m?access_token=... | obd_ingest
+ *
+ * or from a recorded file, and writes one line per decoded record:
+ *
+ *     <coreid> <boot> <device ms> <utc ms> <type> <payload hex>
+ *
+ * Records of `b` events, burst captures, have their type prefixed by b.
+ * Chunks failing their CRC count as malformed. A chunk the device
+ * resent after a NACK is decoded if it's still missing and dropped as a
+ * duplicate otherwise.
+ *
+ * Decoder state is kept per device (see README.md, "Rebuilding timestamps").
+ * The number of tracked devices is bounded and idle devices are evicted.
+ *
+ * With --generate it instead writes a synthetic event stream for a fleet
+ * of simulated vehicles, to use as a load generator:
+ *
+ *     obd_ingest --generate 5000 1000000 | obd_ingest --stats > /dev/null
+ *
+ * Build with: g++ -std=c++11 -O2 -o obd_ingest tools/obd_ingest.cpp
+ * The decoder's tests are in tools/obd_ingest_test.cpp.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+const size_t MAX_DEVICES = 100000;
+// Particle device IDs are 24 hex digits, anything much longer is malformed
+const size_t MAX_COREID = 64;
+const int64_t IDLE_EVICT_MS = 6 * 3600 * 1000LL;
+// A chunk whose anchor is at most this much older than the newest one is
+// taken as delivered out of order, further back as a reboot
+const uint32_t REORDER_WINDOW_MS = 30000;
+// Sequence numbers remembered per device, for reordered, resent and
+// duplicate chunks
+const uint16_t SEQUENCE_WINDOW = 64;
+
+// Version 1 chunks have no UTC anchor in the header, version 2 no
+// sequence number and CRC
+const uint8_t CHUNK_VERSION = 3;
+const uint8_t CHUNK_RESENT = 0x80;
+const size_t CHUNK_HEADER_SIZE_V1 = 5;
+const size_t CHUNK_HEADER_SIZE_V2 = 11;
+const size_t CHUNK_HEADER_SIZE = 15;
+const size_t MAX_CHUNK_SIZE = 196;
+
+const char en85[] =
+	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz!#$%&()*+-;<=>?@^_`{|}~";
+int8_t de85[256];
+
+void initBase85() {
+	memset(de85, -1, sizeof(de85));
+	for (int i = 0; i < 85; i++) {
+		de85[(uint8_t)en85[i]] = i;
+	}
+}
+
+// Decode as many whole 5-character groups as there are, returns the byte count
+int decode85(uint8_t *out, size_t outSize, const char *in, size_t len) {
+	size_t n = 0;
+	for (size_t i = 0; i + 5 <= len; i += 5) {
+		uint32_t acc = 0;
+		for (int j = 0; j < 5; j++) {
+			int8_t d = de85[(uint8_t)in[i + j]];
+			if (d < 0) return -1;
+			acc = acc * 85 + d;
+		}
+		if (n + 4 > outSize) return -1;
+		out[n++] = acc >> 24;
+		out[n++] = acc >> 16;
+		out[n++] = acc >> 8;
+		out[n++] = acc;
+	}
+	return n;
+}
+
+// CRC-16/CCITT-FALSE, as RecordBuffer::crc16(), a byte at a time
+uint16_t crcTable[256];
+
+void initCrc16() {
+	for (int i = 0; i < 256; i++) {
+		uint16_t crc = i << 8;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+		crcTable[i] = crc;
+	}
+}
+
+uint16_t crc16(const uint8_t *data, size_t len) {
+	uint16_t crc = 0xffff;
+	while (len--) {
+		crc = (crc << 8) ^ crcTable[(crc >> 8) ^ *data++];
+	}
+	return crc;
+}
+
+void encode85(std::string &out, const uint8_t *data, size_t bytes) {
+	while (bytes) {
+		uint32_t acc = 0;
+		for (int cnt = 24; cnt >= 0; cnt -= 8) {
+			acc |= (uint32_t)*data++ << cnt;
+			if (--bytes == 0) break;
+		}
+		char group[5];
+		for (int cnt = 4; cnt >= 0; cnt--) {
+			group[cnt] = en85[acc % 85];
+			acc /= 85;
+		}
+		out.append(group, 5);
+	}
+}
+
+int64_t daysFromCivil(int64_t y, unsigned m, unsigned d) {
+	y -= m <= 2;
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	unsigned yoe = (unsigned)(y - era * 400);
+	unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (int64_t)doe - 719468;
+}
+
+// "2016-10-18T12:34:56.789Z" to milliseconds since the Unix epoch
+bool parseIso8601(const char *s, int64_t &ms) {
+	int y, mo, d, h, mi, sec, frac = 0;
+	if (sscanf(s, "%4d-%2d-%2dT%2d:%2d:%2d", &y, &mo, &d, &h, &mi, &sec) != 6) return false;
+	const char *p = s + 19;
+	if (*p == '.') {
+		int digits = 0;
+		while (isdigit((unsigned char)*++p)) {
+			if (digits++ < 3) frac = frac * 10 + (*p - '0');
+		}
+		while (digits++ < 3) frac *= 10;
+	}
+	ms = ((daysFromCivil(y, mo, d) * 24 + h) * 60 + mi) * 60000LL + sec * 1000LL + frac;
+	return true;
+}
+
+void formatIso8601(char *out, size_t size, int64_t ms) {
+	time_t seconds = (time_t)(ms / 1000);
+	struct tm t;
+	gmtime_r(&seconds, &t);
+	size_t n = strftime(out, size, "%Y-%m-%dT%H:%M:%S", &t);
+	snprintf(out + n, size - n, ".%03dZ", (int)(ms % 1000));
+}
+
+// Extract the string value of "key":"value" from a flat JSON object
+bool jsonString(const std::string &json, const char *key, std::string &value) {
+	std::string needle = std::string("\"") + key + "\":\"";
+	size_t start = json.find(needle);
+	if (start == std::string::npos) return false;
+	start += needle.size();
+	size_t end = json.find('"', start);
+	if (end == std::string::npos) return false;
+	value.assign(json, start, end - start);
+	return true;
+}
+
+/*************** Begin: Per-device decoder state ****************/
+
+struct DeviceState {
+	std::string coreid;
+	uint32_t boot;
+	bool hasAnchor;
+	uint32_t lastAnchor;
+	int64_t epoch;          // added to millis() to make it monotonic
+	int64_t utcOffset;      // min(receive time - last record time) this boot
+	int64_t lastSeen;       // receive time of the last event, for eviction
+	bool hasSequence;
+	uint16_t nextSequence;  // after the newest chunk this boot
+	uint64_t missing;       // bit i: chunk nextSequence - 1 - i not received
+	uint32_t anchors[SEQUENCE_WINDOW]; // of the chunks received, by sequence
+	std::list<DeviceState *>::iterator lru;
+};
+
+class DeviceTable {
+public:
+	DeviceState &lookup(const std::string &coreid, int64_t now) {
+		auto it = devices.find(coreid);
+		if (it != devices.end()) {
+			DeviceState &state = it->second;
+			order.splice(order.begin(), order, state.lru);
+			state.lastSeen = now;
+			return state;
+		}
+
+		evictIdle(now);
+		if (devices.size() >= MAX_DEVICES) {
+			evictedCount++;
+			devices.erase(order.back()->coreid);
+			order.pop_back();
+		}
+
+		DeviceState &state = devices[coreid];
+		state.coreid = coreid;
+		state.boot = 0;
+		state.hasAnchor = false;
+		state.lastAnchor = 0;
+		state.epoch = 0;
+		state.utcOffset = INT64_MAX;
+		state.lastSeen = now;
+		state.hasSequence = false;
+		state.nextSequence = 0;
+		state.missing = 0;
+		order.push_front(&state);
+		state.lru = order.begin();
+		return state;
+	}
+
+	size_t size() const { return devices.size(); }
+	uint64_t evicted() const { return evictedCount; }
+
+private:
+	void evictIdle(int64_t now) {
+		while (!order.empty() && now - order.back()->lastSeen > IDLE_EVICT_MS) {
+			evictedCount++;
+			devices.erase(order.back()->coreid);
+			order.pop_back();
+		}
+	}
+
+	std::unordered_map<std::string, DeviceState> devices;
+	std::list<DeviceState *> order; // most recently seen first
+	uint64_t evictedCount = 0;
+};
+
+/*************** End: Per-device decoder state ****************/
+
+class Decoder {
+public:
+	explicit Decoder(FILE *out) : out(out) {}
+
+	// How a chunk relates to those received before it from the device
+	enum Order_e {
+		ORDER_NEXT,      // newer than any so far
+		ORDER_LATE,      // older, but missing until now
+		ORDER_DUPLICATE, // received already
+		ORDER_REBOOT,    // numbered from 0 again
+	};
+
+	void event(const std::string &name, const std::string &json) {
+		if (name != "m" && name != "b") return;
+		// Burst captures are uploaded late, out of order with the m events
+		bool burst = name == "b";
+
+		std::string data, coreid, publishedAt;
+		int64_t receivedAt;
+		if (!jsonString(json, "data", data) ||
+		    !jsonString(json, "coreid", coreid) ||
+		    !jsonString(json, "published_at", publishedAt) ||
+		    !parseIso8601(publishedAt.c_str(), receivedAt) ||
+		    coreid.empty() || coreid.size() > MAX_COREID) {
+			malformed++;
+			return;
+		}
+
+		uint8_t chunk[MAX_CHUNK_SIZE + 4];
+		int len = decode85(chunk, sizeof(chunk), data.data(), data.size());
+		uint8_t version = len > 0 ? chunk[0] & ~CHUNK_RESENT : 0;
+		bool resent = len > 0 && (chunk[0] & CHUNK_RESENT);
+		size_t headerSize = version == 1 ? CHUNK_HEADER_SIZE_V1 :
+			version == 2 ? CHUNK_HEADER_SIZE_V2 : CHUNK_HEADER_SIZE;
+		if (len < (int)headerSize || version < 1 || version > CHUNK_VERSION ||
+				(resent && version < 3)) {
+			malformed++;
+			return;
+		}
+		if (version >= 3) {
+			// Over the base85 padding too, with the CRC field as zero
+			uint16_t crc = be16(chunk + 3);
+			chunk[3] = chunk[4] = 0;
+			if (crc16(chunk, len) != crc) {
+				malformed++;
+				return;
+			}
+		}
+
+		DeviceState &device = devices.lookup(coreid, receivedAt);
+		size_t anchorAt = version >= 3 ? 5 : 1;
+		uint32_t anchor = be32(chunk + anchorAt);
+		Order_e order = version >= 3 ? sequence(device, be16(chunk + 1), resent, burst, anchor) :
+			burst ? ORDER_NEXT : anchorOrder(device, anchor);
+		if (order == ORDER_DUPLICATE) {
+			duplicates++;
+			return;
+		}
+		if (order == ORDER_REBOOT) {
+			device.boot++;
+			device.epoch = 0;
+			device.utcOffset = INT64_MAX;
+			device.hasAnchor = false;
+		}
+		// Bursts are uploaded late by design, dated with the current epoch
+		// without moving it like reordered and resent chunks
+		bool late = burst || order == ORDER_LATE;
+		int64_t epoch = device.epoch;
+		if (!device.hasAnchor) {
+			device.hasAnchor = true;
+			device.lastAnchor = anchor;
+		} else if (late) {
+			if (anchor > device.lastAnchor && anchor - device.lastAnchor > 0x80000000u) {
+				// From before the last 49.7-day wrap
+				epoch -= 0x100000000LL;
+			}
+		} else if (anchor >= device.lastAnchor) {
+			device.lastAnchor = anchor;
+		} else if (device.lastAnchor - anchor > 0x80000000u) {
+			device.epoch += 0x100000000LL;
+			epoch = device.epoch;
+			device.lastAnchor = anchor;
+		}
+
+		// The device's own UTC time, when it has one, beats receive times
+		size_t utcAt = anchorAt + 4;
+		int64_t utcAnchor = version >= 2 ? ((int64_t)be16(chunk + utcAt) << 32) | be32(chunk + utcAt + 2) : 0;
+		int64_t utcOffset = utcAnchor ? utcAnchor - (epoch + anchor) : INT64_MAX;
+
+		// First pass finds the last record time to refine the UTC offset
+		uint32_t anchorTenths = anchor / 100;
+		int64_t lastMs = -1;
+		for (size_t i = headerSize; i + 3 <= (size_t)len;) {
+			uint8_t tag = chunk[i + 2];
+			if (tag == 0) break;
+			uint16_t t = be16(chunk + i);
+			lastMs = recordMs(epoch, anchorTenths, t);
+			i += 3 + (tag & 0x0f);
+		}
+		if (lastMs >= 0 && !late) {
+			device.utcOffset = std::min(device.utcOffset, receivedAt - lastMs);
+		}
+		if (utcOffset == INT64_MAX) {
+			utcOffset = device.utcOffset;
+		}
+
+		for (size_t i = headerSize; i + 3 <= (size_t)len;) {
+			uint8_t tag = chunk[i + 2];
+			size_t payloadLen = tag & 0x0f;
+			if (tag == 0 || i + 3 + payloadLen > (size_t)len) break;
+			int64_t ms = recordMs(epoch, anchorTenths, be16(chunk + i));
+			emit(device, ms, utcOffset, burst, tag >> 4, chunk + i + 3, payloadLen);
+			i += 3 + payloadLen;
+		}
+		decoded++;
+	}
+
+	uint64_t decodedCount() const { return decoded; }
+	uint64_t malformedCount() const { return malformed; }
+	uint64_t duplicateCount() const { return duplicates; }
+	const DeviceTable &table() const { return devices; }
+
+private:
+	static uint16_t be16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+	static uint32_t be32(const uint8_t *p) { return ((uint32_t)be16(p) << 16) | be16(p + 2); }
+
+	/* Without sequence numbers, version 1 and 2 chunks go by the anchor
+	 * alone: a little older than the newest is late, a lot older a
+	 * reboot, unless it's the 49.7-day wrap of millis().
+	 */
+	Order_e anchorOrder(const DeviceState &device, uint32_t anchor) {
+		if (!device.hasAnchor || anchor >= device.lastAnchor ||
+				device.lastAnchor - anchor > 0x80000000u) {
+			return ORDER_NEXT;
+		}
+		return device.lastAnchor - anchor <= REORDER_WINDOW_MS ? ORDER_LATE : ORDER_REBOOT;
+	}
+
+	/* Places the chunk by its sequence number and anchor. One of the last
+	 * SEQUENCE_WINDOW numbers that was missing is late, if its anchor is
+	 * within the reorder window, it was resent or it's a burst (anchored
+	 * at the trigger, so older by design); one received before is
+	 * a duplicate if the anchor matches too. Anything else going back,
+	 * or an anchor going back too far, is a reboot, after which the count
+	 * starts from 0 and the chunks before this one are missing so far.
+	 */
+	Order_e sequence(DeviceState &device, uint16_t sequence, bool resent, bool burst, uint32_t anchor) {
+		bool rewound = !burst && anchorOrder(device, anchor) == ORDER_REBOOT;
+		int16_t ahead = sequence - device.nextSequence;
+		uint16_t behind = device.nextSequence - 1 - sequence;
+		uint32_t &slot = device.anchors[sequence % SEQUENCE_WINDOW];
+		if (device.hasSequence && ahead < 0 && behind < SEQUENCE_WINDOW) {
+			if (device.missing >> behind & 1) {
+				if (resent || !rewound) {
+					device.missing &= ~(1ULL << behind);
+					slot = anchor;
+					return ORDER_LATE;
+				}
+			} else if (slot == anchor) {
+				return ORDER_DUPLICATE;
+			}
+		}
+		if (resent) {
+			// Not missing here, or too old to tell
+			return ORDER_DUPLICATE;
+		}
+
+		Order_e order = ORDER_NEXT;
+		if (!device.hasSequence || ahead < 0 || rewound) {
+			order = device.hasSequence ? ORDER_REBOOT : ORDER_NEXT;
+			device.nextSequence = 0;
+			device.missing = 0;
+		}
+		// The ones skipped, below the one received
+		unsigned shift = (uint16_t)(sequence - device.nextSequence) + 1;
+		uint64_t skipped = shift >= 64 ? ~1ULL : ((1ULL << (shift - 1)) - 1) << 1;
+		device.missing = (shift >= 64 ? 0 : device.missing << shift) | skipped;
+		device.nextSequence = sequence + 1;
+		device.hasSequence = true;
+		slot = anchor;
+		return order;
+	}
+
+	static int64_t recordMs(int64_t epoch, uint32_t anchorTenths, uint16_t t) {
+		uint32_t tenths = anchorTenths + (uint16_t)(t - (anchorTenths & 0xffff));
+		return epoch + (int64_t)tenths * 100;
+	}
+
+	void emit(const DeviceState &device, int64_t ms, int64_t utcOffset, bool burst,
+			unsigned type, const uint8_t *payload, size_t len) {
+		char line[160];
+		long long utc = utcOffset != INT64_MAX ? (long long)(ms + utcOffset) : -1;
+		int n = snprintf(line, sizeof(line), "%s %u %lld %lld %s%u ",
+			device.coreid.c_str(), device.boot, (long long)ms, utc, burst ? "b" : "", type);
+		static const char hex[] = "0123456789abcdef";
+		// snprintf returns the length it wanted, keep room for the payload
+		if (n < 0 || (size_t)n + 2 * len + 1 > sizeof(line)) {
+			malformed++;
+			return;
+		}
+		for (size_t i = 0; i < len; i++) {
+			line[n++] = hex[payload[i] >> 4];
+			line[n++] = hex[payload[i] & 0x0f];
+		}
+		line[n++] = '\n';
+		fwrite(line, 1, n, out);
+	}
+
+	FILE *out;
+	DeviceTable devices;
+	uint64_t decoded = 0;
+	uint64_t malformed = 0;
+	uint64_t duplicates = 0;
+};
+
+/*************** Begin: Load generator ****************/
+
+const uint8_t samplePids[][3] = {
+	{ 0x04, 0x58, 0 }, { 0x05, 0x73, 0 }, { 0x0c, 0x1c, 0xa6 }, { 0x0d, 0x35, 0 },
+	{ 0x10, 0x03, 0x7b }, { 0x11, 0x39, 0 }, { 0x2f, 0xb3, 0 }, { 0x33, 0x65, 0 },
+};
+
+void generate(unsigned vehicles, uint64_t events) {
+	const int64_t start = 1476792000000LL; // 2016-10-18T12:00:00Z
+	std::vector<uint32_t> clock(vehicles);
+	for (unsigned v = 0; v < vehicles; v++) {
+		clock[v] = 1000 + v * 37;
+	}
+
+	uint8_t chunk[MAX_CHUNK_SIZE];
+	std::string data;
+	char when[32];
+	for (uint64_t e = 0; e < events; e++) {
+		unsigned v = e % vehicles;
+		uint32_t &now = clock[v];
+		size_t len = 0;
+		chunk[len++] = CHUNK_VERSION;
+		uint16_t sequence = e / vehicles;
+		chunk[len++] = sequence >> 8;
+		chunk[len++] = sequence;
+		chunk[len++] = 0; // CRC, below
+		chunk[len++] = 0;
+		chunk[len++] = now >> 24;
+		chunk[len++] = now >> 16;
+		chunk[len++] = now >> 8;
+		chunk[len++] = now;
+		uint64_t utc = start + now;
+		for (int shift = 40; shift >= 0; shift -= 8) {
+			chunk[len++] = utc >> shift;
+		}
+		for (unsigned r = 0; len + 6 <= sizeof(chunk); r++) {
+			const uint8_t *pid = samplePids[(r + e) % 8];
+			uint8_t payloadLen = pid[2] ? 3 : 2;
+			uint16_t t = (now / 100) & 0xffff;
+			chunk[len++] = t >> 8;
+			chunk[len++] = t;
+			chunk[len++] = payloadLen;
+			memcpy(chunk + len, pid, payloadLen);
+			len += payloadLen;
+			now += 180;
+		}
+		while (len % 4) {
+			chunk[len++] = 0;
+		}
+		uint16_t crc = crc16(chunk, len);
+		chunk[3] = crc >> 8;
+		chunk[4] = crc;
+		data.clear();
+		encode85(data, chunk, len);
+		formatIso8601(when, sizeof(when), start + now + 250);
+		printf("event: m\ndata: {\"data\":\"%s\",\"ttl\":\"60\",\"published_at\":\"%s\","
+			"\"coreid\":\"%024x\"}\n\n", data.c_str(), when, v);
+	}
+}
+
+/*************** End: Load generator ****************/
+
+int ingest(bool stats) {
+	static char outBuffer[1 << 16];
+	setvbuf(stdout, outBuffer, _IOFBF, sizeof(outBuffer));
+
+	Decoder decoder(stdout);
+	std::vector<uint32_t> latencyNs;
+	std::string eventName, data;
+	char line[4096];
+	auto begin = std::chrono::steady_clock::now();
+	while (fgets(line, sizeof(line), stdin)) {
+		size_t len = strcspn(line, "\r\n");
+		line[len] = 0;
+		if (len == 0) {
+			if (!data.empty()) {
+				auto t0 = std::chrono::steady_clock::now();
+				decoder.event(eventName, data);
+				if (stats) {
+					auto t1 = std::chrono::steady_clock::now();
+					latencyNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+				}
+			}
+			eventName.clear();
+			data.clear();
+		} else if (!strncmp(line, "event: ", 7)) {
+			eventName.assign(line + 7);
+		} else if (!strncmp(line, "data: ", 6)) {
+			data.assign(line + 6);
+		}
+	}
+	fflush(stdout);
+
+	if (stats) {
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		std::sort(latencyNs.begin(), latencyNs.end());
+		uint32_t p50 = latencyNs.empty() ? 0 : latencyNs[latencyNs.size() / 2];
+		uint32_t p99 = latencyNs.empty() ? 0 : latencyNs[latencyNs.size() * 99 / 100];
+		fprintf(stderr, "events %llu malformed %llu duplicates %llu devices %zu evicted %llu\n",
+			(unsigned long long)decoder.decodedCount(), (unsigned long long)decoder.malformedCount(),
+			(unsigned long long)decoder.duplicateCount(),
+			decoder.table().size(), (unsigned long long)decoder.table().evicted());
+		fprintf(stderr, "%.0f events/s, decode latency p50 %u ns, p99 %u ns\n",
+			decoder.decodedCount() / seconds, p50, p99);
+	}
+	return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+	initBase85();
+	initCrc16();
+	if (argc == 4 && !strcmp(argv[1], "--generate")) {
+		generate(atoi(argv[2]), strtoull(argv[3], NULL, 10));
+		return 0;
+	}
+	if (argc == 1 || (argc == 2 && !strcmp(argv[1], "--stats"))) {
+		return ingest(argc == 2);
+	}
+	fprintf(stderr, "usage: %s [--stats] < events\n       %s --generate <vehicles> <events>\n", argv[0], argv[0]);
+	return 2;
+}
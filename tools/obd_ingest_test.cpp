@@ -0,0 +1,354 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Tests for the timestamp reconstruction of obd_ingest: 16-bit record
+ * time and millis() wraps, reboots, and chunks delivered out of order,
+ * twice, resent or corrupted.
+ *
+ * Builds the decoder itself, with its main() renamed:
+ *
+ *     g++ -std=c++11 -O2 -o obd_ingest_test tools/obd_ingest_test.cpp && ./obd_ingest_test
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ */
+
+#define main obd_ingest_main
+#include "obd_ingest.cpp"
+#undef main
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+void check(bool condition, const char *text, int line) {
+	if (!condition) {
+		fprintf(stderr, "obd_ingest_test.cpp:%d: %s\n", line, text);
+		failures++;
+	}
+}
+
+struct Record
+{
+	uint16_t t;
+	uint8_t type;
+	uint8_t value;
+};
+
+// A chunk of one-byte records as the firmware publishes it
+std::string chunkEvent(uint8_t version, uint16_t sequence, uint32_t anchor, uint64_t utc,
+		std::vector<Record> records, int64_t receivedAt, bool resent = false) {
+	uint8_t chunk[MAX_CHUNK_SIZE + 4];
+	size_t len = 0;
+	chunk[len++] = version | (resent ? CHUNK_RESENT : 0);
+	if (version >= 3) {
+		chunk[len++] = sequence >> 8;
+		chunk[len++] = sequence;
+		chunk[len++] = 0;
+		chunk[len++] = 0;
+	}
+	for (int shift = 24; shift >= 0; shift -= 8) {
+		chunk[len++] = anchor >> shift;
+	}
+	if (version >= 2) {
+		for (int shift = 40; shift >= 0; shift -= 8) {
+			chunk[len++] = utc >> shift;
+		}
+	}
+	for (const Record &record : records) {
+		chunk[len++] = record.t >> 8;
+		chunk[len++] = record.t;
+		chunk[len++] = (record.type << 4) | 1;
+		chunk[len++] = record.value;
+	}
+	while (len % 4) {
+		chunk[len++] = 0;
+	}
+	if (version >= 3) {
+		uint16_t crc = crc16(chunk, len);
+		chunk[3] = crc >> 8;
+		chunk[4] = crc;
+	}
+	std::string data;
+	encode85(data, chunk, len);
+	char when[32];
+	formatIso8601(when, sizeof(when), receivedAt);
+	return "{\"data\":\"" + data + "\",\"ttl\":\"60\",\"published_at\":\"" + when +
+		"\",\"coreid\":\"000000000000000000000051\"}";
+}
+
+// A record as obd_ingest writes it
+struct Line
+{
+	unsigned boot;
+	long long ms;
+	long long utc;
+	std::string type;
+	unsigned value;
+};
+
+class Capture {
+public:
+	Capture() : text(NULL), size(0), out(open_memstream(&text, &size)), decoder(out) {}
+	~Capture() {
+		fclose(out);
+		free(text);
+	}
+
+	void event(const char *name, const std::string &json) { decoder.event(name, json); }
+
+	std::vector<Line> lines() {
+		fflush(out);
+		std::vector<Line> result;
+		const char *p = text;
+		while (p && p < text + size) {
+			Line line;
+			char type[8];
+			if (sscanf(p, "%*s %u %lld %lld %7s %x", &line.boot, &line.ms, &line.utc, type,
+					&line.value) == 5) {
+				line.type = type;
+				result.push_back(line);
+			}
+			p = strchr(p, '\n');
+			p = p ? p + 1 : NULL;
+		}
+		return result;
+	}
+
+	char *text;
+	size_t size;
+	FILE *out;
+	Decoder decoder;
+};
+
+const int64_t RECEIVED = 1475323200000LL; // 2016-10-01T12:00:00Z
+
+void testInOrder() {
+	Capture capture;
+	capture.event("m", chunkEvent(3, 0, 1000, 0, { { 10, 0, 1 }, { 15, 0, 2 } }, RECEIVED + 2000));
+	capture.event("m", chunkEvent(3, 1, 6000, 0, { { 60, 0, 3 } }, RECEIVED + 7000));
+	std::vector<Line> lines = capture.lines();
+	CHECK(lines.size() == 3);
+	CHECK(lines[0].boot == 0 && lines[0].ms == 1000 && lines[1].ms == 1500 && lines[2].ms == 6000);
+	// The offset is the smallest receive time minus last record time,
+	// 2000 - 1500 from the first chunk
+	CHECK(lines[2].utc == RECEIVED + 500 + 6000);
+}
+
+void testRecordTimeWrap() {
+	// 65535 tenths is the last before the 16-bit wrap
+	Capture capture;
+	capture.event("m", chunkEvent(3, 0, 6553500, 0, { { 0xffff, 0, 1 }, { 2, 0, 2 } }, RECEIVED));
+	std::vector<Line> lines = capture.lines();
+	CHECK(lines.size() == 2);
+	CHECK(lines[0].ms == 6553500 && lines[1].ms == 6553800);
+}
+
+void testMillisWrap() {
+	Capture capture;
+	uint32_t before = 0xfffff000u;
+	capture.event("m", chunkEvent(3, 0, before, 0, { { (uint16_t)(before / 100), 0, 1 } }, RECEIVED));
+	capture.event("m", chunkEvent(3, 1, 0x1000, 0, { { 0x1000 / 100, 0, 2 } }, RECEIVED + 8192));
+	std::vector<Line> lines = capture.lines();
+	CHECK(lines.size() == 2);
+	CHECK(lines[1].boot == 0);
+	CHECK(lines[1].ms == 0x100000000LL + 0x1000 / 100 * 100);
+}
+
+void testReboot() {
+	Capture capture;
+	capture.event("m", chunkEvent(3, 40, 600000, 0, { { 6000, 0, 1 } }, RECEIVED));
+	capture.event("m", chunkEvent(3, 0, 2000, 0, { { 20, 0, 2 } }, RECEIVED + 5000));
+	capture.event("m", chunkEvent(3, 1, 7000, 0, { { 70, 0, 3 } }, RECEIVED + 10000));
+	std::vector<Line> lines = capture.lines();
+	CHECK(lines.size() == 3);
+	CHECK(lines[0].boot == 0 && lines[1].boot == 1 && lines[2].boot == 1);
+	CHECK(lines[1].ms == 2000 && lines[2].ms == 7000);
+}
+
+void testRebootKeepsSequenceHigh() {
+	// A reboot soon after the last one can't be told by its anchor, but
+	// its sequence number was already taken by another chunk
+	Capture capture;
+	capture.event("m", chunkEvent(3, 0, 3000, 0, { { 30, 0, 1 } }, RECEIVED));
+	capture.event("m", chunkEvent(3, 1, 8000, 0, { { 80, 0, 2 } }, RECEIVED + 5000));
+	capture.event("m", chunkEvent(3, 0, 2500, 0, { { 25, 0, 3 } }, RECEIVED + 9000));
+	std::vector<Line> lines = capture.lines();
+	CHECK(lines.size() == 3);
+	CHECK(lines[2].boot == 1 && lines[2].ms == 2500);
+}
+
+void testOutOfOrder() {
+	Capture capture;
+	capture.event("m", chunkEvent(3, 0, 1000, 0, { { 10, 0, 1 } }, RECEIVED + 1000));
+	capture.event("m", chunkEvent(3, 2, 11000, 0, { { 110, 0, 3 } }, RECEIVED + 11000));
+	capture.event("m", chunkEvent(3, 1, 6000, 0, { { 60, 0, 2 } }, RECEIVED + 11100));
+	capture.event("m", chunkEvent(3, 3, 16000, 0, { { 160, 0, 4 } }, RECEIVED + 16000));
+	std::vector<Line> lines = capture.lines();
+	CHECK(lines.size() == 4);
+	for (const Line &line : lines) {
+		CHECK(line.boot == 0);
+		CHECK(line.ms == (long long)line.value * 5000 - 4000);
+		// Dated with the offset of the chunks that came in order
+		CHECK(line.utc == RECEIVED + line.ms);
+	}
+	CHECK(capture.decoder.duplicateCount() == 0);
+}
+
+void testOutOfOrderWithoutSequence() {
+	Capture capture;
+	capture.event("m", chunkEvent(2, 0, 1000, 0, { { 10, 0, 1 } }, RECEIVED + 1000));
+	capture.event("m", chunkEvent(2, 0, 11000, 0, { { 110, 0, 3 } }, RECEIVED + 11000));
+	capture.event("m", chunkEvent(2, 0, 6000, 0, { { 60, 0, 2 } }, RECEIVED + 11100));
+	capture.event("m", chunkEvent(2, 0, 16000, 0, { { 160, 0, 4 } }, RECEIVED + 16000));
+	std::vector<Line> lines = capture.lines();
+	CHECK(lines.size() == 4);
+	for (const Line &line : lines) {
+		CHECK(line.boot == 0 && line.ms == (long long)line.value * 5000 - 4000);
+	}
+}
+
+void testDuplicate() {
+	Capture capture;
+	std::string event = chunkEvent(3, 0, 1000, 0, { { 10, 0, 1 } }, RECEIVED);
+	capture.event("m", event);
+	capture.event("m", chunkEvent(3, 1, 6000, 0, { { 60, 0, 2 } }, RECEIVED + 5000));
+	capture.event("m", event);
+	CHECK(capture.lines().size() == 2);
+	CHECK(capture.decoder.duplicateCount() == 1);
+}
+
+void testResent() {
+	Capture capture;
+	capture.event("m", chunkEvent(3, 0, 1000, 0, { { 10, 0, 1 } }, RECEIVED));
+	capture.event("m", chunkEvent(3, 2, 11000, 0, { { 110, 0, 3 } }, RECEIVED + 10000));
+	// Resent after a NACK, long after the reorder window
+	std::string resent = chunkEvent(3, 1, 6000, 0, { { 60, 0, 2 } }, RECEIVED + 60000, true);
+	capture.event("m", resent);
+	capture.event("m", resent);
+	std::vector<Line> lines = capture.lines();
+	CHECK(lines.size() == 3);
+	CHECK(lines[2].boot == 0 && lines[2].ms == 6000);
+	CHECK(capture.decoder.duplicateCount() == 1);
+}
+
+void testBurstKeepsAnchor() {
+	// A burst capture anchored well before the newest chunk
+	Capture capture;
+	capture.event("m", chunkEvent(3, 0, 100000, 0, { { 1000, 0, 1 } }, RECEIVED));
+	capture.event("b", chunkEvent(3, 1, 40000, 0, { { 400, 6, 0xf8 } }, RECEIVED + 5000));
+	capture.event("m", chunkEvent(3, 2, 105000, 0, { { 1050, 0, 2 } }, RECEIVED + 6000));
+	std::vector<Line> lines = capture.lines();
+	CHECK(lines.size() == 3);
+	CHECK(lines[1].type == "b6" && lines[1].boot == 0 && lines[1].ms == 40000);
+	CHECK(lines[2].boot == 0 && lines[2].ms == 105000);
+}
+
+void testUtcFromHeader() {
+	Capture capture;
+	uint64_t utc = 1475323100000ULL;
+	capture.event("m", chunkEvent(3, 0, 1000, utc, { { 15, 0, 1 } }, RECEIVED));
+	std::vector<Line> lines = capture.lines();
+	CHECK(lines.size() == 1);
+	CHECK(lines[0].utc == (long long)utc + 500);
+}
+
+void testBadCrc() {
+	Capture capture;
+	std::string event = chunkEvent(3, 0, 1000, 0, { { 10, 0, 1 } }, RECEIVED);
+	size_t data = event.find("\"data\":\"") + 8;
+	event[data + 10] = event[data + 10] == '0' ? '1' : '0';
+	capture.event("m", event);
+	CHECK(capture.lines().empty());
+	CHECK(capture.decoder.malformedCount() == 1);
+}
+
+// Far longer than a device ID, so it can't overrun the output line
+void testLongCoreid() {
+	Capture capture;
+	std::string event = chunkEvent(3, 0, 1000, 0, { { 10, 0, 1 } }, RECEIVED);
+	size_t coreid = event.find("\"coreid\":\"") + 10;
+	event.insert(coreid, std::string(300, 'f'));
+	capture.event("m", event);
+	CHECK(capture.lines().empty());
+	CHECK(capture.decoder.malformedCount() == 1);
+
+	capture.event("m", chunkEvent(3, 0, 1000, 0, { { 10, 0, 1 } }, RECEIVED));
+	CHECK(capture.lines().size() == 1);
+}
+
+// Version 1 chunks, the format before sequence numbers and UTC headers,
+// across the record time wrap and then a reboot
+void testVersion1WrapAndReboot() {
+	Capture capture;
+	capture.event("m", chunkEvent(1, 0, 6553000, 0, { { 65530, 0, 1 }, { 3, 0, 2 } }, RECEIVED));
+	capture.event("m", chunkEvent(1, 0, 6558000, 0, { { 45, 0, 3 } }, RECEIVED + 5000));
+	capture.event("m", chunkEvent(1, 0, 3000, 0, { { 30, 0, 4 } }, RECEIVED + 9000));
+	std::vector<Line> lines = capture.lines();
+	CHECK(lines.size() == 4);
+	CHECK(lines[0].ms == 6553000 && lines[1].ms == 6553900 && lines[2].ms == 6558100);
+	CHECK(lines[0].boot == 0 && lines[2].boot == 0);
+	CHECK(lines[3].boot == 1 && lines[3].ms == 3000);
+}
+
+// Without a UTC header, the offset is off by the smallest upload latency
+// seen so far this boot, and a reboot starts over
+void testUtcFromReceiveTime() {
+	// Device time 0 is RECEIVED in UTC, then 200 s later after a reboot
+	const int64_t latencies[] = { 900, 300, 600 };
+	Capture capture;
+	for (int i = 0; i < 3; i++) {
+		uint32_t last = 50000 * (i + 1);
+		capture.event("m", chunkEvent(1, 0, last - 1000, 0, { { (uint16_t)(last / 100), 0, 1 } },
+			RECEIVED + last + latencies[i]));
+	}
+	capture.event("m", chunkEvent(1, 0, 2000, 0, { { 30, 0, 2 } }, RECEIVED + 200000 + 3000 + 700));
+	std::vector<Line> lines = capture.lines();
+	CHECK(lines.size() == 4);
+	CHECK(lines[0].utc - (RECEIVED + lines[0].ms) == 900);
+	CHECK(lines[1].utc - (RECEIVED + lines[1].ms) == 300);
+	CHECK(lines[2].utc - (RECEIVED + lines[2].ms) == 300);
+	CHECK(lines[3].boot == 1 && lines[3].utc - (RECEIVED + 200000 + lines[3].ms) == 700);
+}
+
+} // namespace
+
+int main() {
+	initBase85();
+	initCrc16();
+	testInOrder();
+	testRecordTimeWrap();
+	testMillisWrap();
+	testReboot();
+	testRebootKeepsSequenceHigh();
+	testOutOfOrder();
+	testOutOfOrderWithoutSequence();
+	testDuplicate();
+	testResent();
+	testBurstKeepsAnchor();
+	testUtcFromHeader();
+	testBadCrc();
+	testLongCoreid();
+	testVersion1WrapAndReboot();
+	testUtcFromReceiveTime();
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	fprintf(stderr, "all obd_ingest tests passed\n");
+	return 0;
+}
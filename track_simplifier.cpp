@@ -0,0 +1,130 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "track_simplifier.h"
+
+static constexpr int32_t HALF_CIRCLE = 18000; // centidegrees
+static constexpr int32_t CENTIDEGREES_PER_RADIAN = 5730;
+
+static int32_t wrapAngle(int32_t angle)
+{
+    while(angle > HALF_CIRCLE)
+        angle -= 2 * HALF_CIRCLE;
+    while(angle <= -HALF_CIRCLE)
+        angle += 2 * HALF_CIRCLE;
+    return angle;
+}
+
+TrackSimplifier::TrackSimplifier(uint32_t corridorMm, uint8_t maxTurnDeg, uint32_t maxIntervalMs)
+    : corridorMm(corridorMm), maxTurnDeg(maxTurnDeg), maxIntervalMs(maxIntervalMs)
+{
+    reset();
+}
+
+void TrackSimplifier::reset()
+{
+    hasStart = false;
+    sleeveOpen = false;
+}
+
+void TrackSimplifier::restart(const TrackFix &fix)
+{
+    start = fix;
+    previous = fix;
+    hasStart = true;
+    sleeveOpen = false;
+}
+
+bool TrackSimplifier::add(const TrackFix &fix, TrackFix &out)
+{
+    if(!hasStart)
+    {
+        restart(fix);
+        out = fix;
+        return true;
+    }
+
+    bool due = fix.time - start.time >= maxIntervalMs;
+
+    // Course is stored in 2-degree steps
+    int turn = (fix.sample.course2Deg - start.sample.course2Deg + 180) % 180;
+    if(turn > 90)
+        turn = 180 - turn;
+    if(turn * 2 > maxTurnDeg && fix.sample.speedKmh > 0)
+        due = true;
+
+    if(narrow(fix))
+    {
+        previous = fix;
+        if(!due)
+            return false;
+        // The segment to this fix still covers the ones dropped since start
+        out = fix;
+        restart(fix);
+        return true;
+    }
+
+    if(previous.time == start.time)
+    {
+        // Nothing dropped since start, nothing to cover
+        out = fix;
+        restart(fix);
+        return true;
+    }
+
+    // Outside the sleeve: the previous fix ends the segment, even when
+    // this one is due, as a segment to it would miss the dropped fixes
+    out = previous;
+    restart(previous);
+    narrow(fix);
+    previous = fix;
+    return true;
+}
+
+// Returns false when the fix can't be covered by a segment from start
+bool TrackSimplifier::narrow(const TrackFix &fix)
+{
+    int32_t dLat = fix.sample.point.lat - start.sample.point.lat;
+    int32_t dLng = fix.sample.point.lng - start.sample.point.lng;
+    if(dLat > 1000000L || dLat < -1000000L || dLng > 1000000L || dLng < -1000000L)
+        return false; // beyond the short span geodesy, just split here
+
+    uint32_t distance = geoDistanceShort(start.sample.point, fix.sample.point);
+    if(distance <= corridorMm)
+        return true; // any direction passes close enough
+
+    int32_t direction = geoCourse(start.sample.point, fix.sample.point);
+    if(!sleeveOpen)
+    {
+        reference = direction;
+        low = -HALF_CIRCLE;
+        high = HALF_CIRCLE;
+        sleeveOpen = true;
+    }
+
+    int32_t relative = wrapAngle(direction - reference);
+    if(relative < low || relative > high)
+        return false;
+
+    // Half-width of the cone of directions passing within the corridor,
+    // asin(corridor / distance) rounded down to stay on the safe side
+    int32_t halfWidth = (int32_t)((uint64_t)corridorMm * CENTIDEGREES_PER_RADIAN / distance);
+    if(relative - halfWidth > low)
+        low = relative - halfWidth;
+    if(relative + halfWidth < high)
+        high = relative + halfWidth;
+    return true;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __TrackSimplifier_h
+#define __TrackSimplifier_h
+
+#include "position_encoder.h"
+
+struct TrackFix
+{
+    PositionSample sample;
+    uint32_t time; // millis() when the fix was taken
+};
+
+/* Streaming track simplification in constant memory.
+ *
+ * Uses the sleeve (opening window) method: from the last emitted fix, each
+ * new fix narrows the range of directions a straight segment could take and
+ * still pass within the corridor of every fix since. When a fix falls outside
+ * that range, the fix before it is emitted and becomes the new start. The
+ * straight line between emitted fixes is then never further than the
+ * corridor from any dropped fix.
+ *
+ * A fix is also emitted when the GPS course turns by more than the turn
+ * threshold since the last emitted fix, and at least every max interval,
+ * unless it is outside the sleeve; then the fix before it is.
+ *
+ * sim/bench.cpp reports the points kept and the largest error on the
+ * simulated drive, sim/test.cpp checks the corridor on a winding track.
+ */
+class TrackSimplifier
+{
+public:
+    TrackSimplifier(uint32_t corridorMm, uint8_t maxTurnDeg, uint32_t maxIntervalMs);
+
+    // Returns true and sets out when a fix should be published.
+    // out may be older than fix.
+    bool add(const TrackFix &fix, TrackFix &out);
+    void reset();
+
+private:
+    void restart(const TrackFix &fix);
+    bool narrow(const TrackFix &fix);
+
+    uint32_t corridorMm;
+    uint8_t maxTurnDeg;
+    uint32_t maxIntervalMs;
+
+    TrackFix start;
+    TrackFix previous;
+    bool hasStart;
+    bool sleeveOpen;
+    int32_t reference; // direction of the first fix outside the corridor, centidegrees
+    int32_t low, high; // allowed directions relative to reference, centidegrees
+};
+
+#endif // def(__TrackSimplifier_h)
@@ -0,0 +1,217 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ubx.h"
+
+UbxParser::UbxParser(TinyGPSPlus &gps)
+    : gps(gps), state(STATE_SYNC_1), msgClass(0), msgId(0), length(0), offset(0), checksumA(0),
+    checksumB(0), passedChecksumCount(0), failedChecksumCount(0)
+{
+}
+
+bool UbxParser::encode(const char *buf, size_t len)
+{
+    bool applied = false;
+    for(size_t i = 0; i < len; ++i)
+        if(encode((uint8_t)buf[i]))
+            applied = true;
+    return applied;
+}
+
+bool UbxParser::encode(uint8_t c)
+{
+    // The 8-bit Fletcher checksum covers class, ID, length and payload
+    if(state >= STATE_CLASS && state <= STATE_PAYLOAD)
+    {
+        checksumA += c;
+        checksumB += checksumA;
+    }
+
+    switch(state)
+    {
+    case STATE_SYNC_1:
+        if(c == SYNC_1)
+            state = STATE_SYNC_2;
+        break;
+    case STATE_SYNC_2:
+        state = c == SYNC_2 ? STATE_CLASS : c == SYNC_1 ? STATE_SYNC_2 : STATE_SYNC_1;
+        checksumA = checksumB = 0;
+        break;
+    case STATE_CLASS:
+        msgClass = c;
+        state = STATE_ID;
+        break;
+    case STATE_ID:
+        msgId = c;
+        state = STATE_LENGTH_1;
+        break;
+    case STATE_LENGTH_1:
+        length = c;
+        state = STATE_LENGTH_2;
+        break;
+    case STATE_LENGTH_2:
+        length |= c << 8;
+        offset = 0;
+        // A corrupted length would otherwise swallow up to 64 KB of stream
+        if(length > MAX_LENGTH)
+        {
+            ++failedChecksumCount;
+            state = STATE_SYNC_1;
+            break;
+        }
+        state = length ? STATE_PAYLOAD : STATE_CHECKSUM_A;
+        break;
+    case STATE_PAYLOAD:
+        // Longer messages are checksummed but not kept
+        if(offset < MAX_PAYLOAD)
+            payload[offset] = c;
+        if(++offset == length)
+            state = STATE_CHECKSUM_A;
+        break;
+    case STATE_CHECKSUM_A:
+        state = c == checksumA ? STATE_CHECKSUM_B : STATE_SYNC_1;
+        if(state == STATE_SYNC_1)
+            ++failedChecksumCount;
+        break;
+    case STATE_CHECKSUM_B:
+        state = STATE_SYNC_1;
+        if(c != checksumB)
+        {
+            ++failedChecksumCount;
+            return false;
+        }
+        ++passedChecksumCount;
+        return handleFrame();
+    }
+
+    return false;
+}
+
+bool UbxParser::handleFrame()
+{
+    if(msgClass != CLASS_NAV)
+        return false;
+
+    if(msgId == NAV_PVT && length == 92)
+    {
+        navPvt();
+        return true;
+    }
+    if(msgId == NAV_DOP && length == 18)
+        navDop();
+    return false;
+}
+
+void UbxParser::navPvt()
+{
+    uint8_t valid = payload[11];
+    uint8_t fixType = payload[20];
+    bool fixOk = (payload[21] & 0x01) && fixType >= 2 && fixType <= 4;
+
+    if(valid & 0x01) // validDate
+    {
+        gps.date.newDate = payload[7] * 10000UL + payload[6] * 100UL + u16(4) % 100;
+        gps.date.commit();
+    }
+    if(valid & 0x02) // validTime
+    {
+        int32_t nano = i32(16);
+        uint32_t centiseconds = nano > 0 ? nano / 10000000L : 0;
+        gps.time.newTime = payload[8] * 1000000UL + payload[9] * 10000UL + payload[10] * 100UL +
+                           centiseconds;
+        gps.time.commit();
+    }
+
+    gps.satellites.newval = payload[23];
+    gps.satellites.commit();
+
+    if(fixOk)
+    {
+        toRawDegrees(i32(28), gps.location.rawNewLatData);
+        toRawDegrees(i32(24), gps.location.rawNewLngData);
+        gps.location.commit();
+
+        // mm above mean sea level to cm
+        gps.altitude.newval = i32(36) / 10;
+        gps.altitude.commit();
+
+        // mm/s to hundredths of a knot
+        gps.speed.newval = (int32_t)(((int64_t)i32(60) * 1944 + 5000) / 10000);
+        gps.speed.commit();
+
+        // 1e-5 degrees to hundredths of a degree
+        gps.course.newval = i32(64) / 1000;
+        gps.course.commit();
+
+        gps.pdop.newval = u16(76);
+        gps.pdop.commit();
+    }
+}
+
+void UbxParser::navDop()
+{
+    // Already in hundredths, like the NMEA fields
+    gps.pdop.newval = u16(6);
+    gps.pdop.commit();
+    gps.vdop.newval = u16(10);
+    gps.vdop.commit();
+    gps.hdop.newval = u16(12);
+    gps.hdop.commit();
+}
+
+uint16_t UbxParser::u16(size_t offset) const
+{
+    return payload[offset] | (payload[offset + 1] << 8);
+}
+
+uint32_t UbxParser::u32(size_t offset) const
+{
+    return u16(offset) | ((uint32_t)u16(offset + 2) << 16);
+}
+
+// static
+void UbxParser::toRawDegrees(int32_t deg7, RawDegrees &raw)
+{
+    raw.negative = deg7 < 0;
+    uint32_t magnitude = raw.negative ? -(uint32_t)deg7 : deg7;
+    raw.deg = magnitude / 10000000UL;
+    raw.billionths = (magnitude % 10000000UL) * 100;
+}
+
+// static
+size_t UbxParser::frame(uint8_t *out, uint8_t msgClass, uint8_t msgId, const uint8_t *payload,
+                        uint16_t len)
+{
+    size_t size = 0;
+    out[size++] = SYNC_1;
+    out[size++] = SYNC_2;
+    out[size++] = msgClass;
+    out[size++] = msgId;
+    out[size++] = len & 0xff;
+    out[size++] = len >> 8;
+    memcpy(out + size, payload, len);
+    size += len;
+
+    uint8_t a = 0, b = 0;
+    for(size_t i = 2; i < size; ++i)
+    {
+        a += out[i];
+        b += a;
+    }
+    out[size++] = a;
+    out[size++] = b;
+    return size;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2016 Zachary Crockett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __Ubx_h
+#define __Ubx_h
+
+#include "TinyGPS++.h"
+
+/* Parser for the u-blox UBX binary protocol.
+ *
+ * Fills the location, date, time, speed, course, altitude, satellites, hdop,
+ * pdop and vdop objects of a TinyGPSPlus from UBX-NAV-PVT and UBX-NAV-DOP,
+ * so code reading those doesn't care which protocol the module speaks.
+ * One checksummed binary frame replaces several NMEA sentences and there is
+ * no ASCII number parsing at all.
+ */
+class UbxParser
+{
+public:
+    static constexpr uint8_t SYNC_1 = 0xb5;
+    static constexpr uint8_t SYNC_2 = 0x62;
+    static constexpr uint8_t CLASS_NAV = 0x01;
+    static constexpr uint8_t CLASS_CFG = 0x06;
+    static constexpr uint8_t NAV_DOP = 0x04;
+    static constexpr uint8_t NAV_PVT = 0x07;
+    static constexpr uint8_t CFG_PRT = 0x00;
+    static constexpr uint8_t CFG_MSG = 0x01;
+    static constexpr uint8_t CFG_RATE = 0x08;
+    static constexpr size_t MAX_PAYLOAD = 92; // NAV-PVT
+    static constexpr uint16_t MAX_LENGTH = 100; // longer lengths are taken as corrupt
+
+    explicit UbxParser(TinyGPSPlus &gps);
+
+    bool encode(uint8_t c); // true when a NAV-PVT was applied
+    bool encode(const char *buf, size_t len);
+
+    // Writes a complete frame to out, which needs len + 8 bytes, returns its size
+    static size_t frame(uint8_t *out, uint8_t msgClass, uint8_t msgId, const uint8_t *payload,
+                        uint16_t len);
+
+    uint32_t framesProcessed() const { return passedChecksumCount; }
+    uint32_t failedChecksum() const { return failedChecksumCount; }
+
+private:
+    enum State_e
+    {
+        STATE_SYNC_1,
+        STATE_SYNC_2,
+        STATE_CLASS,
+        STATE_ID,
+        STATE_LENGTH_1,
+        STATE_LENGTH_2,
+        STATE_PAYLOAD,
+        STATE_CHECKSUM_A,
+        STATE_CHECKSUM_B
+    };
+
+    bool handleFrame();
+    void navPvt();
+    void navDop();
+    uint16_t u16(size_t offset) const;
+    uint32_t u32(size_t offset) const;
+    int32_t i32(size_t offset) const { return (int32_t)u32(offset); }
+    static void toRawDegrees(int32_t deg7, RawDegrees &raw);
+
+    TinyGPSPlus &gps;
+    State_e state;
+    uint8_t msgClass, msgId;
+    uint16_t length, offset;
+    uint8_t checksumA, checksumB;
+    uint8_t payload[MAX_PAYLOAD];
+    uint32_t passedChecksumCount;
+    uint32_t failedChecksumCount;
+};
+
+#endif // def(__Ubx_h)